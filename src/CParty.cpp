@@ -5,14 +5,22 @@
 #include "W_final.hh"
 #include "part_func.hh"
 #include "h_globals.hh"
+#include "parallel.hh"
+#include "beam_fold.hh"
 // a simple driver for the HFold
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
+#include <cmath>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <string>
 #include <getopt.h>
+#include <unordered_map>
+#include <memory>
+#include <random>
+#include <type_traits>
 
 int is_invalid_restriction(char* restricted_structure, char* current_structure);
 
@@ -71,25 +79,385 @@ void validateSequence(std::string sequence){
   }
 }
 
-std::string hfold(std::string seq,std::string res, double &energy, sparse_tree &tree, bool pk_free, bool pk_only, int dangles){
+std::string hfold(std::string seq,std::string res, double &energy, sparse_tree &tree, const fold_tables &tables, bool pk_free, bool pk_only, int dangles, int threads, bool fast_backtrack, bool backtrack, bool prune){
 	W_final min_fold(seq,res, pk_free, pk_only, dangles);
-	energy = min_fold.hfold(tree);
+	min_fold.threads = threads;
+	min_fold.store_backtrack = fast_backtrack;
+	min_fold.backtrack = backtrack;
+	min_fold.prune = prune;
+	energy = min_fold.hfold(tree,tables);
+	if(prune) std::cerr << "Pruned " << min_fold.pruned_loops() << " of " << min_fold.total_loops() << " pseudoknotted interior loops" << std::endl;
     std::string structure = min_fold.structure;
     return structure;
 }
 
-double hfold_pf(std::string seq, sparse_tree &tree, bool pk_free, int dangles, double min_en){
-	W_final_pf min_fold(seq, pk_free,dangles,min_en);
-	double energy = min_fold.hfold_pf(tree);
+/**
+ * Folds once and enumerates the suboptimal structures from the filled matrices, see W_final::subopt.
+ * start and n place the folded part back in the whole sequence.
+*/
+void hfold_subopt(std::string seq,std::string res, sparse_tree &tree, const fold_tables &tables, bool pk_free, bool pk_only, int dangles, int threads, bool fast_backtrack, int kbest, energy_t delta, cand_pos_t start, cand_pos_t n, std::ostream &out){
+	W_final min_fold(seq,res, pk_free, pk_only, dangles);
+	min_fold.threads = threads;
+	min_fold.store_backtrack = fast_backtrack;
+	min_fold.hfold(tree,tables);
+	cand_pos_t length = seq.length();
+	min_fold.subopt(tree,kbest,delta,[&](const std::string &structure, energy_t energy){
+		out << std::string(start,'.') << structure << std::string(n-start-length,'.') << " (" << energy/100.0 << ")" << std::endl;
+	});
+}
+
+// bpp, when not null, gets the base pair probabilities of the fold with positions shifted by offset, and gradients the
+// derivatives of its ensemble energy by the energy parameters.
+// A float fold whose weights left the range of a float is done again in double.
+template <typename T>
+double hfold_pf(std::string seq, sparse_tree &tree, const fold_tables &tables, bool pk_free, int dangles, double min_en, int threads, std::ostream *bpp = nullptr, double cutoff = 0, cand_pos_t offset = 0, std::ostream *gradients = nullptr){
+	W_final_pf<T> min_fold(seq, pk_free,dangles,min_en);
+	min_fold.threads = threads;
+	double energy = min_fold.hfold_pf(tree,tables);
+	if constexpr (std::is_same<T,float>::value) if(!min_fold.in_range()) return hfold_pf<pf_t>(seq,tree,tables,pk_free,dangles,min_en,threads,bpp,cutoff,offset,gradients);
+	if(bpp) min_fold.probabilities(tree,cutoff,offset,*bpp);
+	if(gradients) min_fold.gradients(tree,*gradients);
     return energy;
 }
 
+/**
+ * Guess of the MFE used for pf_scale when the MFE fold is skipped, the energy per base RNAfold
+ * used to start from before the MFE was known.
+*/
+double guess_mfe(cand_pos_t length){
+	vrna_md_t md;
+	vrna_md_set_default(&md);
+	return length*(-185+7.27*(md.temperature-37.))/1000.;
+}
+
+/**
+ * hfold and hfold_pf from a single fill, see W_final_pf::hfold_fused. pf_scale is set from guess_mfe as the MFE is not known
+ * before the fill; when that leaves W(n) out of the range of T the partition function is filled again on its own with the MFE,
+ * in double.
+*/
+template <typename T>
+std::string hfold_fused(std::string seq,std::string res, double &energy, double &pf_energy, sparse_tree &tree, const fold_tables &tables, bool pk_free, bool pk_only, int dangles, int threads, bool fast_backtrack, bool backtrack){
+	W_final min_fold(seq,res, pk_free, pk_only, dangles);
+	min_fold.threads = threads;
+	min_fold.store_backtrack = fast_backtrack;
+	min_fold.backtrack = backtrack;
+	W_final_pf<T> pf_fold(seq,pk_free,dangles,guess_mfe(seq.length()));
+	pf_fold.threads = threads;
+	pf_energy = pf_fold.hfold_fused(min_fold,tree,tables,energy);
+	if(!pf_fold.in_range()) pf_energy = hfold_pf<pf_t>(seq,tree,tables,pk_free,dangles,energy,threads);
+	return min_fold.structure;
+}
+
+/**
+ * The approximate fold of beam_fold in place of hfold and hfold_pf, see --beam. pf_scale is set from the MFE of the beam
+ * fold as partition_functions sets it from the one of hfold, n being the length of the whole sequence.
+*/
+std::string hfold_beam(std::string seq, double &energy, double &pf_energy, sparse_tree &tree, int dangles, int beam, bool backtrack, bool pf, cand_pos_t n){
+	beam_fold fold(seq,dangles,beam);
+	fold.backtrack = backtrack;
+	energy = fold.fold(tree);
+	if(pf) pf_energy = fold.pf(energy*seq.length()/n);
+	return fold.structure;
+}
+
+/**
+ * Formats the parts of a result that were computed: the structure, (MFE) and {ensemble energy}
+*/
+std::string format_result(Result &result, bool structure, bool mfe, bool pf){
+	std::ostringstream out;
+	if(structure) out << result.get_final_structure();
+	if(mfe) out << (structure ? " " : "") << "(" << result.get_final_energy() << ")";
+	if(pf) out << (structure || mfe ? " " : "") << "{" << result.get_pf_energy() << "}";
+	return out.str();
+}
+
+/**
+ * Folds every prefix of the sequence, shortest first, from a single column by column fill of the matrices, see
+ * W_final::cotranscriptional. Each prefix gets one line with its length and the parts of the result that were computed.
+ * pf_scale is estimated from the length of the whole sequence, as for --pf-only, so it is the same per base for every prefix.
+*/
+void hfold_cotranscriptional(std::string seq, std::string res, bool pk_free, bool pk_only, int dangles, bool fast_backtrack, bool mfe, bool pf, bool extended, bool backtrack, bool prune, std::ostream &out){
+	cand_pos_t n = seq.length();
+	sparse_tree tree(res,n);
+	fold_tables tables(seq,tree);
+	std::vector<std::string> structures(n+1);
+	std::vector<double> energies(n+1,0);
+	std::vector<double> pf_energies(n+1,0);
+	if(mfe){
+		W_final min_fold(seq,res, pk_free, pk_only, dangles);
+		min_fold.store_backtrack = fast_backtrack;
+		min_fold.backtrack = backtrack;
+		min_fold.prune = prune;
+		min_fold.cotranscriptional(tree,tables,[&](cand_pos_t length, double energy, const std::string &structure){
+			energies[length] = energy;
+			structures[length] = structure;
+		});
+		if(prune) std::cerr << "Pruned " << min_fold.pruned_loops() << " of " << min_fold.total_loops() << " pseudoknotted interior loops" << std::endl;
+	}
+	if(pf){
+		auto prefix_energy = [&](cand_pos_t length, double energy){ pf_energies[length] = energy; };
+		if(extended) W_final_pf<ext_pf>(seq,pk_free,dangles,guess_mfe(n)).cotranscriptional(tree,tables,prefix_energy);
+		else W_final_pf<pf_t>(seq,pk_free,dangles,guess_mfe(n)).cotranscriptional(tree,tables,prefix_energy);
+	}
+	for(cand_pos_t length = 1; length<=n; ++length){
+		Result result(seq.substr(0,length),res.substr(0,length),0,structures[length],energies[length],pf_energies[length]);
+		out << length << " " << format_result(result,backtrack,mfe,pf) << std::endl;
+	}
+}
+
+/**
+ * Finds the part of the problem that still has to be folded. The 'x' runs at the 5' and 3' ends are forced
+ * unpaired bases of the exterior loop and add nothing to either energy, so they are cut off. TURN of them are
+ * kept at the 5' end so the first entries of the PF W array are the same as for the whole sequence, and one
+ * at the 3' end so the dangles of the last stem see the same neighbour.
+ * Runs of 'x' inside the sequence are left alone as their length still counts in the loops around them.
+*/
+void trim_forced_ends(const std::string &structure, cand_pos_t &start, cand_pos_t &length){
+	cand_pos_t n = structure.length();
+	cand_pos_t first = structure.find_first_not_of('x');
+	if(first == (cand_pos_t) std::string::npos){
+		start = 0;
+		length = n;
+		return;
+	}
+	cand_pos_t last = structure.find_last_not_of('x');
+	start = std::max(first-TURN,0);
+	length = std::min(last+1,n-1) - start + 1;
+}
+
+/**
+ * The fold tables of the part start..start+length of seq under tree. The pair types of the whole sequence are built once
+ * in tables and only the constraint part is set again for each structure; a trimmed part gets tables of its own.
+*/
+const fold_tables &tables_for(const std::string &seq, const sparse_tree &tree, cand_pos_t start, cand_pos_t length, std::unique_ptr<fold_tables> &tables){
+	cand_pos_t n = seq.length();
+	if(start == 0 && length == n && tables && tables->n == n) tables->set_tree(tree);
+	else tables.reset(new fold_tables(seq.substr(start,length),tree));
+	return *tables;
+}
+
+/**
+ * Result i is printed if it is one of the first -n, unless it has the same structure as the result before it
+*/
+bool is_printed(std::vector<Result> &result_list, int i, int number_of_output, bool backtrack){
+	if(i == 0) return true;
+	if(i >= number_of_output) return false;
+	return !(backtrack && result_list[i].get_final_structure() == result_list[i-1].get_final_structure());
+}
+
+/**
+ * Keeps the number_to_keep hotspots with the lowest pseudoknot-free energy, in their original order. The pseudoknot-free
+ * fold is a lot cheaper than the full one and its energy is an upper bound on the final energy of the hotspot.
+ * The given input structure is always kept.
+*/
+void screen_hotspots(std::string &seq, std::vector<Hotspot> &hotspot_list, int number_to_keep, const std::string &restricted, int dangles, int threads, std::unique_ptr<fold_tables> &whole_tables){
+	if((int) hotspot_list.size() <= number_to_keep) return;
+	std::vector<std::pair<double,int> > ranked;
+	for(int i = 0;i<hotspot_list.size();++i){
+		double energy = -INF;
+		std::string structure = hotspot_list[i].get_structure();
+		if(structure != restricted){
+			cand_pos_t start, length;
+			trim_forced_ends(structure,start,length);
+			std::string sub_seq = seq.substr(start,length);
+			std::string sub_structure = structure.substr(start,length);
+			sparse_tree tree(sub_structure,length);
+			hfold(sub_seq,sub_structure,energy,tree,tables_for(seq,tree,start,length,whole_tables),true,false,dangles,threads,false,false,false);
+		}
+		ranked.push_back(std::make_pair(energy,i));
+	}
+	std::stable_sort(ranked.begin(),ranked.end(),[](const std::pair<double,int> &a, const std::pair<double,int> &b){ return a.first < b.first; });
+	std::vector<bool> keep(hotspot_list.size(),false);
+	for(int i = 0;i<number_to_keep;++i) keep[ranked[i].second] = true;
+	std::vector<Hotspot> kept;
+	for(int i = 0;i<hotspot_list.size();++i) if(keep[i]) kept.push_back(hotspot_list[i]);
+	hotspot_list.swap(kept);
+}
+
 void seqtoRNA(std::string &sequence){
     for (char &c : sequence) {
       	if (c == 'T') c = 'U';
     }
 }
 
+/**
+ * Sets the ensemble energy of the results that are printed, with the weights kept as T. With incremental the whole
+ * sequence is folded once and refolded for each structure, see W_final_pf::refold_pf.
+*/
+template <typename T>
+void partition_functions(std::vector<Result> &result_list, const std::string &seq, int number_of_output, bool backtrack, bool mfe_stage, bool incremental, bool fused, bool pk_free, int dangles, int threads, const std::string &bpp_file, double bpp_cutoff, const std::string &gradients_file, std::unique_ptr<fold_tables> &whole_tables){
+	cand_pos_t n = seq.length();
+	std::unique_ptr<W_final_pf<T> > incremental_pf;
+	for(int i = 0;i<result_list.size();++i){
+		if(!is_printed(result_list,i,number_of_output,backtrack)) continue;
+		std::string structure = result_list[i].get_restricted();
+		double energy = result_list[i].get_final_energy();
+		// the probabilities and gradients of the first result come from a fold of its own
+		bool probabilities = i == 0 && (bpp_file != "" || gradients_file != "");
+		// the ensemble energy of a fused or beam fold is already set
+		if(fused && !probabilities) continue;
+		if(incremental && !probabilities){
+			double mfe = mfe_stage ? energy : guess_mfe(n);
+			if(!incremental_pf){
+				incremental_pf.reset(new W_final_pf<T>(seq,pk_free,dangles,mfe));
+				incremental_pf->threads = threads;
+			}
+			result_list[i].set_pf_energy(incremental_pf->refold_pf(structure,mfe));
+			// a float refold that left the range of a float is folded again on its own below, which ends in double
+			if(!std::is_same<T,float>::value || incremental_pf->in_range()) continue;
+		}
+		cand_pos_t start, length;
+		trim_forced_ends(structure,start,length);
+		std::string sub_seq = seq.substr(start,length);
+		std::string sub_structure = structure.substr(start,length);
+
+		sparse_tree tree(sub_structure,length);
+		const fold_tables &tables = tables_for(seq,tree,start,length,whole_tables);
+		// pf_scale is estimated from the energy per base of the whole sequence
+		std::ofstream bpp, gradients;
+		if(probabilities && bpp_file != ""){
+			bpp.open(bpp_file);
+			if(!bpp){
+				std::cout << "Could not open " << bpp_file << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		if(probabilities && gradients_file != ""){
+			gradients.open(gradients_file);
+			if(!gradients){
+				std::cout << "Could not open " << gradients_file << std::endl;
+				exit(EXIT_FAILURE);
+			}
+		}
+		result_list[i].set_pf_energy(hfold_pf<T>(sub_seq,tree,tables,pk_free,dangles,mfe_stage ? energy*length/n : guess_mfe(length),threads,bpp.is_open() ? &bpp : nullptr,bpp_cutoff,start,gradients.is_open() ? &gradients : nullptr));
+	}
+}
+
+/**
+ * Draws count structures of structure, the first result, from a single fill of the partition function, see
+ * W_final_pf::sample. The bases trimmed off the ends are printed unpaired, and the non-redundant structures are followed
+ * by their probability since they are no longer drawn in proportion to it.
+*/
+template <typename T>
+void hfold_sample(const std::string &seq, const std::string &structure, double energy, bool mfe_stage, bool pk_free, int dangles, int threads, int count, bool non_redundant, uint64_t seed, std::ostream &out){
+	cand_pos_t n = seq.length();
+	cand_pos_t start, length;
+	std::string res = structure;
+	trim_forced_ends(res,start,length);
+	std::string sub_seq = seq.substr(start,length);
+	sparse_tree tree(res.substr(start,length),length);
+	fold_tables tables(sub_seq,tree);
+
+	W_final_pf<T> pf_fold(sub_seq,pk_free,dangles,mfe_stage ? energy*length/n : guess_mfe(length));
+	pf_fold.threads = threads;
+	pf_fold.hfold_pf(tree,tables);
+	const std::string before(start,'.'), after(n-start-length,'.');
+	pf_fold.sample(tree,count,non_redundant,seed,[&](const std::string &sampled, double probability){
+		out << before << sampled << after;
+		if(non_redundant) out << " " << probability;
+		out << "\n";
+	});
+	out.flush();
+}
+
+/**
+ * Reads the substitutions given to --scan, a comma separated list such as G12A,C40U: the base, its position from 1 and the
+ * base put in its place. all stands for the single base substitutions of seq that keep every pair of the input structure
+ * res a valid pair. Bases are converted as the sequence is.
+*/
+std::vector<std::pair<cand_pos_t,char> > read_variants(std::string list, const std::string &seq, const std::string &res, bool convert){
+	std::vector<std::pair<cand_pos_t,char> > variants;
+	cand_pos_t n = seq.length();
+	std::vector<cand_pos_t> partner(n+1,0);
+	std::vector<cand_pos_t> open;
+	for(cand_pos_t k = 1; k<=n; ++k){
+		if(res[k-1] == '(') open.push_back(k);
+		else if(res[k-1] == ')'){
+			partner[k] = open.back();
+			partner[open.back()] = k;
+			open.pop_back();
+		}
+	}
+	make_pair_matrix();
+	auto pairs = [&](cand_pos_t k, char c){ return partner[k] == 0 || pair[encode_char(c)][encode_char(seq[partner[k]-1])] > 0; };
+
+	std::transform(list.begin(), list.end(), list.begin(), ::toupper);
+	if(list == "ALL"){
+		for(cand_pos_t k = 1; k<=n; ++k){
+			for(char c : std::string(seq.find('T') == std::string::npos ? "ACGU" : "ACGT")){
+				if(c != seq[k-1] && pairs(k,c)) variants.push_back(std::make_pair(k,c));
+			}
+		}
+		return variants;
+	}
+	std::istringstream in(list);
+	std::string variant;
+	while(std::getline(in,variant,',')){
+		if(convert) seqtoRNA(variant);
+		char *end = nullptr;
+		cand_pos_t k = variant.length() >= 3 ? strtol(variant.c_str()+1,&end,10) : 0;
+		if(k < 1 || k > n || end != variant.c_str()+variant.length()-1 || variant[0] != seq[k-1] || std::string("ACGUT").find(variant.back()) == std::string::npos || variant.back() == variant[0]){
+			std::cout << "Substitution " << variant << " is not of the form G12A for a base of the sequence" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if(!pairs(k,variant.back())){
+			std::cout << "Substitution " << variant << " breaks the pair " << std::min(k,partner[k]) << "." << std::max(k,partner[k]) << " of the input structure" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		variants.push_back(std::make_pair(k,variant.back()));
+	}
+	return variants;
+}
+
+/**
+ * Folds the wild type and every variant with the same input structure, and prints the change of the MFE and of the
+ * ensemble energy for each variant in the order given. The variants are sorted by position and cut into one run per thread.
+ * A run folds the wild type once and then goes from one variant to the next with W_final::mutate and W_final_pf::mutate,
+ * so each step only fills again the cells that see the base substituted before or the one substituted now.
+ * pf_scale stays the one of the wild type for all the variants.
+*/
+template <typename T>
+void hfold_scan(std::string seq, std::string res, const std::vector<std::pair<cand_pos_t,char> > &variants, bool pk_free, bool pk_only, int dangles, int threads, bool fast_backtrack, bool mfe, bool pf, bool backtrack, std::ostream &out){
+	cand_pos_t n = seq.length();
+	int count = variants.size();
+	std::vector<int> order(count);
+	for(int v = 0; v<count; ++v) order[v] = v;
+	std::stable_sort(order.begin(),order.end(),[&](int a, int b){ return variants[a].first < variants[b].first; });
+
+	std::vector<Result> results(count,Result(seq,res,0,"",0,0));
+	Result wild_type(seq,res,0,"",0,0);
+	int runs = std::max(std::min(threads,count),1);
+	parallel_for(runs,runs,[&](int r){
+		int first = (long long) count*r/runs, last = (long long) count*(r+1)/runs;
+		std::unique_ptr<W_final> min_fold;
+		std::unique_ptr<W_final_pf<T> > pf_fold;
+		double energy = 0, pf_energy = 0;
+		if(mfe){
+			min_fold.reset(new W_final(seq,res,pk_free,pk_only,dangles));
+			min_fold->store_backtrack = fast_backtrack;
+			min_fold->backtrack = backtrack;
+			energy = min_fold->refold(res);
+		}
+		if(pf){
+			pf_fold.reset(new W_final_pf<T>(seq,pk_free,dangles,mfe ? energy : guess_mfe(n)));
+			pf_energy = pf_fold->refold_pf(res,mfe ? energy : guess_mfe(n));
+		}
+		if(r == 0) wild_type = Result(seq,res,0,mfe ? min_fold->structure : "",energy,pf_energy);
+		for(int v = first; v<last; ++v){
+			std::string variant = seq;
+			variant[variants[order[v]].first-1] = variants[order[v]].second;
+			double variant_energy = mfe ? min_fold->mutate(variant) : 0;
+			double variant_pf = pf ? pf_fold->mutate(variant) : 0;
+			results[order[v]] = Result(variant,res,0,mfe ? min_fold->structure : "",variant_energy-energy,variant_pf-pf_energy);
+		}
+	});
+
+	out << format_result(wild_type,backtrack,mfe,pf) << std::endl;
+	for(int v = 0; v<count; ++v){
+		cand_pos_t k = variants[v].first;
+		out << seq[k-1] << k << variants[v].second << " " << format_result(results[v],backtrack,mfe,pf) << std::endl;
+	}
+}
 
 int main (int argc, char *argv[])
 {
@@ -124,6 +492,60 @@ int main (int argc, char *argv[])
 
 	int dangles = args_info.dangles_given ? dangle_model : 2;
 
+	int threads = args_info.threads_given ? std::max(num_threads,1) : 1;
+
+	bool fast_backtrack = args_info.fastBacktrack_given;
+
+	// structures enumerated from a single fold, in place of the hotspots of -n
+	bool enumerate = args_info.kbest_given || args_info.delta_given;
+	int k_best = args_info.kbest_given ? std::max(kbest,1) : 0;
+	energy_t delta = args_info.delta_given ? (energy_t) std::lround(std::max(subopt_delta,0.0)*100) : INF;
+	if(enumerate) number_of_suboptimal_structure = 1;
+
+	// stages of the run that can be skipped
+	bool mfe_stage = !args_info.pf_only_given;
+	bool pf_stage = !args_info.mfe_only_given;
+	bool backtrack = mfe_stage && !args_info.energy_only_given;
+	bool hotspots = !args_info.no_hotspots_given;
+	bool prune = args_info.prune_given;
+	int screen_count = args_info.screen_given ? std::max(screen,1) : 0;
+	bool incremental = args_info.incremental_given;
+	bool cotranscriptional = args_info.cotranscriptional_given;
+	bool scan = args_info.scan_given;
+	bool extended_pf = args_info.extended_pf_given;
+	bool convert = !args_info.noConv_given;
+	std::string bpp = args_info.bpp_given ? bpp_file : "";
+	std::string gradients = args_info.gradients_given ? gradients_file : "";
+	double cutoff = args_info.bpp_cutoff_given ? bpp_cutoff : 1e-5;
+	int sample_count = args_info.sample_given ? std::max(samples,0) : 0;
+	bool non_redundant = args_info.non_redundant_given;
+	uint64_t seed = args_info.seed_given ? sample_seed : std::random_device()();
+	bool fused = args_info.fused_given;
+	bool float_pf = args_info.float_pf_given;
+	int beam = args_info.beam_given ? std::max(beam_width,1) : 0;
+	if(!mfe_stage && !pf_stage){
+		std::cout << "--mfe-only and --pf-only cannot be used together" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if((bpp != "" || gradients != "" || sample_count > 0) && !pf_stage){
+		std::cout << "--bpp, --gradients and --sample need the partition function, they cannot be used with --mfe-only" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if(float_pf && extended_pf){
+		std::cout << "--float-pf and --extended-pf cannot be used together" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if(fused && (!mfe_stage || !pf_stage || incremental || prune)){
+		std::cout << "--fused fills the MFE and the partition function together, it cannot be used with --mfe-only, --pf-only, --incremental or --prune" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	// the beam fold is pseudoknot-free and only has the MFE and the ensemble energy
+	if(beam > 0 && ((dangles != 0 && dangles != 2) || pk_only || incremental || fused || prune || enumerate || cotranscriptional || scan || extended_pf || float_pf || bpp != "" || gradients != "" || sample_count > 0)){
+		std::cout << "--beam only supports the dangle models 0 and 2, it cannot be used with -k, --incremental, --fused, --prune, --kbest, --delta, --cotranscriptional, --scan, --extended-pf, --float-pf, --bpp, --gradients or --sample" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if(beam > 0) pk_free = true;
+
 	if(fileI != ""){
 		
 		if(exists(fileI)){
@@ -136,11 +558,12 @@ int main (int argc, char *argv[])
 	}
 	int n = seq.length();
 	std::transform(seq.begin(), seq.end(), seq.begin(), ::toupper);
-	if(!args_info.noConv_given) seqtoRNA(seq);
+	if(convert) seqtoRNA(seq);
 	validateSequence(seq);
 
 	if(restricted != "") validateStructure(seq,restricted);
-	if(pk_free) if(restricted == "") restricted = std::string('.',n);
+	if(pk_free) if(restricted == "") restricted = std::string(n,'.');
+	if(!hotspots && restricted == "") restricted = std::string(n,'.');
 
 	std::string file= "";
 	args_info.paramFile_given ? file = parameter_file : file = "";
@@ -153,7 +576,37 @@ int main (int argc, char *argv[])
 	
 	cmdline_parser_free(&args_info);
 
+	// every prefix of the input structure is folded, the pairs of G could not be kept in the prefixes that cut them
+	if(cotranscriptional){
+		if(restricted.find_first_of("()") != std::string::npos){
+			std::cout << "The input structure can only contain ._x with --cotranscriptional" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if(restricted == "") restricted = std::string(n,'.');
+		std::ofstream file_out;
+		if(fileO != "") file_out.open(fileO);
+		std::ostream &out = (fileO != "") ? file_out : std::cout;
+		out << seq << std::endl;
+		hfold_cotranscriptional(seq,restricted,pk_free,pk_only,dangles,fast_backtrack,mfe_stage,pf_stage,extended_pf,backtrack,prune,out);
+		return 0;
+	}
+
+	// the variants are folded with the input structure, without hotspots
+	if(scan){
+		if(restricted == "") restricted = std::string(n,'.');
+		std::vector<std::pair<cand_pos_t,char> > variants = read_variants(scan_variants,seq,restricted,convert);
+		std::ofstream file_out;
+		if(fileO != "") file_out.open(fileO);
+		std::ostream &out = (fileO != "") ? file_out : std::cout;
+		out << seq << std::endl;
+		if(extended_pf) hfold_scan<ext_pf>(seq,restricted,variants,pk_free,pk_only,dangles,threads,fast_backtrack,mfe_stage,pf_stage,backtrack,out);
+		else hfold_scan<pf_t>(seq,restricted,variants,pk_free,pk_only,dangles,threads,fast_backtrack,mfe_stage,pf_stage,backtrack,out);
+		return 0;
+	}
+
 	std::vector<Hotspot> hotspot_list;
+	// the pair types of seq, built once for the hotspots and all the folds of the whole sequence
+	std::unique_ptr<fold_tables> whole_tables;
 
 	// Hotspots
 
@@ -164,29 +617,98 @@ int main (int argc, char *argv[])
 		hotspot.set_structure(restricted);
 		hotspot_list.push_back(hotspot);
 	}
-	if((number_of_suboptimal_structure-hotspot_list.size())>0) {
-		get_hotspots(seq, hotspot_list,number_of_suboptimal_structure,params);
+	if(hotspots && (number_of_suboptimal_structure-hotspot_list.size())>0) {
+		whole_tables.reset(new fold_tables(seq));
+		get_hotspots(seq, hotspot_list,number_of_suboptimal_structure,params,*whole_tables);
 	}
 	free(params);
+
+	if(enumerate){
+		std::string structure = hotspot_list[0].get_structure();
+		cand_pos_t start, length;
+		trim_forced_ends(structure,start,length);
+		std::string sub_seq = seq.substr(start,length);
+		std::string sub_structure = structure.substr(start,length);
+
+		sparse_tree tree(sub_structure,length);
+		fold_tables tables(sub_seq,tree);
+
+		std::ofstream file_out;
+		if(fileO != "") file_out.open(fileO);
+		std::ostream &out = (fileO != "") ? file_out : std::cout;
+		out << seq << std::endl;
+		hfold_subopt(sub_seq,sub_structure,tree,tables,pk_free,pk_only,dangles,threads,fast_backtrack,k_best,delta,start,n,out);
+		return 0;
+	}
+
+	if(screen_count > 0 && mfe_stage) screen_hotspots(seq,hotspot_list,screen_count,restricted,dangles,threads,whole_tables);
+
 	// Data structure for holding the output
 	std::vector<Result> result_list;
+	// hotspots with the same structure give the same result, so each structure is only folded once
+	std::unordered_map<std::string,int> folded;
+	// with --incremental the folds of the whole sequence kept from one structure to the next
+	std::unique_ptr<W_final> incremental_fold;
     //double min_energy;
 	// Iterate through all hotspots or the single given input structure
 	for(int i = 0;i<hotspot_list.size();++i){
-		double energy;
+		double energy = 0;
+		double pf_energy = 0;
 		std::string structure = hotspot_list[i].get_structure();
+		auto same = folded.find(structure);
+		if(same != folded.end()){
+			Result result = result_list[same->second];
+			result_list.push_back(result);
+			continue;
+		}
+		folded[structure] = result_list.size();
+
+		std::string final_structure = "";
+		if(mfe_stage && incremental){
+			// the whole sequence is folded, so every hotspot refills the same matrices
+			if(!incremental_fold){
+				incremental_fold.reset(new W_final(seq,structure,pk_free,pk_only,dangles));
+				incremental_fold->threads = threads;
+				incremental_fold->store_backtrack = fast_backtrack;
+				incremental_fold->backtrack = backtrack;
+				incremental_fold->prune = prune;
+			}
+			energy = incremental_fold->refold(structure);
+			final_structure = incremental_fold->structure;
+		}
+		else if(beam > 0){
+			// the beam fold always folds for the MFE, its kept states are the ones the partition function goes through
+			cand_pos_t start, length;
+			trim_forced_ends(structure,start,length);
+			std::string sub_seq = seq.substr(start,length);
+			sparse_tree tree(structure.substr(start,length),length);
+			final_structure = hfold_beam(sub_seq,energy,pf_energy,tree,dangles,beam,backtrack,pf_stage,n);
+			if(backtrack) final_structure = std::string(start,'.') + final_structure + std::string(n-start-length,'.');
+		}
+		else if(mfe_stage){
+			cand_pos_t start, length;
+			trim_forced_ends(structure,start,length);
+			std::string sub_seq = seq.substr(start,length);
+			std::string sub_structure = structure.substr(start,length);
+
+			sparse_tree tree(sub_structure,length);
+			const fold_tables &tables = tables_for(seq,tree,start,length,whole_tables);
+			if(fused && extended_pf) final_structure = hfold_fused<ext_pf>(sub_seq,sub_structure,energy,pf_energy,tree,tables,pk_free,pk_only,dangles,threads,fast_backtrack,backtrack);
+			else if(fused && float_pf) final_structure = hfold_fused<float>(sub_seq,sub_structure,energy,pf_energy,tree,tables,pk_free,pk_only,dangles,threads,fast_backtrack,backtrack);
+			else if(fused) final_structure = hfold_fused<pf_t>(sub_seq,sub_structure,energy,pf_energy,tree,tables,pk_free,pk_only,dangles,threads,fast_backtrack,backtrack);
+			else final_structure = hfold(sub_seq,sub_structure, energy,tree,tables,pk_free,pk_only, dangles,threads,fast_backtrack,backtrack,prune);
+			// back to the original coordinates, the cut off ends are unpaired
+			if(backtrack) final_structure = std::string(start,'.') + final_structure + std::string(n-start-length,'.');
+		}
 
-		sparse_tree tree(structure,n);
-		std::string final_structure = hfold(seq,structure, energy,tree,pk_free,pk_only, dangles);
-
-		double pf_energy = hfold_pf(seq,tree,pk_free,dangles,energy);
-		
 		Result result(seq,hotspot_list[i].get_structure(),hotspot_list[i].get_energy(),final_structure,energy,pf_energy);
 		result_list.push_back(result);
 	}
 
     
 
+	if(prune && incremental_fold) std::cerr << "Pruned " << incremental_fold->pruned_loops() << " of " << incremental_fold->total_loops() << " pseudoknotted interior loops" << std::endl;
+
 	Result::Result_comp result_comp;
 	std::sort(result_list.begin(), result_list.end(),result_comp );
 
@@ -195,16 +717,23 @@ int main (int argc, char *argv[])
 	if(number_of_suboptimal_structure != 1){
 			number_of_output = std::min( (int) result_list.size(),number_of_suboptimal_structure);
 	}
+
+	// the partition function is only computed for the results that are printed
+	if(pf_stage){
+		if(extended_pf) partition_functions<ext_pf>(result_list,seq,number_of_output,backtrack,mfe_stage,incremental,fused || beam > 0,pk_free,dangles,threads,bpp,cutoff,gradients,whole_tables);
+		else if(float_pf) partition_functions<float>(result_list,seq,number_of_output,backtrack,mfe_stage,incremental,fused || beam > 0,pk_free,dangles,threads,bpp,cutoff,gradients,whole_tables);
+		else partition_functions<pf_t>(result_list,seq,number_of_output,backtrack,mfe_stage,incremental,fused || beam > 0,pk_free,dangles,threads,bpp,cutoff,gradients,whole_tables);
+	}
 	//output to file
 	if(fileO != ""){
 		std::ofstream out(fileO);
 		out << seq << std::endl;
 		out << "Restricted_" << 0 << ": " << result_list[0].get_restricted() << " (" << result_list[0].get_restricted_energy() << ")" << std::endl;
-		out << "Result_" << 0 << ":     " << result_list[0].get_final_structure() << " (" << result_list[0].get_final_energy() << ") {" << result_list[0].get_pf_energy() << "}" << std::endl;
+		out << "Result_" << 0 << ":     " << format_result(result_list[0],backtrack,mfe_stage,pf_stage) << std::endl;
 		for (int i=1; i < number_of_output; i++) {
-			if(result_list[i].get_final_structure() == result_list[i-1].get_final_structure()) continue;
+			if(!is_printed(result_list,i,number_of_output,backtrack)) continue;
 			out << "Restricted_" << i << ": " << result_list[i].get_restricted() << " (" << result_list[i].get_restricted_energy() << ")" << std::endl;
-			out << "Result_" << i << ":     " << result_list[i].get_final_structure() << " (" << result_list[i].get_final_energy() << ") {" << result_list[i].get_pf_energy() << "}" << std::endl;
+			out << "Result_" << i << ":     " << format_result(result_list[i],backtrack,mfe_stage,pf_stage) << std::endl;
 		}
 
 	}else{
@@ -213,19 +742,30 @@ int main (int argc, char *argv[])
 		//changed format for ouptut to stdout
 		std::cout << seq << std::endl;
 		if(result_list.size() == 1){
-			std::cout << result_list[0].get_final_structure() << " (" << result_list[0].get_final_energy() << ") {" << result_list[0].get_pf_energy() << "}" << std::endl;
+			std::cout << format_result(result_list[0],backtrack,mfe_stage,pf_stage) << std::endl;
 		}
 		else{
 			std::cout << "Restricted_" << 0 << ": " << result_list[0].get_restricted() << " (" << result_list[0].get_restricted_energy() << ")" << std::endl;
-			std::cout << "Result_" << 0 << ":     " << result_list[0].get_final_structure() << " (" << result_list[0].get_final_energy() << ") {" << result_list[0].get_pf_energy() << "}" << std::endl;
+			std::cout << "Result_" << 0 << ":     " << format_result(result_list[0],backtrack,mfe_stage,pf_stage) << std::endl;
 			for (int i=1; i < number_of_output; i++) {
-				if(result_list[i].get_final_structure() == result_list[i-1].get_final_structure()) continue;
+				if(!is_printed(result_list,i,number_of_output,backtrack)) continue;
 				std::cout << "Restricted_" << i << ": " << result_list[i].get_restricted() << " (" << result_list[i].get_restricted_energy() << ")" << std::endl;
-				std::cout << "Result_" << i << ":     " << result_list[i].get_final_structure() << " (" << result_list[i].get_final_energy() << ") {" << result_list[i].get_pf_energy() << "}" << std::endl;
+				std::cout << "Result_" << i << ":     " << format_result(result_list[i],backtrack,mfe_stage,pf_stage) << std::endl;
 			}
 		}
 	}
 
+	// the structures drawn follow the results
+	if(sample_count > 0){
+		std::ofstream file_out;
+		if(fileO != "") file_out.open(fileO,std::ios::app);
+		std::ostream &out = (fileO != "") ? file_out : std::cout;
+		std::string structure = result_list[0].get_restricted();
+		double energy = result_list[0].get_final_energy();
+		if(extended_pf) hfold_sample<ext_pf>(seq,structure,energy,mfe_stage,pk_free,dangles,threads,sample_count,non_redundant,seed,out);
+		else hfold_sample<pf_t>(seq,structure,energy,mfe_stage,pk_free,dangles,threads,sample_count,non_redundant,seed,out);
+	}
+
     return 0;
 }
 
@@ -33,6 +33,10 @@ pf_t Result::get_pf_energy(){
     return this->pf_energy;
 }
 
+void Result::set_pf_energy(pf_t pf_energy){
+    this->pf_energy = pf_energy;
+}
+
 double Result::get_restricted_energy(){
     return this->restricted_energy;
 }
@@ -21,13 +21,14 @@ class Result{
         double get_final_energy();
         pf_t get_pf_energy();
 
+        //setter
+        void set_pf_energy(pf_t pf_energy);
+
         struct Result_comp{
 		bool operator ()(Result &x, Result &y) const {
-			if(x.get_final_energy() < y.get_final_energy()) return true;
-
-            if(x.get_restricted_energy() < y.get_restricted_energy()) return true;
+			if(x.get_final_energy() != y.get_final_energy()) return x.get_final_energy() < y.get_final_energy();
 
-            return false;
+            return x.get_restricted_energy() < y.get_restricted_energy();
 		}
 		} result_comp;
         
@@ -1,12 +1,16 @@
 #include "W_final.hh"
 #include "h_struct.hh"
 #include "h_externs.hh"
+#include "parallel.hh"
 
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
 #include <iostream>
+#include <algorithm>
+#include <queue>
+#include <unordered_set>
 
 
 // Hosna June 20th, 2007
@@ -51,78 +55,246 @@ void W_final::space_allocation(){
 	structure = std::string (n+1,'.');
 
 	// Hosna: June 20th 2007
-    WMB = new pseudo_loop (seq_,res,V,S_,S1_,params_);
+	// the pseudoknotted matrices are not needed for a pk-free fold
+    if(!pk_free) WMB = new pseudo_loop (seq_,res,V,S_,S1_,params_);
 
 }
 
 
 
 
-double W_final::hfold(sparse_tree &tree){
+double W_final::hfold(sparse_tree &tree, const fold_tables &tables){
+		tables_ = &tables;
+		V->tables_ = &tables;
+		if(backtrack) V->keep_types();
+		if(backtrack && store_backtrack) V->keep_internal_splits();
+		if(pk_free) fill_matrices<false>(tree,tables);
+		else{
+			WMB->tables_ = &tables;
+			WMB->prune = prune;
+			fill_matrices<true>(tree,tables);
+		}
+		filled = true;
+		return fold_exterior(tree,tables);
+}
 
-		for (int i = n; i >=1; --i)
-		{	
-			for (int j =i; j<=n; ++j)//for (i=0; i<=j; i++)
-			{
-				const bool evaluate = tree.weakly_closed(i,j);
-				const pair_type ptype_closing = pair[S_[i]][S_[j]];
-				const bool restricted = tree.tree[i].pair == -1 || tree.tree[j].pair == -1;
-				const bool paired = (tree.tree[i].pair == j && tree.tree[j].pair == i);
+/**
+ * The fill of hfold with the same order and threads, each cell going to cell right after it is filled. The record of
+ * the loops is kept per thread, as the cells of different arcs are filled at the same time.
+*/
+double W_final::hfold_fused(sparse_tree &tree, const fold_tables &tables, const std::function<void(cand_pos_t, cand_pos_t, const loop_record &)> &cell){
+	tables_ = &tables;
+	V->tables_ = &tables;
+	if(backtrack) V->keep_types();
+	if(backtrack && store_backtrack) V->keep_internal_splits();
+	if(WMB){
+		WMB->tables_ = &tables;
+		WMB->prune = false;
+	}
+	fill_by_arcs(tree,n,threads,[&](cand_pos_t i, cand_pos_t j){
+		thread_local loop_record record;
+		record.clear();
+		if(pk_free) fill_cell<false>(i,j,tree,tables,&record);
+		else fill_cell<true>(i,j,tree,tables,&record);
+		cell(i,j,record);
+	});
+	filled = true;
+	return fold_exterior(tree,tables);
+}
 
-				const bool pkonly = (!pk_only || paired);
+/**
+ * Keeps the matrices of the last fold and only fills again the cells that can see a base whose constraint is not
+ * the same in res, see fill_changed. The first call folds from scratch.
+*/
+double W_final::refold(const std::string &res){
+	std::vector<bool> changed(n+1,false);
+	for(cand_pos_t k = 1; k<=n; ++k) changed[k] = (res[k-1] != this->res[k-1]);
+	this->res = res;
+	std::unique_ptr<sparse_tree> tree(new sparse_tree(res,n));
+	own_tree.swap(tree);
+	return refill(changed);
+}
 
-				if(ptype_closing> 0 && evaluate && !restricted && pkonly)
-				V->compute_energy_restricted (i,j,tree);
+/**
+ * Folds seq, a sequence of the same length with some bases substituted, under the same constraint. The recurrences
+ * of a cell only read the bases in [i-1,j+1], so as in refold only the cells that see a substituted base are filled again.
+*/
+double W_final::mutate(const std::string &seq){
+	std::vector<bool> changed(n+1,false);
+	for(cand_pos_t k = 1; k<=n; ++k) changed[k] = (seq[k-1] != seq_[k-1]);
+	seq_ = seq;
+	V->set_sequence(seq);
+	// S_ and S1_ are shared with V and WMB, so they are written over in place
+	short *S = encode_sequence(seq.c_str(),0);
+	short *S1 = encode_sequence(seq.c_str(),1);
+	memcpy(S_,S,(n+2)*sizeof(short));
+	memcpy(S1_,S1,(n+2)*sizeof(short));
+	free(S);
+	free(S1);
+	if(!own_tree) own_tree.reset(new sparse_tree(res,n));
+	return refill(changed);
+}
 
-				if(!pk_free) WMB->compute_energies(i,j,tree);
+/**
+ * Fills again the cells that can see a changed position of res or of the sequence, see fill_changed, and backtracks.
+ * Everything is filled when nothing was folded yet.
+*/
+double W_final::refill(const std::vector<bool> &changed){
+	// built before the old one is freed, so the matrices never point to a freed table
+	std::unique_ptr<fold_tables> tables(new fold_tables(seq_,*own_tree));
+	own_tables.swap(tables);
+	if(!filled) return hfold(*own_tree,*own_tables);
+
+	tables_ = own_tables.get();
+	V->tables_ = own_tables.get();
+	if(WMB) WMB->tables_ = own_tables.get();
+	refilled = fill_changed(*own_tables,changed,[&](cand_pos_t i, cand_pos_t j){
+		V->clear_cell(i,j);
+		if(pk_free) fill_cell<false>(i,j,*own_tree,*own_tables);
+		else{
+			WMB->clear_cell(i,j);
+			fill_cell<true>(i,j,*own_tree,*own_tables);
+		}
+	});
+	return fold_exterior(*own_tree,*own_tables);
+}
 
+double W_final::add_pair(cand_pos_t i, cand_pos_t j){
+	std::string constraint = res;
+	if(!sparse_tree::add_pair(constraint,i,j)) return W[n]/100.0;
+	return refold(constraint);
+}
 
-				V->compute_WMv_WMp(i,j,WMB->get_WMB(i,j),tree.tree);
-				V->compute_energy_WM_restricted(i,j,tree,WMB->WMB);
-			}
+double W_final::remove_pair(cand_pos_t i, cand_pos_t j){
+	std::string constraint = res;
+	if(!sparse_tree::remove_pair(constraint,i,j)) return W[n]/100.0;
+	return refold(constraint);
+}
 
-		}
-	for (cand_pos_t j= TURN+1; j <= n; j++){
+/**
+ * Fills the exterior loop array W from the filled matrices and backtracks the MFE structure
+*/
+double W_final::fold_exterior(sparse_tree &tree, const fold_tables &tables){
+	for (cand_pos_t j= TURN+1; j <= n; j++) W[j] = exterior_energy(j,tree,tables);
+	return backtrack_exterior(tree);
+}
+
+/**
+ * W(j), the MFE of the bases 1 to j in the exterior loop. The entries of W before j are filled.
+*/
+energy_t W_final::exterior_energy(cand_pos_t j, sparse_tree &tree, const fold_tables &tables){
 		energy_t m1 = INF;
 		energy_t m2 = INF;
 		energy_t m3 = INF;
-		if(tree.tree[j].pair < 0) m1 = W[j-1];
+		if(tables.is_unpaired(j)) m1 = W[j-1];
 		
 		
 		for (cand_pos_t k=1; k<=j-TURN-1; ++k){
 		 	// m2 = compute_W_br2_restricted (j, fres, must_choose_this_branch);
 			energy_t acc = (k>1) ? W[k-1]: 0;
-			m2 = std::min(m2,acc + E_ext_Stem(V->get_energy(k,j),V->get_energy(k+1,j),V->get_energy(k,j-1),V->get_energy(k+1,j-1),S_,params_,k,j,n,tree.tree));
-			if (k == 1 || (tree.weakly_closed(1,k-1) && tree.weakly_closed(k,j))) m3 = std::min(m3,acc + WMB->get_WMB(k,j) + PS_penalty);
+			m2 = std::min(m2,acc + E_ext_Stem(V->get_energy(k,j),V->get_energy(k+1,j),V->get_energy(k,j-1),V->get_energy(k+1,j-1),S_,params_,k,j,n));
+			if (k == 1 || (tree.weakly_closed(1,k-1) && tree.weakly_closed(k,j))) m3 = std::min(m3,acc + get_WMB(k,j) + PS_penalty);
 			}
-		W[j] = std::min({m1,m2,m3});
-	}
+		return std::min({m1,m2,m3});
+}
 
+/**
+ * Backtracks the MFE structure of the bases 1 to n from W[n]
+*/
+double W_final::backtrack_exterior(sparse_tree &tree){
     double energy = W[n]/100.0;
+    if(!backtrack){
+        structure.clear();
+        return energy;
+    }
 
     // backtrack
+    // a refold backtracks again into the same space
+    structure.assign(n+1,'.');
+    std::fill(f,f+n+1,minimum_fold());
     // first add (1,n) on the stack
-    stack_interval = new seq_interval;
-    stack_interval->i = 1;
-    stack_interval->j = n;
-    stack_interval->energy = W[n];
-    stack_interval->type = FREE;
-    stack_interval->next = NULL;
-
-    seq_interval *cur_interval = stack_interval;
+    stack_interval.clear();
+    stack_interval.reserve(n+1);
+    if(WMB) WMB->set_backtrack_state(&structure,f,&stack_interval);
+    insert_node(1,n,FREE);
+    stack_interval.back().energy = W[n];
 
-    while ( cur_interval != NULL)
+    while (!stack_interval.empty())
     {
-        stack_interval = stack_interval->next;
-        backtrack_restricted (cur_interval,tree);
-        delete cur_interval;    // this should make up for the new in the insert_node
-        cur_interval = stack_interval;
+        // copied out as the nodes pushed while backtracking may move the stack
+        seq_interval cur_interval = stack_interval.back();
+        stack_interval.pop_back();
+        backtrack_restricted (&cur_interval,tree);
     }
 	this->structure = structure.substr(1,n);
     return energy;
 
 }
 
+/**
+ * Fills the matrices column by column, j ascending and i descending, so every cell of the prefix 1..j is known once
+ * column j is done. The prefix is then folded as if j were the last base: n is set to j, W(j) is computed and
+ * backtracked, and the result goes to out. W(j) is computed again with the base after j as its 3' neighbour for the
+ * longer prefixes, so every cell and every entry of W is only computed once or twice.
+*/
+void W_final::cotranscriptional(sparse_tree &tree, const fold_tables &tables, const std::function<void(cand_pos_t, double, const std::string &)> &out){
+	tables_ = &tables;
+	V->tables_ = &tables;
+	if(backtrack) V->keep_types();
+	if(backtrack && store_backtrack) V->keep_internal_splits();
+	if(WMB){
+		WMB->tables_ = &tables;
+		WMB->prune = prune;
+	}
+	const cand_pos_t length = n;
+	for(cand_pos_t j = 1; j <= length; ++j){
+		for(cand_pos_t i = j; i >= 1; --i){
+			if(pk_free) fill_cell<false>(i,j,tree,tables);
+			else fill_cell<true>(i,j,tree,tables);
+		}
+		n = j;
+		if(j > TURN) W[j] = exterior_energy(j,tree,tables);
+		double energy = backtrack_exterior(tree);
+		out(j,energy,structure);
+		n = length;
+		if(j > TURN) W[j] = exterior_energy(j,tree,tables);
+	}
+	filled = true;
+}
+
+/**
+ * Fills V, WM, WMv, WMp and, when pk is true, the pseudoknotted matrices of WMB.
+ * Without pseudoknots every WMB entry is INF, so the same value is used in its place and nothing is allocated for it.
+*/
+template <bool pk>
+void W_final::fill_matrices(sparse_tree &tree, const fold_tables &tables){
+		fill_by_arcs(tree,n,threads,[&](cand_pos_t i, cand_pos_t j){ fill_cell<pk>(i,j,tree,tables); });
+}
+
+template <bool pk>
+void W_final::fill_cell(cand_pos_t i, cand_pos_t j, sparse_tree &tree, const fold_tables &tables, loop_record *record){
+	const bool evaluate = tree.weakly_closed(i,j);
+	const pair_type ptype_closing = tables.ptype(i,j);
+	const bool restricted = tables.is_forced(i) || tables.is_forced(j);
+	const bool paired = tables.in_G(i,j);
+
+	const bool pkonly = (!pk_only || paired);
+
+	if(ptype_closing> 0 && evaluate && !restricted && pkonly)
+	V->compute_energy_restricted (i,j,tree,record);
+
+	if constexpr (pk){
+		WMB->compute_energies(i,j,tree,record);
+
+		V->compute_WMv_WMp(i,j,WMB->get_WMB(i,j));
+		V->compute_energy_WM_restricted<true>(i,j,tree,WMB->WMB.data());
+	}
+	else{
+		V->compute_WMv_WMp(i,j,INF);
+		V->compute_energy_WM_restricted<false>(i,j,tree,nullptr);
+	}
+}
+
 /**
  * @brief Gives the W(i,j) energy. The type of dangle model being used affects this energy. 
  * The type of dangle is also changed to reflect this.
@@ -134,12 +306,13 @@ double W_final::hfold(sparse_tree &tree){
  * @param vij1 The V(i,j-1) energy
  * @param vi1j1 The V(i+1,j-1) energy
 */
-energy_t W_final::E_ext_Stem(const energy_t& vij,const energy_t& vi1j,const energy_t& vij1,const energy_t& vi1j1,const short* S, paramT* params, const cand_pos_t i,const cand_pos_t j, cand_pos_t n, std::vector<Node> &tree){
+energy_t W_final::E_ext_Stem(const energy_t& vij,const energy_t& vi1j,const energy_t& vij1,const energy_t& vi1j1,const short* S, paramT* params, const cand_pos_t i,const cand_pos_t j, cand_pos_t n){
 
 	energy_t e = INF,en = INF;
-  	pair_type tt  = pair[S[i]][S[j]];
+	const fold_tables &ft = *tables_;
+  	pair_type tt  = ft.ptype(i,j);
 	
-    if ((tree[i].pair <-1 && tree[j].pair <-1) || (tree[i].pair == j && tree[j].pair == i)) {
+    if ((ft.is_free(i) && ft.is_free(j)) || ft.in_G(i,j)) {
 				en = vij; // i j
 
 				if (en != INF) {
@@ -159,8 +332,8 @@ energy_t W_final::E_ext_Stem(const energy_t& vij,const energy_t& vi1j,const ener
 	}
 
 	if(params->model_details.dangles  == 1){
-        tt  = pair[S[i+1]][S[j]];
-        if (((tree[i+1].pair <-1 && tree[j].pair <-1) || (tree[i+1].pair == j)) && tree[i].pair<0) {
+        tt  = ft.ptype(i+1,j);
+        if (ft.can_pair(i+1,j) && ft.is_unpaired(i)) {
             en = (j-i-1>TURN) ? vi1j : INF; //i+1 j
 
             if (en != INF) {
@@ -172,8 +345,8 @@ energy_t W_final::E_ext_Stem(const energy_t& vij,const energy_t& vi1j,const ener
             e = MIN2(e,en);
 
         }
-        tt  = pair[S[i]][S[j-1]];
-        if (((tree[i].pair <-1 && tree[j-1].pair <-1) || (tree[i].pair == j-1)) && tree[j].pair<0) {
+        tt  = ft.ptype(i,j-1);
+        if (ft.can_pair(i,j-1) && ft.is_unpaired(j)) {
             en = (j-1-i>TURN) ? vij1 : INF; // i j-1
             if (en != INF) {
 
@@ -184,8 +357,8 @@ energy_t W_final::E_ext_Stem(const energy_t& vij,const energy_t& vi1j,const ener
             e = MIN2(e,en);
 
         }
-        tt  = pair[S[i+1]][S[j-1]];
-        if (((tree[i+1].pair <-1 && tree[j-1].pair <-1) || (tree[i+1].pair == j-1)) && tree[i].pair < 0 && tree[j].pair<0) {
+        tt  = ft.ptype(i+1,j-1);
+        if (ft.can_pair(i+1,j-1) && ft.is_unpaired(i) && ft.is_unpaired(j)) {
             en = (j-1-i-1>TURN) ? vi1j1 : INF; // i+1 j-1
 
             if (en != INF) {
@@ -203,6 +376,7 @@ energy_t W_final::E_ext_Stem(const energy_t& vij,const energy_t& vi1j,const ener
 
 void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree){
     char type;
+	const fold_tables &ft = *tables_;
 
 
 	// printf("type is %c and i is %d and j is %d\n",cur_interval->type,cur_interval->i,cur_interval->j);
@@ -245,15 +419,17 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 					// detect the other closing pair
 					cand_pos_t best_ip=j, best_jp=i;
 					energy_t min = INF;
+					if(V->has_internal_splits()) V->get_internal_split(i,j,best_ip,best_jp);
+					else{
 					cand_pos_t max_ip = std::min(j-TURN-2,i+MAXLOOP+1);
 					for (cand_pos_t k = i+1; k <= max_ip; ++k)
 					{
-						if (tree.up[k-1]>=(k-i-1)){
+						if (ft.up[k-1]>=(k-i-1)){
 							cand_pos_t min_l=std::max(k+TURN+1 + MAXLOOP+2, k+j-i) - MAXLOOP-2;
 							for (cand_pos_t l = j-1; l >= min_l; --l)
 							{
 								
-								if(tree.up[j-1]>=(j-l-1)){
+								if(ft.up[j-1]>=(j-l-1)){
 							
 									energy_t tmp = V->compute_int(i,j,k,l,params_);
 									if (tmp < min)
@@ -266,6 +442,7 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 							}
 						}
 					}
+					}
 
 					if (best_ip < best_jp)
 						insert_node (best_ip, best_jp, LOOP);
@@ -285,7 +462,7 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 					int tmp= INF, min = INF;
 					for (cand_pos_t k = i+1; k <= j-1; k++){
 						
-						tmp = V->get_energy_WM (i+1,k-1) + std::min(V->get_energy_WMv(k, j-1),V->get_energy_WMp(k, j-1)) + E_MLstem(pair[S_[j]][S_[i]],-1,-1,params_) + params_->MLclosing;							
+						tmp = V->get_energy_WM (i+1,k-1) + std::min(V->get_energy_WMv(k, j-1),V->get_energy_WMp(k, j-1)) + E_MLstem(rtype[ft.ptype(i,j)],-1,-1,params_) + params_->MLclosing;							
 						if (tmp < min)
 						  {
 							min = tmp;
@@ -295,9 +472,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 						  // TODO:
 						  // Hosna, May 1st, 2012
 						  // do I need to check for non-canonical base pairings here as well so the dangle values not be INF??
-						if (tree.tree[i+1].pair <= -1)
+						if (ft.is_unpaired(i+1))
 						{
-							tmp = V->get_energy_WM (i+2,k-1) + std::min(V->get_energy_WMv(k, j-1),V->get_energy_WMp(k, j-1)) + E_MLstem(pair[S_[j]][S_[i]],-1,S_[i+1],params_) + params_->MLclosing + params_->MLbase;
+							tmp = V->get_energy_WM (i+2,k-1) + std::min(V->get_energy_WMv(k, j-1),V->get_energy_WMp(k, j-1)) + E_MLstem(rtype[ft.ptype(i,j)],-1,S_[i+1],params_) + params_->MLclosing + params_->MLbase;
 							
 							if (tmp < min)
 							{
@@ -306,9 +483,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 								best_row = 2;
 							}
 						}
-						if (tree.tree[j-1].pair <= -1)
+						if (ft.is_unpaired(j-1))
 						{
-							tmp = V->get_energy_WM (i+1,k-1) + std::min(V->get_energy_WMv(k, j-2),V->get_energy_WMp(k, j-2)) + E_MLstem(pair[S_[j]][S_[i]],S_[j-1],-1,params_) + params_->MLclosing + params_->MLbase;
+							tmp = V->get_energy_WM (i+1,k-1) + std::min(V->get_energy_WMv(k, j-2),V->get_energy_WMp(k, j-2)) + E_MLstem(rtype[ft.ptype(i,j)],S_[j-1],-1,params_) + params_->MLclosing + params_->MLbase;
 							
 							if (tmp < min)
 							{
@@ -317,9 +494,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 								best_row = 3;
 							}
 						}
-						if (tree.tree[i+1].pair <= -1 && tree.tree[j-1].pair <= -1)
+						if (ft.is_unpaired(i+1) && ft.is_unpaired(j-1))
 						{
-							tmp = V->get_energy_WM (i+2,k-1) + std::min(V->get_energy_WMv(k, j-2),V->get_energy_WMp(k, j-2)) + E_MLstem(pair[S_[j]][S_[i]],S_[j-1],S_[i+1],params_) + params_->MLclosing + 2*params_->MLbase;
+							tmp = V->get_energy_WM (i+2,k-1) + std::min(V->get_energy_WMv(k, j-2),V->get_energy_WMp(k, j-2)) + E_MLstem(rtype[ft.ptype(i,j)],S_[j-1],S_[i+1],params_) + params_->MLclosing + 2*params_->MLbase;
 							
 							if (tmp < min)
 							{
@@ -329,7 +506,7 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 							}
 						}
 
-						tmp = static_cast<energy_t>((k-i-1)*params_->MLbase + V->get_energy_WMp(k,j-1))+ E_MLstem(pair[S_[j]][S_[i]],-1,-1,params_) + params_->MLclosing;
+						tmp = static_cast<energy_t>((k-i-1)*params_->MLbase + V->get_energy_WMp(k,j-1))+ E_MLstem(rtype[ft.ptype(i,j)],-1,-1,params_) + params_->MLclosing;
 						if (tmp < min)
 						  {
 							min = tmp;
@@ -339,9 +516,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 						  // TODO:
 						  // Hosna, May 1st, 2012
 						  // do I need to check for non-canonical base pairings here as well so the dangle values not be INF??
-						if (tree.tree[i+1].pair <= -1)
+						if (ft.is_unpaired(i+1))
 						{
-							if((k-(i+1)-1) >=0) tmp = static_cast<energy_t>((k-(i+1)-1)*params_->MLbase) + V->get_energy_WMp(k,j-1) + E_MLstem(pair[S_[j]][S_[i]],-1,S_[i+1],params_) + params_->MLclosing + params_->MLbase;
+							if((k-(i+1)-1) >=0) tmp = static_cast<energy_t>((k-(i+1)-1)*params_->MLbase) + V->get_energy_WMp(k,j-1) + E_MLstem(rtype[ft.ptype(i,j)],-1,S_[i+1],params_) + params_->MLclosing + params_->MLbase;
 							if (tmp < min)
 							{
 								min = tmp;
@@ -349,9 +526,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 								best_row = 6;
 							}
 						}
-						if (tree.tree[j-1].pair <= -1)
+						if (ft.is_unpaired(j-1))
 						{
-							tmp = static_cast<energy_t>((k-i-1)*params_->MLbase) + V->get_energy_WMp(k,j-2) + E_MLstem(pair[S_[j]][S_[i]],S_[j-1],-1,params_) + params_->MLclosing + params_->MLbase;
+							tmp = static_cast<energy_t>((k-i-1)*params_->MLbase) + V->get_energy_WMp(k,j-2) + E_MLstem(rtype[ft.ptype(i,j)],S_[j-1],-1,params_) + params_->MLclosing + params_->MLbase;
 							if (tmp < min)
 							{
 								min = tmp;
@@ -359,9 +536,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 								best_row = 7;
 							}
 						}
-						if (tree.tree[i+1].pair <= -1 && tree.tree[j-1].pair <= -1)
+						if (ft.is_unpaired(i+1) && ft.is_unpaired(j-1))
 						{
-							if((k-(i+1)-1) >=0) tmp = static_cast<energy_t>((k-(i+1)-1)*params_->MLbase) + V->get_energy_WMp(k,j-2) + E_MLstem(pair[S_[j]][S_[i]],S_[j-1],S_[i+1],params_) + params_->MLclosing + 2*params_->MLbase;
+							if((k-(i+1)-1) >=0) tmp = static_cast<energy_t>((k-(i+1)-1)*params_->MLbase) + V->get_energy_WMp(k,j-2) + E_MLstem(rtype[ft.ptype(i,j)],S_[j-1],S_[i+1],params_) + params_->MLclosing + 2*params_->MLbase;
 							if (tmp < min)
 							{
 								min = tmp;
@@ -417,7 +594,7 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 			int min = INF, tmp, best_row, i, best_i, acc, energy_ij;
 
 			// this case is for j unpaired, so I have to check that.
-			if (tree.tree[j].pair <= -1)
+			if (ft.is_unpaired(j))
 			{
 				tmp = W[j-1];
 				if (tmp < min)
@@ -439,9 +616,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 					if(params_->model_details.dangles == 2){
 						base_type si1 = i>1 ? S_[i-1] : -1;
 						base_type sj1 = j<n ? S_[j+1] : -1;
-						tmp = energy_ij + E_ExtLoop(pair[S_[i]][S_[j]],si1,sj1,params_) + acc;
+						tmp = energy_ij + E_ExtLoop(ft.ptype(i,j),si1,sj1,params_) + acc;
 					} else 
-						tmp = energy_ij + E_ExtLoop(pair[S_[i]][S_[j]],-1,-1,params_) + acc; 
+						tmp = energy_ij + E_ExtLoop(ft.ptype(i,j),-1,-1,params_) + acc; 
 					if (tmp < min)
 					{
 					min = tmp;
@@ -451,12 +628,12 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 					
 				}
 				if(params_->model_details.dangles ==1){
-					if (tree.tree[i].pair <= -1)
+					if (ft.is_unpaired(i))
 					{
 						energy_ij = V->get_energy(i+1,j);
 						if (energy_ij < INF)
 						{
-							tmp = energy_ij + E_ExtLoop(pair[S_[i+1]][S_[j]],S_[i],-1,params_) + acc;
+							tmp = energy_ij + E_ExtLoop(ft.ptype(i+1,j),S_[i],-1,params_) + acc;
 							
 							if (tmp < min)
 							{
@@ -467,12 +644,12 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 							
 						}
 					}
-					if (tree.tree[j].pair <= -1)
+					if (ft.is_unpaired(j))
 					{
 						energy_ij = V->get_energy(i,j-1);
 						if (energy_ij < INF)
 						{
-							tmp = energy_ij + E_ExtLoop(pair[S_[i]][S_[j-1]],-1,S_[j],params_) + acc;
+							tmp = energy_ij + E_ExtLoop(ft.ptype(i,j-1),-1,S_[j],params_) + acc;
 							if (tmp < min)
 							{
 								min = tmp;
@@ -481,12 +658,12 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 							}
 						}
 					}
-					if (tree.tree[i].pair <= -1 && tree.tree[j].pair <= -1)
+					if (ft.is_unpaired(i) && ft.is_unpaired(j))
 					{
 						energy_ij = V->get_energy(i+1,j-1);
 						if (energy_ij < INF)
 						{
-							tmp = energy_ij + E_ExtLoop(pair[S_[i+1]][S_[j-1]],S_[i],S_[j],params_) + acc;
+							tmp = energy_ij + E_ExtLoop(ft.ptype(i+1,j-1),S_[i],S_[j],params_) + acc;
 							if (tmp < min)
 							{
 								min = tmp;
@@ -508,7 +685,7 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 
 				acc = (i-1>0) ? W[i-1]: 0;
 
-				energy_ij = WMB->get_WMB(i,j);
+				energy_ij = get_WMB(i,j);
 
 				if (energy_ij < INF)
 				{
@@ -522,9 +699,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 					}
 				}
 
-				if (tree.tree[i].pair <= -1 && i+1 < j)
+				if (ft.is_unpaired(i) && i+1 < j)
 				{
-					energy_ij = WMB->get_WMB(i+1,j);
+					energy_ij = get_WMB(i+1,j);
 					if (energy_ij < INF)
 					{
 						tmp = energy_ij + PS_penalty + acc;
@@ -537,9 +714,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 					}
 				}
 
-				if (tree.tree[j].pair <= -1 && i < j-1)
+				if (ft.is_unpaired(j) && i < j-1)
 				{
-					energy_ij = WMB->get_WMB(i,j-1);
+					energy_ij = get_WMB(i,j-1);
 					if (energy_ij < INF)
 					{
 						tmp = energy_ij + PS_penalty + acc;
@@ -552,9 +729,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 					}
 				}
 
-				if (tree.tree[i].pair <= -1 && tree.tree[j].pair <= -1 && i+1 < j-1)
+				if (ft.is_unpaired(i) && ft.is_unpaired(j) && i+1 < j-1)
 				{
-					energy_ij = WMB->get_WMB(i+1,j-1);
+					energy_ij = get_WMB(i+1,j-1);
 					if (energy_ij < INF)
 					{
 						tmp = energy_ij + PS_penalty + acc;
@@ -633,7 +810,7 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 			energy_t min = INF;
 			cand_pos_t best_k = j, best_row;
 
-			if(tree.tree[j].pair<0){
+			if(ft.is_unpaired(j)){
 			// if(V->get_energy_WM(i,j-1)< min){
 				min = V->get_energy_WM(i,j-1)+params_->MLbase;
 				best_row = 5;
@@ -643,8 +820,8 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 
 			for (cand_pos_t k=i; k <= j-TURN-1; k++)
 			{	energy_t m1 = INF,m2 = INF;
-				energy_t wm_kj = V->E_MLStem(V->get_energy(k,j),V->get_energy(k+1,j),V->get_energy(k,j-1),V->get_energy(k+1,j-1),S_,params_,k,j,n,tree.tree);
-				bool can_pair = tree.up[k-1] >= (k-(i));
+				energy_t wm_kj = V->E_MLStem(V->get_energy(k,j),V->get_energy(k+1,j),V->get_energy(k,j-1),V->get_energy(k+1,j-1),S_,params_,k,j,n);
+				bool can_pair = ft.up[k-1] >= (k-(i));
 				if(can_pair) m1 = static_cast<energy_t>((k-i)*params_->MLbase) + V->get_energy_WMv (k, j);
 				if (m1 < min){
 					min = m1;
@@ -697,28 +874,28 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 			cand_pos_t sj = S_[j];
 			cand_pos_t si1 = (i>1) ? S_[i-1] : -1;
 			cand_pos_t sj1 = (j<n) ? S_[j+1] : -1;
-			pair_type tt = pair[S_[i]][S_[j]];
+			pair_type tt = ft.ptype(i,j);
 			min = V->get_energy(i,j) + ((params_->model_details.dangles == 2) ? E_MLstem(tt,si1,sj1,params_) : E_MLstem(tt,-1,-1,params_));
 			best_row = 1;
 			if(params_->model_details.dangles == 1){
-				if(tree.tree[i].pair<0){
-					tt = pair[S_[i+1]][S_[j]];
+				if(ft.is_unpaired(i)){
+					tt = ft.ptype(i+1,j);
 					energy_t tmp = V->get_energy(i+1,j) + E_MLstem(tt,si,-1,params_) + params_->MLbase;
 					if(tmp<min){
 						min = tmp;
 						best_row = 2;
 					}
 				}
-				if(tree.tree[j].pair<0){
-					tt = pair[S_[i]][S_[j-1]];
+				if(ft.is_unpaired(j)){
+					tt = ft.ptype(i,j-1);
 					energy_t tmp = V->get_energy(i,j-1) + E_MLstem(tt,-1,sj,params_) + params_->MLbase;
 					if(tmp<min){
 						min = tmp;
 						best_row = 3;
 					}
 				}
-				if(tree.tree[i].pair<0 && tree.tree[j].pair<0){
-					tt = pair[S_[i+1]][S_[j-1]];
+				if(ft.is_unpaired(i) && ft.is_unpaired(j)){
+					tt = ft.ptype(i+1,j-1);
 					energy_t tmp = V->get_energy(i+1,j-1) + E_MLstem(tt,si,sj,params_) + 2*params_->MLbase;
 					if(tmp<min){
 						min = tmp;
@@ -726,7 +903,7 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 					}
 				}
 			}
-			if(tree.tree[j].pair<0){
+			if(ft.is_unpaired(j)){
 				energy_t tmp = V->get_energy_WMv(i,j-1) + params_->MLbase;
 				if(tmp< min){
 					min = tmp;
@@ -749,9 +926,9 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 			int min = INF;
 			int best_row;
 
-			min = WMB->get_WMB(i,j) + PSM_penalty + b_penalty;
+			min = get_WMB(i,j) + PSM_penalty + b_penalty;
 			best_row = 1;
-			if(tree.tree[j].pair<0){
+			if(ft.is_unpaired(j)){
 				energy_t tmp = V->get_energy_WMp(i,j-1) + params_->MLbase;
 				if(tmp< min){
 					min = tmp;
@@ -774,11 +951,7 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 		case P_BE:
 		case P_WIP:
 		{
-			WMB->set_stack_interval(stack_interval);
-			WMB->back_track(structure,f,cur_interval,tree);
-			stack_interval = WMB->get_stack_interval();
-			structure = WMB->get_structure();
-			f = WMB->get_minimum_fold();
+			WMB->back_track(cur_interval,tree);
 		}
 			break;
 		default:
@@ -789,122 +962,363 @@ void W_final::backtrack_restricted(seq_interval *cur_interval, sparse_tree &tree
 }
 
 void W_final::insert_node (int i, int j, char type)
-  // insert at the beginning
+  // push on top of the stack
 {
-    seq_interval *tmp;
-    tmp = new seq_interval;
-    tmp->i = i;
-    tmp->j = j;
-    tmp->type = type;
-    tmp->next = stack_interval;
-    stack_interval = tmp;
+    seq_interval tmp;
+    tmp.i = i;
+    tmp.j = j;
+    tmp.type = type;
+    tmp.next = NULL;
+    stack_interval.push_back(tmp);
 }
 
-
-//Mateo 13 Sept 2023
-//return number of bases in between the two inclusive index
-int distance(int left, int right){
-    return (right-left-1);
+/**
+ * Suboptimal traceback on the matrices left by hfold, in the spirit of Wuchty et al. 1999.
+ * Every partial structure keeps the intervals it still has to expand, and its energy is the energy fixed so far
+ * plus the optimum of those intervals, so taking them out of a priority queue gives the complete structures in
+ * order of energy. The nested part of the grammar (W, V, WM, WMv, WMp) is enumerated; a pseudoknotted interval
+ * takes its optimal traceback from pseudo_loop and only the loops it closes are enumerated again.
+ * The grammar is ambiguous, so structures already given are skipped.
+*/
+void W_final::subopt(sparse_tree &tree, int kbest, energy_t delta, const std::function<void(const std::string &, energy_t)> &out){
+	auto higher = [](const subopt_state &a, const subopt_state &b){ return a.energy > b.energy; };
+	std::priority_queue<subopt_state,std::vector<subopt_state>,decltype(higher)> queue(higher);
+	std::unordered_set<std::string> seen;
+	std::vector<subopt_state> next;
+	const energy_t limit = (delta >= INF) ? INF : W[n] + delta;
+	int count = 0;
+
+	subopt_state start;
+	start.energy = W[n];
+	start.structure = std::string(n+1,'.');
+	seq_interval whole;
+	whole.i = 1;
+	whole.j = n;
+	whole.energy = W[n];
+	whole.type = FREE;
+	whole.next = NULL;
+	start.intervals.push_back(whole);
+	queue.push(std::move(start));
+
+	while(!queue.empty()){
+		subopt_state state = std::move(const_cast<subopt_state &>(queue.top()));
+		queue.pop();
+		if(state.energy > limit) break;
+		if(state.intervals.empty()){
+			std::string structure = state.structure.substr(1,n);
+			if(seen.insert(structure).second){
+				out(structure,state.energy);
+				if(kbest > 0 && ++count == kbest) break;
+			}
+			continue;
+		}
+		seq_interval cur = state.intervals.back();
+		state.intervals.pop_back();
+		next.clear();
+		expand_subopt(state,cur,tree,limit,next);
+		for(subopt_state &s : next) queue.push(std::move(s));
+	}
 }
 
-//Mateo 13 Sept 2023
-//given a initial hotspot which is a hairpin loop, keep trying to add a arc to form a larger stack
-void expand_hotspot(s_energy_matrix *V, Hotspot &hotspot, int n){
-    //printf("\nexpanding hotspot: i: %d j: %d\n",hotspot->get_left_inner_index(),hotspot->get_right_inner_index());
-    //calculation for the hairpin that is already in there
-    V->compute_hotspot_energy(hotspot.get_left_outer_index(),hotspot.get_right_outer_index(),0);
-
-
-    //try to expand by adding a arc right beside the current out most arc
-    while(hotspot.get_left_outer_index()-1 >= 1 && hotspot.get_right_outer_index()+1 <= n){
-		base_type sim1 = V->S_[hotspot.get_left_outer_index()-1];
-		base_type sjp1 = V->S_[hotspot.get_right_outer_index()+1];
-		pair_type ptype_closing = pair[sim1][sjp1];
-        if(ptype_closing>0){
-            hotspot.move_left_outer_index();
-            hotspot.move_right_outer_index();
-            hotspot.increment_size();
-            V->compute_hotspot_energy(hotspot.get_left_outer_index(),hotspot.get_right_outer_index(),1);
-        }else{
-            break;
-        }
-    }
-	base_type i = hotspot.get_left_outer_index();
-	base_type j = hotspot.get_right_outer_index();
-	pair_type tt = pair[V->S_[i]][V->S_[j]];
-	base_type si1 = i>1 ? V->S_[i-1] : -1;
-	base_type sj1 = j<=n ? V->S_[j+1] : -1;
-	energy_t dangle_penalty = vrna_E_ext_stem(tt, si1, sj1, V->params_);
+energy_t W_final::subopt_value(const seq_interval &cur){
+	switch(cur.type){
+		case FREE: return (cur.j > TURN) ? W[cur.j] : 0;
+		case LOOP:
+		{
+			energy_t v = V->get_energy(cur.i,cur.j);
+			return (v == s_energy_matrix::UNFILLED) ? INF : v;
+		}
+		case M_WM: return V->get_energy_WM(cur.i,cur.j);
+		case M_WMv: return V->get_energy_WMv(cur.i,cur.j);
+		case M_WMp: return V->get_energy_WMp(cur.i,cur.j);
+		default: return get_WMB(cur.i,cur.j);
+	}
+}
 
+void W_final::expand_subopt(const subopt_state &state, const seq_interval &cur, sparse_tree &tree, energy_t limit, std::vector<subopt_state> &next){
+	const fold_tables &ft = *tables_;
+	const int dangles = params_->model_details.dangles;
+	cand_pos_t i = cur.i;
+	cand_pos_t j = cur.j;
+	// energy of the state without cur
+	const energy_t rest = state.energy - subopt_value(cur);
+	// the state the branches are copied from
+	const subopt_state *from = &state;
+
+	auto node = [](cand_pos_t i, cand_pos_t j, char type){
+		seq_interval tmp;
+		tmp.i = i;
+		tmp.j = j;
+		tmp.energy = 0;
+		tmp.type = type;
+		tmp.next = NULL;
+		return tmp;
+	};
+	// keeps the state with cur replaced by the intervals in parts, e is the energy of the loop between them
+	auto branch = [&](energy_t e, std::initializer_list<seq_interval> parts){
+		for(const seq_interval &part : parts){
+			energy_t v = subopt_value(part);
+			if(v >= INF) return;
+			e += v;
+		}
+		if(rest + e > limit) return;
+		next.push_back(*from);
+		subopt_state &s = next.back();
+		s.energy = rest + e;
+		for(const seq_interval &part : parts) s.intervals.push_back(part);
+	};
+	// the ways of closing a stem at (k,l) in the exterior or a multiloop, the same cases as E_ext_Stem and E_MLStem
+	struct stem_choice{ cand_pos_t i, j; energy_t e; };
+	auto stems = [&](cand_pos_t k, cand_pos_t l, bool multi, stem_choice *choice){
+		int count = 0;
+		const energy_t unpaired = multi ? params_->MLbase : 0;
+		auto stem = [&](cand_pos_t p, cand_pos_t q, base_type mm5, base_type mm3){
+			pair_type tt = ft.ptype(p,q);
+			return multi ? E_MLstem(tt,mm5,mm3,params_) : vrna_E_ext_stem(tt,mm5,mm3,params_);
+		};
+		if(multi ? ft.can_pair(k,l) : ((ft.is_free(k) && ft.is_free(l)) || ft.in_G(k,l))){
+			base_type mm5 = (dangles == 2 && k>1) ? S_[k-1] : -1;
+			base_type mm3 = (dangles == 2 && l<n) ? S_[l+1] : -1;
+			choice[count++] = {k,l,stem(k,l,mm5,mm3)};
+		}
+		if(dangles == 1){
+			if(ft.can_pair(k+1,l) && ft.is_unpaired(k) && l-k-1>TURN) choice[count++] = {k+1,l,unpaired + stem(k+1,l,S_[k],-1)};
+			if(ft.can_pair(k,l-1) && ft.is_unpaired(l) && l-1-k>TURN) choice[count++] = {k,l-1,unpaired + stem(k,l-1,-1,S_[l])};
+			if(ft.can_pair(k+1,l-1) && ft.is_unpaired(k) && ft.is_unpaired(l) && l-k-2>TURN) choice[count++] = {k+1,l-1,2*unpaired + stem(k+1,l-1,S_[k],S_[l])};
+		}
+		return count;
+	};
+	stem_choice choice[4];
 
-    double energy = V->get_energy(hotspot.get_left_outer_index(),hotspot.get_right_outer_index());
+	switch(cur.type){
+		case FREE:
+		{
+			if(j <= TURN){
+				branch(0,{});
+				break;
+			}
+			if(ft.is_unpaired(j)) branch(0,{node(1,j-1,FREE)});
+			for(cand_pos_t k = 1; k<=j-TURN-1; ++k){
+				int count = stems(k,j,false,choice);
+				for(int c = 0; c<count; ++c){
+					if(k>1) branch(choice[c].e,{node(1,k-1,FREE),node(choice[c].i,choice[c].j,LOOP)});
+					else branch(choice[c].e,{node(choice[c].i,choice[c].j,LOOP)});
+				}
+				if (WMB && (k == 1 || (tree.weakly_closed(1,k-1) && tree.weakly_closed(k,j)))){
+					if(k>1) branch(PS_penalty,{node(1,k-1,FREE),node(k,j,P_WMB)});
+					else branch(PS_penalty,{node(k,j,P_WMB)});
+				}
+			}
+		}
+			break;
+		case LOOP:
+		{
+			// the alternatives below all close (i,j)
+			subopt_state paired = state;
+			paired.structure[i] = '(';
+			paired.structure[j] = ')';
+			from = &paired;
+
+			if(tables_->up[j-1] >= (j-i-1)) branch(V->HairpinE(seq_,S_,S1_,params_,i,j),{});
+
+			cand_pos_t max_k = std::min(j-TURN-2,i+MAXLOOP+1);
+			for(cand_pos_t k = i+1; k<=max_k; ++k){
+				if(tables_->up[k-1] < (k-i-1)) continue;
+				cand_pos_t min_l=std::max(k+TURN+1 + MAXLOOP+2, k+j-i) - MAXLOOP-2;
+				for(cand_pos_t l = j-1; l>=min_l; --l){
+					if(tables_->up[j-1] < (j-l-1)) continue;
+					energy_t v_kl = V->get_energy(k,l);
+					if(v_kl >= INF || v_kl == s_energy_matrix::UNFILLED) continue;
+					branch(V->compute_int(i,j,k,l,params_) - v_kl,{node(k,l,LOOP)});
+				}
+			}
 
-    // printf("here and %d\n",energy);
-    //printf("energy: %lf, AU_total: %d, dangle_top_total: %d, dangle_bot_total: %d\n",energy,non_gc_penalty,dangle_top_penalty,dangle_bot_penalty);
+			// the closing pair and dangles of the multiloop, then the same split of its inside as compute_energy_VM_restricted
+			pair_type tt = rtype[ft.ptype(i,j)];
+			struct { cand_pos_t a, b; energy_t e; bool ok; } inside[4] = {
+				{i+1,j-1,E_MLstem(tt,dangles == 2 ? S_[j-1] : -1,dangles == 2 ? S_[i+1] : -1,params_),true},
+				{i+2,j-1,E_MLstem(tt,-1,S_[i+1],params_) + params_->MLbase,dangles == 1 && ft.is_unpaired(i+1)},
+				{i+1,j-2,E_MLstem(tt,S_[j-1],-1,params_) + params_->MLbase,dangles == 1 && ft.is_unpaired(j-1)},
+				{i+2,j-2,E_MLstem(tt,S_[j-1],S_[i+1],params_) + 2*params_->MLbase,dangles == 1 && ft.is_unpaired(i+1) && ft.is_unpaired(j-1)}
+			};
+			for(auto &in : inside){
+				if(!in.ok) continue;
+				energy_t closing = in.e + params_->MLclosing;
+				for(cand_pos_t k = std::max(i+1,in.a); k<=j-3; ++k){
+					branch(closing,{node(in.a,k-1,M_WM),node(k,in.b,M_WMv)});
+					branch(closing,{node(in.a,k-1,M_WM),node(k,in.b,M_WMp)});
+					if(tables_->up[k-1] >= (k-i-1)) branch(closing + static_cast<energy_t>((k-in.a)*params_->MLbase),{node(k,in.b,M_WMp)});
+				}
+			}
+		}
+			break;
+		case M_WM:
+		{
+			if(ft.is_unpaired(j)) branch(params_->MLbase,{node(i,j-1,M_WM)});
+			for(cand_pos_t k = i; k<=j-TURN-1; ++k){
+				bool can_pair = tables_->up[k-1] >= (k-i);
+				energy_t unpaired = static_cast<energy_t>((k-i)*params_->MLbase);
+				int count = stems(k,j,true,choice);
+				for(int c = 0; c<count; ++c){
+					if(can_pair) branch(unpaired + choice[c].e,{node(choice[c].i,choice[c].j,LOOP)});
+					branch(choice[c].e,{node(i,k-1,M_WM),node(choice[c].i,choice[c].j,LOOP)});
+				}
+				if(WMB){
+					if(can_pair) branch(unpaired + PSM_penalty + b_penalty,{node(k,j,P_WMB)});
+					branch(PSM_penalty + b_penalty,{node(i,k-1,M_WM),node(k,j,P_WMB)});
+				}
+			}
+		}
+			break;
+		case M_WMv:
+		{
+			int count = stems(i,j,true,choice);
+			for(int c = 0; c<count; ++c) branch(choice[c].e,{node(choice[c].i,choice[c].j,LOOP)});
+			if(ft.is_unpaired(j)) branch(params_->MLbase,{node(i,j-1,M_WMv)});
+		}
+			break;
+		case M_WMp:
+		{
+			if(WMB) branch(PSM_penalty + b_penalty,{node(i,j,P_WMB)});
+			if(ft.is_unpaired(j)) branch(params_->MLbase,{node(i,j-1,M_WMp)});
+		}
+			break;
+		default:
+		{
+			// the pseudoknot takes its optimal traceback, the loops nested in it are left to expand
+			next.push_back(state);
+			subopt_state &s = next.back();
+			std::vector<seq_interval> pk_stack(1,cur);
+			WMB->set_backtrack_state(&s.structure,f,&pk_stack);
+			while(!pk_stack.empty()){
+				seq_interval pk_interval = pk_stack.back();
+				pk_stack.pop_back();
+				if(pk_interval.type == LOOP) s.intervals.push_back(pk_interval);
+				else WMB->back_track(&pk_interval,tree);
+			}
+		}
+	}
+}
 
-    energy = (energy + dangle_penalty) / 100;
 
-    hotspot.set_energy(energy);
-    //printf("done: %d %d %d %d\n",hotspot->get_left_outer_index(),hotspot->get_left_inner_index(),hotspot->get_right_inner_index(),hotspot->get_right_outer_index());
-    return;
-}
+// a stem found by get_hotspots: its innermost pair, the number of stacked pairs and the energy of the stem with its dangles
+struct stem_candidate{
+    energy_t energy;
+    cand_pos_t i;
+    cand_pos_t j;
+    cand_pos_t size;
+    // lower energy first, then by position, so the kept stems do not depend on the order they are found in
+    bool operator<(const stem_candidate &other) const {
+        if(energy != other.energy) return energy < other.energy;
+        if(i != other.i) return i < other.i;
+        return j < other.j;
+    }
+};
 
 //Mateo 13 Sept 2023
 //look for every possible hairpin loop, and try to add a arc to form a larger stack with at least min_stack_size bases
-void get_hotspots(std::string seq,std::vector<Hotspot> &hotspot_list,int max_hotspot, vrna_param_s *params){
+// Only works from the sequence. A stem of min_stack_size pairs with innermost pair (i,j) needs the min_stack_size bases ending at i to pair with
+// the ones starting at j, so the positions of every k-mer are indexed once and each i only looks at the j where a complementary k-mer starts.
+// The pair types are the ones of tables, which the folds of the hotspots use after. The stem energy is summed directly and only
+// the best max_hotspot stems by (energy, i, j) are kept in a heap, so beyond tables this takes O(n + max_hotspot) memory.
+// Among stems of the same energy the ones with the smaller innermost pair are kept.
+void get_hotspots(std::string seq,std::vector<Hotspot> &hotspot_list,int max_hotspot, vrna_param_s *params, const fold_tables &tables){
     
 	int n = seq.length();
-	s_energy_matrix *V;
 	make_pair_matrix();
 	short *S_ = encode_sequence(seq.c_str(),0);
 	short *S1_ = encode_sequence(seq.c_str(),1);
-	V = new s_energy_matrix (seq,n,S_,S1_,params);
     int min_bp_distance = 3;
     int min_stack_size = 3; //the hotspot must be a stack of size >= 3
-    // Hotspot current_hotspot;
-    //start at min_stack_size-1 and go outward to try to add more arcs to form bigger stack because we cannot expand more than min_stack_size from there anyway
-    for(int i = min_stack_size; i <= n; i++){
-        for(int j = i; j <= n; j++){
-			int ptype_closing = pair[V->S_[i]][V->S_[j]];
-            if(ptype_closing>0 && distance(i,j) >= min_bp_distance){
-                // current_hotspot = new Hotspot(i,j,nb_nucleotides);
-				
-                Hotspot current_hotspot(i,j,n);
 
-                expand_hotspot(V,current_hotspot,n);
-
-
-                if(current_hotspot.get_size() < min_stack_size || current_hotspot.is_invalid_energy()){
+	// the k-mer starting at j, the bases are coded 0 to 4
+	int codes = 1;
+	for(int t = 0; t < min_stack_size; ++t) codes *= 5;
+	std::vector<std::vector<cand_pos_t> > kmer_start(codes);
+	for(cand_pos_t j = 1; j+min_stack_size-1 <= n; ++j){
+		int code = 0;
+		for(int t = 0; t < min_stack_size; ++t) code = code*5 + S_[j+t];
+		kmer_start[code].push_back(j);
+	}
 
-                }else{
-                    
-                    current_hotspot.set_structure();
-                    hotspot_list.push_back(current_hotspot);
+	// the worst of the kept stems on top
+	std::priority_queue<stem_candidate> best;
+	std::vector<int> complements;
+	for(cand_pos_t i = min_stack_size; i <= n; ++i){
+		// every k-mer that pairs base by base with S[i],S[i-1],...
+		complements.assign(1,0);
+		for(int t = 0; t < min_stack_size; ++t){
+			std::vector<int> extended;
+			for(int code : complements){
+				for(int b = 1; b <= 4; ++b) if(pair[S_[i-t]][b]>0) extended.push_back(code*5+b);
+			}
+			complements.swap(extended);
+		}
+		for(int code : complements){
+			for(cand_pos_t j : kmer_start[code]){
+				if(j-i-1 < min_bp_distance) continue;
+
+				// the hairpin at (i,j), then a stacked pair for as long as the stem can be extended outward
+				energy_t energy = E_Hairpin(j-i-1,tables.ptype(i,j),S1_[i+1],S1_[j-1],&seq.c_str()[i-1],params);
+				cand_pos_t k = i, l = j, size = 1;
+				while(k-1 >= 1 && l+1 <= n && tables.ptype(k-1,l+1)>0){
+					energy += E_IntLoop(0,0,tables.ptype(k-1,l+1),rtype[tables.ptype(k,l)],S1_[k],S1_[l],S1_[k-1],S1_[l+1],params);
+					--k;
+					++l;
+					++size;
+				}
+				if(size < min_stack_size) continue;
+
+				base_type si1 = k>1 ? S_[k-1] : -1;
+				base_type sj1 = l<n ? S_[l+1] : -1;
+				energy += vrna_E_ext_stem(tables.ptype(k,l), si1, sj1, params);
+				if(energy >= 0) continue;
+
+				stem_candidate stem = {energy,i,j,size};
+				if((int) best.size() < max_hotspot) best.push(stem);
+				else if(stem < best.top()){
+					best.pop();
+					best.push(stem);
+				}
+			}
+		}
+	}
 
-                }
-            }
-        }
-    }
+	std::vector<stem_candidate> stems;
+	stems.reserve(best.size());
+	for(; !best.empty(); best.pop()) stems.push_back(best.top());
+	std::reverse(stems.begin(),stems.end());
+
+	for(const stem_candidate &stem : stems){
+		Hotspot hotspot(stem.i,stem.j,n);
+		for(cand_pos_t s = 1; s < stem.size; ++s){
+			hotspot.move_left_outer_index();
+			hotspot.move_right_outer_index();
+			hotspot.increment_size();
+		}
+		hotspot.set_energy(stem.energy / 100.0);
+		hotspot.set_structure();
+		hotspot_list.push_back(hotspot);
+	}
 
     //make sure we only keep top 20 hotspot with lowest energy
-    std::sort(hotspot_list.begin(), hotspot_list.end(),compare_hotspot_ptr);
+    std::stable_sort(hotspot_list.begin(), hotspot_list.end(),compare_hotspot_ptr);
     while(hotspot_list.size() > max_hotspot){
         hotspot_list.pop_back();
     }
 
     //if no hotspot found, add all _ as restricted
     if(hotspot_list.size() == 0){
-        Hotspot hotspot(1,n,n+1);
-        hotspot.set_default_structure();
+        Hotspot hotspot(1,n,n);
+        hotspot.set_structure(std::string(n,'.'));
         hotspot_list.push_back(hotspot);
     }
-	delete V;
 	free(S_);
 	free(S1_);
 
     return;
 }
 
-bool compare_hotspot_ptr(Hotspot &a, Hotspot &b) { 
+bool compare_hotspot_ptr(const Hotspot &a, const Hotspot &b) { 
     return (a.get_energy() < b.get_energy()); 
 }
\ No newline at end of file
@@ -8,6 +8,8 @@
 #include "s_energy_matrix.hh"
 #include "constants.hh"
 #include <cstring>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -17,12 +19,17 @@ extern "C" {
 #include "ViennaRNA/params/io.h"
 }
 
-void get_hotspots(std::string seq,std::vector<Hotspot> &hotspot_list, int max_hotspot, vrna_param_s *params);
-int distance(int left, int right);
-void expand_hotspot(s_energy_matrix *V, Hotspot &hotspot, int n);
+void get_hotspots(std::string seq,std::vector<Hotspot> &hotspot_list, int max_hotspot, vrna_param_s *params, const fold_tables &tables);
 //Mateo 2024
 //comparison function for hotspot so we can use it when sorting
-bool compare_hotspot_ptr(Hotspot &a, Hotspot &b);
+bool compare_hotspot_ptr(const Hotspot &a, const Hotspot &b);
+
+// a partial structure of the suboptimal traceback: the pairs fixed so far and the intervals still to expand
+struct subopt_state{
+    energy_t energy;                    // energy of the fixed part plus the optimum of every interval left
+    std::string structure;
+    std::vector<seq_interval> intervals;
+};
  
 
 class W_final{
@@ -33,10 +40,42 @@ class W_final{
         ~W_final ();
         // The destructor
 
-        double hfold (sparse_tree &tree);
+        double hfold (sparse_tree &tree, const fold_tables &tables);
+
+        // hfold that passes every cell to cell as soon as it is filled, with the loop energies V and VP were computed from,
+        // so a partition function can be filled in the same traversal (see W_final_pf::hfold_fused). Pruning is turned off.
+        double hfold_fused (sparse_tree &tree, const fold_tables &tables, const std::function<void(cand_pos_t, cand_pos_t, const loop_record &)> &cell);
+
+        // Incremental folding: keeps the matrices of the last fold and only fills again the cells that can see a base whose
+        // constraint changed, then backtracks as hfold does. The first call folds from scratch.
+        double refold (const std::string &res);
+        // adds or removes the pair i.j of the constraint structure and refolds, the fold is left as it is if the change is not valid
+        double add_pair (cand_pos_t i, cand_pos_t j);
+        double remove_pair (cand_pos_t i, cand_pos_t j);
+        long long refilled_cells() { return refilled; }  // cells filled again by the last refold
+        // Point mutations: folds seq, the sequence with some bases substituted, under the same constraint, only filling again
+        // the cells that see a substituted base. Passing the old sequence back puts the fold back the same way.
+        double mutate (const std::string &seq);
+
+        // Co-transcriptional folding: out gets the length, MFE and MFE structure of every prefix of the sequence, shortest
+        // first, from a single fill of the matrices. The pairs of G should not reach past the prefixes they are wanted in.
+        void cotranscriptional (sparse_tree &tree, const fold_tables &tables, const std::function<void(cand_pos_t, double, const std::string &)> &out);
+
+        // PRE:  hfold has been called
+        // POST: passes every structure within delta of the MFE to out as soon as it is found, lowest energy first,
+        //       and stops after kbest distinct structures (0 for no limit)
+        void subopt (sparse_tree &tree, int kbest, energy_t delta, const std::function<void(const std::string &, energy_t)> &out);
 
         vrna_param_t *params_;
         std::string structure;        // MFE structure
+        int threads = 1;              // threads used to fill the arcs of G that do not depend on each other
+        bool store_backtrack = false; // keep the internal loop choices of V during the fill, faster backtrack for more memory
+        bool backtrack = true;        // false to only compute the MFE, structure is left empty
+        bool prune = false;           // skip the pseudoknotted interior loops that cannot improve VP, the MFE stays the same
+
+        // interior loops of VP skipped and looked at when pruning, 0 for a pk-free fold
+        long long pruned_loops() { return WMB ? WMB->interior_pruned.load() : 0; }
+        long long total_loops() { return WMB ? WMB->interior_total.load() : 0; }
         // PRE:  the init_data function has been called;
         //       the space for structure has been allocate
         // POST: fold sequence, return the MFE structure in structure, and return the MFE
@@ -51,20 +90,25 @@ class W_final{
     	// Hosna: June 18th, 2007:
         // this pointer is the main part of the Hierarchical fold program
         // and corresponds to WMB recurrence
-        pseudo_loop *WMB;
+        pseudo_loop *WMB = nullptr;   // not allocated for a pk-free fold
 
         s_energy_matrix *V;     // the V object
         std::vector<energy_t> W;
         // PARAMTYPE *W;                 // the W exterior loop array
         cand_pos_t n;     // sequence length (number of nucleotides)
-        seq_interval *stack_interval;  // used for backtracking
+        std::vector<seq_interval> stack_interval;  // intervals left to backtrack, kept between calls so the space is reused
         minimum_fold *f;        // the minimum folding, see structs.h
         std::string seq_;
         std::string res;
         short *S_;
 	    short *S1_;
+        const fold_tables *tables_ = nullptr;
         bool pk_free = false;
         bool pk_only = false;
+        bool filled = false;                       // the matrices hold the fold of res
+        long long refilled = 0;
+        std::unique_ptr<sparse_tree> own_tree;     // the constraint of the last refold
+        std::unique_ptr<fold_tables> own_tables;
         
 
         void insert_node (cand_pos_t i, cand_pos_t j, char type);
@@ -74,10 +118,33 @@ class W_final{
         // allocate the necessary memory
         double fold_sequence_restricted ();
 
+        template <bool pk>
+        void fill_matrices(sparse_tree &tree, const fold_tables &tables);
+        template <bool pk>
+        void fill_cell(cand_pos_t i, cand_pos_t j, sparse_tree &tree, const fold_tables &tables, loop_record *record = nullptr);
+
+        // fills the cells that see a changed base again and backtracks, everything on the first fold
+        double refill(const std::vector<bool> &changed);
+
+        // fills W and backtracks, the matrices are filled
+        double fold_exterior(sparse_tree &tree, const fold_tables &tables);
+        // W(j) from the filled matrices and W up to j-1
+        energy_t exterior_energy(cand_pos_t j, sparse_tree &tree, const fold_tables &tables);
+        // backtracks the structure of 1..n from W, gives the MFE
+        double backtrack_exterior(sparse_tree &tree);
+
+        // WMB(i,j), INF for a pk-free fold
+        energy_t get_WMB(cand_pos_t i, cand_pos_t j) { return WMB ? WMB->get_WMB(i,j) : INF; }
+
         void backtrack_restricted (seq_interval *cur_interval, sparse_tree &tree);
         // backtrack, the restricted case
 
-        energy_t E_ext_Stem(const energy_t& vij,const energy_t& vi1j,const energy_t& vij1,const energy_t& vi1j1,const short* S, paramT* params, const cand_pos_t i,const cand_pos_t j, cand_pos_t n, std::vector<Node> &tree);
+        // optimal energy of an interval on the traceback stack
+        energy_t subopt_value (const seq_interval &cur);
+        // adds to next every way of decomposing cur in state that stays below limit
+        void expand_subopt (const subopt_state &state, const seq_interval &cur, sparse_tree &tree, energy_t limit, std::vector<subopt_state> &next);
+
+        energy_t E_ext_Stem(const energy_t& vij,const energy_t& vi1j,const energy_t& vij1,const energy_t& vi1j1,const short* S, paramT* params, const cand_pos_t i,const cand_pos_t j, cand_pos_t n);
 
 };
 
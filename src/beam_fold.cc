@@ -0,0 +1,484 @@
+#include "beam_fold.hh"
+
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+
+beam_fold::beam_fold(std::string seq, int dangle, int beam) : params_(scale_parameters())
+{
+	seq_ = seq;
+	n = seq.length();
+	this->beam = std::max(beam,1);
+	make_pair_matrix();
+	params_->model_details.dangles = dangle;
+	S_ = encode_sequence(seq.c_str(),0);
+	S1_ = encode_sequence(seq.c_str(),1);
+}
+
+beam_fold::~beam_fold(){
+	free(params_);
+	free(exp_params_);
+	free(S_);
+	free(S1_);
+}
+
+/**
+ * Fills the beams column by column and backtracks the MFE structure. When pruning left no structure of 1..n that
+ * keeps the pairs of G, the fold is done again with twice the beam, up to the length of the sequence.
+*/
+double beam_fold::fold(sparse_tree &tree){
+	tree_ = &tree;
+	partner.resize(n+1);
+	for(cand_pos_t k = 1; k<=n; ++k) partner[k] = tree.tree[k].pair;
+	up.assign(tree.up.begin(),tree.up.end());
+
+	// next_pair[c][j] is the first free base after j that pairs with a base of code c (1 to 4 for ACGU), n+1 for none
+	next_pair.assign(5,std::vector<cand_pos_t>(n+1,n+1));
+	for(int c = 1; c<=4; ++c){
+		for(cand_pos_t j = n-1; j>=0; --j) next_pair[c][j] = (is_free(j+1) && pair[c][S_[j+1]] > 0) ? j+1 : next_pair[c][j+1];
+	}
+
+	round.assign(n+1,0);
+	cand_energy.assign(n+1,INF);
+	slot.assign(n+1,0);
+	while(true){
+		V.assign(n+1,std::vector<beam_state>());
+		WMv.assign(n+1,std::vector<beam_state>());
+		WM2.assign(n+1,std::vector<beam_state>());
+		WM.assign(n+1,std::vector<beam_state>());
+		hairpin.assign(n+1,std::vector<cand_pos_t>());
+		W.assign(n+1,0);
+		Wh.assign(n+1,0);
+		for(cand_pos_t j = 1; j<=n; ++j) fill_column(j);
+		if(feasible() || beam >= n) break;
+		beam *= 2;
+	}
+	hairpin.clear();
+	return backtrack_exterior();
+}
+
+/**
+ * Fills column j of V, WMv, WM2 and WM from the states kept in the columns before it, then W(j).
+ * The candidates of V are the bases whose hairpin reaches j, the pair of G ending at j, and the pairs around a kept
+ * V(k,l) or a kept WM2(k,j-1) that close an interior loop or a multiloop with them.
+*/
+void beam_fold::fill_column(cand_pos_t j){
+	// the hairpins of j start with the first base after the turn it can pair with
+	if(is_free(j) && j+TURN < n) open_hairpin(j,j+TURN);
+
+	// V
+	start_round();
+	const bool closes = is_free(j) || (partner[j] >= 0 && partner[j] < j);
+	if(closes){
+		for(cand_pos_t i : hairpin[j]) add(i,INF);
+		if(partner[j] >= 0) add(partner[j],INF);
+
+		for(cand_pos_t l = j-1; l>=1 && j-l-1 <= MAXLOOP; --l){
+			const cand_pos_t u2 = j-l-1;
+			if(up[j-1] < u2) break;
+			for(const beam_state &inner : V[l]){
+				const cand_pos_t k = inner.i;
+				for(cand_pos_t i = k-1; i>=1 && (k-i-1)+u2 <= MAXLOOP; --i){
+					if(up[k-1] < k-i-1) break;
+					if(can_close(i,j)) add(i,E_interior(i,j,k,l) + inner.energy);
+				}
+			}
+		}
+
+		for(const beam_state &ml : WM2[j-1]){
+			const cand_pos_t k = ml.i;
+			for(cand_pos_t i = k-1; i>=1 && k-i-1 <= MAXLOOP; --i){
+				if(up[k-1] < k-i-1) break;
+				if(can_close(i,j)) add(i,ml.energy + (k-i-1)*params_->MLbase + E_ML_closing(i,j));
+			}
+			// a pair of G keeps any number of unpaired bases before the first stem, so it is never left without a loop
+			const cand_pos_t g = partner[j];
+			if(g >= 0 && g < k && k-g-1 > MAXLOOP && up[k-1] >= k-g-1 && can_close(g,j)) add(g,ml.energy + (k-g-1)*params_->MLbase + E_ML_closing(g,j));
+		}
+	}
+	for(cand_pos_t i : touched){
+		if(!can_close(i,j)) continue;
+		energy_t e = cand_energy[i];
+		if(can_hairpin(i,j)) e = std::min(e,E_hairpin(i,j));
+		if(e < INF/2) V[j].push_back({i,e,0});
+	}
+	prune_hairpins(j);
+	prune(V[j]);
+
+	// WMv
+	start_round();
+	for(const beam_state &v : V[j]) add(v.i,v.energy + E_ML_stem(v.i,j));
+	if(is_unpaired(j)) for(const beam_state &s : WMv[j-1]) add(s.i,s.energy + params_->MLbase);
+	collect(WMv[j]);
+
+	// WM2, the last stem from WMv and the ones before it from WM
+	start_round();
+	for(const beam_state &last : WMv[j]){
+		if(last.i < 2) continue;
+		for(const beam_state &first : WM[last.i-1]) add(first.i,first.energy + last.energy);
+	}
+	collect(WM2[j]);
+
+	// WM
+	start_round();
+	for(const beam_state &s : WMv[j]) add(s.i,s.energy);
+	for(const beam_state &s : WM2[j]) add(s.i,s.energy);
+	collect(WM[j]);
+
+	if(j > TURN) W[j] = exterior_energy(j);
+}
+
+void beam_fold::start_round(){
+	++current;
+	touched.clear();
+}
+
+// candidate i of the current matrix gets energy e if it is lower than what it has
+void beam_fold::add(cand_pos_t i, energy_t e){
+	if(round[i] != current){
+		round[i] = current;
+		cand_energy[i] = e;
+		touched.push_back(i);
+	}
+	else if(e < cand_energy[i]) cand_energy[i] = e;
+}
+
+// the candidates of the current matrix become its kept states
+void beam_fold::collect(std::vector<beam_state> &states){
+	for(cand_pos_t i : touched) if(cand_energy[i] < INF/2) states.push_back({i,cand_energy[i],0});
+	prune(states);
+}
+
+/**
+ * Keeps the beam states with the lowest Wh(i-1) + energy, the lower i first on a tie, and sorts them by i
+*/
+void beam_fold::prune(std::vector<beam_state> &states){
+	if((cand_pos_t) states.size() > beam){
+		std::nth_element(states.begin(),states.begin()+(beam-1),states.end(),[&](const beam_state &a, const beam_state &b){
+			energy_t score_a = Wh[a.i-1] + a.energy, score_b = Wh[b.i-1] + b.energy;
+			return score_a < score_b || (score_a == score_b && a.i < b.i);
+		});
+		states.resize(beam);
+	}
+	std::sort(states.begin(),states.end(),[](const beam_state &a, const beam_state &b){ return a.i < b.i; });
+	states.shrink_to_fit();
+}
+
+/**
+ * The bases whose hairpin reached j go on to the next base they can pair with if that hairpin is one of the beam best,
+ * the others cannot start a hairpin any more
+*/
+void beam_fold::prune_hairpins(cand_pos_t j){
+	std::vector<cand_pos_t> &openers = hairpin[j];
+	if((cand_pos_t) openers.size() > beam){
+		std::vector< std::pair<energy_t,cand_pos_t> > ranked;
+		ranked.reserve(openers.size());
+		for(cand_pos_t i : openers) ranked.push_back(std::make_pair(Wh[i-1] + E_hairpin(i,j),i));
+		std::nth_element(ranked.begin(),ranked.begin()+(beam-1),ranked.end());
+		ranked.resize(beam);
+		openers.clear();
+		for(const std::pair<energy_t,cand_pos_t> &r : ranked) openers.push_back(r.second);
+	}
+	for(cand_pos_t i : openers) open_hairpin(i,j);
+	std::vector<cand_pos_t>().swap(openers);
+}
+
+// the next hairpin of i ends at the first base after j it can pair with, if the bases in between can all be unpaired
+void beam_fold::open_hairpin(cand_pos_t i, cand_pos_t j){
+	const cand_pos_t l = next_pair[S_[i]][j];
+	if(l <= n && can_hairpin(i,l)) hairpin[l].push_back(i);
+}
+
+/**
+ * W(j) as in W_final::exterior_energy from the kept V(k,j), and Wh(j) where base j can be left unpaired even when it
+ * is in G, so the states inside the arcs of G are ranked as well
+*/
+energy_t beam_fold::exterior_energy(cand_pos_t j){
+	energy_t w = is_unpaired(j) ? W[j-1] : INF;
+	energy_t wh = Wh[j-1];
+	for(const beam_state &v : V[j]){
+		energy_t e = v.energy + E_ext_stem(v.i,j);
+		w = std::min(w,((v.i > 1) ? W[v.i-1] : 0) + e);
+		wh = std::min(wh,Wh[v.i-1] + e);
+	}
+	Wh[j] = wh;
+	return std::min(w,(energy_t) INF);
+}
+
+const beam_state *beam_fold::find(const std::vector<beam_state> &states, cand_pos_t i) const{
+	auto it = std::lower_bound(states.begin(),states.end(),i,[](const beam_state &s, cand_pos_t i){ return s.i < i; });
+	return (it != states.end() && it->i == i) ? &*it : nullptr;
+}
+
+/**
+ * Backtracks the MFE structure of the bases 1 to n from W[n] through the kept states, every state being made of kept
+ * states only
+*/
+double beam_fold::backtrack_exterior(){
+	double energy = W[n]/100.0;
+	if(!backtrack){
+		structure.clear();
+		return energy;
+	}
+	structure.assign(n+1,'.');
+	if(!feasible()){
+		structure = structure.substr(1,n);
+		return energy;
+	}
+
+	struct interval{
+		beam_matrix matrix;
+		cand_pos_t i;
+		cand_pos_t j;
+		energy_t energy;
+	};
+	std::vector<interval> stack;
+	stack.push_back({B_W,1,n,W[n]});
+	while(!stack.empty()){
+		interval cur = stack.back();
+		stack.pop_back();
+		const cand_pos_t i = cur.i, j = cur.j;
+		const energy_t e = cur.energy;
+		switch(cur.matrix){
+			case B_W:{
+				if(j <= TURN) break;
+				if(is_unpaired(j) && W[j-1] == e){
+					stack.push_back({B_W,1,j-1,W[j-1]});
+					break;
+				}
+				for(const beam_state &v : V[j]){
+					energy_t acc = (v.i > 1) ? W[v.i-1] : 0;
+					if(acc + v.energy + E_ext_stem(v.i,j) == e){
+						stack.push_back({B_V,v.i,j,v.energy});
+						if(v.i > 1) stack.push_back({B_W,1,v.i-1,acc});
+						break;
+					}
+				}
+				break;
+			}
+			case B_V:{
+				structure[i] = '(';
+				structure[j] = ')';
+				if(can_hairpin(i,j) && E_hairpin(i,j) == e) break;
+				bool found = false;
+				for(cand_pos_t l = j-1; !found && l>i && j-l-1 <= MAXLOOP; --l){
+					const cand_pos_t u2 = j-l-1;
+					if(up[j-1] < u2) break;
+					for(cand_pos_t k = i+1; k<l && (k-i-1)+u2 <= MAXLOOP; ++k){
+						if(up[k-1] < k-i-1) break;
+						const beam_state *inner = find(V[l],k);
+						if(inner && E_interior(i,j,k,l) + inner->energy == e){
+							stack.push_back({B_V,k,l,inner->energy});
+							found = true;
+							break;
+						}
+					}
+				}
+				if(found) break;
+				for(cand_pos_t k = i+1; k<j; ++k){
+					if(up[k-1] < k-i-1 || (k-i-1 > MAXLOOP && partner[i] != j)) break;
+					const beam_state *ml = find(WM2[j-1],k);
+					if(ml && ml->energy + (k-i-1)*params_->MLbase + E_ML_closing(i,j) == e){
+						stack.push_back({B_WM2,k,j-1,ml->energy});
+						break;
+					}
+				}
+				break;
+			}
+			case B_WMv:{
+				const beam_state *v = find(V[j],i);
+				if(v && v->energy + E_ML_stem(i,j) == e) stack.push_back({B_V,i,j,v->energy});
+				else stack.push_back({B_WMv,i,j-1,e-params_->MLbase});
+				break;
+			}
+			case B_WM2:{
+				for(const beam_state &last : WMv[j]){
+					if(last.i <= i) continue;
+					const beam_state *first = find(WM[last.i-1],i);
+					if(first && first->energy + last.energy == e){
+						stack.push_back({B_WM,i,last.i-1,first->energy});
+						stack.push_back({B_WMv,last.i,j,last.energy});
+						break;
+					}
+				}
+				break;
+			}
+			case B_WM:{
+				const beam_state *single = find(WMv[j],i);
+				if(single && single->energy == e) stack.push_back({B_WMv,i,j,e});
+				else stack.push_back({B_WM2,i,j,e});
+				break;
+			}
+		}
+	}
+	structure = structure.substr(1,n);
+	return energy;
+}
+
+/**
+ * The partition function over the kept states: each of them sums the decompositions the MFE fill took its energy from,
+ * so a state that was pruned adds nothing anywhere. pf_scale and the scaling are set as in W_final_pf.
+*/
+double beam_fold::pf(double energy){
+	if(!exp_params_) exp_params_ = scale_pf_parameters();
+	exp_params_->model_details.dangles = params_->model_details.dangles;
+	const double kT = exp_params_->kT;
+	const double e_per_nt = energy * 1000. / n;
+	exp_params_->pf_scale = exp(-(exp_params_->model_details.sfact * e_per_nt) / kT);
+	if (exp_params_->pf_scale < 1.) exp_params_->pf_scale = 1.;
+
+	scale.resize(n+1);
+	expMLbase.resize(n+1);
+	scale[0] = 1.;
+	scale[1] = 1. / exp_params_->pf_scale;
+	expMLbase[0] = 1;
+	expMLbase[1] = exp_params_->expMLbase / exp_params_->pf_scale;
+	for(cand_pos_t i = 2; i<=n; ++i){
+		scale[i] = scale[i / 2] * scale[i - (i / 2)];
+		expMLbase[i] = pow(exp_params_->expMLbase, (double)i) * scale[i];
+	}
+
+	W_pf.assign(n+1,0);
+	for(cand_pos_t k = 0; k <= std::min(n,(cand_pos_t)TURN); ++k) W_pf[k] = scale[k];
+	for(cand_pos_t j = 1; j<=n; ++j) fill_column_pf(j);
+	return ((-log(W_pf[n]) - n * log(exp_params_->pf_scale)) * kT / 1000.0);
+}
+
+/**
+ * Column j of the partition function, going through the same kept states as fill_column but only adding to the kept ones
+*/
+void beam_fold::fill_column_pf(cand_pos_t j){
+	// V
+	std::vector<beam_state> &states = V[j];
+	if(!states.empty()){
+		start_round();
+		for(cand_pos_t s = 0; s<(cand_pos_t) states.size(); ++s){
+			const cand_pos_t i = states[s].i;
+			round[i] = current;
+			slot[i] = s;
+			states[s].weight = can_hairpin(i,j) ? exp_hairpin(i,j) : 0;
+		}
+		for(cand_pos_t l = j-1; l>=1 && j-l-1 <= MAXLOOP; --l){
+			const cand_pos_t u2 = j-l-1;
+			if(up[j-1] < u2) break;
+			for(const beam_state &inner : V[l]){
+				const cand_pos_t k = inner.i;
+				for(cand_pos_t i = k-1; i>=1 && (k-i-1)+u2 <= MAXLOOP; --i){
+					if(up[k-1] < k-i-1) break;
+					if(round[i] == current) states[slot[i]].weight += exp_interior(i,j,k,l)*inner.weight;
+				}
+			}
+		}
+		for(const beam_state &ml : WM2[j-1]){
+			const cand_pos_t k = ml.i;
+			for(cand_pos_t i = k-1; i>=1 && k-i-1 <= MAXLOOP; --i){
+				if(up[k-1] < k-i-1) break;
+				if(round[i] == current) states[slot[i]].weight += expMLbase[k-i-1]*ml.weight*exp_ML_closing(i,j);
+			}
+			const cand_pos_t g = partner[j];
+			if(g >= 0 && g < k && k-g-1 > MAXLOOP && up[k-1] >= k-g-1 && round[g] == current) states[slot[g]].weight += expMLbase[k-g-1]*ml.weight*exp_ML_closing(g,j);
+		}
+	}
+
+	// WMv
+	for(beam_state &s : WMv[j]){
+		pf_t weight = 0;
+		const beam_state *v = find(V[j],s.i);
+		if(v) weight += v->weight*exp_ML_stem(s.i,j);
+		if(is_unpaired(j)){
+			const beam_state *shorter = find(WMv[j-1],s.i);
+			if(shorter) weight += shorter->weight*expMLbase[1];
+		}
+		s.weight = weight;
+	}
+
+	// WM2
+	std::vector<beam_state> &multi = WM2[j];
+	if(!multi.empty()){
+		start_round();
+		for(cand_pos_t s = 0; s<(cand_pos_t) multi.size(); ++s){
+			round[multi[s].i] = current;
+			slot[multi[s].i] = s;
+			multi[s].weight = 0;
+		}
+		for(const beam_state &last : WMv[j]){
+			if(last.i < 2) continue;
+			for(const beam_state &first : WM[last.i-1]) if(round[first.i] == current) multi[slot[first.i]].weight += first.weight*last.weight;
+		}
+	}
+
+	// WM
+	for(beam_state &s : WM[j]){
+		pf_t weight = 0;
+		const beam_state *single = find(WMv[j],s.i);
+		if(single) weight += single->weight;
+		const beam_state *several = find(WM2[j],s.i);
+		if(several) weight += several->weight;
+		s.weight = weight;
+	}
+
+	// W, the same as W_final_pf::exterior_sum
+	if(j <= TURN) return;
+	if(!tree_->weakly_closed(1,j)){
+		W_pf[j] = 0;
+		return;
+	}
+	pf_t contributions = 0;
+	for(const beam_state &v : V[j]){
+		pf_t acc = (v.i > 1) ? W_pf[v.i-1] : 1;
+		contributions += acc*v.weight*exp_ext_stem(v.i,j);
+	}
+	if(is_unpaired(j)) contributions += W_pf[j-1]*scale[1];
+	W_pf[j] = contributions;
+}
+
+energy_t beam_fold::E_hairpin(cand_pos_t i, cand_pos_t j){
+	return E_Hairpin(j-i-1,ptype(i,j),S1_[i+1],S1_[j-1],&seq_.c_str()[i-1],params_);
+}
+
+energy_t beam_fold::E_interior(cand_pos_t i, cand_pos_t j, cand_pos_t k, cand_pos_t l){
+	return E_IntLoop(k-i-1,j-l-1,ptype(i,j),rtype[ptype(k,l)],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],params_);
+}
+
+energy_t beam_fold::E_ext_stem(cand_pos_t i, cand_pos_t j){
+	if(params_->model_details.dangles == 2) return vrna_E_ext_stem(ptype(i,j),i>1 ? S_[i-1] : -1,j<n ? S_[j+1] : -1,params_);
+	return vrna_E_ext_stem(ptype(i,j),-1,-1,params_);
+}
+
+energy_t beam_fold::E_ML_stem(cand_pos_t i, cand_pos_t j){
+	if(params_->model_details.dangles == 2) return E_MLstem(ptype(i,j),i>1 ? S_[i-1] : -1,j<n ? S_[j+1] : -1,params_);
+	return E_MLstem(ptype(i,j),-1,-1,params_);
+}
+
+energy_t beam_fold::E_ML_closing(cand_pos_t i, cand_pos_t j){
+	const pair_type tt = rtype[ptype(i,j)];
+	if(params_->model_details.dangles == 2) return E_MLstem(tt,S_[j-1],S_[i+1],params_) + params_->MLclosing;
+	return E_MLstem(tt,-1,-1,params_) + params_->MLclosing;
+}
+
+pf_t beam_fold::exp_hairpin(cand_pos_t i, cand_pos_t j){
+	return exp_E_Hairpin(j-i-1,ptype(i,j),S1_[i+1],S1_[j-1],&seq_.c_str()[i-1],exp_params_)*scale[j-i+1];
+}
+
+pf_t beam_fold::exp_interior(cand_pos_t i, cand_pos_t j, cand_pos_t k, cand_pos_t l){
+	return exp_E_IntLoop(k-i-1,j-l-1,ptype(i,j),rtype[ptype(k,l)],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],exp_params_)*scale[(k-i-1)+(j-l-1)+2];
+}
+
+pf_t beam_fold::exp_ext_stem(cand_pos_t i, cand_pos_t j){
+	if(exp_params_->model_details.dangles == 2) return exp_E_ExtLoop(ptype(i,j),i>1 ? S_[i-1] : -1,j<n ? S_[j+1] : -1,exp_params_);
+	return exp_E_ExtLoop(ptype(i,j),-1,-1,exp_params_);
+}
+
+pf_t beam_fold::exp_ML_stem(cand_pos_t i, cand_pos_t j){
+	if(exp_params_->model_details.dangles == 2) return exp_E_MLstem(ptype(i,j),i>1 ? S_[i-1] : -1,j<n ? S_[j+1] : -1,exp_params_);
+	return exp_E_MLstem(ptype(i,j),-1,-1,exp_params_);
+}
+
+// the exterior neighbours of the closing pair are left out at the ends of the sequence, as in W_final_pf::exp_Mbloop
+pf_t beam_fold::exp_ML_closing(cand_pos_t i, cand_pos_t j){
+	const pair_type tt = rtype[ptype(i,j)];
+	pf_t e;
+	if(exp_params_->model_details.dangles == 2) e = exp_E_MLstem(tt,j<n ? S_[j-1] : -1,i>1 ? S_[i+1] : -1,exp_params_);
+	else e = exp_E_MLstem(tt,-1,-1,exp_params_);
+	return e*exp_params_->expMLclosing*scale[2];
+}
@@ -0,0 +1,129 @@
+#ifndef BEAM_FOLD_H_
+#define BEAM_FOLD_H_
+
+#include "base_types.hh"
+#include "sparse_tree.hh"
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "ViennaRNA/pair_mat.h"
+#include "ViennaRNA/loops/all.h"
+#include "ViennaRNA/params/io.h"
+}
+
+// a state kept in a beam: the 5' end i of its interval, the 3' end being the column it is kept in, its MFE and,
+// once beam_fold::pf has run, its Boltzmann weight
+struct beam_state{
+    cand_pos_t i;
+    energy_t energy;
+    pf_t weight;
+};
+
+/**
+ * @brief Approximate pseudoknot-free fold in linear time, for sequences too long for the O(n^3) matrices.
+ *
+ * The matrices are filled column by column, j from 5' to 3', as in LinearFold and LinearPartition: only the states
+ * (i,j) of V, WMv, WM2 (two or more stems) and WM with the b lowest Wh(i-1) + energy are kept for each j, and the later
+ * columns are built from the kept states only. A hairpin can only start at a base while the hairpins it opens stay in
+ * the beam, and the unpaired bases on the 5' side of a multiloop are limited to MAXLOOP, except for the pairs of G.
+ * Every state and every loop is the same as in W_final and W_final_pf, so with a beam at least as wide as the sequence
+ * only that last limit differs from the exact fold. Each column costs O(b^2) for WM2 and O(b MAXLOOP^2) for the
+ * interior loops, and the kept states O(nb) memory.
+ *
+ * The pairs of G are kept and its 'x' are left unpaired; a pair of G has a single candidate in its column so it is
+ * never pruned, but the states around it can be, so the fold is done again with twice the beam when none is left.
+ * Only the dangle models 0 and 2 are supported.
+*/
+class beam_fold{
+    public:
+        beam_fold(std::string seq, int dangle, int beam);
+        ~beam_fold();
+
+        // MFE of the structures kept by the beams, the MFE structure goes to structure
+        double fold(sparse_tree &tree);
+        // PRE:  fold has been called
+        // POST: the ensemble energy of the structures kept by the beams, pf_scale is set from energy as in W_final_pf
+        double pf(double energy);
+
+        std::string structure;        // MFE structure
+        bool backtrack = true;        // false to only compute the MFE, structure is left empty
+        int beam;                     // states kept per column and matrix, doubled by fold when nothing is left
+
+        bool feasible() const { return W[n] < INF/2; }
+
+    private:
+        enum beam_matrix { B_W, B_V, B_WMv, B_WM2, B_WM };
+
+        std::string seq_;
+        cand_pos_t n;
+        short *S_;
+        short *S1_;
+        vrna_param_t *params_;
+        vrna_exp_param_t *exp_params_ = nullptr;
+        sparse_tree *tree_ = nullptr;
+
+        std::vector<cand_pos_t> partner;                   // tree[k].pair, -2 for free, -1 for forced unpaired
+        std::vector<cand_pos_t> up;                        // sparse_tree::up
+        std::vector< std::vector<cand_pos_t> > next_pair;  // next free base after j that pairs with a base of code c
+
+        // the kept states of column j, in increasing i
+        std::vector< std::vector<beam_state> > V;
+        std::vector< std::vector<beam_state> > WMv;
+        std::vector< std::vector<beam_state> > WM2;
+        std::vector< std::vector<beam_state> > WM;
+        std::vector<energy_t> W;
+        std::vector<energy_t> Wh;     // W where any base may be left unpaired, the prefix the states are ranked with
+        std::vector<pf_t> W_pf;
+
+        // the bases whose hairpin ends at j is the next one to look at
+        std::vector< std::vector<cand_pos_t> > hairpin;
+
+        // candidates of the column being filled, by i: round marks the ones of the current matrix
+        std::vector<cand_pos_t> round;
+        std::vector<energy_t> cand_energy;
+        std::vector<cand_pos_t> slot;
+        std::vector<cand_pos_t> touched;
+        cand_pos_t current = 0;
+
+        std::vector<pf_t> scale;
+        std::vector<pf_t> expMLbase;
+
+        pair_type ptype(cand_pos_t i, cand_pos_t j) const { return pair[S_[i]][S_[j]]; }
+        bool is_free(cand_pos_t k) const { return partner[k] < -1; }
+        bool is_unpaired(cand_pos_t k) const { return partner[k] < 0; }
+        // i.j can be a pair of V: both free or a pair of G, with the region between them weakly closed
+        bool can_close(cand_pos_t i, cand_pos_t j) const {
+            return j-i-1 >= TURN && ptype(i,j) > 0 && ((is_free(i) && is_free(j)) || partner[i] == j) && tree_->weakly_closed(i,j);
+        }
+        bool can_hairpin(cand_pos_t i, cand_pos_t j) const { return up[j-1] >= j-i-1; }
+
+        void fill_column(cand_pos_t j);
+        void fill_column_pf(cand_pos_t j);
+        void start_round();
+        void add(cand_pos_t i, energy_t e);
+        void collect(std::vector<beam_state> &states);
+        void prune(std::vector<beam_state> &states);
+        void prune_hairpins(cand_pos_t j);
+        void open_hairpin(cand_pos_t i, cand_pos_t j);
+        energy_t exterior_energy(cand_pos_t j);
+        double backtrack_exterior();
+
+        // the loop energies, as in W_final and s_energy_matrix
+        energy_t E_hairpin(cand_pos_t i, cand_pos_t j);
+        energy_t E_interior(cand_pos_t i, cand_pos_t j, cand_pos_t k, cand_pos_t l);
+        energy_t E_ext_stem(cand_pos_t i, cand_pos_t j);
+        energy_t E_ML_stem(cand_pos_t i, cand_pos_t j);
+        energy_t E_ML_closing(cand_pos_t i, cand_pos_t j);
+        // their Boltzmann factors, as in W_final_pf
+        pf_t exp_hairpin(cand_pos_t i, cand_pos_t j);
+        pf_t exp_interior(cand_pos_t i, cand_pos_t j, cand_pos_t k, cand_pos_t l);
+        pf_t exp_ext_stem(cand_pos_t i, cand_pos_t j);
+        pf_t exp_ML_stem(cand_pos_t i, cand_pos_t j);
+        pf_t exp_ML_closing(cand_pos_t i, cand_pos_t j);
+
+        const beam_state *find(const std::vector<beam_state> &states, cand_pos_t i) const;
+};
+
+#endif
@@ -15,6 +15,17 @@ std::string output_file;
 std::string parameter_file;
 int dangle_model;
 int subopt;
+int num_threads;
+int kbest;
+double subopt_delta;
+int screen;
+std::string scan_variants;
+std::string bpp_file;
+double bpp_cutoff;
+int samples;
+unsigned long sample_seed;
+int beam_width;
+std::string gradients_file;
 
 static char *package_name = 0;
 
@@ -38,6 +49,29 @@ const char *args_info_help[] = {
   "  -d  --dangles          Specify the dangle model to be used (base is 2)",
   "  -P, --paramFile        Read energy parameters from paramfile, instead of using the default parameter set.\n"
   "      --noConv           Do not convert DNA into RNA. This will use the Matthews 2004 parameters for DNA",
+  "  -t, --threads          Number of threads used to fill the independent arcs of the input structure, and the partition function one span at a time (default is 1)",
+  "      --fastBacktrack    Store the internal loop choices while filling so the backtrack does not search for them again. Uses more memory",
+  "      --kbest            Enumerate the given number of lowest energy structures from a single fold of the input structure, lowest first",
+  "      --delta            Enumerate every structure within the given energy (kcal/mol) of the MFE from a single fold of the input structure, lowest first",
+  "      --mfe-only         Only compute the MFE structure and energy, the partition function is skipped",
+  "      --energy-only      Only compute the MFE and ensemble energies, no structure is backtracked",
+  "      --pf-only          Only compute the ensemble energy, the MFE fold is skipped",
+  "      --no-hotspots      Fold the input structure, or the open chain when there is none, without looking for hotspots",
+  "      --prune            Skip the pseudoknotted interior loops that cannot improve the MFE and print how many were skipped to stderr",
+  "      --screen           Rank the hotspots by a pseudoknot-free fold of each and only fully fold the given number of best ones",
+  "      --incremental      Keep the matrices from one hotspot to the next and only refill the cells that see a changed base",
+  "      --cotranscriptional  Fold every prefix of the sequence as it is transcribed, one line per prefix length",
+  "      --scan             Fold the given substitutions (G12A,C40U or all) and print the change of the MFE and ensemble energy for each",
+  "      --extended-pf      Keep every partition function entry with its own exponent so it cannot overflow or underflow, for long or very stable sequences. About 3 to 4 times slower",
+  "      --bpp              Write the probability of every base pair of the first result to the given file, one \"i j p p_pk\" line per pair, p_pk being the part where the pair is pseudoknotted",
+  "      --bpp-cutoff       Smallest probability of a pair written by --bpp (default is 1e-5)",
+  "      --sample           Draw the given number of structures of the first result from its Boltzmann ensemble and print them after the results",
+  "      --non-redundant    With --sample, never draw a structure twice and print each one with its probability. Runs on one thread",
+  "      --seed             Seed of the random numbers of --sample, for a repeatable run whatever the number of threads",
+  "      --fused            Fill the MFE and the partition function in one pass, evaluating each loop energy once",
+  "      --float-pf         Keep the partition function weights in single precision, half the memory. A fold whose weights leave the range of a float is done again in double",
+  "      --beam             Approximate pseudoknot-free fold keeping only the given number of best states per base and matrix (LinearFold style), linear in the length of the sequence. Implies -p and runs on one thread",
+  "      --gradients        Write the derivative of the ensemble energy of the first result by every pseudoknot penalty and multiloop parameter to the given file, one \"name value\" line per parameter",
 
   "\nThe input sequence is read from standard input, unless it is\ngiven on the command line.\n",
   
@@ -65,6 +99,29 @@ static void init_args_info(struct args_info *args_info)
   args_info->dangles_help = args_info_help[8] ;
   args_info->paramFile_help = args_info_help[9] ;
   args_info->noConv_help = args_info_help[10] ;
+  args_info->threads_help = args_info_help[11] ;
+  args_info->fastBacktrack_help = args_info_help[12] ;
+  args_info->kbest_help = args_info_help[13] ;
+  args_info->delta_help = args_info_help[14] ;
+  args_info->mfe_only_help = args_info_help[15] ;
+  args_info->energy_only_help = args_info_help[16] ;
+  args_info->pf_only_help = args_info_help[17] ;
+  args_info->no_hotspots_help = args_info_help[18] ;
+  args_info->prune_help = args_info_help[19] ;
+  args_info->screen_help = args_info_help[20] ;
+  args_info->incremental_help = args_info_help[21] ;
+  args_info->cotranscriptional_help = args_info_help[22] ;
+  args_info->scan_help = args_info_help[23] ;
+  args_info->extended_pf_help = args_info_help[24] ;
+  args_info->bpp_help = args_info_help[25] ;
+  args_info->bpp_cutoff_help = args_info_help[26] ;
+  args_info->sample_help = args_info_help[27] ;
+  args_info->non_redundant_help = args_info_help[28] ;
+  args_info->seed_help = args_info_help[29] ;
+  args_info->fused_help = args_info_help[30] ;
+  args_info->float_pf_help = args_info_help[31] ;
+  args_info->beam_help = args_info_help[32] ;
+  args_info->gradients_help = args_info_help[33] ;
 }
 void
 cmdline_parser_print_version (void)
@@ -119,6 +176,29 @@ static void clear_given (struct args_info *args_info)
   args_info->dangles_given = 0 ;
   args_info->paramFile_given = 0 ;
   args_info->noConv_given = 0 ;
+  args_info->threads_given = 0 ;
+  args_info->fastBacktrack_given = 0 ;
+  args_info->kbest_given = 0 ;
+  args_info->delta_given = 0 ;
+  args_info->mfe_only_given = 0 ;
+  args_info->energy_only_given = 0 ;
+  args_info->pf_only_given = 0 ;
+  args_info->no_hotspots_given = 0 ;
+  args_info->prune_given = 0 ;
+  args_info->screen_given = 0 ;
+  args_info->incremental_given = 0 ;
+  args_info->cotranscriptional_given = 0 ;
+  args_info->scan_given = 0 ;
+  args_info->extended_pf_given = 0 ;
+  args_info->bpp_given = 0 ;
+  args_info->bpp_cutoff_given = 0 ;
+  args_info->sample_given = 0 ;
+  args_info->non_redundant_given = 0 ;
+  args_info->seed_given = 0 ;
+  args_info->fused_given = 0 ;
+  args_info->float_pf_given = 0 ;
+  args_info->beam_given = 0 ;
+  args_info->gradients_given = 0 ;
 }
 
 static void clear_args (struct args_info *args_info)
@@ -315,10 +395,33 @@ int cmdline_parser_internal (int argc, char **argv, struct args_info *args_info,
         { "dangles",	0, NULL, 'd' },
         { "paramFile",	required_argument, NULL, 'P' },
         { "noConv",	0, NULL, 0 },
+        { "threads",	required_argument, NULL, 't' },
+        { "fastBacktrack",	0, NULL, 0 },
+        { "kbest",	required_argument, NULL, 0 },
+        { "delta",	required_argument, NULL, 0 },
+        { "mfe-only",	0, NULL, 0 },
+        { "energy-only",	0, NULL, 0 },
+        { "pf-only",	0, NULL, 0 },
+        { "no-hotspots",	0, NULL, 0 },
+        { "prune",	0, NULL, 0 },
+        { "screen",	required_argument, NULL, 0 },
+        { "incremental",	0, NULL, 0 },
+        { "cotranscriptional",	0, NULL, 0 },
+        { "scan",	required_argument, NULL, 0 },
+        { "extended-pf",	0, NULL, 0 },
+        { "bpp",	required_argument, NULL, 0 },
+        { "bpp-cutoff",	required_argument, NULL, 0 },
+        { "sample",	required_argument, NULL, 0 },
+        { "non-redundant",	0, NULL, 0 },
+        { "seed",	required_argument, NULL, 0 },
+        { "fused",	0, NULL, 0 },
+        { "float-pf",	0, NULL, 0 },
+        { "beam",	required_argument, NULL, 0 },
+        { "gradients",	required_argument, NULL, 0 },
         { 0,  0, 0, 0 }
       };
 
-      c = getopt_long (argc, argv, "hVr:i:o:n:pkd:P:", long_options, &option_index);
+      c = getopt_long (argc, argv, "hVr:i:o:n:pkd:P:t:", long_options, &option_index);
 
       if (c == -1) break;	/* Exit from `while (1)' loop.  */
 
@@ -424,6 +527,18 @@ int cmdline_parser_internal (int argc, char **argv, struct args_info *args_info,
         
           break;
 
+          case 't':	/* Specify the number of threads.  */
+        
+        
+          if (update_arg( 0 , 
+               0 , &(args_info->threads_given),
+              &(local_args_info.threads_given), optarg, 0, 0, ARG_NO,0, 0,"threads", 't',additional_error))
+            goto failure;
+
+            num_threads = strtol(optarg,NULL,10);
+        
+          break;
+
         case 0:	/* Long option with no short option */
           
           if (strcmp (long_options[option_index].name, "noConv") == 0)
@@ -436,6 +551,246 @@ int cmdline_parser_internal (int argc, char **argv, struct args_info *args_info,
               goto failure;
           
           }
+          else if (strcmp (long_options[option_index].name, "fastBacktrack") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->fastBacktrack_given),
+                &(local_args_info.fastBacktrack_given), optarg, 0, 0, ARG_NO, 0, 0,"fastBacktrack", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "kbest") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->kbest_given),
+                &(local_args_info.kbest_given), optarg, 0, 0, ARG_NO, 0, 0,"kbest", '-', additional_error))
+              goto failure;
+
+              kbest = strtol(optarg,NULL,10);
+          
+          }
+          else if (strcmp (long_options[option_index].name, "delta") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->delta_given),
+                &(local_args_info.delta_given), optarg, 0, 0, ARG_NO, 0, 0,"delta", '-', additional_error))
+              goto failure;
+
+              subopt_delta = strtod(optarg,NULL);
+          
+          }
+          else if (strcmp (long_options[option_index].name, "mfe-only") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->mfe_only_given),
+                &(local_args_info.mfe_only_given), optarg, 0, 0, ARG_NO, 0, 0,"mfe-only", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "energy-only") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->energy_only_given),
+                &(local_args_info.energy_only_given), optarg, 0, 0, ARG_NO, 0, 0,"energy-only", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "pf-only") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->pf_only_given),
+                &(local_args_info.pf_only_given), optarg, 0, 0, ARG_NO, 0, 0,"pf-only", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "no-hotspots") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->no_hotspots_given),
+                &(local_args_info.no_hotspots_given), optarg, 0, 0, ARG_NO, 0, 0,"no-hotspots", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "prune") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->prune_given),
+                &(local_args_info.prune_given), optarg, 0, 0, ARG_NO, 0, 0,"prune", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "screen") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->screen_given),
+                &(local_args_info.screen_given), optarg, 0, 0, ARG_NO, 0, 0,"screen", '-', additional_error))
+              goto failure;
+
+              screen = strtol(optarg,NULL,10);
+          
+          }
+          else if (strcmp (long_options[option_index].name, "incremental") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->incremental_given),
+                &(local_args_info.incremental_given), optarg, 0, 0, ARG_NO, 0, 0,"incremental", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "cotranscriptional") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->cotranscriptional_given),
+                &(local_args_info.cotranscriptional_given), optarg, 0, 0, ARG_NO, 0, 0,"cotranscriptional", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "scan") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->scan_given),
+                &(local_args_info.scan_given), optarg, 0, 0, ARG_NO, 0, 0,"scan", '-', additional_error))
+              goto failure;
+
+              scan_variants = optarg;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "extended-pf") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->extended_pf_given),
+                &(local_args_info.extended_pf_given), optarg, 0, 0, ARG_NO, 0, 0,"extended-pf", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "bpp") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->bpp_given),
+                &(local_args_info.bpp_given), optarg, 0, 0, ARG_NO, 0, 0,"bpp", '-', additional_error))
+              goto failure;
+
+              bpp_file = optarg;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "bpp-cutoff") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->bpp_cutoff_given),
+                &(local_args_info.bpp_cutoff_given), optarg, 0, 0, ARG_NO, 0, 0,"bpp-cutoff", '-', additional_error))
+              goto failure;
+
+              bpp_cutoff = strtod(optarg,NULL);
+          
+          }
+          else if (strcmp (long_options[option_index].name, "sample") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->sample_given),
+                &(local_args_info.sample_given), optarg, 0, 0, ARG_NO, 0, 0,"sample", '-', additional_error))
+              goto failure;
+
+              samples = strtol(optarg,NULL,10);
+          
+          }
+          else if (strcmp (long_options[option_index].name, "non-redundant") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->non_redundant_given),
+                &(local_args_info.non_redundant_given), optarg, 0, 0, ARG_NO, 0, 0,"non-redundant", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "seed") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->seed_given),
+                &(local_args_info.seed_given), optarg, 0, 0, ARG_NO, 0, 0,"seed", '-', additional_error))
+              goto failure;
+
+              sample_seed = strtoul(optarg,NULL,10);
+          
+          }
+          else if (strcmp (long_options[option_index].name, "fused") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->fused_given),
+                &(local_args_info.fused_given), optarg, 0, 0, ARG_NO, 0, 0,"fused", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "float-pf") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->float_pf_given),
+                &(local_args_info.float_pf_given), optarg, 0, 0, ARG_NO, 0, 0,"float-pf", '-', additional_error))
+              goto failure;
+          
+          }
+          else if (strcmp (long_options[option_index].name, "beam") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->beam_given),
+                &(local_args_info.beam_given), optarg, 0, 0, ARG_NO, 0, 0,"beam", '-', additional_error))
+              goto failure;
+
+              beam_width = strtol(optarg,NULL,10);
+          
+          }
+          else if (strcmp (long_options[option_index].name, "gradients") == 0)
+          {
+          
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->gradients_given),
+                &(local_args_info.gradients_given), optarg, 0, 0, ARG_NO, 0, 0,"gradients", '-', additional_error))
+              goto failure;
+
+              gradients_file = optarg;
+          
+          }
 
 
           break;
@@ -25,6 +25,39 @@ extern int dangle_model;
 // The parameter file location
 extern std::string parameter_file;
 
+// Number of threads used to fill the matrices
+extern int num_threads;
+
+// Number of lowest energy structures to enumerate from a single fold
+extern int kbest;
+
+// Energy band above the MFE in which structures are enumerated
+extern double subopt_delta;
+
+// Number of hotspots kept for the full folds after screening them
+extern int screen;
+
+// The substitutions to fold, or all
+extern std::string scan_variants;
+
+// The file the base pair probabilities are written to
+extern std::string bpp_file;
+
+// Smallest base pair probability written to the file
+extern double bpp_cutoff;
+
+// Number of structures drawn from the ensemble
+extern int samples;
+
+// Seed of the random streams of the sampling
+extern unsigned long sample_seed;
+
+// States kept per base and matrix by the beam fold
+extern int beam_width;
+
+// The file the derivatives of the ensemble energy are written to
+extern std::string gradients_file;
+
 
 
 /** @brief Where the command line options are stored */
@@ -41,6 +74,29 @@ struct args_info
   const char *dangles_help; /**< @brief Specify the dangle model*/
   const char *paramFile_help; /**< @brief Use a separate parameter list */
   const char *noConv_help; /**< @brief Turn off automated conversion to RNA help description.  */
+  const char *threads_help; /**< @brief Number of threads used to fill the matrices help description.  */
+  const char *fastBacktrack_help; /**< @brief Store the internal loop choices for the backtrack help description.  */
+  const char *kbest_help; /**< @brief Number of lowest energy structures to enumerate help description.  */
+  const char *delta_help; /**< @brief Energy band of the enumerated structures help description.  */
+  const char *mfe_only_help; /**< @brief Skip the partition function help description.  */
+  const char *energy_only_help; /**< @brief Skip the backtrack help description.  */
+  const char *pf_only_help; /**< @brief Skip the MFE fold help description.  */
+  const char *no_hotspots_help; /**< @brief Skip the hotspots help description.  */
+  const char *prune_help; /**< @brief Prune the pseudoknotted interior loops help description.  */
+  const char *screen_help; /**< @brief Number of hotspots kept after screening help description.  */
+  const char *incremental_help; /**< @brief Refill only the changed cells between hotspots help description.  */
+  const char *cotranscriptional_help; /**< @brief Fold every prefix of the sequence help description.  */
+  const char *scan_help; /**< @brief Substitutions to fold help description.  */
+  const char *extended_pf_help; /**< @brief Extended exponent partition function help description.  */
+  const char *bpp_help; /**< @brief Base pair probabilities file help description.  */
+  const char *bpp_cutoff_help; /**< @brief Base pair probability cutoff help description.  */
+  const char *sample_help; /**< @brief Stochastic sampling help description.  */
+  const char *non_redundant_help; /**< @brief Non-redundant sampling help description.  */
+  const char *seed_help; /**< @brief Sampling seed help description.  */
+  const char *fused_help; /**< @brief Fused MFE and partition function help description.  */
+  const char *float_pf_help; /**< @brief Single precision partition function help description.  */
+  const char *beam_help; /**< @brief Beam fold help description.  */
+  const char *gradients_help; /**< @brief Ensemble energy gradients file help description.  */
 
 
   
@@ -55,6 +111,29 @@ struct args_info
   unsigned int dangles_given ;  /**< @brief Whether dangle model was given.  */
   unsigned int paramFile_given ; /** <@brief whether a parameter file was given */
   unsigned int noConv_given ;	/**< @brief Whether noConv was given.  */
+  unsigned int threads_given ;	/**< @brief Whether threads was given.  */
+  unsigned int fastBacktrack_given ;	/**< @brief Whether fastBacktrack was given.  */
+  unsigned int kbest_given ;	/**< @brief Whether kbest was given.  */
+  unsigned int delta_given ;	/**< @brief Whether delta was given.  */
+  unsigned int mfe_only_given ;	/**< @brief Whether mfe-only was given.  */
+  unsigned int energy_only_given ;	/**< @brief Whether energy-only was given.  */
+  unsigned int pf_only_given ;	/**< @brief Whether pf-only was given.  */
+  unsigned int no_hotspots_given ;	/**< @brief Whether no-hotspots was given.  */
+  unsigned int prune_given ;	/**< @brief Whether prune was given.  */
+  unsigned int screen_given ;	/**< @brief Whether screen was given.  */
+  unsigned int incremental_given ;	/**< @brief Whether incremental was given.  */
+  unsigned int cotranscriptional_given ;	/**< @brief Whether cotranscriptional was given.  */
+  unsigned int scan_given ;	/**< @brief Whether scan was given.  */
+  unsigned int extended_pf_given ;	/**< @brief Whether extended-pf was given.  */
+  unsigned int bpp_given ;	/**< @brief Whether bpp was given.  */
+  unsigned int bpp_cutoff_given ;	/**< @brief Whether bpp-cutoff was given.  */
+  unsigned int sample_given ;	/**< @brief Whether sample was given.  */
+  unsigned int non_redundant_given ;	/**< @brief Whether non-redundant was given.  */
+  unsigned int seed_given ;	/**< @brief Whether seed was given.  */
+  unsigned int fused_given ;	/**< @brief Whether fused was given.  */
+  unsigned int float_pf_given ;	/**< @brief Whether float-pf was given.  */
+  unsigned int beam_given ;	/**< @brief Whether beam was given.  */
+  unsigned int gradients_given ;	/**< @brief Whether gradients was given.  */
 
 
   char **inputs ; /**< @brief unnamed options (options without names) */
@@ -0,0 +1,93 @@
+#ifndef EXT_PF_H
+#define EXT_PF_H
+#include <algorithm>
+#include <assert.h>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// A Boltzmann weight kept as a mantissa in [0.5,1) and its own binary exponent, m*2^e, so the sums of the partition
+// function never overflow or underflow whatever the length and pf_scale. Only what the recurrences of W_final_pf use is
+// defined. Zero is m = 0, e = 0.
+struct ext_pf{
+    double m = 0;
+    int64_t e = 0;
+
+    ext_pf() {}
+    ext_pf(double x){
+        uint64_t bits;
+        std::memcpy(&bits,&x,sizeof(bits));
+        const uint64_t exponent = (bits >> 52) & 0x7FF;
+        if(exponent == 0 || exponent == 0x7FF){
+            int k;
+            m = std::frexp(x,&k);
+            e = k;
+        }
+        else *this = normal(x,0);
+    }
+
+    // m*2^e for a finite m that is 0 or at least DBL_MIN, which is all a product or sum of two mantissas can be.
+    // The exponent bits are read and set directly, frexp is not inlined and would be most of the cost.
+    static ext_pf normal(double m, int64_t e){
+        ext_pf x;
+        if(m == 0) return x;
+        uint64_t bits;
+        std::memcpy(&bits,&m,sizeof(bits));
+        x.e = e + (int64_t) ((bits >> 52) & 0x7FF) - 1022;
+        bits = (bits & ~(0x7FFull << 52)) | (1022ull << 52);
+        std::memcpy(&x.m,&bits,sizeof(bits));
+        return x;
+    }
+
+    // 0 below the range of a double, inf above it
+    explicit operator double() const { return std::ldexp(m,(int) std::max<int64_t>(std::min<int64_t>(e,4096),-4096)); }
+
+    ext_pf &operator+=(const ext_pf &b){ return *this = *this + b; }
+    ext_pf &operator*=(const ext_pf &b){ return *this = *this * b; }
+
+    friend ext_pf operator*(const ext_pf &a, const ext_pf &b){
+        if(a.m == 0 || b.m == 0) return ext_pf();
+        return normal(a.m*b.m,a.e+b.e);
+    }
+
+    friend ext_pf operator/(const ext_pf &a, const ext_pf &b){
+        if(a.m == 0) return ext_pf();
+        return normal(a.m/b.m,a.e-b.e);
+    }
+
+    friend ext_pf operator+(const ext_pf &a, const ext_pf &b){
+        if(a.m == 0) return b;
+        if(b.m == 0) return a;
+        // past 64 binary digits the smaller one is lost in the rounding anyway
+        if(a.e >= b.e) return (a.e-b.e > 64) ? a : normal(a.m + b.m*power_of_two(b.e-a.e),a.e);
+        return (b.e-a.e > 64) ? b : normal(b.m + a.m*power_of_two(a.e-b.e),b.e);
+    }
+
+    // 2^k for -64 <= k <= 0
+    static double power_of_two(int64_t k){
+        uint64_t bits = (uint64_t) (1023 + k) << 52;
+        double x;
+        std::memcpy(&x,&bits,sizeof(bits));
+        return x;
+    }
+
+    // natural log, -inf for 0
+    friend double log(const ext_pf &x){ return std::log(x.m) + x.e*M_LN2; }
+
+    // x^k for a whole k >= 0, by squaring so the mantissa never leaves range. The exponent must be an integer type, a
+    // fractional one does not compile rather than being truncated.
+    template <typename I>
+    friend ext_pf pow(ext_pf x, I k){
+        static_assert(std::is_integral<I>::value,"pow(ext_pf,k) takes a whole exponent");
+        assert(k >= 0);
+        ext_pf result(1.0);
+        for(int64_t p = k; p > 0; p >>= 1){
+            if(p & 1) result *= x;
+            x *= x;
+        }
+        return result;
+    }
+};
+
+#endif
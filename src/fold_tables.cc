@@ -0,0 +1,61 @@
+#include "fold_tables.hh"
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" {
+#include "ViennaRNA/pair_mat.h"
+}
+
+fold_tables::fold_tables(const std::string &seq){
+    n = seq.length();
+    fill_ptype(seq);
+
+    up.resize(n+1);
+    G.resize(n+1,-2);
+    arc.resize(n+1,0);
+    flag.resize(n+1,BASE_FREE);
+    // same run lengths as an unconstrained sparse tree
+    for(cand_pos_t k = 1; k<=n; ++k) up[k] = k-1;
+}
+
+fold_tables::fold_tables(const std::string &seq, const sparse_tree &tree){
+    n = seq.length();
+    fill_ptype(seq);
+    set_tree(tree);
+}
+
+void fold_tables::set_tree(const sparse_tree &tree){
+    up.assign(tree.up.begin(),tree.up.end());
+    G.assign(n+1,-2);
+    arc.assign(n+1,0);
+    flag.assign(n+1,0);
+    for(cand_pos_t k = 1; k<=n; ++k){
+        cand_pos_t pair = tree.tree[k].pair;
+        G[k] = pair;
+        arc[k] = tree.tree[k].parent->index;
+        if(pair < -1) flag[k] = BASE_FREE;
+        else if(pair == -1) flag[k] = BASE_FORCED;
+        else if(pair > k) flag[k] = BASE_G_LEFT;
+        else flag[k] = BASE_G_RIGHT;
+    }
+}
+
+/**
+ * Stores pair[S[i]][S[j]] for all 1 <= i <= j <= n in the same triangular layout as the energy matrices
+*/
+void fold_tables::fill_ptype(const std::string &seq){
+    make_pair_matrix();
+    short *S = encode_sequence(seq.c_str(),0);
+
+    index.resize(n+1);
+    cand_pos_t total_length = ((n+1) *(n+2))/2;
+    index[1] = 0;
+    for (cand_pos_t i=2; i <= n; i++)
+        index[i] = index[i-1]+(n+1)-i+1;
+
+    ptype_.resize(total_length,0);
+    for (cand_pos_t i = 1; i<=n; ++i){
+        for (cand_pos_t j = i; j<=n; ++j) ptype_[index[i]+j-i] = pair[S[i]][S[j]];
+    }
+    free(S);
+}
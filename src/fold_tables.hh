@@ -0,0 +1,62 @@
+#ifndef FOLD_TABLES_H_
+#define FOLD_TABLES_H_
+
+#include "base_types.hh"
+#include "sparse_tree.hh"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// flag bits kept for each base
+#define BASE_FREE 1        // not constrained, may pair with anything
+#define BASE_FORCED 2      // 'x' in the constraint, has to stay unpaired
+#define BASE_G_LEFT 4      // opens a pair of G
+#define BASE_G_RIGHT 8     // closes a pair of G
+
+/**
+ * @brief Per (sequence, constraint) tables shared by all the engines.
+ *
+ * Holds the pair type of every (i,j) as one byte, a flag byte per base and a compact copy
+ * of the partner and unpaired run arrays of the sparse tree, so the inner loops read small
+ * contiguous arrays instead of recomputing pair[S[i]][S[j]] or walking the Node objects.
+*/
+class fold_tables{
+
+    public:
+        // pair types only, every base is unconstrained
+        fold_tables(const std::string &seq);
+        fold_tables(const std::string &seq, const sparse_tree &tree);
+
+        // replaces the constraint part by the one of tree, the pair types only depend on the sequence and are kept
+        void set_tree(const sparse_tree &tree);
+
+        cand_pos_t n;
+        std::vector<cand_pos_t> up;     // copy of sparse_tree::up
+
+        pair_type ptype(cand_pos_t i, cand_pos_t j) const { return ptype_[index[i]+j-i]; }
+
+        // same as tree[k].pair, -2 for free, -1 for forced unpaired
+        cand_pos_t partner(cand_pos_t k) const { return G[k]; }
+        // same as tree[k].parent->index, the left end of the innermost arc of G around k (0 for none)
+        cand_pos_t parent(cand_pos_t k) const { return arc[k]; }
+
+        bool is_free(cand_pos_t k) const { return flag[k] & BASE_FREE; }
+        bool is_unpaired(cand_pos_t k) const { return flag[k] & (BASE_FREE | BASE_FORCED); }
+        bool is_forced(cand_pos_t k) const { return flag[k] & BASE_FORCED; }
+        bool is_paired(cand_pos_t k) const { return flag[k] & (BASE_G_LEFT | BASE_G_RIGHT); }
+
+        // i and j are both free or i.j is a pair of G
+        bool can_pair(cand_pos_t i, cand_pos_t j) const { return (flag[i] & flag[j] & BASE_FREE) || G[i] == j; }
+        bool in_G(cand_pos_t i, cand_pos_t j) const { return G[i] == j && G[j] == i; }
+
+    private:
+        std::vector<cand_pos_t> index;
+        std::vector<uint8_t> ptype_;
+        std::vector<uint8_t> flag;
+        std::vector<cand_pos_t> G;
+        std::vector<cand_pos_t> arc;
+
+        void fill_ptype(const std::string &seq);
+};
+
+#endif
@@ -34,15 +34,5 @@ struct seq_interval
   }
 };
 
-struct free_energy_node
-{
-    int energy;
-    char type;          // type may be: N (NONE), H (HAIRPIN), S (STACKED), I (INTERNAL), M (MULTI)
-    free_energy_node()
-    {
-        energy = 10000; // INF
-        type = NONE;
-    }
-};
 
 #endif /*H_STRUCT_H_*/
@@ -0,0 +1,103 @@
+#include "parallel.hh"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+void parallel_for(int count, int threads, const std::function<void(int)> &body){
+    threads = std::min(threads,count);
+    if(threads <= 1){
+        for(int t = 0; t<count; ++t) body(t);
+        return;
+    }
+    std::atomic<int> next(0);
+    auto worker = [&](){
+        for(int t = next++; t<count; t = next++) body(t);
+    };
+    std::vector<std::thread> pool;
+    for(int k = 1; k<threads; ++k) pool.emplace_back(worker);
+    worker();
+    for(std::thread &th : pool) th.join();
+}
+
+void fill_by_arcs(const sparse_tree &tree, cand_pos_t n, int threads, const std::function<void(cand_pos_t,cand_pos_t)> &cell){
+    std::vector< std::pair<int,int> > arcs;
+    if(threads > 1) arcs = tree.independent_arcs();
+    if(arcs.size() < 2){
+        for (cand_pos_t i = n; i >=1; --i){
+            for (cand_pos_t j =i; j<=n; ++j) cell(i,j);
+        }
+        return;
+    }
+    // largest interiors first so the last ones to finish are small
+    std::sort(arcs.begin(),arcs.end(),[](const std::pair<int,int> &x, const std::pair<int,int> &y){ return x.second-x.first > y.second-y.first; });
+
+    // region[k] is the arc holding k, -1 when k is outside all of them
+    std::vector<int> region(n+1,-1);
+    for(int r = 0; r<(int) arcs.size(); ++r){
+        for(cand_pos_t k = arcs[r].first; k<=arcs[r].second; ++k) region[k] = r;
+    }
+
+    parallel_for(arcs.size(),threads,[&](int r){
+        const cand_pos_t a = arcs[r].first, b = arcs[r].second;
+        for (cand_pos_t i = b; i >=a; --i){
+            for (cand_pos_t j =i; j<=b; ++j) cell(i,j);
+        }
+    });
+
+    for (cand_pos_t i = n; i >=1; --i){
+        for (cand_pos_t j =i; j<=n; ++j){
+            if(region[i] != -1 && region[i] == region[j]) continue;
+            cell(i,j);
+        }
+    }
+}
+
+void fill_by_spans(cand_pos_t n, int threads, const std::function<void(cand_pos_t,cand_pos_t)> &cell){
+    if(threads <= 1 || n < 2){
+        for (cand_pos_t i = n; i >=1; --i){
+            for (cand_pos_t j =i; j<=n; ++j) cell(i,j);
+        }
+        return;
+    }
+    // first[d] is the number of cells of a span below d, the cells are taken in that order
+    std::vector<long long> first(n+1,0);
+    for(cand_pos_t d = 1; d<=n; ++d) first[d] = first[d-1] + (n-d+1);
+    const long long total = first[n];
+
+    std::atomic<long long> next(0), done(0);
+    auto worker = [&](){
+        cand_pos_t d = 0;
+        for(long long t = next++; t<total; t = next++){
+            while(first[d+1] <= t) ++d;
+            while(done.load(std::memory_order_acquire) < first[d]) std::this_thread::yield();
+            const cand_pos_t i = 1 + (cand_pos_t) (t-first[d]);
+            cell(i,i+d);
+            done.fetch_add(1,std::memory_order_release);
+        }
+    };
+    std::vector<std::thread> pool;
+    for(int k = 1; k<threads; ++k) pool.emplace_back(worker);
+    worker();
+    for(std::thread &th : pool) th.join();
+}
+
+long long fill_changed(const fold_tables &tables, const std::vector<bool> &changed, const std::function<void(cand_pos_t,cand_pos_t)> &cell){
+    const cand_pos_t n = tables.n;
+    // next_change[k] is the first changed position at or after k, n+2 when there is none
+    std::vector<cand_pos_t> next_change(n+2,n+2);
+    for(cand_pos_t k = n; k>=1; --k) next_change[k] = changed[k] ? k : next_change[k+1];
+
+    long long count = 0;
+    for (cand_pos_t i = n; i >=1; --i){
+        const cand_pos_t first = next_change[std::max(i-1,1)];
+        const cand_pos_t pi = tables.partner(i);
+        for (cand_pos_t j =i; j<=n; ++j){
+            const cand_pos_t last = std::max(j,pi)+1;
+            if(first > last) continue;
+            cell(i,j);
+            ++count;
+        }
+    }
+    return count;
+}
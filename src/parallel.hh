@@ -0,0 +1,37 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include "base_types.hh"
+#include "sparse_tree.hh"
+#include "fold_tables.hh"
+#include <functional>
+
+/**
+ * Runs body(0) ... body(count-1) on up to threads threads. A thread takes the next index as soon as it is done,
+ * so tasks of uneven size are spread out. With one thread everything runs in the calling thread, in order.
+*/
+void parallel_for(int count, int threads, const std::function<void(int)> &body);
+
+/**
+ * Calls cell(i,j) for every 1 <= i <= j <= n such that each cell comes after all the cells inside it.
+ * The interiors of the independent arcs of G (see sparse_tree::independent_arcs) are filled concurrently first,
+ * then the remaining cells in the usual i descending, j ascending order.
+*/
+void fill_by_arcs(const sparse_tree &tree, cand_pos_t n, int threads, const std::function<void(cand_pos_t,cand_pos_t)> &cell);
+
+/**
+ * Calls cell(i,j) for every 1 <= i <= j <= n, one span j-i after the other, the cells of a span going to whichever of the
+ * threads is free. A cell only starts once every cell of a shorter span is done, so recurrences that only read the cells
+ * strictly inside (i,j) see the same values as in the i descending, j ascending order, whatever the number of threads.
+ * With one thread it is that order.
+*/
+void fill_by_spans(cand_pos_t n, int threads, const std::function<void(cand_pos_t,cand_pos_t)> &cell);
+
+/**
+ * Calls cell(i,j) in the i descending, j ascending order for the cells that have to be filled again after the constraint
+ * changed at the positions k where changed[k] is true. The recurrences of (i,j) only look at the bases in [i-1,j+1] and,
+ * for BE, in the arc of G opened at i, so a cell is skipped when none of those changed. Returns the number of cells called.
+*/
+long long fill_changed(const fold_tables &tables, const std::vector<bool> &changed, const std::function<void(cand_pos_t,cand_pos_t)> &cell);
+
+#endif
@@ -1,8 +1,11 @@
 #include "part_func.hh"
+#include "W_final.hh"
 #include "pf_globals.hh"
 #include "h_externs.hh"
+#include "parallel.hh"
 
 #include <string>
+#include <algorithm>
 #include <iostream>
 #include <stdio.h>
 #include <math.h>
@@ -16,6 +19,10 @@
  */
 #define TRUNC_MAYBE(X) ((!pf_smooth) ? (double)((int)(X)) : (X))
 /* Rescale Free energy contribution according to deviation of temperature from measurement conditions */
+// the loop energies whose Boltzmann factor is kept for a fused fill, the others are rare enough to go through exp
+#define LOOP_ENERGY_MIN -2000
+#define LOOP_ENERGY_MAX 4000
+
 #define RESCALE_dG(dG, dH, dT)   ((dH) - ((dH) - (dG)) * dT)
 
 /*
@@ -31,7 +38,8 @@
     )
 
 
-W_final_pf::W_final_pf(std::string seq, bool pk_free, int dangle, double energy) : exp_params_(scale_pf_parameters())
+template <typename T>
+W_final_pf<T>::W_final_pf(std::string seq, bool pk_free, int dangle, double energy) : exp_params_(scale_pf_parameters())
 {
     this->seq = seq;
     this->n = seq.length();
@@ -55,33 +63,51 @@ W_final_pf::W_final_pf(std::string seq, bool pk_free, int dangle, double energy)
     V.resize(total_length,0);
     WM.resize(total_length,0);
     WMv.resize(total_length,0);
-    WMp.resize(total_length,0);
     // W.resize(n+1,1);
 
     // PK
-    WIP.resize(total_length,0);
-    VP.resize(total_length,0);
-    VPL.resize(total_length,0);
-    VPR.resize(total_length,0);
-    WMB.resize(total_length,0);
-    WMBP.resize(total_length,0);
-    WMBW.resize(total_length,0);
-    BE.resize(total_length,0);
+    // a pk-free fold only needs V, WM, WMv and W, every pseudoknotted entry would stay 0
+    if(!pk_free){
+        WMp.resize(total_length,0);
+        WIP.resize(total_length,0);
+        VP.resize(total_length,0);
+        VPL.resize(total_length,0);
+        VPR.resize(total_length,0);
+        WMB.resize(total_length,0);
+        WMBP.resize(total_length,0);
+        WMBW.resize(total_length,0);
+        BE.resize(total_length,0);
+    }
+    if constexpr (columns){
+        cindex.resize(n+1);
+        for (cand_pos_t j = 1; j <= n; j++) cindex[j] = ((j-1)*j)/2 - 1;
+        VML_col.resize(total_length,0);
+        WMv_col.resize(total_length,0);
+        if(!pk_free){
+            V_col.resize(total_length,0);
+            WMB_col.resize(total_length,0);
+            WMp_col.resize(total_length,0);
+            WIP_col.resize(total_length,0);
+        }
+    }
 
 	
     rescale_pk_globals();
+	mfe = energy;
+	W.resize(n+1,0);
 	exp_params_rescale(energy);
-	W.resize(n+1,scale[1]);
-	WI.resize(total_length,scale[1]);
+	if(!pk_free) WI.resize(total_length,scale[1]);
 
 
 }
 
-W_final_pf::~W_final_pf(){
-
+template <typename T>
+W_final_pf<T>::~W_final_pf(){
+	free(exp_intP_params_);
 }
 
-void W_final_pf::exp_params_rescale(double mfe){
+template <typename T>
+void W_final_pf<T>::exp_params_rescale(double mfe){
 	double e_per_nt, kT;
 	kT = exp_params_->kT;
     
@@ -95,25 +121,33 @@ void W_final_pf::exp_params_rescale(double mfe){
 	//  exp_params_->pf_scale = 1.;
 
 	this->scale[0]     = 1.;
-    this->scale[1]     = (pf_t)(1. / exp_params_->pf_scale);
+    this->scale[1]     = (T)(1. / exp_params_->pf_scale);
     this->expMLbase[0] = 1;
-    this->expMLbase[1] = (pf_t)(exp_params_->expMLbase / exp_params_->pf_scale);
+    this->expMLbase[1] = (T)(exp_params_->expMLbase / exp_params_->pf_scale);
 
 	this->expcp_pen[0] = 1;
-	this->expcp_pen[1] = (pf_t)(expcp_penalty / exp_params_->pf_scale);
+	this->expcp_pen[1] = (T)(expcp_penalty / exp_params_->pf_scale);
 	this->expPUP_pen[0] = 1;
-	this->expPUP_pen[1] = (pf_t)(expPUP_penalty / exp_params_->pf_scale);
+	this->expPUP_pen[1] = (T)(expPUP_penalty / exp_params_->pf_scale);
 
     for (cand_pos_t i = 2; i <= this->n; i++) {
       this->scale[i]     = this->scale[i / 2] * this->scale[i - (i / 2)];
-      this->expMLbase[i] = (pf_t)pow(exp_params_->expMLbase, (double)i) * this->scale[i];
-	  this->expcp_pen[i] = (pf_t)pow(expcp_penalty, (double)i) * this->scale[i];
-	  this->expPUP_pen[i] = (pf_t)pow(expPUP_penalty, (double)i) * this->scale[i];
+      this->expMLbase[i] = pow((T)exp_params_->expMLbase, i) * this->scale[i];
+	  this->expcp_pen[i] = pow((T)expcp_penalty, i) * this->scale[i];
+	  this->expPUP_pen[i] = pow((T)expPUP_penalty, i) * this->scale[i];
 
     }
+	exp_band = (T) (expap_penalty*pow(expbp_penalty,2)) * scale[2];
+
+	// a prefix too short to close a pair has only its unpaired bases, so it is scaled by its own length
+	if(!W.empty()){
+		W[0] = 1;
+		for(cand_pos_t k = 1; k <= std::min(this->n,(cand_pos_t)TURN); ++k) W[k] = this->scale[k];
+	}
 }
 
-void W_final_pf::rescale_pk_globals(){
+template <typename T>
+void W_final_pf<T>::rescale_pk_globals(){
     double kT = exp_params_->model_details.betaScale * ( exp_params_->model_details.temperature + K0) * GASCONST; /* kT in cal/mol  */
     double TT = (exp_params_->model_details.temperature + K0) / (Tmeasure);
     int pf_smooth = exp_params_->model_details.pf_smooth;
@@ -132,55 +166,277 @@ void W_final_pf::rescale_pk_globals(){
     expap_penalty = RESCALE_BF(ap_penalty,ap_penalty*3,TT,kT);
     expbp_penalty = RESCALE_BF(bp_penalty,bp_penalty*3,TT,kT);
     expcp_penalty = RESCALE_BF(cp_penalty,cp_penalty*3,TT,kT);
+    expPB2 = pow(expPB_penalty,2);
+
+	for(int type = 0; type <= NBPAIRS; ++type){
+		for(int type_2 = 0; type_2 <= NBPAIRS; ++type_2) exp_stP[type][type_2] = pow(exp_params_->expstack[type][type_2],e_stP_penalty);
+	}
+	// every factor of exp_E_IntLoop is exp(-E/kT), so at kT/e_intP_penalty it comes out as its e_intP_penalty power
+	vrna_md_t md = exp_params_->model_details;
+	md.betaScale /= e_intP_penalty;
+	exp_intP_params_ = vrna_exp_params(&md);
 }
 
-double W_final_pf::hfold_pf(sparse_tree &tree){
+/**
+ * The interior loops of BE are between two pairs of G, i.partner(i) around l.partner(l), so there are at most as many as
+ * pairs of pairs in G and each is the same for every inner pair of the band.
+*/
+template <typename T>
+void W_final_pf<T>::fill_pk_tables(){
+	if(pk_free) return;
+	const fold_tables &ft = *tables_;
+	exp_intP_G.assign(V.size(),0);
+	for(cand_pos_t i = 1; i <= n; ++i){
+		const cand_pos_t j = ft.partner(i);
+		if(j <= i) continue;
+		for(cand_pos_t l = i+1; l < j; ++l){
+			const cand_pos_t lp = ft.partner(l);
+			if(lp > l && lp < j) exp_intP_G[index[i]+l-i] = get_e_intP(i,l,lp,j);
+		}
+	}
+}
 
-    for (int i = n; i >=1; --i){	
-		for (int j =i; j<=n; ++j){
-			cand_pos_t ij = index[i]+j-i;
+template <typename T>
+double W_final_pf<T>::hfold_pf(sparse_tree &tree, const fold_tables &tables){
+	tables_ = &tables;
+	fill_pk_tables();
 
-			const bool evaluate = tree.weakly_closed(i,j);
-			const pair_type ptype_closing = pair[S_[i]][S_[j]];
-			const bool restricted = tree.tree[i].pair == -1 || tree.tree[j].pair == -1;
-			const bool paired = (tree.tree[i].pair == j && tree.tree[j].pair == i);
+	if(pk_free) fill_matrices<false>(tree,tables);
+	else fill_matrices<true>(tree,tables);
+	filled = true;
+	return fold_exterior(tree,tables);
+}
+
+/**
+ * Every cell is filled right after the MFE fill of mfe_fold filled its own (i,j), in the order and on the threads of
+ * that fill. The hairpin and interior loop energies are only evaluated by the MFE fill, here they are turned into
+ * Boltzmann factors by a table lookup, which gives the factors of exp_E_IntLoop and exp_E_Hairpin up to the rounding.
+*/
+template <typename T>
+double W_final_pf<T>::hfold_fused(W_final &mfe_fold, sparse_tree &tree, const fold_tables &tables, double &mfe){
+	tables_ = &tables;
+	fill_pk_tables();
+	const double kT = exp_params_->kT/10.;
+	exp_loop_energy.resize(LOOP_ENERGY_MAX-LOOP_ENERGY_MIN+1);
+	exp_loop_energy_intP.resize(LOOP_ENERGY_MAX-LOOP_ENERGY_MIN+1);
+	for(energy_t e = LOOP_ENERGY_MIN; e <= LOOP_ENERGY_MAX; ++e){
+		exp_loop_energy[e-LOOP_ENERGY_MIN] = exp(-e/kT);
+		exp_loop_energy_intP[e-LOOP_ENERGY_MIN] = exp(-e_intP_penalty*e/kT);
+	}
 
-			if(ptype_closing> 0 && evaluate && !restricted)
-			compute_energy_restricted (i,j,tree);
-			 
+	mfe = mfe_fold.hfold_fused(tree,tables,[&](cand_pos_t i, cand_pos_t j, const loop_record &record){
+		if(pk_free) fill_cell<false>(i,j,tree,tables,&record);
+		else fill_cell<true>(i,j,tree,tables,&record);
+	});
+	filled = true;
+	return fold_exterior(tree,tables);
+}
 
-			if(!pk_free) compute_pk_energies(i,j,tree);
+template <typename T>
+bool W_final_pf<T>::in_range(){
+	if constexpr (std::is_same<T,ext_pf>::value) return true;
+	else return std::isnormal(W[n]);
+}
 
-			compute_WMv_WMp(i,j,tree.tree);
-			compute_energy_WM_restricted(i,j,tree);
-		}
+// exp(-penalty*e/kT), 0 for INF
+template <typename T>
+pf_t W_final_pf<T>::exp_loop(energy_t e, const std::vector<pf_t> &table, double penalty){
+	if(e >= INF) return 0;
+	if(e >= LOOP_ENERGY_MIN && e <= LOOP_ENERGY_MAX) return table[e-LOOP_ENERGY_MIN];
+	return exp(-penalty*e*10./exp_params_->kT);
+}
 
+template <typename T>
+double W_final_pf<T>::refold_pf(const std::string &res, double energy){
+	std::vector<bool> changed(n+1,true);
+	if(filled && energy == mfe){
+		for(cand_pos_t k = 1; k<=n; ++k) changed[k] = (res[k-1] != this->res[k-1]);
+	}
+	else if(energy != mfe){
+		mfe = energy;
+		exp_params_rescale(energy);
 	}
-    for (cand_pos_t j= TURN+1; j <= n; j++){
-        pf_t contributions = 0;
+	this->res = res;
+	std::unique_ptr<sparse_tree> tree(new sparse_tree(res,n));
+	own_tree.swap(tree);
+	return refill(changed);
+}
+
+/**
+ * Point mutations, see W_final::mutate. pf_scale is left as it is, so the cells that do not see a substituted base are kept.
+*/
+template <typename T>
+double W_final_pf<T>::mutate(const std::string &seq){
+	std::vector<bool> changed(n+1,false);
+	for(cand_pos_t k = 1; k<=n; ++k) changed[k] = (seq[k-1] != this->seq[k-1]);
+	this->seq = seq;
+	short *S = encode_sequence(seq.c_str(),0);
+	short *S1 = encode_sequence(seq.c_str(),1);
+	memcpy(S_,S,(n+2)*sizeof(short));
+	memcpy(S1_,S1,(n+2)*sizeof(short));
+	free(S);
+	free(S1);
+	if(res.empty()) res = std::string(n,'.');
+	if(!own_tree) own_tree.reset(new sparse_tree(res,n));
+	return refill(changed);
+}
+
+template <typename T>
+double W_final_pf<T>::refill(const std::vector<bool> &changed){
+	std::unique_ptr<fold_tables> tables(new fold_tables(seq,*own_tree));
+	own_tables.swap(tables);
+	if(!filled) return hfold_pf(*own_tree,*own_tables);
+
+	tables_ = own_tables.get();
+	fill_pk_tables();
+	fill_changed(*own_tables,changed,[&](cand_pos_t i, cand_pos_t j){
+		clear_cell(i,j);
+		if(pk_free) fill_cell<false>(i,j,*own_tree,*own_tables);
+		else fill_cell<true>(i,j,*own_tree,*own_tables);
+	});
+	return fold_exterior(*own_tree,*own_tables);
+}
+
+template <typename T>
+double W_final_pf<T>::add_pair(cand_pos_t i, cand_pos_t j){
+	std::string constraint = res;
+	if(!filled || !sparse_tree::add_pair(constraint,i,j)) return 0;
+	return refold_pf(constraint,mfe);
+}
+
+template <typename T>
+double W_final_pf<T>::remove_pair(cand_pos_t i, cand_pos_t j){
+	std::string constraint = res;
+	if(!filled || !sparse_tree::remove_pair(constraint,i,j)) return 0;
+	return refold_pf(constraint,mfe);
+}
+
+template <typename T>
+void W_final_pf<T>::clear_cell(cand_pos_t i, cand_pos_t j){
+	cand_pos_t ij = index[i]+j-i;
+	V[ij] = 0;
+	WM[ij] = 0;
+	WMv[ij] = 0;
+	if(pk_free) return;
+	WMp[ij] = 0;
+	WIP[ij] = 0;
+	VP[ij] = 0;
+	VPL[ij] = 0;
+	VPR[ij] = 0;
+	WMB[ij] = 0;
+	WMBP[ij] = 0;
+	WMBW[ij] = 0;
+	WI[ij] = scale[1];
+}
+
+/**
+ * Sums the exterior loop array W from the filled matrices and gives the ensemble energy
+*/
+template <typename T>
+double W_final_pf<T>::fold_exterior(sparse_tree &tree, const fold_tables &tables){
+    for (cand_pos_t j= TURN+1; j <= n; j++) W[j] = exterior_sum(j,tree,tables);
+
+    return ensemble_energy();
+}
+
+/**
+ * W(j), the partition function of the bases 1 to j in the exterior loop. The entries of W before j are filled.
+*/
+template <typename T>
+T W_final_pf<T>::exterior_sum(cand_pos_t j, sparse_tree &tree, const fold_tables &tables){
+		// a prefix that is not weakly closed cuts a pair of G, so it has no contribution at all
+        if(!tree.weakly_closed(1,j)) return 0;
+        T contributions = 0;
 		
 		for (cand_pos_t k=1; k<=j-TURN-1; ++k){
-			pf_t acc = (k>1) ? W[k-1]: 1; //keep as 0 or 1?
-            pair_type tt  = pair[S_[k]][S_[j]];
+			T acc = (k>1) ? W[k-1]: 1; //keep as 0 or 1?
 
 			contributions += acc*get_energy(k,j)*exp_Extloop(k,j);//E_ext_Stem(V->get_energy(k,j),V->get_energy(k+1,j),V->get_energy(k,j-1),V->get_energy(k+1,j-1),S_,params_,k,j,n,tree.tree));
-			if (k == 1 || (tree.weakly_closed(1,k-1) && tree.weakly_closed(k,j))) contributions += acc*get_energy_WMB(k,j)*expPS_penalty;
+			if (!pk_free && (k == 1 || (tree.weakly_closed(1,k-1) && tree.weakly_closed(k,j)))) contributions += acc*get_energy_WMB(k,j)*expPS_penalty;
 
 		}
-        if(tree.tree[j].pair < 0) contributions += W[j-1]*scale[1];
+        if(tables.is_unpaired(j)) contributions += W[j-1]*scale[1];
 
-        if(!tree.weakly_closed(1,j)) contributions = 0;
+		return contributions;
+}
+
+/**
+ * The ensemble energy of the bases 1 to n from W[n], taking the scaling back out
+*/
+template <typename T>
+double W_final_pf<T>::ensemble_energy(){
+    return ((-log(W[n]) - n * log(exp_params_->pf_scale)) * exp_params_->kT / 1000.0);
+}
 
-		W[j] = contributions;	
+/**
+ * Fills the matrices column by column, j ascending and i descending, and gives out the ensemble energy of every
+ * prefix 1..j once its column is done. W(j) is summed with no base after j for the prefix, then again with the
+ * base after j as its 3' neighbour for the longer prefixes. pf_scale stays the one of the whole sequence.
+*/
+template <typename T>
+void W_final_pf<T>::cotranscriptional(sparse_tree &tree, const fold_tables &tables, const std::function<void(cand_pos_t, double)> &out){
+	tables_ = &tables;
+	fill_pk_tables();
+	const cand_pos_t length = n;
+	for(cand_pos_t j = 1; j <= length; ++j){
+		for(cand_pos_t i = j; i >= 1; --i){
+			if(pk_free) fill_cell<false>(i,j,tree,tables);
+			else fill_cell<true>(i,j,tree,tables);
+		}
+		n = j;
+		if(j > TURN) W[j] = exterior_sum(j,tree,tables);
+		out(j,ensemble_energy());
+		n = length;
+		if(j > TURN) W[j] = exterior_sum(j,tree,tables);
 	}
+	filled = true;
+}
+
+/**
+ * Fills V, WM, WMv and, when pk is true, WMp and the pseudoknotted matrices.
+ * Without pseudoknots their entries are all 0 and only add 0 to the sums, so those terms are dropped.
+*/
+template <typename T>
+template <bool pk>
+void W_final_pf<T>::fill_matrices(sparse_tree &tree, const fold_tables &tables){
+	// every read of a cell, BE included, is of a cell strictly inside (i,j), so the spans can be filled in parallel and
+	// each sum still adds its terms in the same order on one thread, the result does not depend on threads
+	fill_by_spans(n,threads,[&](cand_pos_t i, cand_pos_t j){ fill_cell<pk>(i,j,tree,tables); });
+}
+
+template <typename T>
+template <bool pk>
+void W_final_pf<T>::fill_cell(cand_pos_t i, cand_pos_t j, sparse_tree &tree, const fold_tables &tables, const loop_record *record){
+	const bool evaluate = tree.weakly_closed(i,j);
+	const pair_type ptype_closing = tables.ptype(i,j);
+	const bool restricted = tables.is_forced(i) || tables.is_forced(j);
+
+	if(ptype_closing> 0 && evaluate && !restricted)
+	compute_energy_restricted<pk> (i,j,tree,record);
 
-    double energy = ((-log(W[n]) - n * log(exp_params_->pf_scale)) * exp_params_->kT / 1000.0);
+	if constexpr (pk) compute_pk_energies(i,j,tree,record);
 
-    return energy;
+	compute_WMv_WMp<pk>(i,j);
+	if constexpr (columns) set_columns(i,j);
+	compute_energy_WM_restricted<pk>(i,j,tree);
 }
 
-pf_t W_final_pf::exp_Extloop(cand_pos_t i, cand_pos_t j){
-	pair_type tt  = pair[S_[i]][S_[j]];
+template <typename T>
+void W_final_pf<T>::set_columns(cand_pos_t i, cand_pos_t j){
+	const cand_pos_t c = cindex[j]+i;
+	const T v = get_energy(i,j);
+	VML_col[c] = v*exp_MLstem(i,j);
+	WMv_col[c] = get_energy_WMv(i,j);
+	if(pk_free) return;
+	V_col[c] = v;
+	WMB_col[c] = get_energy_WMB(i,j);
+	WMp_col[c] = get_energy_WMp(i,j);
+	WIP_col[c] = get_energy_WIP(i,j);
+}
+
+template <typename T>
+pf_t W_final_pf<T>::exp_Extloop(cand_pos_t i, cand_pos_t j){
+	pair_type tt  = tables_->ptype(i,j);
 
 	if(exp_params_->model_details.dangles == 1 || exp_params_->model_details.dangles == 2){
 		base_type si1 = i>1 ? S_[i-1] : -1;
@@ -192,8 +448,9 @@ pf_t W_final_pf::exp_Extloop(cand_pos_t i, cand_pos_t j){
 	} 
 }
 
-pf_t W_final_pf::exp_MLstem(cand_pos_t i, cand_pos_t j){
-	pair_type tt  = pair[S_[i]][S_[j]];
+template <typename T>
+pf_t W_final_pf<T>::exp_MLstem(cand_pos_t i, cand_pos_t j){
+	pair_type tt  = tables_->ptype(i,j);
 	if(exp_params_->model_details.dangles == 1 || exp_params_->model_details.dangles == 2){
 		base_type si1 = i>1 ? S_[i-1] : -1;
 		base_type sj1 = j<n ? S_[j+1] : -1;
@@ -204,8 +461,9 @@ pf_t W_final_pf::exp_MLstem(cand_pos_t i, cand_pos_t j){
 	} 
 }
 
-pf_t W_final_pf::exp_Mbloop(cand_pos_t i, cand_pos_t j){
-	pair_type tt  = pair[S_[j]][S_[i]];
+template <typename T>
+pf_t W_final_pf<T>::exp_Mbloop(cand_pos_t i, cand_pos_t j){
+	pair_type tt  = rtype[tables_->ptype(i,j)];
 	if(exp_params_->model_details.dangles == 1 || exp_params_->model_details.dangles == 2){
 		base_type si1 = i>1 ? S_[i+1] : -1;
 		base_type sj1 = j<n ? S_[j-1] : -1;
@@ -216,25 +474,32 @@ pf_t W_final_pf::exp_Mbloop(cand_pos_t i, cand_pos_t j){
 	} 
 }
 
-pf_t W_final_pf::HairpinE(cand_pos_t i, cand_pos_t j){
+template <typename T>
+T W_final_pf<T>::HairpinE(cand_pos_t i, cand_pos_t j){
     
-    const int ptype_closing = pair[S_[i]][S_[j]];
+    const int ptype_closing = tables_->ptype(i,j);
     if (ptype_closing==0) return 0;
-	pf_t e_h = static_cast<pf_t>(exp_E_Hairpin(j-i-1,ptype_closing,S1_[i+1],S1_[j-1],&seq.c_str()[i-1],exp_params_));
+	T e_h = static_cast<T>(exp_E_Hairpin(j-i-1,ptype_closing,S1_[i+1],S1_[j-1],&seq.c_str()[i-1],exp_params_));
 	e_h *= scale[j-i+1];
     return e_h;
 }
 
-pf_t W_final_pf::compute_internal_restricted(cand_pos_t i, cand_pos_t j, std::vector<int> &up){
-    pf_t v_iloop = 0;
+template <typename T>
+T W_final_pf<T>::compute_internal_restricted(cand_pos_t i, cand_pos_t j, const loop_record *record){
+    T v_iloop = 0;
+	// the MFE fill of a fused fold went through the same k.l in the same order
+	const energy_t *fused = (record && record->V) ? record->interior.data() : nullptr;
     cand_pos_t max_k = std::min(j-TURN-2,i+MAXLOOP+1);
-	const int ptype_closing = pair[S_[i]][S_[j]];
+	const fold_tables &ft = *tables_;
+	const cand_pos_t *up = ft.up.data();
+	const int ptype_closing = ft.ptype(i,j);
 	for ( cand_pos_t k=i+1; k<=max_k; ++k) {
 		cand_pos_t min_l=std::max(k+TURN+1 + MAXLOOP+2, k+j-i) - MAXLOOP-2;
         if((up[k-1]>=(k-i-1))){
             for (cand_pos_t l=j-1; l>=min_l; --l) {
                 if(up[j-1]>=(j-l-1)){
-					pf_t v_iloop_kl = exp_E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[pair[S_[k]][S_[l]]],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],exp_params_)*get_energy(k,l);
+					pf_t e_int = fused ? exp_loop(*fused++,exp_loop_energy,1) : exp_E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[ft.ptype(k,l)],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],exp_params_);
+					T v_iloop_kl = e_int*get_energy(k,l);
 					int u1 = k-i-1;
 					int u2 = j-l-1;
 					v_iloop_kl *= scale[u1 + u2 + 2];
@@ -248,86 +513,130 @@ pf_t W_final_pf::compute_internal_restricted(cand_pos_t i, cand_pos_t j, std::ve
     return v_iloop;
 }
 
-void W_final_pf::compute_WMv_WMp(cand_pos_t i, cand_pos_t j, std::vector<Node> &tree){
+template <typename T>
+template <bool pk>
+void W_final_pf<T>::compute_WMv_WMp(cand_pos_t i, cand_pos_t j){
 	if(j-i-1<TURN) return;
 	cand_pos_t ij = index[(i)]+(j)-(i);
 	cand_pos_t ijminus1 = index[(i)]+(j)-1-(i);
 
-    pf_t WMv_contributions = 0;
-    pf_t WMp_contributions = 0;
+    T WMv_contributions = 0;
+    T WMp_contributions = 0;
 
 
     WMv_contributions += (get_energy(i,j)*exp_MLstem(i,j));
-	WMp_contributions += (get_energy_WMB(i,j)*expPSM_penalty*expb_penalty);
-	if (tree[j].pair < 0)
+	if constexpr (pk) WMp_contributions += (get_energy_WMB(i,j)*expPSM_penalty*expb_penalty);
+	if (tables_->is_unpaired(j))
 	{
 		WMv_contributions += (WMv[ijminus1]*expMLbase[1]);
-		WMp_contributions += (WMp[ijminus1]*expMLbase[1]);
+		if constexpr (pk) WMp_contributions += (WMp[ijminus1]*expMLbase[1]);
 	}
     WMv[ij] = WMv_contributions;
-    WMp[ij] = WMp_contributions;
+    if constexpr (pk) WMp[ij] = WMp_contributions;
 }
 
-void W_final_pf::compute_energy_WM_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+template <typename T>
+template <bool pk>
+void W_final_pf<T>::compute_energy_WM_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree){
     if(j-i+1<4) return;
-    pf_t contributions = 0;
+    T contributions = 0;
 	cand_pos_t ij = index[(i)]+(j)-(i);
 	cand_pos_t ijminus1 = index[(i)]+(j)-1-(i);
+	const cand_pos_t *up = tables_->up.data();
+
+	if constexpr (columns){
+		// k goes from i to last, the bases i..k-1 can be left unpaired for the k below free
+		const cand_pos_t last = j-TURN-1;
+		cand_pos_t free = i;
+		while(free <= last && up[free-1] >= free-i) ++free;
+		const T *WM_i = &WM[index[i]-i];
+		const T *VML_j = &VML_col[cindex[j]];
+		contributions = pf_dot(expMLbase.data(),VML_j+i,free-i) + pf_dot(WM_i+i+1,VML_j+i+2,last-i-1);
+		if constexpr (pk){
+			const T *WMB_j = &WMB_col[cindex[j]];
+			contributions += (pf_dot(expMLbase.data(),WMB_j+i,free-i) + pf_dot(WM_i+i+1,WMB_j+i+2,last-i-1))*expPSM_penalty*expb_penalty;
+		}
+		if (tables_->is_unpaired(j)) contributions += WM[ijminus1]*expMLbase[1];
+		WM[ij] = contributions;
+		return;
+	}
 
 	for (cand_pos_t k=i; k <= j -TURN-1; k++)
 	{
-		bool can_pair = tree.up[k-1] >= (k-i);
-		if(can_pair) contributions += (static_cast<pf_t>(expMLbase[k-i])*get_energy(k,j)*exp_MLstem(k,j));
-		if(can_pair) contributions += (static_cast<pf_t>(expMLbase[k-i])*get_energy_WMB(k,j)*expPSM_penalty*expb_penalty);
+		bool can_pair = up[k-1] >= (k-i);
+		if(can_pair) contributions += (static_cast<T>(expMLbase[k-i])*get_energy(k,j)*exp_MLstem(k,j));
+		if constexpr (pk) if(can_pair) contributions += (static_cast<T>(expMLbase[k-i])*get_energy_WMB(k,j)*expPSM_penalty*expb_penalty);
 		contributions += (get_energy_WM(i,k-1)*get_energy(k,j)*exp_MLstem(k,j));
-		contributions += (get_energy_WM(i,k-1)*get_energy_WMB(k,j)*expPSM_penalty*expb_penalty);
+		if constexpr (pk) contributions += (get_energy_WM(i,k-1)*get_energy_WMB(k,j)*expPSM_penalty*expb_penalty);
 	}
-	if (tree.tree[j].pair < 0) contributions += WM[ijminus1]*expMLbase[1];
+	if (tables_->is_unpaired(j)) contributions += WM[ijminus1]*expMLbase[1];
 
 
     WM[ij] = contributions;
 }
 
-pf_t W_final_pf::compute_energy_VM_restricted (cand_pos_t i, cand_pos_t j, std::vector<Node> &tree){
-    pf_t contributions = 0;
+template <typename T>
+template <bool pk>
+T W_final_pf<T>::compute_energy_VM_restricted (cand_pos_t i, cand_pos_t j){
+    T contributions = 0;
+    if constexpr (columns){
+        // WM(i+1,k-1) is 0 up to k = i+2
+        const T *WM_i1 = &WM[index[i+1]-(i+1)];
+        const T *WMv_j1 = &WMv_col[cindex[j-1]];
+        T sum = pf_dot(WM_i1+i+2,WMv_j1+i+3,j-i-5);
+        if constexpr (pk){
+            const T *WMp_j1 = &WMp_col[cindex[j-1]];
+            sum += pf_dot(WM_i1+i+2,WMp_j1+i+3,j-i-5);
+            sum += pf_dot(expMLbase.data(),WMp_j1+i+1,j-i-3);
+        }
+        contributions = sum*exp_Mbloop(i,j)*exp_params_->expMLclosing;
+        contributions *= scale[2];
+        return contributions;
+    }
     for (cand_pos_t k = i+1; k <= j-3; ++k)
     {
         contributions += (get_energy_WM(i+1,k-1)*get_energy_WMv(k,j-1)*exp_Mbloop(i,j)*exp_params_->expMLclosing);
-        contributions += (get_energy_WM(i+1,k-1)*get_energy_WMp(k,j-1)*exp_Mbloop(i,j)*exp_params_->expMLclosing);
-        contributions += (expMLbase[k-i-1]*get_energy_WMp(k,j-1)*exp_Mbloop(i,j)*exp_params_->expMLclosing);
+        if constexpr (pk){
+            contributions += (get_energy_WM(i+1,k-1)*get_energy_WMp(k,j-1)*exp_Mbloop(i,j)*exp_params_->expMLclosing);
+            contributions += (expMLbase[k-i-1]*get_energy_WMp(k,j-1)*exp_Mbloop(i,j)*exp_params_->expMLclosing);
+        }
     }
 
 	contributions *=scale[2];
     return contributions;
 }
 
-void W_final_pf::compute_energy_restricted(cand_pos_t i,cand_pos_t j,sparse_tree &tree){
+template <typename T>
+template <bool pk>
+void W_final_pf<T>::compute_energy_restricted(cand_pos_t i,cand_pos_t j,sparse_tree &tree, const loop_record *record){
 
     cand_pos_t ij = index[i]+j-i;
 
-    const pair_type ptype_closing = pair[S_[i]][S_[j]];
-    const bool unpaired = (tree.tree[i].pair<-1 && tree.tree[j].pair<-1);
-	const bool paired = (tree.tree[i].pair == j && tree.tree[j].pair == i);
+    const fold_tables &ft = *tables_;
+    const bool unpaired = ft.is_free(i) && ft.is_free(j);
+	const bool paired = ft.in_G(i,j);
 
-    pf_t contributions = 0;
+    T contributions = 0;
 
     if (paired || unpaired)    // if i and j can pair
     {
-        bool canH = !(tree.up[j-1]<(j-i-1));
-        if(canH) contributions += HairpinE(i,j);
+        bool canH = !(ft.up[j-1]<(j-i-1));
+        if(canH) contributions += (record && record->V) ? exp_loop(record->hairpin,exp_loop_energy,1)*scale[j-i+1] : HairpinE(i,j);
 
-        contributions += compute_internal_restricted(i,j,tree.up);
+        contributions += compute_internal_restricted(i,j,record);
 
-        contributions += compute_energy_VM_restricted(i,j,tree.tree);
+        contributions += compute_energy_VM_restricted<pk>(i,j);
     }   
 
     V[ij] = contributions;
 }
 
-void W_final_pf::compute_pk_energies(cand_pos_t i,cand_pos_t j,sparse_tree &tree){
+template <typename T>
+void W_final_pf<T>::compute_pk_energies(cand_pos_t i,cand_pos_t j,sparse_tree &tree, const loop_record *record){
 
     cand_pos_t ij = index[i]+j-i;
-	const pair_type ptype_closing = pair[S_[i]][S_[j]];
+	const fold_tables &ft = *tables_;
+	const pair_type ptype_closing = ft.ptype(i,j);
 	bool weakly_closed_ij = tree.weakly_closed(i,j);
 
 	if ((i == j || j-i<4 || weakly_closed_ij))	{
@@ -336,12 +645,20 @@ void W_final_pf::compute_pk_energies(cand_pos_t i,cand_pos_t j,sparse_tree &tree
 		VPR[ij] = 0;
 	}
 	else{
-		if(ptype_closing>0 && tree.tree[i].pair < -1 && tree.tree[j].pair < -1) compute_VP(i,j,tree);
-		if(tree.tree[j].pair < -1) compute_VPL(i,j,tree);
-		if(tree.tree[j].pair < j) compute_VPR(i,j,tree);
+		if(ptype_closing>0 && ft.is_free(i) && ft.is_free(j)) compute_VP(i,j,tree,record);
+		if(ft.is_free(j)) compute_VPL(i,j,tree);
+		if(ft.partner(j) < j) compute_VPR(i,j,tree);
 	}
 
-	if (!((j-i-1) <= TURN || (tree.tree[i].pair >= -1 && tree.tree[i].pair > j) || (tree.tree[j].pair >= -1 && tree.tree[j].pair < i) || (tree.tree[i].pair >= -1 && tree.tree[i].pair < i ) || (tree.tree[j].pair >= -1 && j < tree.tree[j].pair))){
+	const cand_pos_t pi = ft.partner(i), pj = ft.partner(j);
+	// The bands of the arc i.j of G are filled here rather than in the cell of their inner pair, as they read WIP past it up
+	// to j-1. Everything they read is then inside (i,j), and WMB reads them below.
+	if (pi == j && i < j){
+		for (cand_pos_t jp = i+1; jp <= j; ++jp){
+			if (ft.partner(jp) >= i && ft.partner(jp) < jp) compute_BE(i,j,ft.partner(jp),jp,tree);
+		}
+	}
+	if (!((j-i-1) <= TURN || (pi >= -1 && pi > j) || (pj >= -1 && pj < i) || (pi >= -1 && pi < i ) || (pj >= -1 && j < pj))){
 		compute_WMBW(i,j,tree);
 		compute_WMBP(i,j,tree);
 		compute_WMB(i,j,tree);
@@ -355,17 +672,14 @@ void W_final_pf::compute_pk_energies(cand_pos_t i,cand_pos_t j,sparse_tree &tree
 		compute_WI(i,j,tree);
 		compute_WIP(i,j,tree);
 	}
-	cand_pos_t ip = tree.tree[i].pair; // i's pair ip should be right side so ip = )
-	cand_pos_t jp = tree.tree[j].pair; // j's pair jp should be left side so jp = (
-	compute_BE(i,ip,jp,j,tree);
-    cand_pos_t ijp = index[i]+jp-i;
 
 }
 
-void W_final_pf::compute_WI(cand_pos_t i,cand_pos_t j,sparse_tree &tree){
+template <typename T>
+void W_final_pf<T>::compute_WI(cand_pos_t i,cand_pos_t j,sparse_tree &tree){
 
     cand_pos_t ij = index[i]+j-i;
-    pf_t contributions = 0;
+    T contributions = 0;
     if(i==j){
         WI[ij] = expPUP_pen[1];
         return;
@@ -373,54 +687,88 @@ void W_final_pf::compute_WI(cand_pos_t i,cand_pos_t j,sparse_tree &tree){
     contributions += (get_energy(i,j)*expPPS_penalty);
     contributions += (get_energy_WMB(i,j)*expPSP_penalty*expPPS_penalty);
 
-    for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
+    if constexpr (columns){
+        const T *WI_i = &WI[index[i]-i];
+        contributions += pf_dot(WI_i+i,&V_col[cindex[j]]+i+1,j-TURN-2-i)*expPPS_penalty;
+        contributions += pf_dot(WI_i+i,&WMB_col[cindex[j]]+i+1,j-TURN-2-i)*expPSP_penalty*expPPS_penalty;
+    }
+    else for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
         contributions += (get_energy_WI(i,k-1)*get_energy(k,j)*expPPS_penalty);
         contributions += (get_energy_WI(i,k-1)*get_energy_WMB(k,j)*expPSP_penalty*expPPS_penalty);
     }
-    if (tree.tree[j].pair < 0) contributions +=  (get_energy_WI(i,j-1)*expPUP_pen[1]);
+    if (tables_->is_unpaired(j)) contributions +=  (get_energy_WI(i,j-1)*expPUP_pen[1]);
 
     WI[ij] = contributions;
 }
 
-void W_final_pf::compute_WIP(cand_pos_t i,cand_pos_t j,sparse_tree &tree){
+template <typename T>
+void W_final_pf<T>::compute_WIP(cand_pos_t i,cand_pos_t j,sparse_tree &tree){
 
     cand_pos_t ij = index[i]+j-i;
-    pf_t contributions = 0;
+    T contributions = 0;
     contributions += get_energy(i,j)*expbp_penalty;
     contributions += get_energy_WMB(i,j)*expbp_penalty*expPSM_penalty;
-    for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
-		bool can_pair = tree.up[k-1] >= (k-i);
+    const cand_pos_t *up = tables_->up.data();
+    if constexpr (columns){
+        // WIP(i,k-1) is 0 for k = i+1, and the bases i..k-1 can be left unpaired for the k below free
+        const cand_pos_t last = j-TURN-2;
+        cand_pos_t free = i+1;
+        while(free <= last && up[free-1] >= free-i) ++free;
+        const T *WIP_i = &WIP[index[i]-i];
+        const T *V_j = &V_col[cindex[j]];
+        const T *WMB_j = &WMB_col[cindex[j]];
+        contributions += pf_dot(WIP_i+i+1,V_j+i+2,last-i-1)*expbp_penalty;
+        contributions += pf_dot(WIP_i+i+1,WMB_j+i+2,last-i-1)*expb_penalty*expPSM_penalty;
+        contributions += pf_dot(expcp_pen.data()+1,V_j+i+1,free-i-1)*expbp_penalty;
+        contributions += pf_dot(expcp_pen.data()+1,WMB_j+i+1,free-i-1)*expbp_penalty*expPSM_penalty;
+    }
+    else for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
+		bool can_pair = up[k-1] >= (k-i);
 
         contributions += (get_energy_WIP(i,k-1)*get_energy(k,j)*expbp_penalty);
         contributions += (get_energy_WIP(i,k-1)*get_energy_WMB(k,j)*expb_penalty*expPSM_penalty);
         if(can_pair) contributions += (expcp_pen[k-i]*get_energy(k,j)*expbp_penalty);
         if(can_pair) contributions += (expcp_pen[k-i]*get_energy_WMB(k,j)*expbp_penalty*expPSM_penalty);
     }
-    if (tree.tree[j].pair < 0) contributions += (get_energy_WIP(i,j-1)*expcp_pen[1]);
+    if (tables_->is_unpaired(j)) contributions += (get_energy_WIP(i,j-1)*expcp_pen[1]);
     WIP[ij] = contributions;
 
 }
 
-void W_final_pf::compute_VPL(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+template <typename T>
+void W_final_pf<T>::compute_VPL(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 
 	cand_pos_t ij = index[i]+j-i;
-	pf_t contributions = 0;
+	T contributions = 0;
 
 	cand_pos_t min_Bp_j = std::min((cand_pos_tu) tree.b(i,j), (cand_pos_tu) tree.Bp(i,j));
+	const cand_pos_t *up = tables_->up.data();
 	for(cand_pos_t k = i+1; k<min_Bp_j; ++k){
-		bool can_pair = tree.up[k-1] >= (k-i);
+		bool can_pair = up[k-1] >= (k-i);
 		if(can_pair) contributions += (expcp_pen[k-i]*get_energy_VP(k,j));
 	}
 	VPL[ij] = contributions;
 }
 
-void W_final_pf::compute_VPR(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+template <typename T>
+void W_final_pf<T>::compute_VPR(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 
 	cand_pos_t ij = index[i]+j-i;
-	pf_t contributions = 0;
+	T contributions = 0;
 	cand_pos_t max_i_bp = std::max(tree.B(i,j),tree.bp(i,j));
+	const cand_pos_t up_j = tables_->up[j-1];
+	if constexpr (columns){
+		// VP(i,k) is 0 up to k = i, WIP(k+1,j) from k = j-1, and the bases k+1..j can be left unpaired from k = j-up_j
+		const cand_pos_t first = std::max(max_i_bp+1,i+1);
+		const cand_pos_t first_cp = std::max(first,j-up_j);
+		const T *VP_i = &VP[index[i]-i];
+		contributions = pf_dot(VP_i+first,&WIP_col[cindex[j]]+first+1,j-1-first);
+		contributions += pf_dot(VP_i+first_cp,expcp_pen.data()+first_cp-i,j-first_cp);
+		VPR[ij] = contributions;
+		return;
+	}
 	for(cand_pos_t k = max_i_bp+1; k<j; ++k){
-		bool can_pair = tree.up[j-1] >= (j-k);
+		bool can_pair = up_j >= (j-k);
 		contributions += (get_energy_VP(i,k)*get_energy_WIP(k+1,j));
 		if(can_pair) contributions += (get_energy_VP(i,k)*expcp_pen[k-i]);
 
@@ -429,11 +777,13 @@ void W_final_pf::compute_VPR(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 }
 
 
-void W_final_pf::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+template <typename T>
+void W_final_pf<T>::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree, const loop_record *record){
 	cand_pos_t ij = index[i]+j-i;
 
-	const pair_type ptype_closing = pair[S_[i]][S_[j]];	
-    pf_t contributions = 0;
+	const fold_tables &ft = *tables_;
+	const cand_pos_t *up = ft.up.data();
+    T contributions = 0;
 	
 	// Borders -- added one to i and j to make it fit current bounds but also subtracted 1 from answer as the tree bounds are shifted as well
 	cand_pos_t Bp_ij = tree.Bp(i,j);
@@ -441,45 +791,49 @@ void W_final_pf::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 	cand_pos_t b_ij = tree.b(i,j);
 	cand_pos_t bp_ij = tree.bp(i,j);
 	
-	if((tree.tree[i].parent->index) > 0 && (tree.tree[j].parent->index) < (tree.tree[i].parent->index) && Bp_ij >= 0 && B_ij >= 0 && bp_ij < 0){
-		pf_t m1 = (get_energy_WI(i+1,Bp_ij-1)*get_energy_WI(B_ij+1,j-1));
+	if((ft.parent(i)) > 0 && (ft.parent(j)) < (ft.parent(i)) && Bp_ij >= 0 && B_ij >= 0 && bp_ij < 0){
+		T m1 = (get_energy_WI(i+1,Bp_ij-1)*get_energy_WI(B_ij+1,j-1));
 		m1 *= scale[2];
         contributions += m1;
 	}
 
-	if ((tree.tree[i].parent->index) < (tree.tree[j].parent->index) && (tree.tree[j].parent->index) > 0 && b_ij>= 0 && bp_ij >= 0 && Bp_ij < 0){
-		pf_t m2 = (get_energy_WI(i+1,b_ij-1)*get_energy_WI(bp_ij+1,j-1));
+	if ((ft.parent(i)) < (ft.parent(j)) && (ft.parent(j)) > 0 && b_ij>= 0 && bp_ij >= 0 && Bp_ij < 0){
+		T m2 = (get_energy_WI(i+1,b_ij-1)*get_energy_WI(bp_ij+1,j-1));
 		m2 *= scale[2];
         contributions += m2;
 	}
 
-	if((tree.tree[i].parent->index) > 0 && (tree.tree[j].parent->index) > 0 && Bp_ij >= 0 && B_ij >= 0  && b_ij >= 0 && bp_ij>= 0){
-		pf_t m3 = (get_energy_WI(i+1,Bp_ij-1)*get_energy_WI(B_ij+1,b_ij-1)*get_energy_WI(bp_ij+1,j-1));
+	if((ft.parent(i)) > 0 && (ft.parent(j)) > 0 && Bp_ij >= 0 && B_ij >= 0  && b_ij >= 0 && bp_ij>= 0){
+		T m3 = (get_energy_WI(i+1,Bp_ij-1)*get_energy_WI(B_ij+1,b_ij-1)*get_energy_WI(bp_ij+1,j-1));
 		m3 *= scale[2];
         contributions += m3;
 	}
 
-	pair_type ptype_closingip1jm1 = pair[S_[i+1]][S_[j-1]];
-	if((tree.tree[i+1].pair) < -1 && (tree.tree[j-1].pair) < -1 && ptype_closingip1jm1>0){
-		pf_t vp_stp = (get_e_stP(i,j)*get_energy_VP(i+1,j-1));
+	pair_type ptype_closingip1jm1 = ft.ptype(i+1,j-1);
+	if(ft.is_free(i+1) && ft.is_free(j-1) && ptype_closingip1jm1>0){
+		T vp_stp = (get_e_stP(i,j)*get_energy_VP(i+1,j-1));
 		vp_stp *= scale[2];
         contributions += vp_stp;
 	}
 
 
+	// the MFE fill of a fused fold went through the same k.l in the same order
+	const energy_t *fused = (record && record->VP) ? record->vp_interior.data() : nullptr;
 	cand_pos_t min_borders = std::min((cand_pos_tu) Bp_ij, (cand_pos_tu) b_ij);
 	cand_pos_t edge_i = std::min(i+MAXLOOP+1,j-TURN-1);
 	min_borders = std::min(min_borders,edge_i);
 	for (cand_pos_t k = i+1; k < min_borders; ++k){
-		if (tree.tree[k].pair < -1 && (tree.up[(k)-1] >= ((k)-(i)-1))){
+		if (ft.is_free(k) && (up[(k)-1] >= ((k)-(i)-1))){
 			cand_pos_t max_borders = std::max(bp_ij,B_ij)+1;
 			cand_pos_t edge_j = k+j-i-MAXLOOP-2;
 			max_borders = std::max(max_borders,edge_j);
 			for (cand_pos_t l = j-1; l > max_borders ; --l){
-				pair_type ptype_closingkj = pair[S_[k]][S_[l]];
-                if(k==i+1 && l==j-1) continue; // I have to add or else it will add a stP version and an eintP version to the sum
-				if (tree.tree[l].pair < -1 && ptype_closingkj>0 && (tree.up[(j)-1] >= ((j)-(l)-1))){
-					pf_t vp_iloop_kl = (get_e_intP(i,k,l,j)*get_energy_VP(k,l));
+				pair_type ptype_closingkj = ft.ptype(k,l);
+				if (ft.is_free(l) && ptype_closingkj>0 && (up[(j)-1] >= ((j)-(l)-1))){
+					// the record of a fused fold has the stack as well
+					pf_t e_intP = fused ? exp_loop(*fused++,exp_loop_energy_intP,e_intP_penalty) : get_e_intP(i,k,l,j);
+					if(k==i+1 && l==j-1) continue; // I have to add or else it will add a stP version and an eintP version to the sum
+					T vp_iloop_kl = (e_intP*get_energy_VP(k,l));
 					int u1 = k-i-1;
 					int u2 = j-l-1;
 					vp_iloop_kl *= scale[u1 + u2 + 2];	
@@ -494,61 +848,52 @@ void W_final_pf::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 	cand_pos_t max_i_bp = std::max(tree.B(i,j),tree.bp(i,j));
 
 	for(cand_pos_t k = i+1; k<min_Bp_j; ++k){
-		pf_t m6 = (get_energy_WIP(i+1,k-1)*get_energy_VP(k,j-1)*expap_penalty*pow(expbp_penalty,2));
-		m6 *= scale[2];
+		T m6 = (get_energy_WIP(i+1,k-1)*get_energy_VP(k,j-1)*exp_band);
 		contributions += m6; 
 	}
 
 	for(cand_pos_t k = max_i_bp+1; k<j; ++k){
-		pf_t m7 = (get_energy_VP(i+1,k)*get_energy_WIP(k+1,j-1)*expap_penalty*pow(expbp_penalty,2));
-		m7 *= scale[2];
+		T m7 = (get_energy_VP(i+1,k)*get_energy_WIP(k+1,j-1)*exp_band);
 		contributions += m7;
 	}
 
 	for(cand_pos_t k = i+1; k<min_Bp_j; ++k){
-		pf_t m8 = (get_energy_WIP(i+1,k-1)*get_energy_VPR(k,j-1)*expap_penalty*pow(expbp_penalty,2));
-		m8 *= scale[2];
+		T m8 = (get_energy_WIP(i+1,k-1)*get_energy_VPR(k,j-1)*exp_band);
 		contributions += m8;
 	}
 
 	for(cand_pos_t k = max_i_bp+1; k<j; ++k){
-		pf_t m9 = (get_energy_VPL(i+1,k)*get_energy_WIP(k+1,j-1)*expap_penalty*pow(expbp_penalty,2));
-		m9 *= scale[2];
+		T m9 = (get_energy_VPL(i+1,k)*get_energy_WIP(k+1,j-1)*exp_band);
 		contributions += m9;
 	}
 
 	VP[ij] = contributions;
 }
 
-pf_t W_final_pf::compute_int(cand_pos_t i, cand_pos_t j, cand_pos_t k, cand_pos_t l){
-	const pair_type ptype_closing = pair[S_[i]][S_[j]];
-    return  exp_E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[pair[S_[k]][S_[l]]],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],exp_params_);
-}
-
-pf_t W_final_pf::get_e_stP(cand_pos_t i, cand_pos_t j){
+template <typename T>
+pf_t W_final_pf<T>::get_e_stP(cand_pos_t i, cand_pos_t j){
 	if (i+1 == j-1){ // TODO: do I need something like that or stack is taking care of this?
 		return 0;
 	}
-	pf_t e_st = compute_int(i,j,i+1,j-1);
-
-    return pow(e_st,e_stP_penalty); 
+	return exp_stP[tables_->ptype(i,j)][rtype[tables_->ptype(i+1,j-1)]];
 }
 
-pf_t W_final_pf::get_e_intP(cand_pos_t i, cand_pos_t ip, cand_pos_t jp, cand_pos_t j){
+template <typename T>
+pf_t W_final_pf<T>::get_e_intP(cand_pos_t i, cand_pos_t ip, cand_pos_t jp, cand_pos_t j){
 	if(ip==i+1 && jp==j-1) return 0;
-    pf_t e_int = compute_int(i,j,ip,jp);
-
-	return pow(e_int,e_intP_penalty);
+	const pair_type ptype_closing = tables_->ptype(i,j);
+	return exp_E_IntLoop(ip-i-1,j-jp-1,ptype_closing,rtype[tables_->ptype(ip,jp)],S1_[i+1],S1_[j-1],S1_[ip-1],S1_[jp+1],exp_intP_params_);
 }
 
-void W_final_pf::compute_WMBW(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+template <typename T>
+void W_final_pf<T>::compute_WMBW(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 	cand_pos_t ij = index[i]+j-i;
 
-	pf_t contributions = 0;
+	T contributions = 0;
 
-	if(tree.tree[j].pair < j){
+	if(tables_->partner(j) < j){
 		for(cand_pos_t l = i+1; l<j; l++){
-			if (tree.tree[l].pair < 0 && tree.tree[l].parent->index > -1 && tree.tree[j].parent->index > -1 && tree.tree[j].parent->index == tree.tree[l].parent->index){
+			if (tables_->is_unpaired(l) && tables_->parent(l) > -1 && tables_->parent(j) > -1 && tables_->parent(j) == tables_->parent(l)){
 				contributions += get_energy_WMBP(i,l)*get_energy_WI(l+1,j);
 			}
 		}
@@ -556,11 +901,13 @@ void W_final_pf::compute_WMBW(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 	WMBW[ij] = contributions;
 }
 
-void W_final_pf::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+template <typename T>
+void W_final_pf<T>::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
     cand_pos_t ij = index[i]+j-i;
-    pf_t contributions = 0;
+    T contributions = 0;
+    const fold_tables &ft = *tables_;
 
-    if (tree.tree[j].pair < 0){
+    if (ft.is_unpaired(j)){
 		cand_pos_t b_ij = tree.b(i,j);
         for (cand_pos_t l = i+1; l<j ; l++)	{
             cand_pos_t bp_il = tree.bp(i,l);
@@ -568,8 +915,8 @@ void W_final_pf::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 			if(b_ij > 0 && l < b_ij){
 				if (bp_il >= 0 && l>bp_il && Bp_lj > 0 && l<Bp_lj){ 
 					cand_pos_t B_lj = tree.B(l,j);
-					if (i <= tree.tree[l].parent->index && tree.tree[l].parent->index < j && l+TURN <=j){
-						pf_t m1 = get_BE(tree.tree[B_lj].pair,B_lj,tree.tree[Bp_lj].pair,Bp_lj,tree)*get_energy_WMBP(i,l-1)*get_energy_VP(l,j)*pow(expPB_penalty,2);
+					if (i <= ft.parent(l) && ft.parent(l) < j && l+TURN <=j){
+						T m1 = get_BE(ft.partner(B_lj),B_lj,ft.partner(Bp_lj),Bp_lj,tree,i)*get_energy_WMBP(i,l-1)*get_energy_VP(l,j)*expPB2;
 						contributions += m1;
 					}
 				}
@@ -577,7 +924,7 @@ void W_final_pf::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
         }
     }
 
-    if (tree.tree[j].pair < 0){
+    if (ft.is_unpaired(j)){
 		cand_pos_t b_ij = tree.b(i,j);
         for (cand_pos_t l = i+1; l<j ; l++)	{
             cand_pos_t bp_il = tree.bp(i,l);
@@ -585,8 +932,8 @@ void W_final_pf::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 			if(b_ij>0 && l<b_ij){
 				if (bp_il >= 0 && l>bp_il && Bp_lj > 0 && l<Bp_lj){ 
 					cand_pos_t B_lj = tree.B(l,j);
-					if (i <= tree.tree[l].parent->index && tree.tree[l].parent->index < j && l+TURN <=j){
-						pf_t m2 = get_BE(tree.tree[B_lj].pair,B_lj,tree.tree[Bp_lj].pair,Bp_lj,tree)*get_energy_WMBW(i,l-1)*get_energy_VP(l,j)*pow(expPB_penalty,2);
+					if (i <= ft.parent(l) && ft.parent(l) < j && l+TURN <=j){
+						T m2 = get_BE(ft.partner(B_lj),B_lj,ft.partner(Bp_lj),Bp_lj,tree,i)*get_energy_WMBW(i,l-1)*get_energy_VP(l,j)*expPB2;
 						contributions += m2;
 					}
 				}   
@@ -594,10 +941,10 @@ void W_final_pf::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
         }
 	}
 
-	pf_t m3 = get_energy_VP(i,j)*expPB_penalty;
+	T m3 = get_energy_VP(i,j)*expPB_penalty;
     contributions += m3; // Make sure not to use non-Partition values
 
-    if(tree.tree[j].pair < 0 && tree.tree[i].pair >= 0){
+    if(ft.is_unpaired(j) && ft.is_paired(i)){
 		energy_t tmp = INF;
 		cand_pos_t b_ij = tree.b(i,j);
 		for (cand_pos_t l = i+1; l < j; l++){
@@ -605,8 +952,8 @@ void W_final_pf::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 			cand_pos_t Bp_lj = tree.Bp(l,j);
 			if(b_ij>0 && l<b_ij){
 				if(bp_il >= 0 && bp_il < n && l+TURN <= j){
-					if (i <= tree.tree[l].parent->index && tree.tree[l].parent->index < j && l+TURN <=j){
-						pf_t m4 = get_BE(i,tree.tree[i].pair,bp_il,tree.tree[bp_il].pair,tree)*get_energy_WI(bp_il+1,l-1)*get_energy_VP(l,j)*pow(expPB_penalty,2);
+					if (i <= ft.parent(l) && ft.parent(l) < j && l+TURN <=j){
+						T m4 = get_BE(i,ft.partner(i),bp_il,ft.partner(bp_il),tree)*get_energy_WI(bp_il+1,l-1)*get_energy_VP(l,j)*expPB2;
 						contributions += m4;
 					}
 				}
@@ -617,9 +964,10 @@ void W_final_pf::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
     WMBP[ij] = contributions;
 }
 
-void W_final_pf::compute_WMB(cand_pos_t  i, cand_pos_t  j, sparse_tree &tree){
+template <typename T>
+void W_final_pf<T>::compute_WMB(cand_pos_t  i, cand_pos_t  j, sparse_tree &tree){
 	cand_pos_t ij = index[i]+j-i;
-    pf_t contributions = 0;
+    T contributions = 0;
 	//base case
 	if (i == j){
 		WMB[ij] = 0;
@@ -628,13 +976,14 @@ void W_final_pf::compute_WMB(cand_pos_t  i, cand_pos_t  j, sparse_tree &tree){
 
 	energy_t m2 = INF, mWMBP = INF;
 
-	if (tree.tree[j].pair >= 0 && j > tree.tree[j].pair){
-		cand_pos_t bp_j = tree.tree[j].pair;
+	const fold_tables &ft = *tables_;
+	if (ft.partner(j) >= 0 && j > ft.partner(j)){
+		cand_pos_t bp_j = ft.partner(j);
 		for (cand_pos_t l = (bp_j +1); (l < j); l++){
-			if(tree.tree[l].pair>0) continue;
+			if(ft.partner(l)>0) continue;
 			cand_pos_t Bp_lj = tree.Bp(l,j);
 			if (Bp_lj >= 0 && Bp_lj<n){
-                contributions += get_BE(bp_j,j,tree.tree[Bp_lj].pair,Bp_lj,tree)*get_energy_WMBP(i,l)*get_energy_WI(l+1,Bp_lj-1)*expPB_penalty;
+                contributions += get_BE(bp_j,j,ft.partner(Bp_lj),Bp_lj,tree)*get_energy_WMBP(i,l)*get_energy_WI(l+1,Bp_lj-1)*expPB_penalty;
 			}
 		}
 	}
@@ -646,17 +995,20 @@ void W_final_pf::compute_WMB(cand_pos_t  i, cand_pos_t  j, sparse_tree &tree){
 	WMB[ij] = contributions;	
 }
 
-void W_final_pf::compute_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree){
+template <typename T>
+void W_final_pf<T>::compute_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree){
 
-	if (!( i >= 1 && i <= ip && ip < jp && jp <= j && j <= n && tree.tree[i].pair > 0 && tree.tree[j].pair > 0 && tree.tree[ip].pair > 0 && tree.tree[jp].pair > 0 && tree.tree[i].pair == j && tree.tree[j].pair == i && tree.tree[ip].pair == jp && tree.tree[jp].pair == ip)){ //impossible cases
+	const fold_tables &ft = *tables_;
+	if (!( i >= 1 && i <= ip && ip < jp && jp <= j && j <= n && ft.partner(i) > 0 && ft.partner(j) > 0 && ft.partner(ip) > 0 && ft.partner(jp) > 0 && ft.in_G(i,j) && ft.in_G(ip,jp))){ //impossible cases
 		return;
 	}
+	const cand_pos_t *up = ft.up.data();
 	// (   (    (   )    )   ) //
 	// i   l    ip  jp   lp  j //
 	cand_pos_t iip = index[i]+ip-i;
-    pf_t contributions = 0;
+    T contributions = 0;
 	// base case: i.j and ip.jp must be in G
-	if (tree.tree[i].pair != j || tree.tree[ip].pair != jp){
+	if (ft.partner(i) != j || ft.partner(ip) != jp){
 		BE[iip] = 0;
 		return;
 	}
@@ -668,44 +1020,39 @@ void W_final_pf::compute_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_
 		return;
 	}
     
-    if (tree.tree[i+1].pair == j-1){
-		pf_t be_estp = get_e_stP(i,j)*get_BE(i+1,j-1,ip,jp,tree);
+    if (ft.partner(i+1) == j-1){
+		T be_estp = get_e_stP(i,j)*get_BE(i+1,j-1,ip,jp,tree);
 		be_estp *= scale[2];
 		contributions += be_estp;
 	}
 
 	for (cand_pos_t l = i+1; l<= ip ; l++){
-		if (tree.tree[l].pair >= -1 && jp <= tree.tree[l].pair && tree.tree[l].pair < j){
+		if (ft.partner(l) >= -1 && jp <= ft.partner(l) && ft.partner(l) < j){
 
-			cand_pos_t lp = tree.tree[l].pair;
-			cand_pos_t il = index[i]+l-i;
-			cand_pos_t lpj = index[lp]+j-lp;
+			cand_pos_t lp = ft.partner(l);
 
-			bool empty_region_il = (tree.up[(l)-1] >= l-i-1); //empty between i+1 and l-1
-			bool empty_region_lpj = (tree.up[(j)-1] >= j-lp-1); // empty between lp+1 and j-1
+			bool empty_region_il = (up[(l)-1] >= l-i-1); //empty between i+1 and l-1
+			bool empty_region_lpj = (up[(j)-1] >= j-lp-1); // empty between lp+1 and j-1
 			bool weakly_closed_il = tree.weakly_closed(i+1,l-1); // weakly closed between i+1 and l-1
 			bool weakly_closed_lpj = tree.weakly_closed(lp+1,j-1); // weakly closed between lp+1 and j-1
 
 			if (empty_region_il && empty_region_lpj){//&& !(ip == (i+1) && jp==(j-1)) && !(l == (i+1) && lp == (j-1))){
-				pf_t eintp = get_e_intP(i,l,lp,j)*get_BE(l,lp,ip,jp,tree);
+				T eintp = exp_intP_G[index[i]+l-i]*get_BE(l,lp,ip,jp,tree);
 				int u1 = l-i-1;
 				int u2 = j-lp-1;
 				eintp *= scale[u1+u2+2];
                 contributions += eintp; // Added to e_intP that l != i+1 and lp != j-1 at the same time
 			}
 			if (weakly_closed_il && weakly_closed_lpj){
-				pf_t m3 = get_energy_WIP(i+1,l-1)*get_BE(l,lp,ip,jp,tree)*get_energy_WIP(lp+1,j-1)*expap_penalty*pow(expbp_penalty,2);
-				m3 *= scale[2];
+				T m3 = get_energy_WIP(i+1,l-1)*get_BE(l,lp,ip,jp,tree)*get_energy_WIP(lp+1,j-1)*exp_band;
                 contributions += m3;
 			}
 			if (weakly_closed_il && empty_region_lpj){
-				pf_t m4 = get_energy_WIP(i+1,l-1)*get_BE(l,lp,ip,jp,tree)*expcp_pen[j-lp+1]*expap_penalty*pow(bp_penalty,2);
-				m4*=scale[2];
+				T m4 = get_energy_WIP(i+1,l-1)*get_BE(l,lp,ip,jp,tree)*expcp_pen[j-lp+1]*exp_band;
                 contributions += m4;
 			}
 			if (empty_region_il && weakly_closed_lpj){
-				pf_t m5 = expcp_pen[l-i+1]*get_BE(l,lp,ip,jp,tree)*get_energy_WIP(lp+1,j-1)*expap_penalty*pow(bp_penalty,2);
-				m5 *= scale[2];
+				T m5 = expcp_pen[l-i+1]*get_BE(l,lp,ip,jp,tree)*get_energy_WIP(lp+1,j-1)*exp_band;
                 contributions += m5;
 
 			}
@@ -715,4 +1062,1008 @@ void W_final_pf::compute_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_
 	BE[iip] = contributions;
 }
 
+/**
+ * Base pair probabilities from an outside pass. Every recurrence is a sum of products of cells, so going through the cells
+ * in the reverse of the fill order, each cell hands its outside value times the other factors of a term to every factor of
+ * the term. X_out(i,j)*X(i,j) is then the probability of the structures whose derivation goes through X(i,j).
+ * A read of BE from a cell filled before the entry read 0 (see BE_read), so it passes nothing on.
+*/
+template <typename T>
+void W_final_pf<T>::probabilities(sparse_tree &tree, double cutoff, cand_pos_t offset, std::ostream &out){
+	outside(tree);
+
+	for(cand_pos_t i = 1; i <= n; ++i){
+		for(cand_pos_t j = i+1; j <= n; ++j){
+			cand_pos_t ij = index[i]+j-i;
+			double p_nested = static_cast<double>(V_out[ij]*V[ij]);
+			double p_pk = pk_free ? 0 : static_cast<double>(VP_out[ij]*VP[ij]);
+			double p = p_nested + p_pk;
+			// a pair of G is in every structure, and pseudoknotted when it is not closing a loop of V. Not all of those
+			// go through BE, the bands of G crossed by the VP of WMBP(i,j) = VP(i,j) are never expanded.
+			if(tables_->in_G(i,j)){
+				p = 1;
+				p_pk = pk_free ? 0 : std::max(1-p_nested,0.0);
+			}
+			if(p >= cutoff && p > 0) out << i+offset << " " << j+offset << " " << p << " " << p_pk << "\n";
+		}
+	}
+	out.flush();
+
+	for(std::vector<T> *X_out : {&V_out,&WMv_out,&WMp_out,&WM_out,&W_out,&WI_out,&VP_out,&VPL_out,&VPR_out,&WMB_out,&WMBP_out,&WMBW_out,&WIP_out,&BE_out}) std::vector<T>().swap(*X_out);
+}
+
+/**
+ * The ensemble energy is G = -kT ln Z, so the derivative of G by a parameter is the average over the ensemble of the
+ * derivative of the energy of a structure, which is the number of times the structure uses the parameter for an energy
+ * added once per loop, base or band. A term of a cell X(i,j) has the probability X_out(i,j) times the term, and each term
+ * uses the same parameters in every structure derived through it, so the outside pass sums those probabilities times the
+ * uses of each parameter (see count). e_stP_penalty and e_intP_penalty multiply the energies of the stacks and interior
+ * loops of VP and BE, their derivative is the expected energy of those loops.
+ * The penalties are given at 37 degrees: a penalty P is -3P + 2P*TT at the temperature T, as in rescale_pk_globals, and a
+ * penalty whose enthalpy does not depend on it, such as b_penalty or ML_intern37, is P*TT, TT being T/Tmeasure in Kelvin.
+ * The derivatives are in kcal/mol per kcal/mol, kcal/mol for the two multipliers. a_penalty, c_penalty and
+ * start_hybrid_penalty are in no recurrence of the partition function, so theirs is 0.
+*/
+template <typename T>
+void W_final_pf<T>::gradients(sparse_tree &tree, std::ostream &out){
+	expected.assign(G_COUNT,0);
+	outside(tree);
+
+	const double TT = (exp_params_->model_details.temperature + K0) / (Tmeasure);
+	const double penalty = 3-2*TT;
+	const std::pair<const char*,double> parameters[G_COUNT] = {
+		{"PS_penalty",penalty}, {"PSM_penalty",penalty}, {"PSP_penalty",penalty}, {"PB_penalty",penalty}, {"PUP_penalty",penalty},
+		{"PPS_penalty",penalty}, {"e_stP_penalty",1}, {"e_intP_penalty",1}, {"a_penalty",TT}, {"b_penalty",TT}, {"c_penalty",TT},
+		{"ap_penalty",penalty}, {"bp_penalty",penalty}, {"cp_penalty",penalty}, {"start_hybrid_penalty",0},
+		{"ML_closing37",TT}, {"ML_intern37",TT}, {"ML_BASE37",TT}};
+	for(int p = 0; p < G_COUNT; ++p) out << parameters[p].first << " " << expected[p]*parameters[p].second << "\n";
+	out.flush();
+
+	std::vector<double>().swap(expected);
+	for(std::vector<T> *X_out : {&V_out,&WMv_out,&WMp_out,&WM_out,&W_out,&WI_out,&VP_out,&VPL_out,&VPR_out,&WMB_out,&WMBP_out,&WMBW_out,&WIP_out,&BE_out}) std::vector<T>().swap(*X_out);
+}
+
+template <typename T>
+void W_final_pf<T>::outside(sparse_tree &tree){
+	const cand_pos_t total_length = V.size();
+	for(std::vector<T> *X_out : {&V_out,&WMv_out,&WM_out}) X_out->assign(total_length,0);
+	W_out.assign(n+1,0);
+	if(!pk_free) for(std::vector<T> *X_out : {&WMp_out,&WI_out,&VP_out,&VPL_out,&VPR_out,&WMB_out,&WMBP_out,&WMBW_out,&WIP_out,&BE_out}) X_out->assign(total_length,0);
+
+	W_out[n] = T(1.0)/W[n];
+	for(cand_pos_t j = n; j > TURN; --j) outside_exterior(j,tree);
+	for(cand_pos_t i = 1; i <= n; ++i){
+		for(cand_pos_t j = n; j >= i; --j){
+			if(pk_free) outside_cell<false>(i,j,tree);
+			else outside_cell<true>(i,j,tree);
+		}
+	}
+}
+
+template <typename T>
+double W_final_pf<T>::stack_energy(cand_pos_t i, cand_pos_t j){
+	return -exp_params_->kT*log(exp_params_->expstack[tables_->ptype(i,j)][rtype[tables_->ptype(i+1,j-1)]])/1000;
+}
+
+template <typename T>
+double W_final_pf<T>::interior_energy(cand_pos_t i, cand_pos_t k, cand_pos_t l, cand_pos_t j){
+	const pf_t e = exp_E_IntLoop(k-i-1,j-l-1,tables_->ptype(i,j),rtype[tables_->ptype(k,l)],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],exp_params_);
+	return -exp_params_->kT*log(e)/1000;
+}
+
+/**
+ * BE(i,j,ip,jp) is filled in the cell (i,j), before the cells that read it. Those are the cells (ci,cj) around i.j, where
+ * i > ci, or i == ci and jp < cj. A read from anywhere else, such as a row argument of get_BE past i, was 0.
+*/
+template <typename T>
+cand_pos_t W_final_pf<T>::BE_read(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, cand_pos_t ci, cand_pos_t cj){
+	if (j-i>= TURN && i >= 1 && i <= ip && ip < jp && jp <= j && j <=n && tables_->in_G(i,j) && tables_->in_G(ip,jp) && (i > ci || (i == ci && jp < cj))) return index[i]+ip-i;
+	return -1;
+}
+
+template <typename T>
+cand_pos_t W_final_pf<T>::BE_written(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp){
+	const fold_tables &ft = *tables_;
+	if (!( i >= 1 && i <= ip && ip < jp && jp <= j && j <= n && ft.partner(i) > 0 && ft.partner(j) > 0 && ft.partner(ip) > 0 && ft.partner(jp) > 0 && ft.in_G(i,j) && ft.in_G(ip,jp))) return -1;
+	return index[i]+ip-i;
+}
+
+template <typename T>
+void W_final_pf<T>::outside_exterior(cand_pos_t j, sparse_tree &tree){
+	if(!tree.weakly_closed(1,j)) return;
+	const T g = W_out[j];
+	for (cand_pos_t k=1; k<=j-TURN-1; ++k){
+		T acc = (k>1) ? W[k-1]: 1;
+		pf_t e = exp_Extloop(k,j);
+		add_out(V_out,k,j,g*acc*e);
+		if(k>1) W_out[k-1] += g*get_energy(k,j)*e;
+		if (!pk_free && (k == 1 || (tree.weakly_closed(1,k-1) && tree.weakly_closed(k,j)))){
+			add_out(WMB_out,k,j,g*acc*expPS_penalty);
+			if(k>1) W_out[k-1] += g*get_energy_WMB(k,j)*expPS_penalty;
+			count(G_PS,1,g*acc*get_energy_WMB(k,j)*expPS_penalty);
+		}
+	}
+	if(tables_->is_unpaired(j)) W_out[j-1] += g*scale[1];
+}
+
+/**
+ * fill_cell backwards
+*/
+template <typename T>
+template <bool pk>
+void W_final_pf<T>::outside_cell(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+	outside_WM<pk>(i,j);
+	outside_WMv_WMp<pk>(i,j);
+	if constexpr (pk) outside_pk(i,j,tree);
+	const bool restricted = tables_->is_forced(i) || tables_->is_forced(j);
+	if(tables_->ptype(i,j) > 0 && tree.weakly_closed(i,j) && !restricted) outside_V<pk>(i,j);
+}
+
+template <typename T>
+template <bool pk>
+void W_final_pf<T>::outside_V(cand_pos_t i, cand_pos_t j){
+	const fold_tables &ft = *tables_;
+	if(!((ft.is_free(i) && ft.is_free(j)) || ft.in_G(i,j))) return;
+	const T g = V_out[index[i]+j-i];
+
+	cand_pos_t max_k = std::min(j-TURN-2,i+MAXLOOP+1);
+	const cand_pos_t *up = ft.up.data();
+	const int ptype_closing = ft.ptype(i,j);
+	for ( cand_pos_t k=i+1; k<=max_k; ++k) {
+		cand_pos_t min_l=std::max(k+TURN+1 + MAXLOOP+2, k+j-i) - MAXLOOP-2;
+		if((up[k-1]>=(k-i-1))){
+			for (cand_pos_t l=j-1; l>=min_l; --l) {
+				if(up[j-1]>=(j-l-1)){
+					int u1 = k-i-1;
+					int u2 = j-l-1;
+					add_out(V_out,k,l,g*exp_E_IntLoop(u1,u2,ptype_closing,rtype[ft.ptype(k,l)],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],exp_params_)*scale[u1+u2+2]);
+				}
+			}
+		}
+	}
+
+	const T g_ml = g*scale[2]*exp_Mbloop(i,j)*exp_params_->expMLclosing;
+	for (cand_pos_t k = i+1; k <= j-3; ++k){
+		add_out(WM_out,i+1,k-1,g_ml*get_energy_WMv(k,j-1));
+		add_out(WMv_out,k,j-1,g_ml*get_energy_WM(i+1,k-1));
+		T closed = get_energy_WM(i+1,k-1)*get_energy_WMv(k,j-1);
+		if constexpr (pk){
+			add_out(WM_out,i+1,k-1,g_ml*get_energy_WMp(k,j-1));
+			add_out(WMp_out,k,j-1,g_ml*(get_energy_WM(i+1,k-1) + expMLbase[k-i-1]));
+			closed += (get_energy_WM(i+1,k-1) + expMLbase[k-i-1])*get_energy_WMp(k,j-1);
+			count(G_ML_base,k-i-1,g_ml*expMLbase[k-i-1]*get_energy_WMp(k,j-1));
+		}
+		// the closing pair is a stem of the multiloop too
+		count(G_ML_closing,1,g_ml*closed);
+		count(G_ML_intern,1,g_ml*closed);
+	}
+}
+
+template <typename T>
+template <bool pk>
+void W_final_pf<T>::outside_WMv_WMp(cand_pos_t i, cand_pos_t j){
+	if(j-i-1<TURN) return;
+	cand_pos_t ij = index[(i)]+(j)-(i);
+	cand_pos_t ijminus1 = index[(i)]+(j)-1-(i);
+
+	const T g_v = WMv_out[ij];
+	add_out(V_out,i,j,g_v*exp_MLstem(i,j));
+	count(G_ML_intern,1,g_v*exp_MLstem(i,j)*get_energy(i,j));
+	if (tables_->is_unpaired(j)){
+		WMv_out[ijminus1] += g_v*expMLbase[1];
+		count(G_ML_base,1,g_v*expMLbase[1]*get_energy_WMv(i,j-1));
+	}
+	if constexpr (pk){
+		const T g_p = WMp_out[ij];
+		add_out(WMB_out,i,j,g_p*expPSM_penalty*expb_penalty);
+		count(G_PSM,1,g_p*expPSM_penalty*expb_penalty*get_energy_WMB(i,j));
+		count(G_b,1,g_p*expPSM_penalty*expb_penalty*get_energy_WMB(i,j));
+		if (tables_->is_unpaired(j)){
+			WMp_out[ijminus1] += g_p*expMLbase[1];
+			count(G_ML_base,1,g_p*expMLbase[1]*get_energy_WMp(i,j-1));
+		}
+	}
+}
+
+template <typename T>
+template <bool pk>
+void W_final_pf<T>::outside_WM(cand_pos_t i, cand_pos_t j){
+	if(j-i+1<4) return;
+	cand_pos_t ij = index[(i)]+(j)-(i);
+	cand_pos_t ijminus1 = index[(i)]+(j)-1-(i);
+	const cand_pos_t *up = tables_->up.data();
+	const T g = WM_out[ij];
+
+	for (cand_pos_t k=i; k <= j -TURN-1; k++)
+	{
+		bool can_pair = up[k-1] >= (k-i);
+		pf_t ml = exp_MLstem(k,j);
+		T wm = get_energy_WM(i,k-1);
+		if(can_pair) add_out(V_out,k,j,g*expMLbase[k-i]*ml);
+		add_out(V_out,k,j,g*wm*ml);
+		add_out(WM_out,i,k-1,g*get_energy(k,j)*ml);
+		// the bases before the stem are unpaired, or the WM before it
+		const T before = can_pair ? wm + expMLbase[k-i] : wm;
+		count(G_ML_intern,1,g*before*get_energy(k,j)*ml);
+		if(can_pair) count(G_ML_base,k-i,g*expMLbase[k-i]*get_energy(k,j)*ml);
+		if constexpr (pk){
+			if(can_pair) add_out(WMB_out,k,j,g*expMLbase[k-i]*expPSM_penalty*expb_penalty);
+			add_out(WMB_out,k,j,g*wm*expPSM_penalty*expb_penalty);
+			add_out(WM_out,i,k-1,g*get_energy_WMB(k,j)*expPSM_penalty*expb_penalty);
+			const T wmb = g*get_energy_WMB(k,j)*expPSM_penalty*expb_penalty;
+			count(G_PSM,1,wmb*before);
+			count(G_b,1,wmb*before);
+			if(can_pair) count(G_ML_base,k-i,wmb*expMLbase[k-i]);
+		}
+	}
+	if (tables_->is_unpaired(j)){
+		WM_out[ijminus1] += g*expMLbase[1];
+		count(G_ML_base,1,g*expMLbase[1]*get_energy_WM(i,j-1));
+	}
+}
+
+/**
+ * compute_pk_energies backwards
+*/
+template <typename T>
+void W_final_pf<T>::outside_pk(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+	const fold_tables &ft = *tables_;
+	bool weakly_closed_ij = tree.weakly_closed(i,j);
+	const cand_pos_t pi = ft.partner(i), pj = ft.partner(j);
+
+	outside_BE(i,pi,pj,j,tree);
+
+	if(weakly_closed_ij){
+		outside_WIP(i,j);
+		outside_WI(i,j);
+	}
+	if (!((j-i-1) <= TURN || (pi >= -1 && pi > j) || (pj >= -1 && pj < i) || (pi >= -1 && pi < i ) || (pj >= -1 && j < pj))){
+		outside_WMB(i,j,tree);
+		outside_WMBP(i,j,tree);
+		outside_WMBW(i,j);
+	}
+	if (!(i == j || j-i<4 || weakly_closed_ij)){
+		if(ft.partner(j) < j) outside_VPR(i,j,tree);
+		if(ft.is_free(j)) outside_VPL(i,j,tree);
+		if(ft.ptype(i,j)>0 && ft.is_free(i) && ft.is_free(j)) outside_VP(i,j,tree);
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::outside_WI(cand_pos_t i, cand_pos_t j){
+	const T g = WI_out[index[i]+j-i];
+	if(i==j){
+		count(G_PUP,1,g*WI[index[i]]);
+		return;
+	}
+	add_out(V_out,i,j,g*expPPS_penalty);
+	add_out(WMB_out,i,j,g*expPSP_penalty*expPPS_penalty);
+	count(G_PPS,1,g*(get_energy(i,j)*expPPS_penalty + get_energy_WMB(i,j)*expPSP_penalty*expPPS_penalty));
+	count(G_PSP,1,g*get_energy_WMB(i,j)*expPSP_penalty*expPPS_penalty);
+	for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
+		T wi = get_energy_WI(i,k-1);
+		add_WI_out(i,k-1,g*(get_energy(k,j)*expPPS_penalty + get_energy_WMB(k,j)*expPSP_penalty*expPPS_penalty));
+		add_out(V_out,k,j,g*wi*expPPS_penalty);
+		add_out(WMB_out,k,j,g*wi*expPSP_penalty*expPPS_penalty);
+		count(G_PPS,1,g*wi*(get_energy(k,j)*expPPS_penalty + get_energy_WMB(k,j)*expPSP_penalty*expPPS_penalty));
+		count(G_PSP,1,g*wi*get_energy_WMB(k,j)*expPSP_penalty*expPPS_penalty);
+	}
+	if (tables_->is_unpaired(j)){
+		add_WI_out(i,j-1,g*expPUP_pen[1]);
+		count(G_PUP,1,g*expPUP_pen[1]*get_energy_WI(i,j-1));
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::outside_WIP(cand_pos_t i, cand_pos_t j){
+	const T g = WIP_out[index[i]+j-i];
+	add_out(V_out,i,j,g*expbp_penalty);
+	add_out(WMB_out,i,j,g*expbp_penalty*expPSM_penalty);
+	count(G_bp,1,g*(get_energy(i,j) + get_energy_WMB(i,j)*expPSM_penalty)*expbp_penalty);
+	count(G_PSM,1,g*get_energy_WMB(i,j)*expbp_penalty*expPSM_penalty);
+	const cand_pos_t *up = tables_->up.data();
+	for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
+		bool can_pair = up[k-1] >= (k-i);
+		T wip = get_energy_WIP(i,k-1);
+		add_out(WIP_out,i,k-1,g*(get_energy(k,j)*expbp_penalty + get_energy_WMB(k,j)*expb_penalty*expPSM_penalty));
+		add_out(V_out,k,j,g*wip*expbp_penalty);
+		add_out(WMB_out,k,j,g*wip*expb_penalty*expPSM_penalty);
+		count(G_bp,1,g*wip*get_energy(k,j)*expbp_penalty);
+		count(G_b,1,g*wip*get_energy_WMB(k,j)*expb_penalty*expPSM_penalty);
+		count(G_PSM,1,g*wip*get_energy_WMB(k,j)*expb_penalty*expPSM_penalty);
+		if(can_pair){
+			add_out(V_out,k,j,g*expcp_pen[k-i]*expbp_penalty);
+			add_out(WMB_out,k,j,g*expcp_pen[k-i]*expbp_penalty*expPSM_penalty);
+			const T cp = g*expcp_pen[k-i]*(get_energy(k,j) + get_energy_WMB(k,j)*expPSM_penalty)*expbp_penalty;
+			count(G_cp,k-i,cp);
+			count(G_bp,1,cp);
+			count(G_PSM,1,g*expcp_pen[k-i]*get_energy_WMB(k,j)*expbp_penalty*expPSM_penalty);
+		}
+	}
+	if (tables_->is_unpaired(j)){
+		add_out(WIP_out,i,j-1,g*expcp_pen[1]);
+		count(G_cp,1,g*expcp_pen[1]*get_energy_WIP(i,j-1));
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::outside_VPL(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+	const T g = VPL_out[index[i]+j-i];
+	cand_pos_t min_Bp_j = std::min((cand_pos_tu) tree.b(i,j), (cand_pos_tu) tree.Bp(i,j));
+	const cand_pos_t *up = tables_->up.data();
+	for(cand_pos_t k = i+1; k<min_Bp_j; ++k){
+		bool can_pair = up[k-1] >= (k-i);
+		if(can_pair){
+			add_out(VP_out,k,j,g*expcp_pen[k-i]);
+			count(G_cp,k-i,g*expcp_pen[k-i]*get_energy_VP(k,j));
+		}
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::outside_VPR(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+	const T g = VPR_out[index[i]+j-i];
+	cand_pos_t max_i_bp = std::max(tree.B(i,j),tree.bp(i,j));
+	const cand_pos_t up_j = tables_->up[j-1];
+	for(cand_pos_t k = max_i_bp+1; k<j; ++k){
+		bool can_pair = up_j >= (j-k);
+		add_out(VP_out,i,k,g*get_energy_WIP(k+1,j));
+		add_out(WIP_out,k+1,j,g*get_energy_VP(i,k));
+		if(can_pair){
+			add_out(VP_out,i,k,g*expcp_pen[k-i]);
+			count(G_cp,k-i,g*expcp_pen[k-i]*get_energy_VP(i,k));
+		}
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::outside_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+	const fold_tables &ft = *tables_;
+	const cand_pos_t *up = ft.up.data();
+	const T g = VP_out[index[i]+j-i];
+
+	cand_pos_t Bp_ij = tree.Bp(i,j);
+	cand_pos_t B_ij = tree.B(i,j);
+	cand_pos_t b_ij = tree.b(i,j);
+	cand_pos_t bp_ij = tree.bp(i,j);
+
+	const T g2 = g*scale[2];
+	if((ft.parent(i)) > 0 && (ft.parent(j)) < (ft.parent(i)) && Bp_ij >= 0 && B_ij >= 0 && bp_ij < 0){
+		add_WI_out(i+1,Bp_ij-1,g2*get_energy_WI(B_ij+1,j-1));
+		add_WI_out(B_ij+1,j-1,g2*get_energy_WI(i+1,Bp_ij-1));
+	}
+
+	if ((ft.parent(i)) < (ft.parent(j)) && (ft.parent(j)) > 0 && b_ij>= 0 && bp_ij >= 0 && Bp_ij < 0){
+		add_WI_out(i+1,b_ij-1,g2*get_energy_WI(bp_ij+1,j-1));
+		add_WI_out(bp_ij+1,j-1,g2*get_energy_WI(i+1,b_ij-1));
+	}
+
+	if((ft.parent(i)) > 0 && (ft.parent(j)) > 0 && Bp_ij >= 0 && B_ij >= 0  && b_ij >= 0 && bp_ij>= 0){
+		T wi1 = get_energy_WI(i+1,Bp_ij-1), wi2 = get_energy_WI(B_ij+1,b_ij-1), wi3 = get_energy_WI(bp_ij+1,j-1);
+		add_WI_out(i+1,Bp_ij-1,g2*wi2*wi3);
+		add_WI_out(B_ij+1,b_ij-1,g2*wi1*wi3);
+		add_WI_out(bp_ij+1,j-1,g2*wi1*wi2);
+	}
+
+	if(ft.is_free(i+1) && ft.is_free(j-1) && ft.ptype(i+1,j-1)>0){
+		add_out(VP_out,i+1,j-1,g2*get_e_stP(i,j));
+		if(!expected.empty() && i+1 < j-1) count(G_e_stP,stack_energy(i,j),g2*get_e_stP(i,j)*get_energy_VP(i+1,j-1));
+	}
+
+	cand_pos_t min_borders = std::min((cand_pos_tu) Bp_ij, (cand_pos_tu) b_ij);
+	cand_pos_t edge_i = std::min(i+MAXLOOP+1,j-TURN-1);
+	min_borders = std::min(min_borders,edge_i);
+	for (cand_pos_t k = i+1; k < min_borders; ++k){
+		if (ft.is_free(k) && (up[(k)-1] >= ((k)-(i)-1))){
+			cand_pos_t max_borders = std::max(bp_ij,B_ij)+1;
+			cand_pos_t edge_j = k+j-i-MAXLOOP-2;
+			max_borders = std::max(max_borders,edge_j);
+			for (cand_pos_t l = j-1; l > max_borders ; --l){
+				if(k==i+1 && l==j-1) continue;
+				if (ft.is_free(l) && ft.ptype(k,l)>0 && (up[(j)-1] >= ((j)-(l)-1))){
+					int u1 = k-i-1;
+					int u2 = j-l-1;
+					add_out(VP_out,k,l,g*get_e_intP(i,k,l,j)*scale[u1 + u2 + 2]);
+					if(!expected.empty()) count(G_e_intP,interior_energy(i,k,l,j),g*get_e_intP(i,k,l,j)*scale[u1 + u2 + 2]*get_energy_VP(k,l));
+				}
+			}
+		}
+	}
+
+	cand_pos_t min_Bp_j = std::min((cand_pos_tu) tree.b(i,j), (cand_pos_tu) tree.Bp(i,j));
+	cand_pos_t max_i_bp = std::max(tree.B(i,j),tree.bp(i,j));
+	const T g_band = g*exp_band;
+
+	for(cand_pos_t k = i+1; k<min_Bp_j; ++k){
+		T wip = get_energy_WIP(i+1,k-1);
+		add_out(WIP_out,i+1,k-1,g_band*(get_energy_VP(k,j-1) + get_energy_VPR(k,j-1)));
+		add_out(VP_out,k,j-1,g_band*wip);
+		add_out(VPR_out,k,j-1,g_band*wip);
+		count(G_ap,1,g_band*wip*(get_energy_VP(k,j-1) + get_energy_VPR(k,j-1)));
+		count(G_bp,2,g_band*wip*(get_energy_VP(k,j-1) + get_energy_VPR(k,j-1)));
+	}
+
+	for(cand_pos_t k = max_i_bp+1; k<j; ++k){
+		T wip = get_energy_WIP(k+1,j-1);
+		add_out(WIP_out,k+1,j-1,g_band*(get_energy_VP(i+1,k) + get_energy_VPL(i+1,k)));
+		add_out(VP_out,i+1,k,g_band*wip);
+		add_out(VPL_out,i+1,k,g_band*wip);
+		count(G_ap,1,g_band*wip*(get_energy_VP(i+1,k) + get_energy_VPL(i+1,k)));
+		count(G_bp,2,g_band*wip*(get_energy_VP(i+1,k) + get_energy_VPL(i+1,k)));
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::outside_WMBW(cand_pos_t i, cand_pos_t j){
+	if(tables_->partner(j) >= j) return;
+	const T g = WMBW_out[index[i]+j-i];
+	for(cand_pos_t l = i+1; l<j; l++){
+		if (tables_->is_unpaired(l) && tables_->parent(l) > -1 && tables_->parent(j) > -1 && tables_->parent(j) == tables_->parent(l)){
+			add_out(WMBP_out,i,l,g*get_energy_WI(l+1,j));
+			add_WI_out(l+1,j,g*get_energy_WMBP(i,l));
+		}
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::outside_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+	const fold_tables &ft = *tables_;
+	const T g = WMBP_out[index[i]+j-i];
+	const T g_pb = g*expPB2;
+
+	if (ft.is_unpaired(j)){
+		cand_pos_t b_ij = tree.b(i,j);
+		for (cand_pos_t l = i+1; l<j ; l++)	{
+			cand_pos_t bp_il = tree.bp(i,l);
+			cand_pos_t Bp_lj = tree.Bp(l,j);
+			if(b_ij > 0 && l < b_ij && bp_il >= 0 && l>bp_il && Bp_lj > 0 && l<Bp_lj){
+				cand_pos_t B_lj = tree.B(l,j);
+				if (i <= ft.parent(l) && ft.parent(l) < j && l+TURN <=j){
+					cand_pos_t e = BE_read(ft.partner(B_lj),B_lj,ft.partner(Bp_lj),Bp_lj,i,j);
+					T be = BE_at(e), vp = get_energy_VP(l,j);
+					T wmbp = get_energy_WMBP(i,l-1), wmbw = get_energy_WMBW(i,l-1);
+					add_BE_out(e,g_pb*(wmbp + wmbw)*vp);
+					add_out(WMBP_out,i,l-1,g_pb*be*vp);
+					add_out(WMBW_out,i,l-1,g_pb*be*vp);
+					add_out(VP_out,l,j,g_pb*be*(wmbp + wmbw));
+					count(G_PB,2,g_pb*be*(wmbp + wmbw)*vp);
+				}
+			}
+		}
+	}
+
+	add_out(VP_out,i,j,g*expPB_penalty);
+	count(G_PB,1,g*expPB_penalty*get_energy_VP(i,j));
+
+	if(ft.is_unpaired(j) && ft.is_paired(i)){
+		cand_pos_t b_ij = tree.b(i,j);
+		for (cand_pos_t l = i+1; l < j; l++){
+			cand_pos_t bp_il = tree.bp(i,l);
+			if(b_ij>0 && l<b_ij && bp_il >= 0 && bp_il < n && l+TURN <= j){
+				if (i <= ft.parent(l) && ft.parent(l) < j && l+TURN <=j){
+					cand_pos_t e = BE_read(i,ft.partner(i),bp_il,ft.partner(bp_il),i,j);
+					T be = BE_at(e), wi = get_energy_WI(bp_il+1,l-1), vp = get_energy_VP(l,j);
+					add_BE_out(e,g_pb*wi*vp);
+					add_WI_out(bp_il+1,l-1,g_pb*be*vp);
+					add_out(VP_out,l,j,g_pb*be*wi);
+					count(G_PB,2,g_pb*be*wi*vp);
+				}
+			}
+		}
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::outside_WMB(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+	if (i == j) return;
+	const fold_tables &ft = *tables_;
+	const T g = WMB_out[index[i]+j-i];
+	if (ft.partner(j) >= 0 && j > ft.partner(j)){
+		cand_pos_t bp_j = ft.partner(j);
+		for (cand_pos_t l = (bp_j +1); (l < j); l++){
+			if(ft.partner(l)>0) continue;
+			cand_pos_t Bp_lj = tree.Bp(l,j);
+			if (Bp_lj >= 0 && Bp_lj<n){
+				cand_pos_t e = BE_read(bp_j,j,ft.partner(Bp_lj),Bp_lj,i,j);
+				T be = BE_at(e), wmbp = get_energy_WMBP(i,l), wi = get_energy_WI(l+1,Bp_lj-1);
+				const T g_pb = g*expPB_penalty;
+				add_BE_out(e,g_pb*wmbp*wi);
+				add_out(WMBP_out,i,l,g_pb*be*wi);
+				add_WI_out(l+1,Bp_lj-1,g_pb*be*wmbp);
+				count(G_PB,1,g_pb*be*wmbp*wi);
+			}
+		}
+	}
+	add_out(WMBP_out,i,j,g);
+}
+
+template <typename T>
+void W_final_pf<T>::outside_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree){
+	const fold_tables &ft = *tables_;
+	cand_pos_t iip = BE_written(i,j,ip,jp);
+	// the base cases have no cell under them
+	if (iip < 0 || ft.partner(i) != j || ft.partner(ip) != jp || (i == ip && j == jp)) return;
+	const cand_pos_t *up = ft.up.data();
+	const T g = BE_out[iip];
+
+	if (ft.partner(i+1) == j-1){
+		cand_pos_t e = BE_read(i+1,j-1,ip,jp,i,jp);
+		add_BE_out(e,g*get_e_stP(i,j)*scale[2]);
+		if(!expected.empty() && i+1 < j-1) count(G_e_stP,stack_energy(i,j),g*get_e_stP(i,j)*scale[2]*BE_at(e));
+	}
+
+	for (cand_pos_t l = i+1; l<= ip ; l++){
+		if (ft.partner(l) >= -1 && jp <= ft.partner(l) && ft.partner(l) < j){
+			cand_pos_t lp = ft.partner(l);
+
+			bool empty_region_il = (up[(l)-1] >= l-i-1);
+			bool empty_region_lpj = (up[(j)-1] >= j-lp-1);
+			bool weakly_closed_il = tree.weakly_closed(i+1,l-1);
+			bool weakly_closed_lpj = tree.weakly_closed(lp+1,j-1);
+
+			cand_pos_t e = BE_read(l,lp,ip,jp,i,jp);
+			T be = BE_at(e), wip_il = get_energy_WIP(i+1,l-1), wip_lpj = get_energy_WIP(lp+1,j-1);
+			if (empty_region_il && empty_region_lpj){
+				int u1 = l-i-1;
+				int u2 = j-lp-1;
+				add_BE_out(e,g*exp_intP_G[index[i]+l-i]*scale[u1+u2+2]);
+				if(!expected.empty() && u1+u2 > 0) count(G_e_intP,interior_energy(i,l,lp,j),g*exp_intP_G[index[i]+l-i]*scale[u1+u2+2]*be);
+			}
+			if (weakly_closed_il && weakly_closed_lpj){
+				const T g_band = g*exp_band;
+				add_BE_out(e,g_band*wip_il*wip_lpj);
+				add_out(WIP_out,i+1,l-1,g_band*be*wip_lpj);
+				add_out(WIP_out,lp+1,j-1,g_band*wip_il*be);
+				count(G_ap,1,g_band*wip_il*be*wip_lpj);
+				count(G_bp,2,g_band*wip_il*be*wip_lpj);
+			}
+			if (weakly_closed_il && empty_region_lpj){
+				const T g_band = g*expcp_pen[j-lp+1]*exp_band;
+				add_BE_out(e,g_band*wip_il);
+				add_out(WIP_out,i+1,l-1,g_band*be);
+				count(G_ap,1,g_band*wip_il*be);
+				count(G_bp,2,g_band*wip_il*be);
+				count(G_cp,j-lp+1,g_band*wip_il*be);
+			}
+			if (empty_region_il && weakly_closed_lpj){
+				const T g_band = g*expcp_pen[l-i+1]*exp_band;
+				add_BE_out(e,g_band*wip_lpj);
+				add_out(WIP_out,lp+1,j-1,g_band*be);
+				count(G_ap,1,g_band*be*wip_lpj);
+				count(G_bp,2,g_band*be*wip_lpj);
+				count(G_cp,l-i+1,g_band*be*wip_lpj);
+			}
+		}
+	}
+}
+
+/**
+ * Draws structures from the filled matrices. A cell is expanded by picking one of the terms of its sum with a probability
+ * proportional to the term, and then expanding the cells of that term, starting from W(n). The pairs of G are in every
+ * structure, the pairs closing a V are added as () and those of a VP as [] as in the MFE structure.
+ * In the non-redundant mode every choice with more than one term is a node of a tree of the choices made, which keeps the
+ * probability of the structures drawn through it. A term then has its probability less what was drawn through it.
+*/
+template <typename T>
+void W_final_pf<T>::sample(sparse_tree &tree, int count, bool non_redundant, uint64_t seed, const std::function<void(const std::string &, double)> &out){
+	if(non_redundant){
+		std::mt19937_64 random(seed);
+		sample_node root;
+		std::string structure;
+		int drawn = 0, missed = 0;
+		// a miss is a choice that only had rounding left in it, it is taken out of the tree so it is not made again
+		while(drawn < count && root.drawn < 1-1e-12 && missed < 1000){
+			double probability = draw(tree,random,&root,structure);
+			if(probability < 0){
+				++missed;
+				continue;
+			}
+			out(structure,probability);
+			++drawn;
+			missed = 0;
+		}
+		return;
+	}
+
+	// sample k is drawn with random numbers seeded by seed and k, and the threads draw a round of blocks at a time that is
+	// handed over in order, so the same seed gives the same structures whatever the number of threads
+	const int block = 64;
+	std::vector<std::pair<std::string,double> > drawn;
+	for(int first = 0; first < count; first += block*threads){
+		int last = std::min(count,first + block*threads);
+		drawn.assign(last-first,std::pair<std::string,double>());
+		parallel_for(threads,threads,[&](int t){
+			for(int k = first + t; k < last; k += threads){
+				std::seed_seq seeds{seed,(uint64_t) k};
+				std::mt19937_64 random(seeds);
+				drawn[k-first].second = draw(tree,random,nullptr,drawn[k-first].first);
+			}
+		});
+		for(auto &s : drawn) out(s.first,s.second);
+	}
+}
+
+template <typename T>
+double W_final_pf<T>::draw(sparse_tree &tree, std::mt19937_64 &random, sample_node *root, std::string &structure){
+	std::uniform_real_distribution<double> uniform(0,1);
+	structure.assign(n,'.');
+	for(cand_pos_t k = 1; k <= n; ++k){
+		if(tables_->partner(k) > k){
+			structure[k-1] = '(';
+			structure[tables_->partner(k)-1] = ')';
+		}
+	}
+
+	std::vector<pf_cell> cells;
+	if(n > TURN) cells.push_back({PF_W,0,n});
+	std::vector<pf_term> options;
+	std::vector<double> weights;
+	std::vector<sample_node *> path;
+	sample_node *node = root;
+	double probability = 1;
+	while(!cells.empty()){
+		pf_cell c = cells.back();
+		cells.pop_back();
+		if(c.type == PF_V){
+			structure[c.i-1] = '(';
+			structure[c.j-1] = ')';
+		}
+		else if(c.type == PF_VP){
+			structure[c.i-1] = '[';
+			structure[c.j-1] = ']';
+		}
+		options.clear();
+		terms(c,tree,options);
+		if(options.empty()) continue;
+
+		T total = 0;
+		for(const pf_term &term : options) total += term.weight;
+		weights.resize(options.size());
+		int choices = 0;
+		for(size_t k = 0; k < options.size(); ++k){
+			weights[k] = static_cast<double>(options[k].weight/total);
+			if(weights[k] > 0) ++choices;
+		}
+		// a cell with a single term is not a choice, it does not need a node
+		const bool node_choice = root && choices > 1;
+		if(node_choice){
+			for(size_t k = 0; k < options.size(); ++k){
+				auto below = node->below.find(k);
+				double left = weights[k]*probability - (below == node->below.end() ? 0 : below->second->drawn);
+				weights[k] = left > 1e-12*probability ? left : 0;
+			}
+		}
+		double sum = 0;
+		for(double w : weights) sum += w;
+		if(sum <= 0 && root){
+			// nothing but rounding is left below this choice, so it is counted as drawn
+			double rest = probability - node->drawn;
+			root->drawn += rest;
+			for(sample_node *above : path) above->drawn += rest;
+			return -1;
+		}
+		double r = uniform(random)*sum;
+		size_t chosen = 0;
+		for(size_t k = 0; k < options.size(); ++k){
+			if(weights[k] <= 0) continue;
+			chosen = k;
+			r -= weights[k];
+			if(r < 0) break;
+		}
+		probability *= static_cast<double>(options[chosen].weight/total);
+		if(node_choice){
+			std::unique_ptr<sample_node> &below = node->below[chosen];
+			if(!below) below.reset(new sample_node());
+			node = below.get();
+			path.push_back(node);
+		}
+		for(int k = 0; k < options[chosen].count; ++k) cells.push_back(options[chosen].cells[k]);
+	}
+
+	if(root){
+		root->drawn += probability;
+		for(sample_node *below : path) below->drawn += probability;
+	}
+	return probability;
+}
+
+template <typename T>
+void W_final_pf<T>::add_term(std::vector<pf_term> &out, const T &weight, std::initializer_list<pf_cell> cells){
+	pf_term term;
+	term.weight = weight;
+	term.count = 0;
+	for(const pf_cell &c : cells){
+		// W up to TURN is all unpaired, WI(i,i-1) is the empty region, and the other matrices are 0 below the diagonal
+		if(c.type == PF_W ? c.j <= TURN : c.type == PF_BE ? false : c.type == PF_WI ? c.i > c.j : c.i >= c.j) continue;
+		term.cells[term.count++] = c;
+	}
+	out.push_back(term);
+}
+
+template <typename T>
+void W_final_pf<T>::terms(const pf_cell &c, sparse_tree &tree, std::vector<pf_term> &out){
+	const cand_pos_t i = c.i, j = c.j;
+	switch(c.type){
+		case PF_W: terms_exterior(j,tree,out); break;
+		case PF_V: terms_V(i,j,out); break;
+		case PF_WM: terms_WM(i,j,out); break;
+		case PF_WMv:
+			add_term(out,get_energy(i,j)*exp_MLstem(i,j),{{PF_V,i,j}});
+			if (tables_->is_unpaired(j)) add_term(out,get_energy_WMv(i,j-1)*expMLbase[1],{{PF_WMv,i,j-1}});
+			break;
+		case PF_WMp:
+			add_term(out,get_energy_WMB(i,j)*expPSM_penalty*expb_penalty,{{PF_WMB,i,j}});
+			if (tables_->is_unpaired(j)) add_term(out,get_energy_WMp(i,j-1)*expMLbase[1],{{PF_WMp,i,j-1}});
+			break;
+		case PF_WI: terms_WI(i,j,out); break;
+		case PF_WIP: terms_WIP(i,j,out); break;
+		case PF_VP: terms_VP(i,j,tree,out); break;
+		case PF_VPL: terms_VPL(i,j,tree,out); break;
+		case PF_VPR: terms_VPR(i,j,tree,out); break;
+		case PF_WMB: terms_WMB(i,j,tree,out); break;
+		case PF_WMBP: terms_WMBP(i,j,tree,out); break;
+		case PF_WMBW: terms_WMBW(i,j,out); break;
+		case PF_BE: terms_BE(i,j,tree,out); break;
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::terms_exterior(cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out){
+	for (cand_pos_t k=1; k<=j-TURN-1; ++k){
+		T acc = (k>1) ? W[k-1]: 1;
+		add_term(out,acc*get_energy(k,j)*exp_Extloop(k,j),{{PF_V,k,j},{PF_W,0,k-1}});
+		if (!pk_free && (k == 1 || (tree.weakly_closed(1,k-1) && tree.weakly_closed(k,j)))) add_term(out,acc*get_energy_WMB(k,j)*expPS_penalty,{{PF_WMB,k,j},{PF_W,0,k-1}});
+	}
+	if(tables_->is_unpaired(j)) add_term(out,W[j-1]*scale[1],{{PF_W,0,j-1}});
+}
+
+template <typename T>
+void W_final_pf<T>::terms_V(cand_pos_t i, cand_pos_t j, std::vector<pf_term> &out){
+	const fold_tables &ft = *tables_;
+	bool canH = !(ft.up[j-1]<(j-i-1));
+	if(canH) add_term(out,HairpinE(i,j),{});
+
+	cand_pos_t max_k = std::min(j-TURN-2,i+MAXLOOP+1);
+	const cand_pos_t *up = ft.up.data();
+	const int ptype_closing = ft.ptype(i,j);
+	for ( cand_pos_t k=i+1; k<=max_k; ++k) {
+		cand_pos_t min_l=std::max(k+TURN+1 + MAXLOOP+2, k+j-i) - MAXLOOP-2;
+		if((up[k-1]>=(k-i-1))){
+			for (cand_pos_t l=j-1; l>=min_l; --l) {
+				if(up[j-1]>=(j-l-1)){
+					int u1 = k-i-1;
+					int u2 = j-l-1;
+					add_term(out,exp_E_IntLoop(u1,u2,ptype_closing,rtype[ft.ptype(k,l)],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],exp_params_)*get_energy(k,l)*scale[u1+u2+2],{{PF_V,k,l}});
+				}
+			}
+		}
+	}
+
+	const T closing = exp_Mbloop(i,j)*exp_params_->expMLclosing*scale[2];
+	for (cand_pos_t k = i+1; k <= j-3; ++k){
+		add_term(out,get_energy_WM(i+1,k-1)*get_energy_WMv(k,j-1)*closing,{{PF_WM,i+1,k-1},{PF_WMv,k,j-1}});
+		if (!pk_free){
+			add_term(out,get_energy_WM(i+1,k-1)*get_energy_WMp(k,j-1)*closing,{{PF_WM,i+1,k-1},{PF_WMp,k,j-1}});
+			add_term(out,expMLbase[k-i-1]*get_energy_WMp(k,j-1)*closing,{{PF_WMp,k,j-1}});
+		}
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::terms_WM(cand_pos_t i, cand_pos_t j, std::vector<pf_term> &out){
+	const cand_pos_t *up = tables_->up.data();
+	for (cand_pos_t k=i; k <= j -TURN-1; k++)
+	{
+		bool can_pair = up[k-1] >= (k-i);
+		if(can_pair) add_term(out,expMLbase[k-i]*get_energy(k,j)*exp_MLstem(k,j),{{PF_V,k,j}});
+		if(!pk_free && can_pair) add_term(out,expMLbase[k-i]*get_energy_WMB(k,j)*expPSM_penalty*expb_penalty,{{PF_WMB,k,j}});
+		add_term(out,get_energy_WM(i,k-1)*get_energy(k,j)*exp_MLstem(k,j),{{PF_WM,i,k-1},{PF_V,k,j}});
+		if(!pk_free) add_term(out,get_energy_WM(i,k-1)*get_energy_WMB(k,j)*expPSM_penalty*expb_penalty,{{PF_WM,i,k-1},{PF_WMB,k,j}});
+	}
+	if (tables_->is_unpaired(j)) add_term(out,get_energy_WM(i,j-1)*expMLbase[1],{{PF_WM,i,j-1}});
+}
+
+template <typename T>
+void W_final_pf<T>::terms_WI(cand_pos_t i, cand_pos_t j, std::vector<pf_term> &out){
+	if(i==j) return;
+	add_term(out,get_energy(i,j)*expPPS_penalty,{{PF_V,i,j}});
+	add_term(out,get_energy_WMB(i,j)*expPSP_penalty*expPPS_penalty,{{PF_WMB,i,j}});
+	for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
+		add_term(out,get_energy_WI(i,k-1)*get_energy(k,j)*expPPS_penalty,{{PF_WI,i,k-1},{PF_V,k,j}});
+		add_term(out,get_energy_WI(i,k-1)*get_energy_WMB(k,j)*expPSP_penalty*expPPS_penalty,{{PF_WI,i,k-1},{PF_WMB,k,j}});
+	}
+	if (tables_->is_unpaired(j)) add_term(out,get_energy_WI(i,j-1)*expPUP_pen[1],{{PF_WI,i,j-1}});
+}
+
+template <typename T>
+void W_final_pf<T>::terms_WIP(cand_pos_t i, cand_pos_t j, std::vector<pf_term> &out){
+	add_term(out,get_energy(i,j)*expbp_penalty,{{PF_V,i,j}});
+	add_term(out,get_energy_WMB(i,j)*expbp_penalty*expPSM_penalty,{{PF_WMB,i,j}});
+	const cand_pos_t *up = tables_->up.data();
+	for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
+		bool can_pair = up[k-1] >= (k-i);
+		add_term(out,get_energy_WIP(i,k-1)*get_energy(k,j)*expbp_penalty,{{PF_WIP,i,k-1},{PF_V,k,j}});
+		add_term(out,get_energy_WIP(i,k-1)*get_energy_WMB(k,j)*expb_penalty*expPSM_penalty,{{PF_WIP,i,k-1},{PF_WMB,k,j}});
+		if(can_pair) add_term(out,expcp_pen[k-i]*get_energy(k,j)*expbp_penalty,{{PF_V,k,j}});
+		if(can_pair) add_term(out,expcp_pen[k-i]*get_energy_WMB(k,j)*expbp_penalty*expPSM_penalty,{{PF_WMB,k,j}});
+	}
+	if (tables_->is_unpaired(j)) add_term(out,get_energy_WIP(i,j-1)*expcp_pen[1],{{PF_WIP,i,j-1}});
+}
+
+template <typename T>
+void W_final_pf<T>::terms_VPL(cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out){
+	cand_pos_t min_Bp_j = std::min((cand_pos_tu) tree.b(i,j), (cand_pos_tu) tree.Bp(i,j));
+	const cand_pos_t *up = tables_->up.data();
+	for(cand_pos_t k = i+1; k<min_Bp_j; ++k){
+		bool can_pair = up[k-1] >= (k-i);
+		if(can_pair) add_term(out,expcp_pen[k-i]*get_energy_VP(k,j),{{PF_VP,k,j}});
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::terms_VPR(cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out){
+	cand_pos_t max_i_bp = std::max(tree.B(i,j),tree.bp(i,j));
+	const cand_pos_t up_j = tables_->up[j-1];
+	for(cand_pos_t k = max_i_bp+1; k<j; ++k){
+		bool can_pair = up_j >= (j-k);
+		add_term(out,get_energy_VP(i,k)*get_energy_WIP(k+1,j),{{PF_VP,i,k},{PF_WIP,k+1,j}});
+		if(can_pair) add_term(out,get_energy_VP(i,k)*expcp_pen[k-i],{{PF_VP,i,k}});
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::terms_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out){
+	const fold_tables &ft = *tables_;
+	const cand_pos_t *up = ft.up.data();
+
+	cand_pos_t Bp_ij = tree.Bp(i,j);
+	cand_pos_t B_ij = tree.B(i,j);
+	cand_pos_t b_ij = tree.b(i,j);
+	cand_pos_t bp_ij = tree.bp(i,j);
+
+	if((ft.parent(i)) > 0 && (ft.parent(j)) < (ft.parent(i)) && Bp_ij >= 0 && B_ij >= 0 && bp_ij < 0)
+		add_term(out,get_energy_WI(i+1,Bp_ij-1)*get_energy_WI(B_ij+1,j-1)*scale[2],{{PF_WI,i+1,Bp_ij-1},{PF_WI,B_ij+1,j-1}});
+
+	if ((ft.parent(i)) < (ft.parent(j)) && (ft.parent(j)) > 0 && b_ij>= 0 && bp_ij >= 0 && Bp_ij < 0)
+		add_term(out,get_energy_WI(i+1,b_ij-1)*get_energy_WI(bp_ij+1,j-1)*scale[2],{{PF_WI,i+1,b_ij-1},{PF_WI,bp_ij+1,j-1}});
+
+	if((ft.parent(i)) > 0 && (ft.parent(j)) > 0 && Bp_ij >= 0 && B_ij >= 0  && b_ij >= 0 && bp_ij>= 0)
+		add_term(out,get_energy_WI(i+1,Bp_ij-1)*get_energy_WI(B_ij+1,b_ij-1)*get_energy_WI(bp_ij+1,j-1)*scale[2],{{PF_WI,i+1,Bp_ij-1},{PF_WI,B_ij+1,b_ij-1},{PF_WI,bp_ij+1,j-1}});
+
+	if(ft.is_free(i+1) && ft.is_free(j-1) && ft.ptype(i+1,j-1)>0) add_term(out,get_e_stP(i,j)*get_energy_VP(i+1,j-1)*scale[2],{{PF_VP,i+1,j-1}});
+
+	cand_pos_t min_borders = std::min((cand_pos_tu) Bp_ij, (cand_pos_tu) b_ij);
+	cand_pos_t edge_i = std::min(i+MAXLOOP+1,j-TURN-1);
+	min_borders = std::min(min_borders,edge_i);
+	for (cand_pos_t k = i+1; k < min_borders; ++k){
+		if (ft.is_free(k) && (up[(k)-1] >= ((k)-(i)-1))){
+			cand_pos_t max_borders = std::max(bp_ij,B_ij)+1;
+			cand_pos_t edge_j = k+j-i-MAXLOOP-2;
+			max_borders = std::max(max_borders,edge_j);
+			for (cand_pos_t l = j-1; l > max_borders ; --l){
+				if(k==i+1 && l==j-1) continue;
+				if (ft.is_free(l) && ft.ptype(k,l)>0 && (up[(j)-1] >= ((j)-(l)-1))){
+					int u1 = k-i-1;
+					int u2 = j-l-1;
+					add_term(out,get_e_intP(i,k,l,j)*get_energy_VP(k,l)*scale[u1 + u2 + 2],{{PF_VP,k,l}});
+				}
+			}
+		}
+	}
+
+	cand_pos_t min_Bp_j = std::min((cand_pos_tu) tree.b(i,j), (cand_pos_tu) tree.Bp(i,j));
+	cand_pos_t max_i_bp = std::max(tree.B(i,j),tree.bp(i,j));
+	const T band = exp_band;
+
+	for(cand_pos_t k = i+1; k<min_Bp_j; ++k){
+		add_term(out,get_energy_WIP(i+1,k-1)*get_energy_VP(k,j-1)*band,{{PF_WIP,i+1,k-1},{PF_VP,k,j-1}});
+		add_term(out,get_energy_WIP(i+1,k-1)*get_energy_VPR(k,j-1)*band,{{PF_WIP,i+1,k-1},{PF_VPR,k,j-1}});
+	}
+	for(cand_pos_t k = max_i_bp+1; k<j; ++k){
+		add_term(out,get_energy_VP(i+1,k)*get_energy_WIP(k+1,j-1)*band,{{PF_VP,i+1,k},{PF_WIP,k+1,j-1}});
+		add_term(out,get_energy_VPL(i+1,k)*get_energy_WIP(k+1,j-1)*band,{{PF_VPL,i+1,k},{PF_WIP,k+1,j-1}});
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::terms_WMBW(cand_pos_t i, cand_pos_t j, std::vector<pf_term> &out){
+	if(tables_->partner(j) >= j) return;
+	for(cand_pos_t l = i+1; l<j; l++){
+		if (tables_->is_unpaired(l) && tables_->parent(l) > -1 && tables_->parent(j) > -1 && tables_->parent(j) == tables_->parent(l))
+			add_term(out,get_energy_WMBP(i,l)*get_energy_WI(l+1,j),{{PF_WMBP,i,l},{PF_WI,l+1,j}});
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::terms_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out){
+	const fold_tables &ft = *tables_;
+	const pf_t band = expPB2;
+
+	if (ft.is_unpaired(j)){
+		cand_pos_t b_ij = tree.b(i,j);
+		for (cand_pos_t l = i+1; l<j ; l++)	{
+			cand_pos_t bp_il = tree.bp(i,l);
+			cand_pos_t Bp_lj = tree.Bp(l,j);
+			if(b_ij > 0 && l < b_ij && bp_il >= 0 && l>bp_il && Bp_lj > 0 && l<Bp_lj){
+				cand_pos_t B_lj = tree.B(l,j);
+				if (i <= ft.parent(l) && ft.parent(l) < j && l+TURN <=j){
+					T be = BE_at(BE_read(ft.partner(B_lj),B_lj,ft.partner(Bp_lj),Bp_lj,i,j));
+					pf_cell band_cell = {PF_BE,ft.partner(B_lj),ft.partner(Bp_lj)};
+					add_term(out,be*get_energy_WMBP(i,l-1)*get_energy_VP(l,j)*band,{band_cell,{PF_WMBP,i,l-1},{PF_VP,l,j}});
+					add_term(out,be*get_energy_WMBW(i,l-1)*get_energy_VP(l,j)*band,{band_cell,{PF_WMBW,i,l-1},{PF_VP,l,j}});
+				}
+			}
+		}
+	}
+
+	add_term(out,get_energy_VP(i,j)*expPB_penalty,{{PF_VP,i,j}});
+
+	if(ft.is_unpaired(j) && ft.is_paired(i)){
+		cand_pos_t b_ij = tree.b(i,j);
+		for (cand_pos_t l = i+1; l < j; l++){
+			cand_pos_t bp_il = tree.bp(i,l);
+			if(b_ij>0 && l<b_ij && bp_il >= 0 && bp_il < n && l+TURN <= j){
+				if (i <= ft.parent(l) && ft.parent(l) < j && l+TURN <=j){
+					T be = BE_at(BE_read(i,ft.partner(i),bp_il,ft.partner(bp_il),i,j));
+					add_term(out,be*get_energy_WI(bp_il+1,l-1)*get_energy_VP(l,j)*band,{{PF_BE,i,bp_il},{PF_WI,bp_il+1,l-1},{PF_VP,l,j}});
+				}
+			}
+		}
+	}
+}
+
+template <typename T>
+void W_final_pf<T>::terms_WMB(cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out){
+	const fold_tables &ft = *tables_;
+	if (ft.partner(j) >= 0 && j > ft.partner(j)){
+		cand_pos_t bp_j = ft.partner(j);
+		for (cand_pos_t l = (bp_j +1); (l < j); l++){
+			if(ft.partner(l)>0) continue;
+			cand_pos_t Bp_lj = tree.Bp(l,j);
+			if (Bp_lj >= 0 && Bp_lj<n){
+				T be = BE_at(BE_read(bp_j,j,ft.partner(Bp_lj),Bp_lj,i,j));
+				add_term(out,be*get_energy_WMBP(i,l)*get_energy_WI(l+1,Bp_lj-1)*expPB_penalty,{{PF_BE,bp_j,ft.partner(Bp_lj)},{PF_WMBP,i,l},{PF_WI,l+1,Bp_lj-1}});
+			}
+		}
+	}
+	add_term(out,get_energy_WMBP(i,j),{{PF_WMBP,i,j}});
+}
+
+template <typename T>
+void W_final_pf<T>::terms_BE(cand_pos_t i, cand_pos_t ip, sparse_tree &tree, std::vector<pf_term> &out){
+	const fold_tables &ft = *tables_;
+	const cand_pos_t j = ft.partner(i), jp = ft.partner(ip);
+	if (BE_written(i,j,ip,jp) < 0 || i == ip) return;
+	const cand_pos_t *up = ft.up.data();
+
+	if (ft.partner(i+1) == j-1) add_term(out,get_e_stP(i,j)*BE_at(BE_read(i+1,j-1,ip,jp,i,jp))*scale[2],{{PF_BE,i+1,ip}});
+
+	for (cand_pos_t l = i+1; l<= ip ; l++){
+		if (ft.partner(l) >= -1 && jp <= ft.partner(l) && ft.partner(l) < j){
+			cand_pos_t lp = ft.partner(l);
+
+			bool empty_region_il = (up[(l)-1] >= l-i-1);
+			bool empty_region_lpj = (up[(j)-1] >= j-lp-1);
+			bool weakly_closed_il = tree.weakly_closed(i+1,l-1);
+			bool weakly_closed_lpj = tree.weakly_closed(lp+1,j-1);
+
+			T be = BE_at(BE_read(l,lp,ip,jp,i,jp));
+			const pf_cell band_cell = {PF_BE,l,ip};
+			if (empty_region_il && empty_region_lpj){
+				int u1 = l-i-1;
+				int u2 = j-lp-1;
+				add_term(out,exp_intP_G[index[i]+l-i]*be*scale[u1+u2+2],{band_cell});
+			}
+			if (weakly_closed_il && weakly_closed_lpj)
+				add_term(out,get_energy_WIP(i+1,l-1)*be*get_energy_WIP(lp+1,j-1)*exp_band,{{PF_WIP,i+1,l-1},band_cell,{PF_WIP,lp+1,j-1}});
+			if (weakly_closed_il && empty_region_lpj)
+				add_term(out,get_energy_WIP(i+1,l-1)*be*expcp_pen[j-lp+1]*exp_band,{{PF_WIP,i+1,l-1},band_cell});
+			if (empty_region_il && weakly_closed_lpj)
+				add_term(out,expcp_pen[l-i+1]*be*get_energy_WIP(lp+1,j-1)*exp_band,{band_cell,{PF_WIP,lp+1,j-1}});
+		}
+	}
+}
 
+template class W_final_pf<pf_t>;
+template class W_final_pf<ext_pf>;
+template class W_final_pf<float>;
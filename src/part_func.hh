@@ -2,8 +2,17 @@
 #define PART_FUNC
 #include "base_types.hh"
 #include "sparse_tree.hh"
+#include "fold_tables.hh"
+#include "ext_pf.hh"
+#include "pf_kernels.hh"
 #include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <random>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 extern "C" {
@@ -13,7 +22,12 @@ extern "C" {
 #include "ViennaRNA/params/default.h"
 }
 
+class W_final;
+struct loop_record;
 
+// T is the type of the Boltzmann weights in the matrices: pf_t, float for half the memory when the scaled weights stay in
+// its range (see in_range), or ext_pf when the sums could leave the range of a double
+template <typename T>
 class W_final_pf{
 
     public:
@@ -23,27 +37,65 @@ class W_final_pf{
         ~W_final_pf ();
         // The destructor
 
-        double hfold_pf (sparse_tree &tree);
+        double hfold_pf (sparse_tree &tree, const fold_tables &tables);
+
+        // Incremental folding, see W_final::refold. The cells are only kept when energy is the one of the last fold,
+        // a new pf_scale changes every cell so everything is filled again.
+        double refold_pf (const std::string &res, double energy);
+        double add_pair (cand_pos_t i, cand_pos_t j);
+        double remove_pair (cand_pos_t i, cand_pos_t j);
+        // point mutations with the same constraint and pf_scale, see W_final::mutate
+        double mutate (const std::string &seq);
+
+        // Co-transcriptional folding, see W_final::cotranscriptional: out gets the length and ensemble energy of every prefix
+        void cotranscriptional (sparse_tree &tree, const fold_tables &tables, const std::function<void(cand_pos_t, double)> &out);
+
+        // Base pair probabilities of the last fold, from an outside pass over the same recurrences. Writes "i j p p_pk" for
+        // every pair with a probability p of at least cutoff, p_pk being the part of p where the pair is pseudoknotted
+        // (a pair of VP, or a pair of G that is not closing a loop of V). Positions are shifted by offset. The outside matrices
+        // are freed on return.
+        void probabilities (sparse_tree &tree, double cutoff, cand_pos_t offset, std::ostream &out);
+
+        // Derivatives of the ensemble energy of the last fold by the energy parameters, from the same outside pass: the
+        // probability of every term of the recurrences times the times it uses each parameter. Writes "name value" for the
+        // penalties of h_globals.hh, e_stP_penalty and e_intP_penalty and the multiloop parameters of the Turner model.
+        void gradients (sparse_tree &tree, std::ostream &out);
+
+        // Stochastic traceback of the last fold: draws count structures, each with its Boltzmann probability, and passes every
+        // one to out with that probability as soon as it is drawn. Each thread draws from its own random stream, seeded from seed
+        // and the thread number. With non_redundant no structure is drawn twice: the probability of the ones drawn is taken out
+        // of the choices left, so it runs on one thread and stops early when there is nothing left to draw.
+        void sample (sparse_tree &tree, int count, bool non_redundant, uint64_t seed, const std::function<void(const std::string &, double)> &out);
+
+        // Fills the matrices in the same traversal as the MFE fill of mfe_fold, see W_final::hfold_fused, taking the
+        // Boltzmann factors of the hairpins and interior loops from the energies the MFE fill evaluated. pf_scale stays the one
+        // of the constructor and mfe gets the MFE of mfe_fold. Gives the ensemble energy, check in_range before using it.
+        double hfold_fused (W_final &mfe_fold, sparse_tree &tree, const fold_tables &tables, double &mfe);
+        // false when W(n) left the range of T, the energy given to the constructor was too far from the MFE for pf_scale
+        bool in_range ();
 
         vrna_exp_param_t *exp_params_;
-
-        pf_t get_energy (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return V[ij]; }
-        pf_t get_energy_WM (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WM[ij]; }
-        pf_t get_energy_WMv (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WMv[ij]; }
-        pf_t get_energy_WMp (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WMp[ij]; }
-
-        pf_t get_energy_WI (cand_pos_t i, cand_pos_t j) { if (i>j) return 1; cand_pos_t ij = index[i]+j-i; return WI[ij]; }
-        pf_t get_energy_WIP (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WIP[ij]; }
-        pf_t get_energy_VP (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return VP[ij]; }
-        pf_t get_energy_VPL (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return VPL[ij]; }
-        pf_t get_energy_VPR (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return VPR[ij]; }
-        pf_t get_energy_WMB (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WMB[ij]; }
-        pf_t get_energy_WMBP (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WMBP[ij]; }
-        pf_t get_energy_WMBW (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WMBW[ij]; }
-        pf_t get_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree){
+        int threads = 1;              // threads filling the cells of a span together, see fill_by_spans
+
+        T get_energy (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return V[ij]; }
+        T get_energy_WM (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WM[ij]; }
+        T get_energy_WMv (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WMv[ij]; }
+        T get_energy_WMp (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WMp[ij]; }
+
+        T get_energy_WI (cand_pos_t i, cand_pos_t j) { if (i>j) return 1; cand_pos_t ij = index[i]+j-i; return WI[ij]; }
+        T get_energy_WIP (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WIP[ij]; }
+        T get_energy_VP (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return VP[ij]; }
+        T get_energy_VPL (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return VPL[ij]; }
+        T get_energy_VPR (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return VPR[ij]; }
+        T get_energy_WMB (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WMB[ij]; }
+        T get_energy_WMBP (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WMBP[ij]; }
+        T get_energy_WMBW (cand_pos_t i, cand_pos_t j) { if (i>=j) return 0; cand_pos_t ij = index[i]+j-i; return WMBW[ij]; }
+        // row is the i of the cell being filled, BE rows left of it are not filled yet and read as 0 (see pseudo_loop::get_BE)
+        T get_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree, cand_pos_t row = 1){
         // Hosna, March 16, 2012,
         // i and j should be at least 3 bases apart
-            if (j-i>= TURN && i >= 1 && i <= ip && ip < jp && jp <= j && j <=n && tree.tree[i].pair >=0 && tree.tree[j].pair >= 0 && tree.tree[ip].pair >= 0 && tree.tree[jp].pair >= 0 && tree.tree[i].pair == j && tree.tree[j].pair == i && tree.tree[ip].pair == jp && tree.tree[jp].pair == ip){
+            if (j-i>= TURN && i >= 1 && i <= ip && ip < jp && jp <= j && j <=n && tables_->in_G(i,j) && tables_->in_G(ip,jp)){
+                if(i < row) return 0;
                 // if(i == ip && j == jp && i<j){
                 //     return 1;
                 // }
@@ -64,45 +116,122 @@ class W_final_pf{
 
         short *S_;
         short *S1_;
-
-        std::vector<pf_t> V;
-        std::vector<pf_t> WMv;
-        std::vector<pf_t> WMp;
-        std::vector<pf_t> WM;
-        std::vector<pf_t> W;
-
-        std::vector<pf_t> WI;				// the loop inside a pseudoknot (in general it looks like a W but is inside a pseudoknot)
-        std::vector<pf_t> VP;				// the loop corresponding to the pseudoknotted region of WMB
-        std::vector<pf_t> VPL;				// the loop corresponding to the pseudoknotted region of WMB
-        std::vector<pf_t> VPR;				// the loop corresponding to the pseudoknotted region of WMB
-        std::vector<pf_t> WMB;				// the main loop for pseudoloops and bands
-        std::vector<pf_t> WMBP; 				// the main loop to calculate WMB
-        std::vector<pf_t> WMBW;
-        std::vector<pf_t> WIP;				// the loop corresponding to WI'
-        std::vector<pf_t> BE;				// the loop corresponding to BE
-
-        std::vector<pf_t> scale;
-        std::vector<pf_t> expMLbase;
-        std::vector<pf_t> expcp_pen;
-        std::vector<pf_t> expPUP_pen;
+        const fold_tables *tables_ = nullptr;
+
+        std::string res;                            // constraint of the last refold
+        double mfe;                                 // energy pf_scale was set from
+        bool filled = false;
+        std::unique_ptr<sparse_tree> own_tree;
+        std::unique_ptr<fold_tables> own_tables;
+
+        std::vector<T> V;
+        std::vector<T> WMv;
+        std::vector<T> WMp;
+        std::vector<T> WM;
+        std::vector<T> W;
+
+        std::vector<T> WI;				// the loop inside a pseudoknot (in general it looks like a W but is inside a pseudoknot)
+        std::vector<T> VP;				// the loop corresponding to the pseudoknotted region of WMB
+        std::vector<T> VPL;				// the loop corresponding to the pseudoknotted region of WMB
+        std::vector<T> VPR;				// the loop corresponding to the pseudoknotted region of WMB
+        std::vector<T> WMB;				// the main loop for pseudoloops and bands
+        std::vector<T> WMBP; 				// the main loop to calculate WMB
+        std::vector<T> WMBW;
+        std::vector<T> WIP;				// the loop corresponding to WI'
+        std::vector<T> BE;				// the loop corresponding to BE
+
+        // The split point loops of WM, VM, WI, WIP and VPR read one factor along a row and the other down a column. For
+        // pf_t and float the cells read down a column are also kept column by column, (k,j) at cindex[j]+k, so those loops
+        // are a pf_dot of two slices. ext_pf has no kernel and keeps the plain loops. VML_col holds V(k,j)*exp_MLstem(k,j).
+        static constexpr bool columns = std::is_same<T,double>::value || std::is_same<T,float>::value;
+        std::vector<cand_pos_t> cindex;
+        std::vector<T> VML_col, WMv_col;
+        std::vector<T> V_col, WMB_col, WMp_col, WIP_col;   // pseudoknotted folds only
+
+        std::vector<T> scale;
+        std::vector<T> expMLbase;
+        std::vector<T> expcp_pen;
+        std::vector<T> expPUP_pen;
+
+        // Boltzmann factors of the pseudoknotted loops, so the inner loops of VP and BE look them up instead of raising
+        // exp_E_IntLoop to e_stP_penalty or e_intP_penalty every time. The stacks only depend on the two pair types. The
+        // interior loops between two pairs of G are the same for every inner pair of a band, so they are kept per fold.
+        // Any other interior loop of VP is taken from exp_intP_params_, the parameters at kT/e_intP_penalty, which gives the
+        // factors already raised to e_intP_penalty.
+        pf_t exp_stP[NBPAIRS+1][NBPAIRS+1];
+        std::vector<pf_t> exp_intP_G;           // e_intP(i,l,partner(l),partner(i)) at index[i]+l-i, for i.partner(i) and l.partner(l) in G
+        vrna_exp_param_t *exp_intP_params_;
+        T exp_band;                             // expap_penalty*expbp_penalty^2*scale[2], a band of VP or BE closed like a multiloop
+        pf_t expPB2;                            // expPB_penalty^2, the two bands of a pseudoknot in WMBP
+
+        // exp(-E/kT) and exp(-e_intP_penalty*E/kT) for the loop energies E of a fused fill, from LOOP_ENERGY_MIN up
+        std::vector<pf_t> exp_loop_energy;
+        std::vector<pf_t> exp_loop_energy_intP;
+        pf_t exp_loop(energy_t e, const std::vector<pf_t> &table, double penalty);
+
+        // outside matrices of probabilities, X_out(i,j) is the derivative of W(n) by X(i,j) over W(n)
+        std::vector<T> V_out, WMv_out, WMp_out, WM_out, W_out;
+        std::vector<T> WI_out, VP_out, VPL_out, VPR_out, WMB_out, WMBP_out, WMBW_out, WIP_out, BE_out;
+
+        // the parameters gradients writes, and the times each is expected to be used in a structure of the ensemble, summed
+        // by the outside pass when not empty. The two multipliers get the expected energy of the loops they scale instead.
+        enum pf_parameter { G_PS, G_PSM, G_PSP, G_PB, G_PUP, G_PPS, G_e_stP, G_e_intP, G_a, G_b, G_c, G_ap, G_bp, G_cp, G_start_hybrid,
+                            G_ML_closing, G_ML_intern, G_ML_base, G_COUNT };
+        std::vector<double> expected;
+        void count(pf_parameter p, double times, const T &probability) {
+            if (expected.empty()) return;
+            double x = static_cast<double>(probability);
+            // a term of weight 0 is in no structure, and the energy of its loop can be infinite
+            if (x > 0) expected[p] += times*x;
+        }
+        // the energies in kcal/mol the multipliers scale: the stack of i.j on i+1.j-1, and the interior loop of i.j and k.l
+        double stack_energy(cand_pos_t i, cand_pos_t j);
+        double interior_energy(cand_pos_t i, cand_pos_t k, cand_pos_t l, cand_pos_t j);
 
         void rescale_pk_globals();
+        // fills exp_intP_G for the sequence and G of tables_
+        void fill_pk_tables();
 
         void exp_params_rescale(double mfe);
 
-        void compute_energy_restricted(cand_pos_t i,cand_pos_t j,sparse_tree &tree);
+        // the recurrences with pk false leave out every pseudoknotted term (WMp included), for a pk-free fold
+        template <bool pk>
+        void fill_matrices(sparse_tree &tree, const fold_tables &tables);
+        template <bool pk>
+        void fill_cell(cand_pos_t i, cand_pos_t j, sparse_tree &tree, const fold_tables &tables, const loop_record *record = nullptr);
+
+        // copies the cells of (i,j) read down a column, once they are filled and before WM(i,j) reads them
+        void set_columns(cand_pos_t i, cand_pos_t j);
+
+        // puts the cells of (i,j) back to their values before filling, BE is left alone as in pseudo_loop::clear_cell
+        void clear_cell(cand_pos_t i, cand_pos_t j);
 
-        void compute_WMv_WMp(cand_pos_t i, cand_pos_t j, std::vector<Node> &tree);
+        // fills the cells that see a changed base again and sums W, everything on the first fold
+        double refill(const std::vector<bool> &changed);
 
+        // sums W, the matrices are filled
+        double fold_exterior(sparse_tree &tree, const fold_tables &tables);
+        // W(j) from the filled matrices and W up to j-1
+        T exterior_sum(cand_pos_t j, sparse_tree &tree, const fold_tables &tables);
+        // the ensemble energy of 1..n from W
+        double ensemble_energy();
+
+        template <bool pk>
+        void compute_energy_restricted(cand_pos_t i,cand_pos_t j,sparse_tree &tree, const loop_record *record);
+
+        template <bool pk>
+        void compute_WMv_WMp(cand_pos_t i, cand_pos_t j);
+
+        template <bool pk>
         void compute_energy_WM_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree);
 
-        void compute_pk_energies(cand_pos_t i,cand_pos_t j,sparse_tree &tree);
+        void compute_pk_energies(cand_pos_t i,cand_pos_t j,sparse_tree &tree, const loop_record *record);
 
         void compute_WI(cand_pos_t i,cand_pos_t j,sparse_tree &tree);
 
         void compute_WIP(cand_pos_t i,cand_pos_t j,sparse_tree &tree);
 
-        void compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
+        void compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree, const loop_record *record = nullptr);
 
         void compute_VPL(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
 
@@ -117,22 +246,80 @@ class W_final_pf{
         void compute_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree);
 
 
+        // a cell the stochastic traceback has left to expand, (i,ip) for BE(i,partner(i),ip,partner(ip)) and (0,j) for W(j)
+        enum pf_matrix : char { PF_W, PF_V, PF_WM, PF_WMv, PF_WMp, PF_WI, PF_WIP, PF_VP, PF_VPL, PF_VPR, PF_WMB, PF_WMBP, PF_WMBW, PF_BE };
+        struct pf_cell { pf_matrix type; cand_pos_t i, j; };
+        // a term of the sum of a cell: its weight and the cells it multiplies, constants left out
+        struct pf_term { T weight; pf_cell cells[3]; int count; };
+        // the choices made so far in the non-redundant mode, with the probability of the structures drawn through each
+        struct sample_node { double drawn = 0; std::map<int,std::unique_ptr<sample_node> > below; };
+
+        // one structure drawn from the matrices, its probability, or -1 when a choice had nothing left in it (root is not null)
+        double draw(sparse_tree &tree, std::mt19937_64 &random, sample_node *root, std::string &structure);
+        // the terms of the cell c as the fill summed them
+        void terms(const pf_cell &c, sparse_tree &tree, std::vector<pf_term> &out);
+        void add_term(std::vector<pf_term> &out, const T &weight, std::initializer_list<pf_cell> cells);
+        void terms_exterior(cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out);
+        void terms_V(cand_pos_t i, cand_pos_t j, std::vector<pf_term> &out);
+        void terms_WM(cand_pos_t i, cand_pos_t j, std::vector<pf_term> &out);
+        void terms_WI(cand_pos_t i, cand_pos_t j, std::vector<pf_term> &out);
+        void terms_WIP(cand_pos_t i, cand_pos_t j, std::vector<pf_term> &out);
+        void terms_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out);
+        void terms_VPL(cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out);
+        void terms_VPR(cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out);
+        void terms_WMBW(cand_pos_t i, cand_pos_t j, std::vector<pf_term> &out);
+        void terms_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out);
+        void terms_WMB(cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<pf_term> &out);
+        void terms_BE(cand_pos_t i, cand_pos_t ip, sparse_tree &tree, std::vector<pf_term> &out);
+
+        // the outside pass, each one undoes the compute_ function of the same matrix
+        void add_out(std::vector<T> &X_out, cand_pos_t i, cand_pos_t j, const T &x) { if (i<j) X_out[index[i]+j-i] += x; }
+        void add_WI_out(cand_pos_t i, cand_pos_t j, const T &x) { if (i<=j) WI_out[index[i]+j-i] += x; }
+        // the BE entry the fill read for BE(i,j,ip,jp) while filling the cell (ci,cj), -1 when it read 0
+        cand_pos_t BE_read(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, cand_pos_t ci, cand_pos_t cj);
+        T BE_at(cand_pos_t e) { return e < 0 ? T(0) : BE[e]; }
+        void add_BE_out(cand_pos_t e, const T &x) { if (e >= 0) BE_out[e] += x; }
+        // the BE entry compute_BE writes, -1 for none
+        cand_pos_t BE_written(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp);
+
+        // fills the outside matrices of the last fold
+        void outside(sparse_tree &tree);
+        void outside_exterior(cand_pos_t j, sparse_tree &tree);
+        template <bool pk>
+        void outside_cell(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
+        template <bool pk>
+        void outside_V(cand_pos_t i, cand_pos_t j);
+        template <bool pk>
+        void outside_WMv_WMp(cand_pos_t i, cand_pos_t j);
+        template <bool pk>
+        void outside_WM(cand_pos_t i, cand_pos_t j);
+        void outside_pk(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
+        void outside_WI(cand_pos_t i, cand_pos_t j);
+        void outside_WIP(cand_pos_t i, cand_pos_t j);
+        void outside_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
+        void outside_VPL(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
+        void outside_VPR(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
+        void outside_WMBW(cand_pos_t i, cand_pos_t j);
+        void outside_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
+        void outside_WMB(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
+        void outside_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree);
+
         pf_t exp_Extloop(cand_pos_t i, cand_pos_t j);
 
         pf_t exp_MLstem(cand_pos_t i, cand_pos_t j);
 
         pf_t exp_Mbloop(cand_pos_t i, cand_pos_t j);
 
-        pf_t HairpinE(cand_pos_t i, cand_pos_t j);
-
-        pf_t compute_internal_restricted(cand_pos_t i, cand_pos_t j,std::vector<int> &up);
+        T HairpinE(cand_pos_t i, cand_pos_t j);
 
-        pf_t compute_energy_VM_restricted (cand_pos_t i, cand_pos_t j, std::vector<Node> &tree);
+        T compute_internal_restricted(cand_pos_t i, cand_pos_t j, const loop_record *record);
 
-        pf_t compute_int(cand_pos_t i, cand_pos_t j, cand_pos_t k, cand_pos_t l);
+        template <bool pk>
+        T compute_energy_VM_restricted (cand_pos_t i, cand_pos_t j);
 
         pf_t get_e_stP(cand_pos_t i, cand_pos_t j);
 
+        // an interior loop of VP, the ones of BE are read from exp_intP_G
         pf_t get_e_intP(cand_pos_t i, cand_pos_t ip, cand_pos_t jp, cand_pos_t j);
 };
 
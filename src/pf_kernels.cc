@@ -0,0 +1,77 @@
+#include "pf_kernels.hh"
+
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include "ViennaRNA/utils/cpu.h"
+}
+
+typedef double (proto_dot_double)(const double *a, const double *b, cand_pos_t count);
+typedef float (proto_dot_float)(const float *a, const float *b, cand_pos_t count);
+
+#if CPARTY_WITH_SIMD_AVX512
+double pf_dot_avx512(const double *a, const double *b, cand_pos_t count);
+float pf_dot_avx512(const float *a, const float *b, cand_pos_t count);
+#endif
+
+#if CPARTY_WITH_SIMD_AVX2
+double pf_dot_avx2(const double *a, const double *b, cand_pos_t count);
+float pf_dot_avx2(const float *a, const float *b, cand_pos_t count);
+#endif
+
+template <typename T, int lanes>
+static T dot_default(const T *a, const T *b, cand_pos_t count){
+    T sum[lanes] = {};
+    for(cand_pos_t k = 0; k<count; ++k) sum[k%lanes] += a[k]*b[k];
+    for(int half = lanes/2; half>0; half /= 2){
+        for(int l = 0; l<half; ++l) sum[l] += sum[l+half];
+    }
+    return sum[0];
+}
+
+static double pf_dot_default(const double *a, const double *b, cand_pos_t count){ return dot_default<double,PF_DOT_LANES_DOUBLE>(a,b,count); }
+static float pf_dot_default(const float *a, const float *b, cand_pos_t count){ return dot_default<float,PF_DOT_LANES_FLOAT>(a,b,count); }
+
+// the instruction sets of the CPU, less the ones left out by CPARTY_SIMD=avx2 (no AVX-512) or CPARTY_SIMD=none (plain
+// version only), so the versions can be compared on one machine
+static unsigned int simd_features(){
+    unsigned int features = vrna_cpu_simd_capabilities();
+    const char *simd = std::getenv("CPARTY_SIMD");
+    if(simd && std::strcmp(simd,"avx2") == 0) features &= ~VRNA_CPU_SIMD_AVX512F;
+    else if(simd && std::strcmp(simd,"none") == 0) features &= ~(VRNA_CPU_SIMD_AVX512F | VRNA_CPU_SIMD_AVX2);
+    return features;
+}
+
+// the versions the CPU supports, picked once before main so the fill threads only ever read the pointers
+template <typename proto>
+static proto *dispatch(proto *avx512, proto *avx2, proto *fallback){
+    unsigned int features = simd_features();
+    if(avx512 && (features & VRNA_CPU_SIMD_AVX512F)) return avx512;
+    if(avx2 && (features & VRNA_CPU_SIMD_AVX2)) return avx2;
+    return fallback;
+}
+
+#if CPARTY_WITH_SIMD_AVX512
+#define DOT_AVX512(T) static_cast<T>(&pf_dot_avx512)
+#else
+#define DOT_AVX512(T) nullptr
+#endif
+#if CPARTY_WITH_SIMD_AVX2
+#define DOT_AVX2(T) static_cast<T>(&pf_dot_avx2)
+#else
+#define DOT_AVX2(T) nullptr
+#endif
+
+static proto_dot_double *const dot_double = dispatch<proto_dot_double>(DOT_AVX512(proto_dot_double *),DOT_AVX2(proto_dot_double *),&pf_dot_default);
+static proto_dot_float *const dot_float = dispatch<proto_dot_float>(DOT_AVX512(proto_dot_float *),DOT_AVX2(proto_dot_float *),&pf_dot_default);
+
+double pf_dot(const double *a, const double *b, cand_pos_t count){
+    if(count <= 0) return 0;
+    return (*dot_double)(a,b,count);
+}
+
+float pf_dot(const float *a, const float *b, cand_pos_t count){
+    if(count <= 0) return 0;
+    return (*dot_float)(a,b,count);
+}
@@ -0,0 +1,20 @@
+#ifndef PF_KERNELS_H_
+#define PF_KERNELS_H_
+
+#include "base_types.hh"
+
+/**
+ * Sum of a[k]*b[k] for 0 <= k < count, the split point loops of the partition function once the two factors of every
+ * term are laid out one after the other (see W_final_pf::set_columns). The products go to PF_DOT_LANES partial sums,
+ * product k to sum k mod PF_DOT_LANES, which are then added pairwise, the second half onto the first. The AVX-512, AVX2
+ * and plain versions all keep that order, so the result is the same to the last bit whichever the CPU runs; the best one
+ * it supports is picked once at start up, as ViennaRNA does for vrna_fun_zip_add_min.
+*/
+double pf_dot(const double *a, const double *b, cand_pos_t count);
+float pf_dot(const float *a, const float *b, cand_pos_t count);
+
+// partial sums of pf_dot: a 512 bit register of doubles, or of floats
+#define PF_DOT_LANES_DOUBLE 8
+#define PF_DOT_LANES_FLOAT 16
+
+#endif
@@ -0,0 +1,47 @@
+#include "pf_kernels.hh"
+
+#include <immintrin.h>
+#include <algorithm>
+
+// pf_dot with two 4 double (8 float) registers of partial sums, built with -mavx2 and no contraction to FMA so every
+// product and sum is rounded as in the plain version
+
+double pf_dot_avx2(const double *a, const double *b, cand_pos_t count){
+    __m256d low = _mm256_setzero_pd(), high = _mm256_setzero_pd();
+    cand_pos_t k = 0;
+    for(; k+PF_DOT_LANES_DOUBLE <= count; k += PF_DOT_LANES_DOUBLE){
+        low = _mm256_add_pd(low,_mm256_mul_pd(_mm256_loadu_pd(a+k),_mm256_loadu_pd(b+k)));
+        high = _mm256_add_pd(high,_mm256_mul_pd(_mm256_loadu_pd(a+k+4),_mm256_loadu_pd(b+k+4)));
+    }
+    if(k < count){
+        // the lanes past the end add 0*0
+        alignas(32) double ta[PF_DOT_LANES_DOUBLE] = {}, tb[PF_DOT_LANES_DOUBLE] = {};
+        std::copy(a+k,a+count,ta);
+        std::copy(b+k,b+count,tb);
+        low = _mm256_add_pd(low,_mm256_mul_pd(_mm256_load_pd(ta),_mm256_load_pd(tb)));
+        high = _mm256_add_pd(high,_mm256_mul_pd(_mm256_load_pd(ta+4),_mm256_load_pd(tb+4)));
+    }
+    __m256d sum4 = _mm256_add_pd(low,high);
+    __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum4),_mm256_extractf128_pd(sum4,1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum2,_mm_unpackhi_pd(sum2,sum2)));
+}
+
+float pf_dot_avx2(const float *a, const float *b, cand_pos_t count){
+    __m256 low = _mm256_setzero_ps(), high = _mm256_setzero_ps();
+    cand_pos_t k = 0;
+    for(; k+PF_DOT_LANES_FLOAT <= count; k += PF_DOT_LANES_FLOAT){
+        low = _mm256_add_ps(low,_mm256_mul_ps(_mm256_loadu_ps(a+k),_mm256_loadu_ps(b+k)));
+        high = _mm256_add_ps(high,_mm256_mul_ps(_mm256_loadu_ps(a+k+8),_mm256_loadu_ps(b+k+8)));
+    }
+    if(k < count){
+        alignas(32) float ta[PF_DOT_LANES_FLOAT] = {}, tb[PF_DOT_LANES_FLOAT] = {};
+        std::copy(a+k,a+count,ta);
+        std::copy(b+k,b+count,tb);
+        low = _mm256_add_ps(low,_mm256_mul_ps(_mm256_load_ps(ta),_mm256_load_ps(tb)));
+        high = _mm256_add_ps(high,_mm256_mul_ps(_mm256_load_ps(ta+8),_mm256_load_ps(tb+8)));
+    }
+    __m256 sum8 = _mm256_add_ps(low,high);
+    __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(sum8),_mm256_extractf128_ps(sum8,1));
+    __m128 sum2 = _mm_add_ps(sum4,_mm_movehl_ps(sum4,sum4));
+    return _mm_cvtss_f32(_mm_add_ss(sum2,_mm_shuffle_ps(sum2,sum2,1)));
+}
@@ -0,0 +1,40 @@
+#include "pf_kernels.hh"
+
+#include <immintrin.h>
+
+// pf_dot with one 8 double (16 float) register of partial sums, built with -mavx512f and no contraction to FMA so every
+// product and sum is rounded as in the plain version
+
+double pf_dot_avx512(const double *a, const double *b, cand_pos_t count){
+    __m512d sum = _mm512_setzero_pd();
+    cand_pos_t k = 0;
+    for(; k+PF_DOT_LANES_DOUBLE <= count; k += PF_DOT_LANES_DOUBLE){
+        sum = _mm512_add_pd(sum,_mm512_mul_pd(_mm512_loadu_pd(a+k),_mm512_loadu_pd(b+k)));
+    }
+    if(k < count){
+        // the lanes past the end are loaded as 0 and add 0*0
+        const __mmask8 tail = (__mmask8) ((1u << (count-k)) - 1);
+        sum = _mm512_add_pd(sum,_mm512_mul_pd(_mm512_maskz_loadu_pd(tail,a+k),_mm512_maskz_loadu_pd(tail,b+k)));
+    }
+    __m256d sum4 = _mm256_add_pd(_mm512_castpd512_pd256(sum),_mm512_extractf64x4_pd(sum,1));
+    __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum4),_mm256_extractf128_pd(sum4,1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum2,_mm_unpackhi_pd(sum2,sum2)));
+}
+
+float pf_dot_avx512(const float *a, const float *b, cand_pos_t count){
+    __m512 sum = _mm512_setzero_ps();
+    cand_pos_t k = 0;
+    for(; k+PF_DOT_LANES_FLOAT <= count; k += PF_DOT_LANES_FLOAT){
+        sum = _mm512_add_ps(sum,_mm512_mul_ps(_mm512_loadu_ps(a+k),_mm512_loadu_ps(b+k)));
+    }
+    if(k < count){
+        const __mmask16 tail = (__mmask16) ((1u << (count-k)) - 1);
+        sum = _mm512_add_ps(sum,_mm512_mul_ps(_mm512_maskz_loadu_ps(tail,a+k),_mm512_maskz_loadu_ps(tail,b+k)));
+    }
+    // the high 8 floats, through the double view as extracting 8 floats needs AVX512DQ
+    __m256 high = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(sum),1));
+    __m256 sum8 = _mm256_add_ps(_mm512_castps512_ps256(sum),high);
+    __m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(sum8),_mm256_extractf128_ps(sum8,1));
+    __m128 sum2 = _mm_add_ps(sum4,_mm_movehl_ps(sum4,sum4));
+    return _mm_cvtss_f32(_mm_add_ss(sum2,_mm_shuffle_ps(sum2,sum2,1)));
+}
@@ -7,6 +7,29 @@
 #include <math.h>
 #include <algorithm>
 
+/**
+ * Lower bound on E_IntLoop for every loop of at most MAXLOOP unpaired bases: a stack, a bulge, one of the
+ * tabulated small loops, or the size term, asymmetry and two mismatches of any other loop.
+*/
+static energy_t int_loop_lower_bound(const paramT *P){
+	auto table_min = [](const auto &table){
+		const int *first = reinterpret_cast<const int *>(&table);
+		return *std::min_element(first,first + sizeof(table)/sizeof(int));
+	};
+	energy_t stack = table_min(P->stack);
+	energy_t bound = std::min({stack,table_min(P->int11),table_min(P->int21),table_min(P->int22)});
+
+	bound = std::min(bound,P->bulge[1] + stack);
+	energy_t loop = INF;
+	for(cand_pos_t u = 2; u<=MAXLOOP; ++u){
+		bound = std::min(bound,P->bulge[u] + 2*std::min(P->TerminalAU,0));
+		loop = std::min(loop,P->internal_loop[u]);
+	}
+	energy_t mismatch = std::min({table_min(P->mismatchI),table_min(P->mismatch1nI),table_min(P->mismatch23I)});
+	energy_t asymmetry = std::min(0,std::min(MAX_NINIO,MAXLOOP*P->ninio[2]));
+	return std::min(bound,loop + asymmetry + 2*mismatch);
+}
+
 pseudo_loop::pseudo_loop(std::string seq, std::string res, s_energy_matrix *V, short *S, short *S1, vrna_param_t *params)
 {
 	this->seq = seq;
@@ -16,6 +39,10 @@ pseudo_loop::pseudo_loop(std::string seq, std::string res, s_energy_matrix *V, s
 	S1_ = S1;
 	params_ = params;
 	make_pair_matrix();
+	min_e_intP = lrint(e_intP_penalty * int_loop_lower_bound(params_));
+	for(int type = 0; type <= NBPAIRS; ++type){
+		for(int type_2 = 0; type_2 <= NBPAIRS; ++type_2) e_stP[type][type_2] = lrint(e_stP_penalty * params_->stack[type][type_2]);
+	}
     allocate_space();
 }
 
@@ -53,10 +80,23 @@ pseudo_loop::~pseudo_loop()
 {
 }
 
-void pseudo_loop::compute_energies(cand_pos_t i, cand_pos_t j, sparse_tree &tree)
+void pseudo_loop::clear_cell(cand_pos_t i, cand_pos_t j){
+	cand_pos_t ij = index[i]+j-i;
+	WI[ij] = 0;
+	VP[ij] = INF;
+	VPL[ij] = INF;
+	VPR[ij] = INF;
+	WMB[ij] = INF;
+	WMBW[ij] = INF;
+	WMBP[ij] = INF;
+	WIP[ij] = INF;
+}
+
+void pseudo_loop::compute_energies(cand_pos_t i, cand_pos_t j, sparse_tree &tree, loop_record *record)
 {
 	cand_pos_t ij = index[i]+j-i;
-	const pair_type ptype_closing = pair[S_[i]][S_[j]];
+	const fold_tables &ft = *tables_;
+	const pair_type ptype_closing = ft.ptype(i,j);
 	bool weakly_closed_ij = tree.weakly_closed(i,j);
 	// base cases:
 	// a) i == j => VP[ij] = INF
@@ -68,14 +108,15 @@ void pseudo_loop::compute_energies(cand_pos_t i, cand_pos_t j, sparse_tree &tree
 		VPR[ij] = INF;
 	}
 	else{
-		if(ptype_closing>0 && tree.tree[i].pair < -1 && tree.tree[j].pair < -1) compute_VP(i,j,tree);
+		if(ptype_closing>0 && ft.is_free(i) && ft.is_free(j)) compute_VP(i,j,tree,record);
 		
-		if(tree.tree[j].pair < -1) compute_VPL(i,j,tree);
+		if(ft.is_free(j)) compute_VPL(i,j,tree);
 
-		if(tree.tree[j].pair < j) compute_VPR(i,j,tree);
+		if(ft.partner(j) < j) compute_VPR(i,j,tree);
 	}
 
-	if (!((j-i-1) <= TURN || (tree.tree[i].pair >= -1 && tree.tree[i].pair > j) || (tree.tree[j].pair >= -1 && tree.tree[j].pair < i) || (tree.tree[i].pair >= -1 && tree.tree[i].pair < i ) || (tree.tree[j].pair >= -1 && j < tree.tree[j].pair))){
+	const cand_pos_t pi = ft.partner(i), pj = ft.partner(j);
+	if (!((j-i-1) <= TURN || (pi >= -1 && pi > j) || (pj >= -1 && pj < i) || (pi >= -1 && pi < i ) || (pj >= -1 && j < pj))){
 		compute_WMBW(i,j,tree);
 		
 		compute_WMBP(i,j,tree);
@@ -92,8 +133,8 @@ void pseudo_loop::compute_energies(cand_pos_t i, cand_pos_t j, sparse_tree &tree
 		compute_WIP(i,j,tree);
 	}
 
-	cand_pos_t ip = tree.tree[i].pair; // i's pair ip should be right side so ip = )
-	cand_pos_t jp = tree.tree[j].pair; // j's pair jp should be left side so jp = (
+	cand_pos_t ip = pi; // i's pair ip should be right side so ip = )
+	cand_pos_t jp = pj; // j's pair jp should be left side so jp = (
 
 	compute_BE(i,ip,jp,j,tree);
 
@@ -117,7 +158,7 @@ void pseudo_loop::compute_WI(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 	}
 	m1 += PPS_penalty;
 	m2 += PSP_penalty + PPS_penalty;
-	if (tree.tree[j].pair < 0) m3 = get_WI(i,j-1) + PUP_penalty; 
+	if (tables_->is_unpaired(j)) m3 = get_WI(i,j-1) + PUP_penalty; 
 	m4 = V->get_energy(i,j) + PPS_penalty;
 	m5 = get_WMB(i,j) + PSP_penalty + PPS_penalty;
 
@@ -128,10 +169,11 @@ void pseudo_loop::compute_WIP(cand_pos_t  i, cand_pos_t  j, sparse_tree &tree){
 	cand_pos_t ij = index[i]+j-i;
 
 	energy_t m1 = INF, m2 = INF, m3 = INF, m4 = INF, m5 = INF, m6 = INF, m7 = INF;
+	const cand_pos_t *up = tables_->up.data();
 
 	// branch 1:
 	for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
-		bool can_pair = tree.up[k-1] >= (k-i);
+		bool can_pair = up[k-1] >= (k-i);
 		energy_t wi_1 = get_WIP(i,k-1);
 		energy_t v_energy = V->get_energy(k,j);
 		energy_t wmb_energy = get_WMB(k,j);
@@ -145,7 +187,7 @@ void pseudo_loop::compute_WIP(cand_pos_t  i, cand_pos_t  j, sparse_tree &tree){
 	m3 += bp_penalty;
 	m4 += PSM_penalty + bp_penalty;
 	// branch 2:
-	if (tree.tree[j].pair < 0) m5 = get_WIP(i,j-1) + cp_penalty;
+	if (tables_->is_unpaired(j)) m5 = get_WIP(i,j-1) + cp_penalty;
 	m6 = V->get_energy(i,j) + bp_penalty;
 	m7 = get_WMB(i,j) + PSM_penalty + bp_penalty;
 
@@ -159,8 +201,9 @@ void pseudo_loop::compute_VPL(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 	energy_t m1 = INF;
 
 	cand_pos_t min_Bp_j = std::min((cand_pos_tu) tree.b(i,j), (cand_pos_tu) tree.Bp(i,j));
+	const cand_pos_t *up = tables_->up.data();
 	for(cand_pos_t k = i+1; k<min_Bp_j; ++k){
-		bool can_pair = tree.up[k-1] >= (k-i);
+		bool can_pair = up[k-1] >= (k-i);
 		if(can_pair) m1 = std::min(m1, static_cast<energy_t>((k-i)*cp_penalty) + get_VP(k,j));
 	}
 
@@ -174,10 +217,11 @@ void pseudo_loop::compute_VPR(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 	energy_t m1 = INF, m2 = INF;
 
 	cand_pos_t max_i_bp = std::max(tree.B(i,j),tree.bp(i,j));
+	const cand_pos_t up_j = tables_->up[j-1];
 
 	for(cand_pos_t k = max_i_bp+1; k<j; ++k){
 		energy_t VP_energy = get_VP(i,k);
-		bool can_pair = tree.up[j-1] >= (j-k);
+		bool can_pair = up_j >= (j-k);
 
 		m1 = std::min(m1, VP_energy + get_WIP(k+1,j));
 		if(can_pair) m2 = std::min(m2,VP_energy + static_cast<energy_t>((j-k)*cp_penalty));
@@ -187,10 +231,11 @@ void pseudo_loop::compute_VPR(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 }
 
 
-void pseudo_loop::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
+void pseudo_loop::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree, loop_record *record){
 	cand_pos_t ij = index[i]+j-i;
 
-	const pair_type ptype_closing = pair[S_[i]][S_[j]];	
+	const fold_tables &ft = *tables_;
+	const cand_pos_t *up = ft.up.data();
 	
 	energy_t m1 = INF, m2 = INF, m3 = INF, m4= INF, m5 = INF, m6 = INF, m7 = INF, m8 = INF, m9 = INF; //different branches
 	
@@ -206,7 +251,7 @@ void pseudo_loop::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 
 	// Hosna April 9th, 2007
 	// need to check the borders as they may be negative
-	if((tree.tree[i].parent->index) > 0 && (tree.tree[j].parent->index) < (tree.tree[i].parent->index) && Bp_ij >= 0 && B_ij >= 0 && bp_ij < 0){
+	if((ft.parent(i)) > 0 && (ft.parent(j)) < (ft.parent(i)) && Bp_ij >= 0 && B_ij >= 0 && bp_ij < 0){
 		energy_t WI_ipus1_BPminus = get_WI(i+1,Bp_ij - 1) ;
 		energy_t WI_Bplus_jminus = get_WI(B_ij + 1,j-1);
 		m1 =   WI_ipus1_BPminus + WI_Bplus_jminus;
@@ -217,7 +262,7 @@ void pseudo_loop::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 
 	// Hosna April 9th, 2007
 	// checking the borders as they may be negative
-	if ((tree.tree[i].parent->index) < (tree.tree[j].parent->index) && (tree.tree[j].parent->index) > 0 && b_ij>= 0 && bp_ij >= 0 && Bp_ij < 0){
+	if ((ft.parent(i)) < (ft.parent(j)) && (ft.parent(j)) > 0 && b_ij>= 0 && bp_ij >= 0 && Bp_ij < 0){
 		energy_t WI_i_plus_b_minus = get_WI(i+1,b_ij - 1);
 		energy_t WI_bp_plus_j_minus = get_WI(bp_ij + 1,j-1);
 		m2 = WI_i_plus_b_minus + WI_bp_plus_j_minus;
@@ -228,7 +273,7 @@ void pseudo_loop::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 
 	// Hosna April 9th, 2007
 	// checking the borders as they may be negative
-	if((tree.tree[i].parent->index) > 0 && (tree.tree[j].parent->index) > 0 && Bp_ij >= 0 && B_ij >= 0  && b_ij >= 0 && bp_ij>= 0){
+	if((ft.parent(i)) > 0 && (ft.parent(j)) > 0 && Bp_ij >= 0 && B_ij >= 0  && b_ij >= 0 && bp_ij>= 0){
 		energy_t WI_i_plus_Bp_minus = get_WI(i+1,Bp_ij - 1);
 		energy_t WI_B_plus_b_minus = get_WI(B_ij + 1,b_ij - 1);
 		energy_t WI_bp_plus_j_minus = get_WI(bp_ij +1,j - 1);
@@ -237,8 +282,8 @@ void pseudo_loop::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 
 	// 4) NOT_paired(i+1) and NOT_paired(j-1) and they can pair together
 	// e_stP(i,i+1,j-1,j) + VP(i+1)(j-1)
-	pair_type ptype_closingip1jm1 = pair[S_[i+1]][S_[j-1]];
-	if((tree.tree[i+1].pair) < -1 && (tree.tree[j-1].pair) < -1 && ptype_closingip1jm1>0){
+	pair_type ptype_closingip1jm1 = ft.ptype(i+1,j-1);
+	if(ft.is_free(i+1) && ft.is_free(j-1) && ptype_closingip1jm1>0){
 		m4 = get_e_stP(i,j)+ get_VP(i+1,j-1);
 	}
 
@@ -250,12 +295,13 @@ void pseudo_loop::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 	cand_pos_t edge_i = std::min(i+MAXLOOP+1,j-TURN-1);
 	min_borders = std::min({min_borders,edge_i});
 //		printf("B'(%d,%d) = %d, b(%d,%d) = %d, min_borders = %d\n",i,j,get_Bp(i,j),i,j,get_b(i,j), min_borders);
+	long long pruned = 0, total = 0;
 	for (cand_pos_t k = i+1; k < min_borders; ++k){
 		// Hosna: April 20, 2007
 		// i and ip and j and jp should be in the same arc
 		// also it should be the case that [i+1,ip-1] && [jp+1,j-1] are empty regions
 
-		if (tree.tree[k].pair < -1 && (tree.up[(k)-1] >= ((k)-(i)-1))){
+		if (ft.is_free(k) && (up[(k)-1] >= ((k)-(i)-1))){
 			// Hosna, April 6th, 2007
 			// whenever we use get_borders we have to check for the correct values
 			cand_pos_t max_borders = std::max(bp_ij,B_ij)+1;
@@ -263,17 +309,35 @@ void pseudo_loop::compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 			max_borders = std::max({max_borders,edge_j});
 			for (cand_pos_t l = j-1; l > max_borders ; --l){
 
-				pair_type ptype_closingkj = pair[S_[k]][S_[l]];
-				if (tree.tree[l].pair < -1 && ptype_closingkj>0 && (tree.up[(j)-1] >= ((j)-(l)-1))){
+				pair_type ptype_closingkj = ft.ptype(k,l);
+				if (ft.is_free(l) && ptype_closingkj>0 && (up[(j)-1] >= ((j)-(l)-1))){
 					// Hosna: April 20, 2007
 					// i and ip and j and jp should be in the same arc -- If it's unpaired between them, they have to be
-					energy_t tmp = get_e_intP(i,k,l,j) + get_VP(k,l);
+					energy_t vp_kl = get_VP(k,l);
+					// an infeasible VP(k,l) or one that cannot go below m5 with the best possible loop is skipped,
+					// the loop energy is what costs here
+					if(prune){
+						++total;
+						if(vp_kl >= INF || vp_kl + min_e_intP >= m5){
+							++pruned;
+							continue;
+						}
+					}
+					// get_e_intP, keeping the loop energy for the record
+					energy_t e_int = compute_int(i,j,k,l,params_);
+					if(record) record->vp_interior.push_back(e_int);
+					energy_t tmp = lrint(e_intP_penalty * e_int) + vp_kl;
 					m5 = std::min(m5,tmp);
 					
 				}
 			}
 		}
 	}
+	if(record) record->VP = true;
+	if(prune){
+		interior_pruned.fetch_add(pruned,std::memory_order_relaxed);
+		interior_total.fetch_add(total,std::memory_order_relaxed);
+	}
 
 		cand_pos_t min_Bp_j = std::min((cand_pos_tu) tree.b(i,j), (cand_pos_tu) tree.Bp(i,j));
 		cand_pos_t max_i_bp = std::max(tree.B(i,j),tree.bp(i,j));
@@ -321,9 +385,9 @@ void pseudo_loop::compute_WMBW(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 
 	energy_t m1 = INF;
 
-	if(tree.tree[j].pair < j){
+	if(tables_->partner(j) < j){
 		for(cand_pos_t l = i+1; l<j; l++){
-			if (tree.tree[l].pair < 0 && tree.tree[l].parent->index > -1 && tree.tree[j].parent->index > -1 && tree.tree[j].parent->index == tree.tree[l].parent->index){
+			if (tables_->is_unpaired(l) && tables_->parent(l) > -1 && tables_->parent(j) > -1 && tables_->parent(j) == tables_->parent(l)){
 				energy_t tmp = get_WMBP(i,l) + get_WI(l+1,j);
 				m1 = std::min(m1,tmp);
 			}
@@ -336,9 +400,10 @@ void pseudo_loop::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 	cand_pos_t ij = index[i]+j-i;
 
 	energy_t m1 = INF, m2 = INF, m4 = INF;	
+	const fold_tables &ft = *tables_;
 
 	// 1)
-	if (tree.tree[j].pair < 0){
+	if (ft.is_unpaired(j)){
 		energy_t tmp = INF;
 		cand_pos_t b_ij = tree.b(i,j);
 		for (cand_pos_t l = i+1; l<j ; l++)	{
@@ -354,8 +419,8 @@ void pseudo_loop::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 
 					// Hosna: July 5th, 2007:
 					// as long as we have i <= arc(l)< j we are fine
-					if (i <= tree.tree[l].parent->index && tree.tree[l].parent->index < j && l+TURN <=j){
-						energy_t sum = get_BE(tree.tree[B_lj].pair,B_lj,tree.tree[Bp_lj].pair,Bp_lj,tree)+ get_WMBP(i,l-1)+ get_VP(l,j);
+					if (i <= tables_->parent(l) && tables_->parent(l) < j && l+TURN <=j){
+						energy_t sum = get_BE(ft.partner(B_lj),B_lj,ft.partner(Bp_lj),Bp_lj,tree,i)+ get_WMBP(i,l-1)+ get_VP(l,j);
 						tmp = std::min(tmp,sum);
 					}
 				}
@@ -366,7 +431,7 @@ void pseudo_loop::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 	}
 	// 2) WMB(i,j) = min_{i<l<j}{WMB(i,l)+WI(l+1,j)} if bp(j)<j
 	// Hosna: Feb 5, 2007
-	if (tree.tree[j].pair < 0){
+	if (ft.is_unpaired(j)){
 		energy_t tmp = INF;
 		cand_pos_t b_ij = tree.b(i,j);
 		for (cand_pos_t l = i+1; l<j ; l++)	{
@@ -382,8 +447,8 @@ void pseudo_loop::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 
 					// Hosna: July 5th, 2007:
 					// as long as we have i <= arc(l)< j we are fine
-					if (i <= tree.tree[l].parent->index && tree.tree[l].parent->index < j && l+TURN <=j){
-						energy_t sum = get_BE(tree.tree[B_lj].pair,B_lj,tree.tree[Bp_lj].pair,Bp_lj,tree)+ get_WMBW(i,l-1)+ get_VP(l,j);
+					if (i <= tables_->parent(l) && tables_->parent(l) < j && l+TURN <=j){
+						energy_t sum = get_BE(ft.partner(B_lj),B_lj,ft.partner(Bp_lj),Bp_lj,tree,i)+ get_WMBW(i,l-1)+ get_VP(l,j);
 						tmp = std::min(tmp,sum);
 					}
 				}
@@ -396,7 +461,7 @@ void pseudo_loop::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 
 	// if not paired(j) and paired(i) then
 	// WMBP(i,j) = 2*Pb + min_{i<l<bp(i)}(BE(i,bp(i),b'(i,l),bp(b'(i,l)))+WI(b'+1,l-1)+VP(l,j))
-	if(tree.tree[j].pair < 0 && tree.tree[i].pair >= 0){
+	if(ft.is_unpaired(j) && ft.is_paired(i)){
 		energy_t tmp = INF;
 		// Hosna: June 29, 2007
 		// if j is inside i's arc then the l should be
@@ -409,7 +474,7 @@ void pseudo_loop::compute_WMBP(cand_pos_t i, cand_pos_t j, sparse_tree &tree){
 			// checking the borders as they may be negative
 			cand_pos_t bp_il = tree.bp(i,l);
 			if(bp_il >= 0 && bp_il < n && l+TURN <= j){
-				energy_t BE_energy = get_BE(i,tree.tree[i].pair,bp_il,tree.tree[bp_il].pair,tree);
+				energy_t BE_energy = get_BE(i,ft.partner(i),bp_il,ft.partner(bp_il),tree);
 				energy_t WI_energy = get_WI(bp_il +1,l-1);
 				energy_t VP_energy = get_VP(l,j);
 				energy_t sum = BE_energy + WI_energy + VP_energy;
@@ -437,8 +502,9 @@ void pseudo_loop::compute_WMB(cand_pos_t  i, cand_pos_t  j, sparse_tree &tree){
 	// added impossible cases
 	energy_t m2 = INF, mWMBP = INF;
 	// 2)
-	if (tree.tree[j].pair >= 0 && j > tree.tree[j].pair && tree.tree[j].pair > i){
-		cand_pos_t bp_j = tree.tree[j].pair;
+	const fold_tables &ft = *tables_;
+	if (ft.partner(j) >= 0 && j > ft.partner(j) && ft.partner(j) > i){
+		cand_pos_t bp_j = ft.partner(j);
 		for (cand_pos_t l = (bp_j +1); (l < j); l++){
 			// Hosna: April 24, 2007
 			// correct case 2 such that a multi-pseudoknotted
@@ -446,7 +512,7 @@ void pseudo_loop::compute_WMB(cand_pos_t  i, cand_pos_t  j, sparse_tree &tree){
 			cand_pos_t Bp_lj = tree.Bp(l,j);
 
 			if (Bp_lj >= 0 && Bp_lj<n){
-				energy_t sum = get_BE(bp_j,j,tree.tree[Bp_lj].pair,Bp_lj,tree) + get_WMBP(i,l) + get_WI(l+1,Bp_lj-1);
+				energy_t sum = get_BE(bp_j,j,ft.partner(Bp_lj),Bp_lj,tree) + get_WMBP(i,l) + get_WI(l+1,Bp_lj-1);
 				m2 = std::min(m2,sum);
 			}
 
@@ -468,12 +534,14 @@ void pseudo_loop::compute_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos
     // Ian Wark July 19 2017
     // otherwise it will create pairs in spots where the restricted structure says there should be no pairs
 
-	if (!( i >= 1 && i <= ip && ip < jp && jp <= j && j <= n && tree.tree[i].pair > 0 && tree.tree[j].pair > 0 && tree.tree[ip].pair > 0 && tree.tree[jp].pair > 0 && tree.tree[i].pair == j && tree.tree[j].pair == i && tree.tree[ip].pair == jp && tree.tree[jp].pair == ip)){ //impossible cases
+	const fold_tables &ft = *tables_;
+	if (!( i >= 1 && i <= ip && ip < jp && jp <= j && j <= n && ft.partner(i) > 0 && ft.partner(j) > 0 && ft.partner(ip) > 0 && ft.partner(jp) > 0 && ft.in_G(i,j) && ft.in_G(ip,jp))){ //impossible cases
 		return;
 	}
+	const cand_pos_t *up = ft.up.data();
 	cand_pos_t iip = index[i]+ip-i;
 	// base case: i.j and ip.jp must be in G
-	if (tree.tree[i].pair != j || tree.tree[ip].pair != jp){
+	if (ft.partner(i) != j || ft.partner(ip) != jp){
 		BE[iip] = INF;
 		return;
 	}
@@ -486,7 +554,7 @@ void pseudo_loop::compute_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos
 
 	energy_t m1 = INF, m2 = INF, m3 = INF, m4 = INF, m5 = INF;
 	// 1) bp(i+1) == j-1
-	if (tree.tree[i+1].pair == j-1){
+	if (ft.partner(i+1) == j-1){
 		m1 = get_e_stP(i,j) + get_BE(i+1,j-1,ip,jp,tree);
 
 	}
@@ -495,20 +563,18 @@ void pseudo_loop::compute_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos
 	for (cand_pos_t l = i+1; l<= ip ; l++){
 
 		// Hosna: March 14th, 2007
-		if (tree.tree[l].pair >= -1 && jp <= tree.tree[l].pair && tree.tree[l].pair < j){
+		if (ft.partner(l) >= -1 && jp <= ft.partner(l) && ft.partner(l) < j){
 			// Hosna, March 15, 2007
 			// since not_paired_all[i,l] includes i and l themselves
 			// and in BE energy calculation we are looking for the oepn region (i,l)
 			// we have to look at not_paired_all[i+1,l-1]
-			cand_pos_t lp = tree.tree[l].pair;
-			cand_pos_t il = index[i]+l-i;
-			cand_pos_t lpj = index[lp]+j-lp;
+			cand_pos_t lp = ft.partner(l);
 			// 2)
 			// Hosna June 29, 2007
 			// when we pass a stacked pair instead of an internal loop to e_int, it returns underflow,
 			// so I am checking explicitely that we won't have stems instead of internal loop
-			bool empty_region_il = (tree.up[(l)-1] >= l-i-1); //empty between i+1 and lp-1
-			bool empty_region_lpj = (tree.up[(j)-1] >= j-lp-1); // empty between l+1 and ip-1
+			bool empty_region_il = (up[(l)-1] >= l-i-1); //empty between i+1 and lp-1
+			bool empty_region_lpj = (up[(j)-1] >= j-lp-1); // empty between l+1 and ip-1
 			bool weakly_closed_il = tree.weakly_closed(i+1,l-1); // weakly closed between i+1 and lp-1
 			bool weakly_closed_lpj = tree.weakly_closed(lp+1,j-1); // weakly closed between l+1 and ip-1
 
@@ -596,13 +662,17 @@ energy_t pseudo_loop::get_WMBP(cand_pos_t i, cand_pos_t j){
 	return WMBP[ij];
 }
 
-energy_t pseudo_loop::get_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree){
+energy_t pseudo_loop::get_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree, cand_pos_t row){
 	// Hosna, March 16, 2012,
 	// i and j should be at least 3 bases apart
-	if (j-i>= TURN && i >= 1 && i <= ip && ip < jp && jp <= j && j <=n && tree.tree[i].pair >=0 && tree.tree[j].pair >= 0 && tree.tree[ip].pair >= 0 && tree.tree[jp].pair >= 0 && tree.tree[i].pair == j && tree.tree[j].pair == i && tree.tree[ip].pair == jp && tree.tree[jp].pair == ip){
+	if (j-i>= TURN && i >= 1 && i <= ip && ip < jp && jp <= j && j <=n && tables_->in_G(i,j) && tables_->in_G(ip,jp)){
 		if(i == ip && j == jp && i<j){
 			return 0;
 		}
+		// In the i descending fill a band whose outer arc starts left of the current row has not been filled yet and
+		// its entry still holds the initial 0. Returning that value here keeps the result the same when cells are filled
+		// in another order (see fill_by_arcs).
+		if(i < row) return 0;
 		cand_pos_t iip = index[i]+ip-i;
 
 		return BE[iip];
@@ -613,16 +683,15 @@ energy_t pseudo_loop::get_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos
 
 energy_t pseudo_loop::compute_int(cand_pos_t i, cand_pos_t j, cand_pos_t k, cand_pos_t l, const paramT *params){
 
-	const pair_type ptype_closing = pair[S_[i]][S_[j]];
-    return E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[pair[S_[k]][S_[l]]],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],const_cast<paramT *>(params));
+	const pair_type ptype_closing = tables_->ptype(i,j);
+    return E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[tables_->ptype(k,l)],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],const_cast<paramT *>(params));
 }
 
 energy_t pseudo_loop::get_e_stP(cand_pos_t i, cand_pos_t j){
 	if (i+1 == j-1){ // TODO: do I need something like that or stack is taking care of this?
 		return INF;
 	}
-	energy_t ss = compute_int(i,j,i+1,j-1,params_);
-	return lrint(e_stP_penalty * ss);
+	return e_stP[tables_->ptype(i,j)][rtype[tables_->ptype(i+1,j-1)]];
 }
 
 energy_t pseudo_loop::get_e_intP(cand_pos_t i, cand_pos_t ip, cand_pos_t jp, cand_pos_t j){
@@ -635,10 +704,9 @@ energy_t pseudo_loop::get_e_intP(cand_pos_t i, cand_pos_t ip, cand_pos_t jp, can
 	return energy;
 }
 
-void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interval *cur_interval, sparse_tree &tree)
+void pseudo_loop::back_track(seq_interval *cur_interval, sparse_tree &tree)
 {
-	this->structure = structure;
-	this->f = f;
+	const fold_tables &ft = *tables_;
 	// printf("At %c at %d and %d\n",cur_interval->type,cur_interval->i,cur_interval->j);
 	// changing the nested if structure to switch for optimality
 	switch (cur_interval->type)
@@ -653,9 +721,9 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				energy_t tmp = INF, min = INF;
 
 				// case 1
-				if (tree.tree[j].pair >= 0 && j > tree.tree[j].pair && tree.tree[j].pair > i){
+				if (ft.partner(j) >= 0 && j > ft.partner(j) && ft.partner(j) > i){
 					energy_t acc = INF;
-					cand_pos_t bp_j = tree.tree[j].pair;
+					cand_pos_t bp_j = ft.partner(j);
 					for (cand_pos_t l = bp_j +1; l < j; l++){
 						// Hosna: April 24, 2007
 						// correct case 2 such that a multi-pseudoknotted
@@ -663,7 +731,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 						cand_pos_t Bp_lj = tree.Bp(l,j);
 
 						if (Bp_lj >= 0 && Bp_lj<n){
-							energy_t sum = get_BE(bp_j,j,tree.tree[Bp_lj].pair,Bp_lj,tree) + get_WMBP(i,l) + get_WI(l+1,Bp_lj-1);
+							energy_t sum = get_BE(bp_j,j,ft.partner(Bp_lj),Bp_lj,tree) + get_WMBP(i,l) + get_WI(l+1,Bp_lj-1);
 							if (acc > sum){
 								acc = sum;
 								best_l = l;
@@ -690,7 +758,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 						if (best_l > -1){
 							insert_node(i,best_l,P_WMBP);
 							insert_node(best_l +1,tree.Bp(best_l,j)-1,P_WI);
-							insert_node(tree.tree[j].pair,tree.tree[tree.Bp(best_l,j)].pair, P_BE);
+							insert_node(ft.partner(j),ft.partner(tree.Bp(best_l,j)), P_BE);
 						}
 						break;
 					case 2:
@@ -709,9 +777,9 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				cand_pos_t best_l = -1;
 				energy_t min = INF;
 
-				if(tree.tree[j].pair < j){
+				if(ft.partner(j) < j){
 					for(cand_pos_t l = i+1; l<j; l++){
-						if (tree.tree[l].pair < 0 && tree.tree[l].parent->index > -1 && tree.tree[j].parent->index > -1 && tree.tree[j].parent->index == tree.tree[l].parent->index){
+						if (ft.partner(l) < 0 && ft.parent(l) > -1 && ft.parent(j) > -1 && ft.parent(j) == ft.parent(l)){
 							energy_t tmp = get_WMBP(i,l) + get_WI(l+1,j);
 							if(tmp<min){
 								min = tmp;
@@ -739,7 +807,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 
 				// case 1
 				cand_pos_t b_ij = tree.b(i,j);
-				if (tree.tree[j].pair < 0){
+				if (ft.partner(j) < 0){
 					energy_t acc = INF;
 					cand_pos_t l3 = -1;
 					cand_pos_t b_ij = tree.b(i,j);
@@ -750,8 +818,8 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 							if (bp_il >= 0 && l>bp_il && Bp_lj > 0 && l<Bp_lj){ // bp(i,l) < l < Bp(l,j)
 		
 								cand_pos_t B_lj = tree.B(l,j);
-								if (i <= tree.tree[l].parent->index && tree.tree[l].parent->index < j && l+TURN <=j){
-									energy_t sum = get_BE(tree.tree[B_lj].pair,B_lj,tree.tree[Bp_lj].pair,Bp_lj,tree)+ get_WMBP(i,l-1)+ get_VP(l,j);
+								if (i <= ft.parent(l) && ft.parent(l) < j && l+TURN <=j){
+									energy_t sum = get_BE(ft.partner(B_lj),B_lj,ft.partner(Bp_lj),Bp_lj,tree)+ get_WMBP(i,l-1)+ get_VP(l,j);
 									if (acc > sum){
 										acc = sum;
 										l3 = l;
@@ -769,7 +837,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				}
 
 				// case 2
-				if (tree.tree[j].pair < 0){
+				if (ft.partner(j) < 0){
 					energy_t acc = INF;
 					cand_pos_t l3 = -1;
 					cand_pos_t b_ij = tree.b(i,j);
@@ -780,8 +848,8 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 							if (bp_il >= 0 && l>bp_il && Bp_lj > 0 && l<Bp_lj){ // bp(i,l) < l < Bp(l,j)
 		
 								cand_pos_t B_lj = tree.B(l,j);
-								if (i <= tree.tree[l].parent->index && tree.tree[l].parent->index < j && l+TURN <=j){
-									energy_t sum = get_BE(tree.tree[B_lj].pair,B_lj,tree.tree[Bp_lj].pair,Bp_lj,tree)+ get_WMBW(i,l-1)+ get_VP(l,j);
+								if (i <= ft.parent(l) && ft.parent(l) < j && l+TURN <=j){
+									energy_t sum = get_BE(ft.partner(B_lj),B_lj,ft.partner(Bp_lj),Bp_lj,tree)+ get_WMBW(i,l-1)+ get_VP(l,j);
 									if (acc > sum){
 										acc = sum;
 										l3 = l;
@@ -806,7 +874,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				}
 
 				// case 4
-				if(tree.tree[j].pair < 0 && tree.tree[i].pair >= 0){
+				if(ft.partner(j) < 0 && ft.partner(i) >= 0){
 					cand_pos_t l1 = -1;
 					energy_t acc = INF;
 					for (cand_pos_t l = i+1; l < j; l++){
@@ -818,7 +886,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 						if( bp_il >= 0 &&  bp_il < n && l+TURN <= j){
 							// Hosna: April 19th, 2007
 							// the chosen l should be less than border_b(i,j)
-							energy_t BE_energy = get_BE(i,tree.tree[i].pair,bp_il,tree.tree[bp_il].pair,tree);
+							energy_t BE_energy = get_BE(i,ft.partner(i),bp_il,ft.partner(bp_il),tree);
 							energy_t WI_energy = get_WI(bp_il +1,l-1);
 							energy_t VP_energy = get_VP(l,j);
 							energy_t sum = BE_energy + WI_energy + VP_energy;
@@ -842,12 +910,12 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 						if (best_l > -1){
 							insert_node(i,best_l -1,P_WMBP);
 							insert_node(best_l,j,P_VP);
-							insert_node(tree.tree[tree.B(best_l,j)].pair,tree.tree[tree.Bp(best_l,j)].pair,P_BE);
+							insert_node(ft.partner(tree.B(best_l,j)),ft.partner(tree.Bp(best_l,j)),P_BE);
 						}
 						break;
 					case 2:
 						if (best_l > -1){
-							insert_node(tree.tree[tree.B(best_l,j)].pair,tree.tree[tree.Bp(best_l,j)].pair,P_BE);
+							insert_node(ft.partner(tree.B(best_l,j)),ft.partner(tree.Bp(best_l,j)),P_BE);
 							insert_node(i,best_l-1,P_WMBW);
 							insert_node(best_l,j,P_VP);
 						}
@@ -875,8 +943,8 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				}
 				f[i].pair = j;
 				f[j].pair = i;
-				this->structure[i] = '[';
-				this->structure[j] = ']';
+				(*structure)[i] = '[';
+				(*structure)[j] = ']';
 				//printf("----> original VP: adding (%d,%d) <-------\n",i,j);
 				f[i].type = P_VP;
 				f[j].type = P_VP;
@@ -889,7 +957,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				//case 1
 				// Hosna April 9th, 2007
 				// need to check the borders as they may be negative
-				if((tree.tree[i].parent->index) > 0 && (tree.tree[j].parent->index) < (tree.tree[i].parent->index) && Bp_ij >= 0 && B_ij >= 0 && bp_ij < 0){
+				if(ft.parent(i) > 0 && ft.parent(j) < ft.parent(i) && Bp_ij >= 0 && B_ij >= 0 && bp_ij < 0){
 					energy_t WI_ipus1_BPminus = get_WI(i+1,Bp_ij - 1) ;
 					energy_t WI_Bplus_jminus = get_WI(B_ij + 1,j-1);
 					tmp =   WI_ipus1_BPminus + WI_Bplus_jminus;
@@ -901,7 +969,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				//case 2
 				// Hosna April 9th, 2007
 				// checking the borders as they may be negative
-				if ((tree.tree[i].parent->index) < (tree.tree[j].parent->index) && (tree.tree[j].parent->index) > 0 && b_ij>= 0 && bp_ij >= 0 && Bp_ij < 0){
+				if (ft.parent(i) < ft.parent(j) && ft.parent(j) > 0 && b_ij>= 0 && bp_ij >= 0 && Bp_ij < 0){
 					energy_t WI_i_plus_b_minus = get_WI(i+1,b_ij - 1);
 					energy_t WI_bp_plus_j_minus = get_WI(bp_ij + 1,j-1);
 					tmp = WI_i_plus_b_minus + WI_bp_plus_j_minus;
@@ -913,7 +981,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				//case 3
 				// Hosna April 9th, 2007
 				// checking the borders as they may be negative
-				if((tree.tree[i].parent->index) > 0 && (tree.tree[j].parent->index) > 0 && Bp_ij >= 0 && B_ij >= 0  && b_ij >= 0 && bp_ij>= 0){
+				if(ft.parent(i) > 0 && ft.parent(j) > 0 && Bp_ij >= 0 && B_ij >= 0  && b_ij >= 0 && bp_ij>= 0){
 					energy_t WI_i_plus_Bp_minus = get_WI(i+1,Bp_ij - 1);
 					energy_t WI_B_plus_b_minus = get_WI(B_ij + 1,b_ij - 1);
 					energy_t WI_bp_plus_j_minus = get_WI(bp_ij +1,j - 1);
@@ -924,8 +992,8 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 					}
 				}
 				//case 4
-				pair_type ptype_closingip1jm1 = pair[S_[i+1]][S_[j-1]];
-				if(tree.tree[i+1].pair < 0 && tree.tree[j-1].pair < 0 && ptype_closingip1jm1 > 0){
+				pair_type ptype_closingip1jm1 = ft.ptype(i+1,j-1);
+				if(ft.partner(i+1) < 0 && ft.partner(j-1) < 0 && ptype_closingip1jm1 > 0){
 					tmp = get_e_stP(i,j)+ get_VP(i+1,j-1);
 					if (tmp < min){
 						min = tmp;
@@ -940,15 +1008,15 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 					// Hosna: April 20, 2007
 					// i and ip and j and jp should be in the same arc
 					// it should also be the case that [i+1,ip-1] && [jp+1,j-1] are empty regions
-					if (tree.tree[k].pair < -1 && (tree.up[(k)-1] >= ((k)-(i)-1))){
+					if (ft.partner(k) < -1 && (ft.up[(k)-1] >= ((k)-(i)-1))){
 						// Hosna, April 9th, 2007
 						// whenever we use get_borders we have to check for the correct values
 						cand_pos_t max_borders = std::max(bp_ij,B_ij)+1;
 						cand_pos_t edge_j = k+j-i-MAXLOOP-2;
 						max_borders = std::max({max_borders,edge_j});
 						for (cand_pos_t l = j-1; l > max_borders ; --l){
-							pair_type ptype_closingkj = pair[S_[k]][S_[l]];
-							if (tree.tree[l].pair < -1 && ptype_closingkj>0 && (tree.up[(j)-1] >= ((j)-(l)-1))){
+							pair_type ptype_closingkj = ft.ptype(k,l);
+							if (ft.partner(l) < -1 && ptype_closingkj>0 && (ft.up[(j)-1] >= ((j)-(l)-1))){
 								// Hosna: April 20, 2007
 								// i and ip and j and jp should be in the same arc
 								tmp = get_e_intP(i,k,l,j) + get_VP(k,l);
@@ -1093,7 +1161,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 
 				cand_pos_t min_Bp_j = std::min((cand_pos_tu) tree.b(i,j), (cand_pos_tu) tree.Bp(i,j));
 				for(cand_pos_t k = i+1; k<min_Bp_j; ++k){
-					bool can_pair = tree.up[k-1] >= (k-i);
+					bool can_pair = ft.up[k-1] >= (k-i);
 					if(can_pair) tmp = static_cast<energy_t>((k-i)*cp_penalty) + get_VP(k,j);
 					if(tmp < min){
 						best_k = k;
@@ -1130,7 +1198,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 
 				for(cand_pos_t k = max_i_bp+1; k<j; ++k){
 					energy_t VP_energy = get_VP(i,k);
-					bool can_pair = tree.up[j-1] >= (j-k);
+					bool can_pair = ft.up[j-1] >= (j-k);
 					if(can_pair) tmp = VP_energy + static_cast<energy_t>((j-k)*cp_penalty);
 					if(tmp < min){
 						best_k = k;
@@ -1200,7 +1268,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 						best_t = t;
 					}
 				}
-				if (tree.tree[j].pair < 0){
+				if (ft.partner(j) < 0){
 					tmp = get_WI(i,j-1) + PUP_penalty;
 					if(tmp<min){
 						min = tmp;
@@ -1252,30 +1320,30 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 		case P_BE:
 		{
 			cand_pos_t i = cur_interval->i;
-			cand_pos_t j = tree.tree[i].pair;
+			cand_pos_t j = ft.partner(i);
 			cand_pos_t ip = cur_interval->j;
-			cand_pos_t jp = tree.tree[ip].pair;
+			cand_pos_t jp = ft.partner(ip);
 			if (i > ip || i > j || ip > jp || jp > j){
 				return;
 			}
 
 			f[i].pair = j;
 			f[j].pair = i;
-			this->structure[i] = '(';
-			this->structure[j] = ')';
+			(*structure)[i] = '(';
+			(*structure)[j] = ')';
 			f[i].type = P_BE;
 			f[j].type = P_BE;
 			f[ip].pair = jp;
 			f[jp].pair = ip;
-			this->structure[ip] = '(';
-			this->structure[jp] = ')';
+			(*structure)[ip] = '(';
+			(*structure)[jp] = ')';
 			f[ip].type = P_BE;
 			f[jp].type = P_BE;
 
 			energy_t min = INF, tmp = INF;
 			cand_pos_t best_row = -1, best_l = INF;
 			//case 1
-			if (tree.tree[i+1].pair == j-1){
+			if (ft.partner(i+1) == j-1){
 				tmp = get_e_stP(i,j) + get_BE(i+1,j-1,ip,jp,tree);
 				if(tmp < min){
 					min = tmp;
@@ -1283,11 +1351,11 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				}
 			}
 			for (cand_pos_t l = i+1; l<= ip ; l++){
-				if (tree.tree[l].pair >= 0 && jp <= tree.tree[l].pair && tree.tree[l].pair < j){
-				cand_pos_t lp = tree.tree[l].pair;
+				if (ft.partner(l) >= 0 && jp <= ft.partner(l) && ft.partner(l) < j){
+				cand_pos_t lp = ft.partner(l);
 
-				bool empty_region_il = (tree.up[(l)-1] >= l-i-1); //empty between i+1 and lp-1
-				bool empty_region_lpj = (tree.up[(j)-1] >= j-lp-1); // empty between l+1 and ip-1
+				bool empty_region_il = (ft.up[(l)-1] >= l-i-1); //empty between i+1 and lp-1
+				bool empty_region_lpj = (ft.up[(j)-1] >= j-lp-1); // empty between l+1 and ip-1
 				bool weakly_closed_il = tree.weakly_closed(i+1,l-1); // weakly closed between i+1 and lp-1
 				bool weakly_closed_lpj = tree.weakly_closed(lp+1,j-1); // weakly closed between l+1 and ip-1
 
@@ -1357,8 +1425,8 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 						if (best_l <= ip){
 							insert_node(best_l,ip,P_BE);
 						}
-						if (tree.tree[best_l].pair  <= j-1){
-							insert_node(tree.tree[best_l].pair +1,j-1,P_WIP);
+						if (ft.partner(best_l)  <= j-1){
+							insert_node(ft.partner(best_l) +1,j-1,P_WIP);
 						}
 					}
 					break;
@@ -1377,8 +1445,8 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 						if (best_l <= ip){
 							insert_node(best_l,ip,P_BE);
 						}
-						if (tree.tree[best_l].pair <= j-1){
-							insert_node(tree.tree[best_l].pair +1,j-1,P_WIP);
+						if (ft.partner(best_l) <= j-1){
+							insert_node(ft.partner(best_l) +1,j-1,P_WIP);
 						}
 					}
 					break;
@@ -1409,7 +1477,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 			}
 
 			for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
-				bool can_pair = tree.up[k-1] >= (k-i);
+				bool can_pair = ft.up[k-1] >= (k-i);
 				energy_t wi_1 = get_WIP(i,k-1);
 				tmp = wi_1 + V->get_energy(k,j);
 				if (tmp < min){
@@ -1428,7 +1496,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				}
 			}
 			for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
-				bool can_pair = tree.up[k-1] >= (k-i);
+				bool can_pair = ft.up[k-1] >= (k-i);
 				if(can_pair) tmp = static_cast<energy_t>((k-i)*cp_penalty) + V->get_energy(k,j);
 				if (tmp < min){
 					min = tmp;
@@ -1437,7 +1505,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				}
 			}
 			for (cand_pos_t k = i+1; k < j-TURN-1; ++k){
-				bool can_pair = tree.up[k-1] >= (k-i);
+				bool can_pair = ft.up[k-1] >= (k-i);
 				if(can_pair) tmp = static_cast<energy_t>((k-i)*cp_penalty) + get_WMB(k,j);
 				if (tmp < min){
 					min = tmp;
@@ -1446,7 +1514,7 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 				}
 			}
 			//case 2
-			if (tree.tree[j].pair < 0){
+			if (ft.partner(j) < 0){
 				tmp = get_WIP(i,j-1) + cp_penalty;
 				if (tmp < min){
 					min = tmp;
@@ -1513,16 +1581,17 @@ void pseudo_loop::back_track(std::string structure, minimum_fold *f, seq_interva
 
 void pseudo_loop::insert_node(int i, int j, char type)
 {
-	seq_interval *tmp;
-    tmp = new seq_interval;
-    tmp->i = i;
-    tmp->j = j;
-    tmp->type = type;
-    tmp->next = stack_interval;
-    stack_interval = tmp;
+	seq_interval tmp;
+    tmp.i = i;
+    tmp.j = j;
+    tmp.type = type;
+    tmp.next = NULL;
+    stack_interval->push_back(tmp);
 
 }
 
-void pseudo_loop::set_stack_interval(seq_interval *stack_interval){
+void pseudo_loop::set_backtrack_state(std::string *structure, minimum_fold *f, std::vector<seq_interval> *stack_interval){
+	this->structure = structure;
+	this->f = f;
 	this->stack_interval = stack_interval;
 }
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "s_energy_matrix.hh"
+#include <atomic>
 
 class VM_final;
 class V_final;
@@ -18,7 +19,11 @@ public:
 	// destructor
 	~pseudo_loop();
 
-    void compute_energies(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
+    // record, when not null, gets the energies of the pseudoknotted interior loops looked at, pruning has to be off
+    void compute_energies(cand_pos_t i, cand_pos_t j, sparse_tree &tree, loop_record *record = nullptr);
+    // puts the cells of (i,j) back to their values before filling, so they can be filled again. BE is left alone as
+    // every entry of it that is read is written again whenever the cell it belongs to is filled
+    void clear_cell(cand_pos_t i, cand_pos_t j);
 
     // energy_t get_energy(cand_pos_t i, cand_pos_t j);
 	// in order to be able to check the border values consistantly
@@ -30,18 +35,23 @@ public:
 	energy_t get_VPL(cand_pos_t i, cand_pos_t j);
 	energy_t get_VPR(cand_pos_t i, cand_pos_t j);
 	energy_t get_WMB(cand_pos_t i, cand_pos_t j);
-	energy_t get_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree);
+	// row is the i of the cell being filled, BE rows left of it are not filled yet and read as 0
+	energy_t get_BE(cand_pos_t i, cand_pos_t j, cand_pos_t ip, cand_pos_t jp, sparse_tree &tree, cand_pos_t row = 1);
 
 	energy_t get_WMBP(cand_pos_t i, cand_pos_t j);
 	energy_t get_WMBW(cand_pos_t i, cand_pos_t j);
 
-    void back_track(std::string structure, minimum_fold *f, seq_interval *cur_interval, sparse_tree &tree);
+    void back_track(seq_interval *cur_interval, sparse_tree &tree);
 
-    void set_stack_interval(seq_interval *stack_interval);
-    seq_interval *get_stack_interval(){return stack_interval;}
-    std::string get_structure(){return structure;}
-    minimum_fold *get_minimum_fold(){return f;}
+    // the structure, pairs and backtracking stack are owned by W_final, back_track writes to them in place
+    void set_backtrack_state(std::string *structure, minimum_fold *f, std::vector<seq_interval> *stack_interval);
 	std::vector<energy_t> WMB;				// the main loop for pseudoloops and bands
+	const fold_tables *tables_ = nullptr;	// pair types and constraint flags, set by the caller before filling
+
+	// MFE only: skip the interior loops of VP that cannot improve the best value found so far for the cell
+	bool prune = false;
+	std::atomic<long long> interior_pruned{0};	// interior loops of VP skipped
+	std::atomic<long long> interior_total{0};	// interior loops of VP looked at
 
 private:
 
@@ -51,10 +61,12 @@ private:
 
     s_energy_matrix *V;		        // the V object
 
-	seq_interval *stack_interval;
-	std::string structure;
-	minimum_fold *f;
+	std::vector<seq_interval> *stack_interval = nullptr;
+	std::string *structure = nullptr;
+	minimum_fold *f = nullptr;
 	vrna_param_t *params_;
+	energy_t min_e_intP;	// lower bound on get_e_intP for any loop
+	energy_t e_stP[NBPAIRS+1][NBPAIRS+1];	// get_e_stP for the pair types of the outer and inner pair
 
 
 	//Hosna
@@ -77,7 +89,7 @@ private:
     void compute_WI(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
 	// Hosna: This function is supposed to fill in the WI array
 
-	void compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree);
+	void compute_VP(cand_pos_t i, cand_pos_t j, sparse_tree &tree, loop_record *record = nullptr);
 	// Hosna: this function is supposed to fill the VP array
 
 	// Computes the non-redundant recurrence from CParty (replaces VPP from original)
@@ -55,7 +55,8 @@ s_energy_matrix::s_energy_matrix (std::string seq, cand_pos_t length, short *S,
 	WMv.resize(total_length,INF);
 	WMp.resize(total_length,INF);
     // this array holds V(i,j), and what (i,j) encloses: hairpin loop, stack pair, internal loop or multi-loop
-	nodes.resize(total_length);
+	// cells that are never filled are left at UNFILLED, as they always were
+	energies.resize(total_length,UNFILLED);
 }
 
 
@@ -64,6 +65,16 @@ s_energy_matrix::~s_energy_matrix ()
 {
 }
 
+void s_energy_matrix::clear_cell (cand_pos_t i, cand_pos_t j){
+	cand_pos_t ij = index[i]+j-i;
+	energies[ij] = UNFILLED;
+	WM[ij] = INF;
+	WMv[ij] = INF;
+	WMp[ij] = INF;
+	if(!types.empty()) types[ij] = NONE;
+	if(!internal_split.empty()) internal_split[ij] = 0;
+}
+
 /**
  * @brief Gives the WM(i,j) energy. The type of dangle model being used affects this energy. 
  * The type of dangle is also changed to reflect this.
@@ -75,14 +86,15 @@ s_energy_matrix::~s_energy_matrix ()
  * @param vij1 The V(i,j-1) energy
  * @param vi1j1 The V(i+1,j-1) energy
 */
-energy_t s_energy_matrix::E_MLStem(const energy_t& vij,const energy_t& vi1j,const energy_t& vij1,const energy_t& vi1j1,const short* S, paramT* params,cand_pos_t i, cand_pos_t j, const  cand_pos_t& n, std::vector<Node> &tree){
+energy_t s_energy_matrix::E_MLStem(const energy_t& vij,const energy_t& vi1j,const energy_t& vij1,const energy_t& vi1j1,const short* S, paramT* params,cand_pos_t i, cand_pos_t j, const  cand_pos_t& n){
 
 	energy_t e = INF,en=INF;
+	const fold_tables &ft = *tables_;
 
-	pair_type type = pair[S[i]][S[j]];
+	pair_type type = ft.ptype(i,j);
 
 	
-	if ((tree[i].pair < -1 && tree[j].pair < -1) || (tree[i].pair == j)) {
+	if (ft.can_pair(i,j)) {
 		en = vij; // i j
 		if (en != INF) {
 			if (params->model_details.dangles == 2){
@@ -99,35 +111,35 @@ energy_t s_energy_matrix::E_MLStem(const energy_t& vij,const energy_t& vi1j,cons
 	if(params->model_details.dangles == 1){
 		const base_type mm5 = S[i], mm3 = S[j];
 
-		if (((tree[i+1].pair < -1 && tree[j].pair < -1) || (tree[i+1].pair == j)) && tree[i].pair < 0) {
+		if (ft.can_pair(i+1,j) && ft.is_unpaired(i)) {
       		en = (j-i-1 >TURN) ? vi1j : INF; // i+1 j
       		if (en != INF) {
         		en += params->MLbase;
 
-            	type = pair[S[i+1]][S[j]];
+            	type = ft.ptype(i+1,j);
             	en += E_MLstem(type, mm5, -1, params);
 
         		e = MIN2(e, en);
       		}
     	}
 
-		if (((tree[i].pair < -1 && tree[j-1].pair < -1) || (tree[i].pair == j-1)) && tree[j].pair < 0) {
+		if (ft.can_pair(i,j-1) && ft.is_unpaired(j)) {
       		en = (j-1-i>TURN) ? vij1 : INF; // i j-1
       		if (en != INF) {
        			en += params->MLbase;
 
-            	type = pair[S[i]][S[j-1]];
+            	type = ft.ptype(i,j-1);
             	en += E_MLstem(type, -1, mm3, params);
  
         		e = MIN2(e, en);
       		}
     	}
-    	if (((tree[i+1].pair < -1 && tree[j-1].pair < -1) || (tree[i+1].pair == j-1)) && tree[i].pair < 0 && tree[j].pair<0) {
+    	if (ft.can_pair(i+1,j-1) && ft.is_unpaired(i) && ft.is_unpaired(j)) {
       		en = (j-1-i-1>TURN) ? vi1j1 : INF; // i+1 j-1
       		if (en != INF) {
         		en += 2 * params->MLbase;
 
-        		type = pair[S[i+1]][S[j-1]];
+        		type = ft.ptype(i+1,j-1);
         		en += E_MLstem(type, mm5, mm3, params);
         
 				e = MIN2(e, en);
@@ -148,11 +160,12 @@ energy_t s_energy_matrix::E_MLStem(const energy_t& vij,const energy_t& vi1j,cons
 * @param dmli1 Row of WM2 from one iteration ago
 * @param dmli2 Row of WM2 from two iterations ago 
 */
-energy_t s_energy_matrix::E_MbLoop(const energy_t WM2ij, const energy_t WM2ip1j, const energy_t WM2ijm1, const energy_t WM2ip1jm1, const short* S, paramT* params, cand_pos_t i, cand_pos_t j, std::vector<Node> &tree){
+energy_t s_energy_matrix::E_MbLoop(const energy_t WM2ij, const energy_t WM2ip1j, const energy_t WM2ijm1, const energy_t WM2ip1jm1, const short* S, paramT* params, cand_pos_t i, cand_pos_t j){
 
 	energy_t e = INF,en = INF;
-  	pair_type tt  = pair[S[j]][S[i]];
-	bool pairable = (tree[i].pair <-1 && tree[j].pair <-1) || (tree[i].pair == j);
+	const fold_tables &ft = *tables_;
+  	pair_type tt  = rtype[ft.ptype(i,j)];
+	bool pairable = ft.can_pair(i,j);
 	
 	/* double dangles */
 	switch(params->model_details.dangles){
@@ -191,7 +204,7 @@ energy_t s_energy_matrix::E_MbLoop(const energy_t WM2ij, const energy_t WM2ip1j,
 			* new closing pair (i,j) with mb part [i+2,j-1] 
 			*/
 
-      		if (pairable && tree[i+1].pair < 0) {
+      		if (pairable && ft.is_unpaired(i+1)) {
         		en = WM2ip1j;
 
         		if (en != INF) {
@@ -208,7 +221,7 @@ energy_t s_energy_matrix::E_MbLoop(const energy_t WM2ij, const energy_t WM2ip1j,
 			* ML pair 3
 			* new closing pair (i,j) with mb part [i+1, j-2] 
 			*/
-			if (pairable && tree[j-1].pair < 0) {
+			if (pairable && ft.is_unpaired(j-1)) {
 				en = WM2ijm1;
 
 				if (en != INF) {
@@ -222,7 +235,7 @@ energy_t s_energy_matrix::E_MbLoop(const energy_t WM2ij, const energy_t WM2ip1j,
 			* ML pair 53
 			* new closing pair (i,j) with mb part [i+2.j-2]
 			*/
-			if (pairable && tree[i+1].pair < 0 && tree[j-1].pair <0) {
+			if (pairable && ft.is_unpaired(i+1) && ft.is_unpaired(j-1)) {
 				en = WM2ip1jm1;			
 
 				if (en != INF) {
@@ -249,15 +262,15 @@ energy_t s_energy_matrix::E_MbLoop(const energy_t WM2ij, const energy_t WM2ip1j,
 
 	return e;
 }
-void s_energy_matrix::compute_WMv_WMp(cand_pos_t i, cand_pos_t j, energy_t WMB, std::vector<Node> &tree){
+void s_energy_matrix::compute_WMv_WMp(cand_pos_t i, cand_pos_t j, energy_t WMB){
 	if(j-i+1<4) return;
 	cand_pos_t ij = index[(i)]+(j)-(i);
 	cand_pos_t iplus1j = index[(i)+1]+(j)-(i)-1;
 	cand_pos_t ijminus1 = index[(i)]+(j)-1-(i);
 
-	WMv[ij] = E_MLStem(get_energy(i,j),get_energy(i+1,j),get_energy(i,j-1),get_energy(i+1,j-1),S_,params_,i,j,n,tree);
+	WMv[ij] = E_MLStem(get_energy(i,j),get_energy(i+1,j),get_energy(i,j-1),get_energy(i+1,j-1),S_,params_,i,j,n);
 	WMp[ij] = WMB+PSM_penalty+b_penalty;
-	if (tree[j].pair <= -1)
+	if (tables_->is_unpaired(j))
 	{
 		energy_t tmp = WMv[ijminus1] + params_->MLbase;
 		WMv[ij] = std::min(WMv[ij],tmp);
@@ -266,7 +279,8 @@ void s_energy_matrix::compute_WMv_WMp(cand_pos_t i, cand_pos_t j, energy_t WMB,
 	}
 }
 
-void s_energy_matrix::compute_energy_WM_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree, std::vector<energy_t> &WMB)
+template <bool pk>
+void s_energy_matrix::compute_energy_WM_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree, const energy_t *WMB)
 // compute de MFE of a partial multi-loop closed at (i,j), the restricted case
 {
     if(j-i+1<4) return;
@@ -274,13 +288,16 @@ void s_energy_matrix::compute_energy_WM_restricted (cand_pos_t i, cand_pos_t j,
     // ++j;
 	cand_pos_t ij = index[i]+j-i;
 	cand_pos_t ijminus1 = index[i]+(j-1)-i;
+	const cand_pos_t *up = tables_->up.data();
 	
 	for (cand_pos_t k=j-TURN-1; k >= i; --k)
 	{
 		cand_pos_t kj = index[k]+j-k;
-		energy_t wm_kj = E_MLStem(get_energy(k,j),get_energy(k+1,j),get_energy(k,j-1),get_energy(k+1,j-1),S_,params_,k,j,n,tree.tree);
-		energy_t wmb_kj = WMB[kj]+PSM_penalty+b_penalty;
-		bool can_pair = tree.up[k-1] >= (k-i);
+		energy_t wm_kj = E_MLStem(get_energy(k,j),get_energy(k+1,j),get_energy(k,j-1),get_energy(k+1,j-1),S_,params_,k,j,n);
+		energy_t wmb_kj;
+		if constexpr (pk) wmb_kj = WMB[kj]+PSM_penalty+b_penalty;
+		else wmb_kj = INF+PSM_penalty+b_penalty;
+		bool can_pair = up[k-1] >= (k-i);
 		if(can_pair) m1 = std::min(m1,static_cast<energy_t>((k-i)*params_->MLbase) + wm_kj);
 		if(can_pair) m2 = std::min(m2,static_cast<energy_t>((k-i)*params_->MLbase) + wmb_kj);
 		m3 =  std::min(m3,get_energy_WM(i,k-1) + wm_kj);
@@ -288,35 +305,37 @@ void s_energy_matrix::compute_energy_WM_restricted (cand_pos_t i, cand_pos_t j,
 
 	}
 	WM[ij] = std::min({m1,m2,m3,m4});
-	if (tree.tree[j].pair <= -1) WM[ij] = std::min(WM[ij],WM[ijminus1] + params_->MLbase);
+	if (tables_->is_unpaired(j)) WM[ij] = std::min(WM[ij],WM[ijminus1] + params_->MLbase);
     
 }
 
+template void s_energy_matrix::compute_energy_WM_restricted<true>(cand_pos_t i, cand_pos_t j, sparse_tree &tree, const energy_t *WMB);
+template void s_energy_matrix::compute_energy_WM_restricted<false>(cand_pos_t i, cand_pos_t j, sparse_tree &tree, const energy_t *WMB);
+
 energy_t s_energy_matrix::compute_energy_VM_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree)
 // compute the MFE of a multi-loop closed at (i,j), the restricted case
 {
     energy_t min = INF;
-	// i--;
-	// j--;
+	const cand_pos_t *up = tables_->up.data();
     for (cand_pos_t k = i+1; k <= j-3; ++k)
     {
         energy_t WM2ij = get_energy_WM(i+1,k-1) + get_energy_WMv(k,j-1);
 		WM2ij = std::min(WM2ij,get_energy_WM(i+1,k-1) + get_energy_WMp(k,j-1));
-		if(tree.up[k-1] >= (k-(i+1)))WM2ij = std::min(WM2ij,static_cast<energy_t>((k-i-1)*params_->MLbase) + get_energy_WMp(k,j-1));
+		if(up[k-1] >= (k-(i+1)))WM2ij = std::min(WM2ij,static_cast<energy_t>((k-i-1)*params_->MLbase) + get_energy_WMp(k,j-1));
 
         energy_t WM2ip1j = get_energy_WM(i+2,k-1) + get_energy_WMv(k,j-1);
 		WM2ip1j = std::min(WM2ip1j,get_energy_WM(i+2,k-1) + get_energy_WMp(k-1,j-1));
-		if(tree.up[k-1] >= (k-(i+1))) WM2ip1j = std::min(WM2ip1j,static_cast<energy_t>((k-(i+1)-1)*params_->MLbase) + get_energy_WMp(k,j-1));
+		if(up[k-1] >= (k-(i+1))) WM2ip1j = std::min(WM2ip1j,static_cast<energy_t>((k-(i+1)-1)*params_->MLbase) + get_energy_WMp(k,j-1));
 
         energy_t WM2ijm1 = get_energy_WM(i+1,k-1) + get_energy_WMv(k,j-2);
 		WM2ijm1 = std::min(WM2ijm1, get_energy_WM(i+1,k-1) + get_energy_WMp(k,j-2));
-		if(tree.up[k-1] >= (k-(i+2))) WM2ijm1 = std::min(WM2ijm1,static_cast<energy_t>((k-i-1)*params_->MLbase) + get_energy_WMp(k,j-2));
+		if(up[k-1] >= (k-(i+2))) WM2ijm1 = std::min(WM2ijm1,static_cast<energy_t>((k-i-1)*params_->MLbase) + get_energy_WMp(k,j-2));
 
         energy_t WM2ip1jm1 = get_energy_WM(i+2,k-1) + get_energy_WMv(k,j-2);
 		WM2ip1jm1 = std::min(WM2ip1jm1,get_energy_WM(i+2,k-1) + get_energy_WMp(k,j-2));
-		if(tree.up[k-2] >= (k-(i+2))) WM2ip1jm1 = std::min(WM2ip1jm1,static_cast<energy_t>((k-(i+1)-1)*params_->MLbase) + get_energy_WMp(k,j-2));
+		if(up[k-2] >= (k-(i+2))) WM2ip1jm1 = std::min(WM2ip1jm1,static_cast<energy_t>((k-(i+1)-1)*params_->MLbase) + get_energy_WMp(k,j-2));
 
-        min = std::min(min,E_MbLoop(WM2ij,WM2ip1j,WM2ijm1,WM2ip1jm1,S_,params_,i,j,tree.tree));
+        min = std::min(min,E_MbLoop(WM2ij,WM2ip1j,WM2ijm1,WM2ip1jm1,S_,params_,i,j));
     }
     return min;
 }
@@ -329,7 +348,7 @@ energy_t s_energy_matrix::compute_energy_VM_restricted (cand_pos_t i, cand_pos_t
 */
 energy_t s_energy_matrix::HairpinE(const std::string& seq, const short* S, const short* S1,  const paramT* params, cand_pos_t i, cand_pos_t j) {
 	
-	const int ptype_closing = pair[S[i]][S[j]];
+	const int ptype_closing = tables_->ptype(i,j);
 
 	if (ptype_closing==0) return INF;
 
@@ -339,18 +358,26 @@ energy_t s_energy_matrix::HairpinE(const std::string& seq, const short* S, const
 /**
  * @brief restricted version
 */
-energy_t s_energy_matrix::compute_internal_restricted(cand_pos_t i, cand_pos_t j, const paramT *params, std::vector<int> &up){
+energy_t s_energy_matrix::compute_internal_restricted(cand_pos_t i, cand_pos_t j, const paramT *params, uint16_t &best_kl, loop_record *record){
 	energy_t v_iloop = INF;
 	cand_pos_t max_k = std::min(j-TURN-2,i+MAXLOOP+1);
-	const int ptype_closing = pair[S_[i]][S_[j]];
+	const fold_tables &ft = *tables_;
+	const cand_pos_t *up = ft.up.data();
+	const int ptype_closing = ft.ptype(i,j);
 	for ( cand_pos_t k=i+1; k<=max_k; ++k) {
 		
 		cand_pos_t min_l=std::max(k+TURN+1 + MAXLOOP+2, k+j-i) - MAXLOOP-2;
         if((up[k-1]>=(k-i-1))){
             for (int l=j-1; l>=min_l; --l) {
                 if(up[j-1]>=(j-l-1)){
-                    energy_t v_iloop_kl = E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[pair[S_[k]][S_[l]]],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],const_cast<paramT *>(params)) + get_energy(k,l);
-                    v_iloop = std::min(v_iloop,v_iloop_kl);
+                    energy_t e_int = E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[ft.ptype(k,l)],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],const_cast<paramT *>(params));
+                    if(record) record->interior.push_back(e_int);
+                    energy_t v_iloop_kl = e_int + get_energy(k,l);
+                    // the first minimum in this order, the same one the backtrack finds
+                    if(v_iloop_kl < v_iloop){
+                        v_iloop = v_iloop_kl;
+                        best_kl = ((k-i) << 8) | (j-l);
+                    }
                 }
             }
         }
@@ -360,19 +387,19 @@ energy_t s_energy_matrix::compute_internal_restricted(cand_pos_t i, cand_pos_t j
 
 energy_t s_energy_matrix::compute_stack(cand_pos_t i, cand_pos_t j, const paramT *params){
 
-	const int ptype_closing = pair[S_[i]][S_[j]];
+	const int ptype_closing = tables_->ptype(i,j);
 	cand_pos_t k = i+1;
     cand_pos_t l = j-1;
-    return E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[pair[S_[k]][S_[l]]],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],const_cast<paramT *>(params)) + get_energy(k,l);
+    return E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[tables_->ptype(k,l)],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],const_cast<paramT *>(params)) + get_energy(k,l);
 }
 
 energy_t s_energy_matrix::compute_int(cand_pos_t i, cand_pos_t j, cand_pos_t k, cand_pos_t l, const paramT *params){
 
-	const int ptype_closing = pair[S_[i]][S_[j]];
-    return E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[pair[S_[k]][S_[l]]],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],const_cast<paramT *>(params)) + get_energy(k,l);
+	const int ptype_closing = tables_->ptype(i,j);
+    return E_IntLoop(k-i-1,j-l-1,ptype_closing,rtype[tables_->ptype(k,l)],S1_[i+1],S1_[j-1],S1_[k-1],S1_[l+1],const_cast<paramT *>(params)) + get_energy(k,l);
 }
 
-void s_energy_matrix::compute_energy_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree)
+void s_energy_matrix::compute_energy_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree, loop_record *record)
 // compute the V(i,j) value, if the structure must be restricted
 {
     energy_t min, min_en[3];
@@ -384,17 +411,22 @@ void s_energy_matrix::compute_energy_restricted (cand_pos_t i, cand_pos_t j, spa
     min_en[0] = INF;
     min_en[1] = INF;
     min_en[2] = INF;
+    uint16_t best_kl = 0;
 
 
-	const pair_type ptype_closing = pair[S_[i]][S_[j]];
-    const bool unpaired = (tree.tree[i].pair<-1 && tree.tree[j].pair<-1);
-	const bool paired = (tree.tree[i].pair == j && tree.tree[j].pair == i);
+	const fold_tables &ft = *tables_;
+    const bool unpaired = ft.is_free(i) && ft.is_free(j);
+	const bool paired = ft.in_G(i,j);
     if (paired || unpaired)    // if i and j can pair
     {
-        bool canH = !(tree.up[j-1]<(j-i-1));
+        bool canH = !(ft.up[j-1]<(j-i-1));
         if(canH) min_en[0] = HairpinE(seq_,S_,S1_,params_,i,j);
 
-        min_en[1] = compute_internal_restricted(i,j,params_,tree.up);
+        min_en[1] = compute_internal_restricted(i,j,params_,best_kl,record);
+        if(record){
+            record->V = true;
+            record->hairpin = min_en[0];
+        }
         min_en[2] = compute_energy_VM_restricted(i,j,tree);
     }
 
@@ -417,25 +449,9 @@ void s_energy_matrix::compute_energy_restricted (cand_pos_t i, cand_pos_t j, spa
 
     if (min < INF/2) {
         int ij = index[i]+j-i;
-        nodes[ij].energy = min;
-        nodes[ij].type = type;
+        energies[ij] = min;
+        if(!types.empty()) types[ij] = type;
+        if(type == INTER && !internal_split.empty()) internal_split[ij] = best_kl;
     }
 }
 
-//Mateo 13 Sept 2023
-void s_energy_matrix::compute_hotspot_energy (cand_pos_t i, cand_pos_t j, bool is_stack)
-{
-    //printf("in compute_hotspot_energy i:%d j:%d\n",i,j);
-    energy_t energy = 0;
-    if(is_stack){
-        energy = compute_stack(i,j,params_);
-        // printf("stack: %d\n",energy);
-    }else{
-        energy = HairpinE(seq_,S_,S1_,params_,i,j);
-        // printf("hairpin: %d\n",energy);
-    }
-        
-    cand_pos_t ij = index[i]+j-i;
-    nodes[ij].energy = energy;
-    return;
-}
@@ -22,6 +22,7 @@
 
 #include "base_types.hh"
 #include "sparse_tree.hh"
+#include "fold_tables.hh"
 #include <string>
 #include <vector>
 
@@ -31,6 +32,19 @@ extern "C" {
 #include "ViennaRNA/params/io.h"
 }
 
+/**
+ * The loop energies the MFE fill evaluated for V(i,j) and VP(i,j), in the order it evaluated them, so the partition
+ * function of a fused fold takes its Boltzmann factors from them instead of evaluating the same loops again.
+*/
+struct loop_record{
+    bool V = false;                     // hairpin and interior were filled for the cell
+    bool VP = false;                    // vp_interior was filled for the cell
+    energy_t hairpin = INF;
+    std::vector<energy_t> interior;     // E_IntLoop of every inner pair k.l of V(i,j), k ascending then l descending
+    std::vector<energy_t> vp_interior;  // the same for the pseudoknotted interior loops of VP(i,j), before e_intP_penalty
+
+    void clear() { V = false; VP = false; hairpin = INF; interior.clear(); vp_interior.clear(); }
+};
 
 class s_energy_matrix
 {
@@ -44,44 +58,60 @@ class s_energy_matrix
         ~s_energy_matrix ();
         // The destructor
 
+        // V(i,j) of the cells the fill never sets, it only adds a large energy in the fill but is no loop at all
+        static constexpr energy_t UNFILLED = 10000;
+
         vrna_param_t *params_;
 
         short *S_;
         short *S1_;
+        const fold_tables *tables_ = nullptr;   // pair types and constraint flags, set by the caller before filling
         // VM_sub should be NULL if you don't want suboptimals
 
         // void compute_energy (int i, int j);
         // compute the V(i,j) value
 
-        void compute_energy_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree);
-
+        // record, when not null, gets the hairpin and interior loop energies looked at
+        void compute_energy_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree, loop_record *record = nullptr);
 
-        free_energy_node* get_node (cand_pos_t i, cand_pos_t j) { cand_pos_t ij = index[i]+j-i; return &nodes[ij]; }
-        // return the node at (i,j)
 
         // May 15, 2007. Added "if (i>=j) return INF;"  below. It was miscalculating the backtracked structure.
-        energy_t get_energy (cand_pos_t i, cand_pos_t j) { if (i>=j) return INF; cand_pos_t ij = index[i]+j-i; return nodes[ij].energy; }
+        energy_t get_energy (cand_pos_t i, cand_pos_t j) { if (i>=j) return INF; cand_pos_t ij = index[i]+j-i; return energies[ij]; }
 
         energy_t get_energy_WM (cand_pos_t i, cand_pos_t j) { if (i>=j) return INF; cand_pos_t ij = index[i]+j-i; return WM[ij]; }
         energy_t get_energy_WMv (cand_pos_t i, cand_pos_t j) { if (i>=j) return INF; cand_pos_t ij = index[i]+j-i; return WMv[ij]; }
         energy_t get_energy_WMp (cand_pos_t i, cand_pos_t j) { if (i>=j) return INF; cand_pos_t ij = index[i]+j-i; return WMp[ij]; }
         // return the value at V(i,j)
 
-        char get_type (cand_pos_t i, cand_pos_t j) { cand_pos_t ij = index[i]+j-i; return nodes[ij].type; }
+        char get_type (cand_pos_t i, cand_pos_t j) { cand_pos_t ij = index[i]+j-i; return types[ij]; }
         // return the type at V(i,j)
-         //Mateo 13 Sept 2023
-        void compute_hotspot_energy (cand_pos_t i, cand_pos_t j, bool is_stack);
+
+        // The type of V(i,j) is only read when backtracking, so it is not kept unless this is called before filling
+        void keep_types () { types.assign(energies.size(),NONE); }
+
+        // Keeps the inner pair of every internal loop chosen for V(i,j) during the fill, so backtracking reads it
+        // instead of going through all the (k,l) again. Costs two bytes per cell, call it before filling.
+        void keep_internal_splits () { internal_split.assign(energies.size(),0); }
+        bool has_internal_splits () { return !internal_split.empty(); }
+
+        // Puts V(i,j), its type and the WM cells of (i,j) back to their values before filling, so the cell can be filled again
+        void clear_cell (cand_pos_t i, cand_pos_t j);
+        // the sequence read by the hairpins, S_ and S1_ are updated by their owner
+        void set_sequence (const std::string &seq) { seq_ = seq; }
+        void get_internal_split (cand_pos_t i, cand_pos_t j, cand_pos_t &k, cand_pos_t &l) { uint16_t kl = internal_split[index[i]+j-i]; k = i + (kl >> 8); l = j - (kl & 0xFF); }
 
         energy_t HairpinE(const std::string& seq, const short* S, const short* S1,  const paramT* params, cand_pos_t i, cand_pos_t j);
         energy_t compute_stack(cand_pos_t i, cand_pos_t j, const paramT *params);
-        energy_t compute_internal_restricted(cand_pos_t i, cand_pos_t j, const paramT *params, std::vector<int> &up);
+        energy_t compute_internal_restricted(cand_pos_t i, cand_pos_t j, const paramT *params, uint16_t &best_kl, loop_record *record = nullptr);
         energy_t compute_int(cand_pos_t i, cand_pos_t j, cand_pos_t k, cand_pos_t l, const paramT *params);
 
-        void compute_energy_WM_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree,std::vector<energy_t> &WMB);
+        // WMB is only read when pk is true, it can be null otherwise
+        template <bool pk>
+        void compute_energy_WM_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree, const energy_t *WMB);
         energy_t compute_energy_VM_restricted (cand_pos_t i, cand_pos_t j, sparse_tree &tree);
-        energy_t E_MLStem(const energy_t& vij,const energy_t& vi1j,const energy_t& vij1,const energy_t& vi1j1,const short* S, paramT* params,cand_pos_t i, cand_pos_t j, const  cand_pos_t& n, std::vector<Node> &tree);
-        energy_t E_MbLoop(const energy_t WM2ij, const energy_t WM2ip1j, const energy_t WM2ijm1, const energy_t WM2ip1jm1, const short* S, paramT* params, cand_pos_t i, cand_pos_t j, std::vector<Node> &tree);
-        void compute_WMv_WMp(cand_pos_t i, cand_pos_t j, energy_t WMB, std::vector<Node> &tree);
+        energy_t E_MLStem(const energy_t& vij,const energy_t& vi1j,const energy_t& vij1,const energy_t& vi1j1,const short* S, paramT* params,cand_pos_t i, cand_pos_t j, const  cand_pos_t& n);
+        energy_t E_MbLoop(const energy_t WM2ij, const energy_t WM2ip1j, const energy_t WM2ijm1, const energy_t WM2ip1jm1, const short* S, paramT* params, cand_pos_t i, cand_pos_t j);
+        void compute_WMv_WMp(cand_pos_t i, cand_pos_t j, energy_t WMB);
 
     // better to have protected variable rather than private, it's necessary for Hfold
     protected:
@@ -96,7 +126,9 @@ class s_energy_matrix
         cand_pos_t n;              // sequence length
         std::vector<cand_pos_t> index;
         // int *index;                // an array with indexes, such that we don't work with a 2D array, but with a 1D array of length (n*(n+1))/2
-        std::vector<free_energy_node> nodes;   // the free energy and type (i.e. base pair closing a hairpin loops, stacked pair etc), for each i and j
+        std::vector<energy_t> energies;        // the free energy of V(i,j), for each i and j
+        std::vector<char> types;               // what (i,j) closes (i.e. hairpin loop, internal loop or multi-loop), empty unless asked for
+        std::vector<uint16_t> internal_split;  // (k-i) << 8 | (j-l) for the inner pair k.l of an internal loop, empty unless asked for
 };
 
 
@@ -2,6 +2,7 @@
 #include "sparse_tree.hh"
 #include <iomanip>
 #include <vector>
+#include <stdio.h>
 
 #define maxSize 14 // 2^14 for sparse table
 
@@ -19,6 +20,7 @@ sparse_tree::sparse_tree(std::string structure,int n){
     up.resize(n+1);
     logn.resize(2*(n+1));
     create_tree(n,structure);
+    build_weakly_closed(n);
     preprocess();
     ptr = 0;
 
@@ -93,6 +95,65 @@ void sparse_tree::preprocess(){
         }
     }          
 }
+/**
+ * Cells (i,j) inside an arc of G only depend on cells inside the same arc, so the interiors of sibling arcs
+ * do not share any work. Starting at the root, we go down while a node has a single arc below it,
+ * so a structure closed by one outer stem still gives the arcs of its branches.
+*/
+std::vector< std::pair<int,int> > sparse_tree::independent_arcs() const{
+    int cur = 0;
+    while(tree[cur].children.size() == 1) cur = tree[cur].children[0];
+
+    std::vector< std::pair<int,int> > arcs;
+    for(int k : tree[cur].children) arcs.push_back(std::make_pair(k,tree[k].pair));
+    return arcs;
+}
+
+/**
+ * Both bases have to be unconstrained and i.j must not cross the pairs of the structure
+*/
+bool sparse_tree::add_pair(std::string &structure, int i, int j){
+    int n = structure.length();
+    if(i < 1 || j > n || i >= j || !(structure[i-1] == '.' || structure[i-1] == '_') || !(structure[j-1] == '.' || structure[j-1] == '_')){
+        fprintf(stderr,"Cannot add the pair %d.%d, both bases have to be unconstrained\n",i,j);
+        return false;
+    }
+    int depth = 0;
+    for(int k = i+1; k<j; ++k){
+        if(structure[k-1] == '(') ++depth;
+        else if(structure[k-1] == ')' && --depth < 0) break;
+    }
+    if(depth != 0){
+        fprintf(stderr,"Cannot add the pair %d.%d, it crosses the constraint structure\n",i,j);
+        return false;
+    }
+    structure[i-1] = '(';
+    structure[j-1] = ')';
+    return true;
+}
+
+/**
+ * i.j has to be a pair of the structure, so the bases between them are balanced
+*/
+bool sparse_tree::remove_pair(std::string &structure, int i, int j){
+    int n = structure.length();
+    int depth = 0;
+    if(i >= 1 && j <= n && i < j && structure[i-1] == '(' && structure[j-1] == ')'){
+        for(int k = i+1; k<j && depth >= 0; ++k){
+            if(structure[k-1] == '(') ++depth;
+            else if(structure[k-1] == ')') --depth;
+        }
+    }
+    else depth = -1;
+    if(depth != 0){
+        fprintf(stderr,"Cannot remove the pair %d.%d, it is not in the constraint structure\n",i,j);
+        return false;
+    }
+    structure[i-1] = '.';
+    structure[j-1] = '.';
+    return true;
+}
+
 /**
  * Create a tree from a structure
  * A stack is used to hold the opening base pairs indices
@@ -224,18 +285,18 @@ const int sparse_tree::b(int i, int l) const{
     }
 }
 /**
- * Returns whether there the area between i and j is weakly closed, specifically if all pairs in the [i,j] stay within [i,j]
+ * Precompute the weakly closed oracle once per structure.
+ * Each base gets the index of its innermost enclosing arc (0 for the exterior loop), as stored in its parent.
+ * A base closing a pair can never start a weakly closed region and a base opening a pair can never end one,
+ * so those get sentinels that never match. The unmatched ')' case keeps pair 0 and is treated as unpaired, as before.
 */
-const bool sparse_tree::weakly_closed(int i, int j) const{
-    if(j<i) return 0;
-    if((i > tree[i].pair && tree[i].pair > 0) || tree[j].pair> j) return 0;
-    if(i==j) return !(tree[j].pair > 0);
-    // if((tree[i].pair > i && tree[j].pair > j) ||(tree[i].pair < i && tree[j].pair < j && tree[i].pair != -1 && tree[j].pair != -1)) return 0;
-    // if(depthArr[FAI[i]] == depthArr[FAI[j]] && tree[i].parent->index == tree[j].parent->index) return 1;
-
-    if((void*)tree[i].parent == (void*) tree[j].parent) {
-        if(depthArr[FAI[i]] == depthArr[FAI[j]]) 
-            return 1;
+void sparse_tree::build_weakly_closed(int n){
+    wc_left.resize(n+1,-1);
+    wc_right.resize(n+1,-2);
+    for(int k = 1; k<=n; ++k){
+        int arc = tree[k].parent->index;
+        int pair = tree[k].pair;
+        wc_left[k] = (k > pair && pair > 0) ? -1 : arc;
+        wc_right[k] = (pair > k) ? -2 : arc;
     }
-    return 0;
-}
\ No newline at end of file
+}
@@ -5,6 +5,7 @@
 #include <vector>
 #include <string>
 #include <cstdint>
+#include <utility>
 
 #define maxSize 14 // 2^14 for sparse table
 
@@ -50,6 +51,8 @@ class sparse_tree{
         std::vector<int> depthArr; // depths corresponding to euler
         std::vector<int> logn; // holds logn values
         std::vector<int> up; // vector holding unpaired bases
+        std::vector<int> wc_left; // arc enclosing each base when it can start a weakly closed region, -1 for a closing base
+        std::vector<int> wc_right; // arc enclosing each base when it can end a weakly closed region, -2 for an opening base
         uint16_t n;
         std::string structure;
         int ptr; // Pointer to euler walk
@@ -61,7 +64,23 @@ class sparse_tree{
         const int Bp(int l, int j) const;
         const int B(int l, int j) const;
         const int b(int i, int l) const;
-        const bool weakly_closed(int i, int j) const;
+        /**
+         * Returns whether the area between i and j is weakly closed, i.e. all pairs in [i,j] stay within [i,j].
+         * This holds exactly when i and j lie directly inside the same arc, i does not close a pair and j does not open one,
+         * so it reduces to one comparison on the arrays filled by build_weakly_closed.
+        */
+        bool weakly_closed(int i, int j) const { return j >= i && wc_left[i] == wc_right[j]; }
+        /**
+         * Returns the arcs [a,b] of G whose cells can be filled independently of each other.
+         * These are the top-level arcs, or the arcs directly inside the outermost stem when there is only one.
+        */
+        std::vector< std::pair<int,int> > independent_arcs() const;
+        /**
+         * Add or remove the pair i.j of the constraint structure in place. When the change is not valid the structure is
+         * left as it is, the reason is printed to stderr and false is returned.
+        */
+        static bool add_pair(std::string &structure, int i, int j);
+        static bool remove_pair(std::string &structure, int i, int j);
 
 
     private:
@@ -72,6 +91,7 @@ class sparse_tree{
         void create_tree(int n, std::string structure);
         void dfs(int cur, int prev, int dep);
         void buildSparseTable(int n);
+        void build_weakly_closed(int n);
 
 
 };
@@ -0,0 +1,15 @@
+#!/bin/bash
+# The one-sided bands of BE are weighted by the Boltzmann factor of ap_penalty + 2*bp_penalty, as the MFE charges them.
+# With bp_penalty itself in place of its Boltzmann factor this constraint gave -3.01255.
+B=$1
+S=AAAUAAACUUGUGUUGCACCUCGUGAAGUCAUGAUCAAAGGUAUAGGUUG
+R='.......((((((...)))......)))......................'
+ensemble(){ grep -o '{[^}]*}' | tail -1 | tr -d '{}'; }
+close(){
+	awk -v a="$2" -v b="$3" 'BEGIN{d=a-b; if(d<0) d=-d; exit !(d < 1e-3)}' || { echo "$1: $2 != $3"; exit 1; }
+}
+
+close "ensemble energy" -2.0169 "$($B -r "$R" $S | ensemble)"
+close "--pf-only" -2.0169 "$($B --pf-only -r "$R" $S | ensemble)"
+close "--extended-pf" -2.0169 "$($B --extended-pf -r "$R" $S | ensemble)"
+exit 0
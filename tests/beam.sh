@@ -0,0 +1,20 @@
+#!/bin/bash
+# With a beam as wide as the sequence --beam keeps every state, so it prints what the exact pk-free fold of -p prints. A
+# narrower beam drops structures, so neither its MFE nor its ensemble energy can be below the exact ones.
+B=$1
+EXAMPLES=$(dirname $0)/../examples
+energies(){ tail -1 | sed 's/.* (\([^()]*\)) {\(.*\)}$/\1 \2/'; }
+
+for f in tRNA tmRNA; do
+	S=$(sed -n 2p $EXAMPLES/$f.txt)
+	R=$(sed -n 3p $EXAMPLES/$f.txt)
+	for option in "" "-r $R" "-d0"; do
+		exact=$($B -p $option $S | tail -1)
+		[ "$exact" == "$($B --beam ${#S} $option $S | tail -1)" ] || { echo "$f $option: --beam ${#S} is not the exact fold"; exit 1; }
+		for beam in 5 20; do
+			echo "$($B --beam $beam $option $S | energies) $(echo "$exact" | energies)" | awk '{exit !($1 >= $3 && $2 >= $4-1e-4)}' ||
+				{ echo "$f $option --beam $beam: below the exact fold"; exit 1; }
+		done
+	done
+done
+exit 0
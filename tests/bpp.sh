@@ -0,0 +1,48 @@
+#!/bin/bash
+# --bpp writes "i j p p_pk" lines with 1 <= i < j <= n and 0 <= p_pk <= p <= 1, only for p at least the cutoff. No base is
+# paired with probability above 1, the pairs of the input structure have probability 1, bases marked x are never paired
+# and with -p no pair is pseudoknotted.
+B=$1
+S=GCGCAUAGCAAAAUAAACUUGUGUUGCACCUCGUGAAGUCAUGAUCAAAGGUAUAGGUUGCAUCGAUGC
+R='xxxxxxxxxx.......((((((...)))......))).......................xxxxxxxx'
+FILE=$(mktemp)
+trap "rm -f $FILE" EXIT
+
+check(){
+	awk -v n=${#S} -v r="$R" -v cutoff=$2 -v pk_free=$3 -v name="$1" '
+		function fail(message){ print name ": " message; bad = 1; exit 1 }
+		{
+			i = $1; j = $2; p = $3; p_pk = $4
+			if(i < 1 || i >= j || j > n) fail("pair " i " " j " is out of range")
+			if(p < cutoff || p > 1+1e-6 || p_pk < 0 || p_pk > p+1e-9) fail("pair " i " " j " has p " p " and p_pk " p_pk)
+			if(pk_free && p_pk > 0) fail("pair " i " " j " is pseudoknotted with -p")
+			if(substr(r,i,1) == "x" || substr(r,j,1) == "x") fail("base " i " or " j " is marked x")
+			paired[i] += p; paired[j] += p; prob[i " " j] = p
+		}
+		END{
+			if(bad) exit 1
+			for(k in paired) if(paired[k] > 1+1e-6) fail("base " k " is paired with probability " paired[k])
+			# the pairs of the input structure
+			top = 0
+			for(k = 1; k <= length(r); ++k){
+				c = substr(r,k,1)
+				if(c == "(") stack[++top] = k
+				if(c == ")"){ pair = stack[top--] " " k; if(prob[pair] < 1-1e-6) fail("input pair " pair " has probability " prob[pair]) }
+			}
+		}' $FILE || exit 1
+}
+
+for option in "" "-d1" "--pf-only" "--extended-pf"; do
+	$B $option --bpp $FILE -r "$R" $S > /dev/null
+	check "$option" 1e-5 0
+done
+$B -p --bpp $FILE -r "$R" $S > /dev/null
+check "-p" 1e-5 1
+
+# a higher cutoff keeps exactly the lines at or above it
+$B --bpp $FILE -r "$R" $S > /dev/null
+all=$(awk '$3 >= 0.01' $FILE)
+$B --bpp $FILE --bpp-cutoff 0.01 -r "$R" $S > /dev/null
+check "--bpp-cutoff 0.01" 0.01 0
+[ "$(cat $FILE)" == "$all" ] || { echo "--bpp-cutoff 0.01: not the lines of the default cutoff at or above it"; exit 1; }
+exit 0
@@ -0,0 +1,19 @@
+#!/bin/bash
+# Every prefix printed by --cotranscriptional has the structure and MFE of a separate fold of those bases under the same
+# prefix of the constraint. The ensemble energy is equal up to rounding, as pf_scale comes from the whole sequence.
+B=$1
+S=GGGCUCGUAGAUCAGCGGUAGAUCGCUUCCUUCGCAAGGAAGAGGCCCUGGGUUCAAAUCCCAGCGAGUCCACCA
+R='......xxx.....................xxxx.......................................xx'
+ensemble(){ grep -o '{[^}]*}' | tr -d '{}'; }
+rest(){ sed 's/ {.*//'; }
+
+for option in "" "-p" "-d1" "--mfe-only -k" "--pf-only"; do
+	all=$($B $option --cotranscriptional -r "$R" $S)
+	for k in 1 5 8 20 33 50 64 75; do
+		prefix=$(echo "$all" | grep "^$k " | sed 's/^[0-9]* //')
+		alone=$($B $option -r "${R:0:k}" ${S:0:k} | tail -1)
+		[ "$(echo "$prefix" | rest)" == "$(echo "$alone" | rest)" ] || { echo "$option prefix $k: $prefix != $alone"; exit 1; }
+		awk -v a="$(echo "$prefix" | ensemble)" -v b="$(echo "$alone" | ensemble)" 'BEGIN{d=a-b; if(d<0) d=-d; exit !(d < 1e-4)}' || { echo "$option prefix $k: $prefix != $alone"; exit 1; }
+	done
+done
+exit 0
@@ -0,0 +1,21 @@
+#!/bin/bash
+# --extended-pf gives the ensemble energy of the double partition function wherever that one stays in range, and still
+# gives it where the double one overflows (nan): with --pf-only pf_scale is only guessed from the length, which is far off for
+# a long GC repeat.
+B=$1
+S=GGGCUCGUAGAUCAGCGGUAGAUCGCUUCCUUCGCAAGGAAGAGGCCCUGGGUUCAAAUCCCAGCGAGUCCACCA
+R='.........((((.......)))).(((((.......))))).....(((((.......)))))...........'
+ensemble(){ grep -o '{[^}]*}' | tail -1 | tr -d '{}'; }
+close(){
+	awk -v a="$2" -v b="$3" 'BEGIN{d=a-b; if(d<0) d=-d; exit !(d < 1e-4)}' || { echo "$1: $2 != $3"; exit 1; }
+}
+
+for option in "" "-p" "-d1" "-n 3" "--pf-only" "--fused" "-r $R" "-p -r $R" "--pf-only -r $R"; do
+	close "$option" "$($B $option $S | ensemble)" "$($B $option --extended-pf $S | ensemble)"
+done
+
+GC=$(printf 'GGGGCCCC%.0s' {1..60})
+FREE=$(printf '.%.0s' {1..480})
+double=$($B -p -r $FREE $GC | ensemble)
+close "GC repeat --pf-only" "$double" "$($B -p --pf-only --extended-pf $GC | ensemble)"
+exit 0
@@ -0,0 +1,19 @@
+#!/bin/bash
+# --float-pf gives the ensemble energy of the double partition function to within the rounding of a float. Where a float
+# leaves its range, as for the long GC repeat, the fold is done again in double and the result is the same as without it.
+B=$1
+S=GGGCUCGUAGAUCAGCGGUAGAUCGCUUCCUUCGCAAGGAAGAGGCCCUGGGUUCAAAUCCCAGCGAGUCCACCA
+R='.........((((.......)))).(((((.......))))).....(((((.......)))))...........'
+ensembles(){ grep -o '{[^}]*}' | tr -d '{}'; }
+close(){
+	paste <(echo "$2") <(echo "$3") | awk -v name="$1" '{d=$1-$2; if(d<0) d=-d; if(!(d < 1e-2)){ print name ": " $1 " != " $2; bad = 1 }} END{exit bad || NR == 0}' || exit 1
+}
+
+for option in "" "-p" "-d1" "--pf-only" "--fused" "-r $R" "-p -r $R" "-n 3" "-n 3 --incremental"; do
+	close "$option" "$($B $option $S | ensembles)" "$($B $option --float-pf $S | ensembles)"
+done
+
+GC=$(printf 'GGGGCCCC%.0s' {1..60})
+FREE=$(printf '.%.0s' {1..480})
+close "GC repeat" "$($B -p -r $FREE $GC | ensembles)" "$($B -p -r $FREE --float-pf $GC | ensembles)"
+exit 0
@@ -0,0 +1,35 @@
+#!/bin/bash
+# --gradients writes the derivative of the ensemble energy of the first result by each parameter. For the multiloop parameters it must match
+# the central difference of the ensemble energies with the parameter moved by 0.05 kcal/mol in a -P file. The penalties
+# are expected numbers of uses, never negative, and with -p no pseudoknot penalty is ever used.
+B=$1
+S=GGGCUCGUAGAUCAGCGGUAGAUCGCUUCCUUCGCAAGGAAGAGGCCCUGGGUUCAAAUCCCAGCGAGUCCACCA
+R='.........((((.......)))).(((((.......))))).....(((((.......)))))...........'
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+ensemble(){ grep -o '{[^}]*}' | head -1 | tr -d '{}'; }
+gradient(){ awk -v name=$2 '$1 == name {print $2}' $1; }
+# the multiloop parameters of Turner 2004 in dcal/mol, cu cu_dH cc cc_dH ci ci_dH, with one of the 37 degree ones moved
+parameters(){
+	local values=(0 0 930 3000 -90 -220)
+	values[$1]=$((values[$1] + $2))
+	printf '## RNAfold parameter file v2.0\n\n# ML_params\n\t%s\n\n# END\n' "${values[*]}" > $DIR/ml.par
+}
+
+for option in "-r $R" "-n 3"; do
+	$B $option --gradients $DIR/gradients $S > /dev/null
+	for parameter in "ML_BASE37 0" "ML_closing37 2" "ML_intern37 4"; do
+		set -- $parameter
+		parameters $2 5
+		up=$($B $option -P $DIR/ml.par $S | ensemble)
+		parameters $2 -5
+		down=$($B $option -P $DIR/ml.par $S | ensemble)
+		awk -v g=$(gradient $DIR/gradients $1) -v up=$up -v down=$down 'BEGIN{d=(up-down)/0.1-g; if(d<0) d=-d; exit !(d < 0.01 + 0.01*g)}' ||
+			{ echo "$option $1: gradient $(gradient $DIR/gradients $1), difference of $down and $up"; exit 1; }
+	done
+	awk '$1 != "e_stP_penalty" && $1 != "e_intP_penalty" && $2 < 0 {print; bad = 1} END{exit bad}' $DIR/gradients || { echo "$option: a negative count"; exit 1; }
+done
+
+$B -p -r "$R" --gradients $DIR/gradients $S > /dev/null
+awk '$1 !~ /^ML_/ && $2 != 0 {print; bad = 1} END{exit bad || NR == 0}' $DIR/gradients || { echo "-p: a pseudoknot penalty is used"; exit 1; }
+exit 0
@@ -0,0 +1,14 @@
+#!/bin/bash
+# --incremental refills only the cells that see a changed base from one hotspot to the next, and must print exactly what
+# folding each hotspot from scratch prints.
+B=$1
+same(){ [ "$2" == "$3" ] || { echo "$1:"; echo "$2"; echo "!="; echo "$3"; exit 1; }; }
+
+for S in GGGCUCGUAGAUCAGCGGUAGAUCGCUUCCUUCGCAAGGAAGAGGCCCUGGGUUCAAAUCCCAGCGAGUCCACCA \
+	CUAAAGACAAUUACAUAACAUACACGUCAGCACGAAACUUGUUGGCCCAGUGUGAAUCGC \
+	UAAGGGUUAAGUAAGUGUGAUGCAUACGCCUUUACUUGCUGUGUCCACCCCAUCGGACUGGCAUUUUUAUUACACUCAGAAACAGAACUC; do
+	for option in "" "-d0" "-p" "--pf-only" "--fastBacktrack" "-t 3"; do
+		same "$option $S" "$($B -n 10 $option $S)" "$($B -n 10 $option --incremental $S)"
+	done
+done
+exit 0
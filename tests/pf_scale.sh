@@ -0,0 +1,19 @@
+#!/bin/bash
+# The ensemble energy must not depend on pf_scale: the full run scales by the MFE, --pf-only and --fused by the
+# guess from the length, and --cotranscriptional folds every prefix with the pf_scale of the whole sequence.
+B=$1
+S=GGGAAAUCCCGCGGCCAUGGCGGCCGGGAGAUUUCCAAAGGGCGAAAGCUUGCAAAGCCCAAAGGAAUCC
+ensemble(){ grep -o '{[^}]*}' | tail -1 | tr -d '{}'; }
+same(){
+	awk -v a="$2" -v b="$3" 'BEGIN{d=a-b; if(d<0) d=-d; exit !(d < 1e-4)}' || { echo "$1: $2 != $3"; exit 1; }
+}
+
+full=$($B -p $S | ensemble)
+same "--pf-only" "$full" "$($B -p --pf-only $S | ensemble)"
+same "--fused" "$full" "$($B -p --fused $S | ensemble)"
+cot=$($B -p --cotranscriptional $S)
+same "--cotranscriptional" "$full" "$(echo "$cot" | tail -1 | ensemble)"
+same "--cotranscriptional prefix 30" "$($B -p ${S:0:30} | ensemble)" "$(echo "$cot" | grep '^30 ' | ensemble)"
+# no pair closes in the first four bases
+for k in 1 2 3 4; do same "--cotranscriptional prefix $k" 0 "$(echo "$cot" | grep "^$k " | ensemble)"; done
+exit 0
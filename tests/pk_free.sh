@@ -0,0 +1,26 @@
+#!/bin/bash
+# The pk-free engine of -p gives the MFE the full engine gave with -p before it, never prints a pseudoknot, and its
+# ensemble energy is at most its MFE.
+B=$1
+EXAMPLES=$(dirname $0)/../examples
+check(){
+	line=$($B -p $2 | tail -1)
+	mfe=$(echo "$line" | sed 's/.* (\([^()]*\)) {.*/\1/')
+	ensemble=$(echo "$line" | grep -o '{[^}]*}' | tr -d '{}')
+	[ "$mfe" == "$3" ] || { echo "$1: MFE $mfe != $3"; exit 1; }
+	case "$line" in *"["*) echo "$1: $line has a pseudoknot"; exit 1;; esac
+	awk -v g="$ensemble" -v e="$mfe" 'BEGIN{exit !(g <= e)}' || { echo "$1: ensemble energy $ensemble above the MFE $mfe"; exit 1; }
+}
+
+for f in tRNA tmRNA; do
+	S=$(sed -n 2p $EXAMPLES/$f.txt)
+	R=$(sed -n 3p $EXAMPLES/$f.txt)
+	case $f in
+		tRNA) expected=(-29.1 -28.3 -27.5);;
+		tmRNA) expected=(-138.3 -128.8 -134.4);;
+	esac
+	check "$f" "$S" ${expected[0]}
+	check "$f -r" "-r $R $S" ${expected[1]}
+	check "$f -d1" "-d1 $S" ${expected[2]}
+done
+exit 0
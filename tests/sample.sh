@@ -0,0 +1,42 @@
+#!/bin/bash
+# --sample draws structures that keep the pairs of the input structure and leave the bases marked x unpaired, the same
+# ones for the same --seed. A structure is drawn about as often as the probability --non-redundant prints for it, and
+# --non-redundant never prints a structure twice.
+B=$1
+S=GCGCAUAGCAAAAUAAACUUGUGUUGCACCUCGUGAAGUCAUGAUCAAAGGUAUAGGUUGCAUCGAUGC
+R='xxxxxxxxxx.......((((((...)))......))).......................xxxxxxxx'
+samples(){ tail -n +3; }
+
+check(){
+	awk -v r="$R" -v name="$1" '
+		function fail(message){ print name ": " message; exit 1 }
+		{
+			s = $1
+			if(length(s) != length(r)) fail(s " has the wrong length")
+			for(k = 1; k <= length(r); ++k){
+				c = substr(r,k,1)
+				if(c == "x" && substr(s,k,1) != ".") fail(s " pairs base " k)
+				if((c == "(" || c == ")") && substr(s,k,1) != c) fail(s " does not keep the input pair at " k)
+			}
+		}' || exit 1
+}
+
+one=$($B --sample 200 --seed 7 -r "$R" $S | samples)
+[ $(echo "$one" | wc -l) == 200 ] || { echo "--sample 200: not 200 structures"; exit 1; }
+echo "$one" | check "--sample"
+[ "$one" == "$($B --sample 200 --seed 7 -r "$R" $S | samples)" ] || { echo "--seed 7: not repeatable"; exit 1; }
+[ "$one" != "$($B --sample 200 --seed 8 -r "$R" $S | samples)" ] || { echo "--seed 8: the same structures as --seed 7"; exit 1; }
+
+distinct=$($B --sample 50 --non-redundant --seed 7 -r "$R" $S | samples)
+echo "$distinct" | check "--non-redundant"
+[ $(echo "$distinct" | wc -l) == 50 ] || { echo "--non-redundant 50: not 50 structures"; exit 1; }
+[ $(echo "$distinct" | awk '{print $1}' | sort -u | wc -l) == 50 ] || { echo "--non-redundant: a structure is drawn twice"; exit 1; }
+echo "$distinct" | awk '{ if($2 <= 0 || $2 > 1) bad = 1; sum += $2 } END{ exit bad || sum > 1+1e-6 }' || { echo "--non-redundant: probabilities out of range"; exit 1; }
+
+# the frequencies of the three most likely structures in 20000 draws, within about six standard deviations
+many=$($B --sample 20000 --seed 7 -r "$R" $S | samples)
+echo "$distinct" | sort -k2 -gr | head -3 | while read structure p; do
+	count=$(echo "$many" | grep -cxF "$structure")
+	awk -v f=$count -v p=$p 'BEGIN{d=f/20000-p; if(d<0) d=-d; exit !(d < 0.015)}' || { echo "$structure drawn $count times in 20000 for probability $p"; exit 1; }
+done || exit 1
+exit 0
@@ -0,0 +1,32 @@
+#!/bin/bash
+# Each substitution of --scan prints the structure of the variant and the change of its MFE and ensemble energy, which
+# must be those of separate folds of the variant and the wild type. The line after the sequence is the wild type itself.
+B=$1
+S=GGGCUCGUAGAUCAGCGGUAGAUCGCUUCCUUCGCAAGGAAGAGGCCCUGGGUUCAAAUCCCAGCGAGUCCACCA
+R='.........((((.......)))).(((((.......))))).....(((((.......)))))...........'
+structure(){ sed 's/ .*//'; }
+mfe(){ grep -o ' ([^()]*)' | tr -d ' ()'; }
+ensemble(){ grep -o '{[^}]*}' | tr -d '{}'; }
+close(){
+	awk -v a="$2" -v b="$3" 'BEGIN{d=a-b; if(d<0) d=-d; exit !(d < 1e-3)}' || { echo "$1: $2 != $3"; exit 1; }
+}
+
+for option in "" "-p" "-d1"; do
+	wild=$($B $option -r "$R" $S | tail -1)
+	scan=$($B $option --scan G1A,A9G,G17C,C33U,G45A,A56U,C70G,A75C -r "$R" $S)
+	[ "$(echo "$scan" | sed -n 2p)" == "$wild" ] || { echo "$option wild type: $(echo "$scan" | sed -n 2p) != $wild"; exit 1; }
+	for variant in G1A A9G G17C C33U G45A A56U C70G A75C; do
+		k=${variant:1:${#variant}-2}
+		alone=$($B $option -r "$R" ${S:0:k-1}${variant: -1}${S:k} | tail -1)
+		line=$(echo "$scan" | grep "^$variant " | sed 's/^[^ ]* //')
+		[ "$(echo "$line" | structure)" == "$(echo "$alone" | structure)" ] || { echo "$option $variant: $line != $alone"; exit 1; }
+		close "$option $variant MFE" "$(echo "$line" | mfe)" "$(awk -v a="$(echo "$alone" | mfe)" -v b="$(echo "$wild" | mfe)" 'BEGIN{print a-b}')"
+		close "$option $variant ensemble" "$(echo "$line" | ensemble)" "$(awk -v a="$(echo "$alone" | ensemble)" -v b="$(echo "$wild" | ensemble)" 'BEGIN{print a-b}')"
+	done
+done
+# all the substitutions include the given ones, with the same result
+all=$($B --scan all -r "$R" $S)
+for variant in G1A A9G G17C C33U G45A A56U C70G A75C; do
+	[ "$(echo "$all" | grep "^$variant ")" == "$($B --scan $variant -r "$R" $S | grep "^$variant ")" ] || { echo "--scan all: $variant differs"; exit 1; }
+done
+exit 0
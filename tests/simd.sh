@@ -0,0 +1,19 @@
+#!/bin/bash
+# The AVX-512, AVX2 and plain kernels of pf_dot give the same partition function to the last bit. CPARTY_SIMD leaves
+# out the wider ones, see pf_kernels.cc; on a CPU without them all the runs take the plain version. The ensemble energies,
+# the --bpp and --gradients files and the structures drawn by --sample from one seed are compared.
+B=$1
+S=GGGCUCGUAGAUCAGCGGUAGAUCGCUUCCUUCGCAAGGAAGAGGCCCUGGGUUCAAAUCCCAGCGAGUCCACCA
+R='.........((((.......)))).(((((.......))))).....(((((.......)))))...........'
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+run(){ CPARTY_SIMD=$1 $B $2 --bpp $DIR/bpp --gradients $DIR/gradients --sample 500 --seed 5 $S; cat $DIR/bpp $DIR/gradients; }
+
+for option in "-r $R" "-n 3" "-p -r $R" "--float-pf -r $R" "--extended-pf -r $R" "--float-pf -p -r $R"; do
+	plain=$(run none "$option")
+	for simd in avx2 ""; do
+		[ "$plain" == "$(run "$simd" "$option")" ] || { echo "CPARTY_SIMD=$simd $option: not the output of the plain kernels"; exit 1; }
+	done
+done
+exit 0
@@ -0,0 +1,21 @@
+#!/bin/bash
+# --kbest and --delta with forced unpaired bases: the structures come out in order of energy, none is below the MFE
+# and no base marked x is paired in any of them.
+B=$1
+S=ACGGCGAGCUUUACAUUUGCUGUG
+R='((x(((((.......)))))x)).'
+
+mfe=$($B -d2 -r "$R" $S | sed -n 2p | grep -o '([-0-9.]*)' | tail -1 | tr -d '()')
+for option in "--kbest 6" "--delta 10"; do
+	$B -d2 -r "$R" $option $S | tail -n +2 | awk -v mfe="$mfe" -v r="$R" -v option="$option" '
+		{
+			e = $2; gsub(/[()]/,"",e)
+			if(e+0 < mfe-1e-9){ print option ": " $0 " is below the MFE " mfe; bad = 1 }
+			if(NR > 1 && e+0 < last-1e-9){ print option ": " $0 " is out of order"; bad = 1 }
+			last = e+0
+			for(k = 1; k <= length(r); ++k) if(substr(r,k,1) == "x" && substr($1,k,1) != "."){ print option ": " $0 " pairs base " k; bad = 1 }
+			++count
+		}
+		END{ if(count == 0){ print option ": no structures"; bad = 1 } exit bad }' || exit 1
+done
+exit 0
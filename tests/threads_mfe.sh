@@ -0,0 +1,13 @@
+#!/bin/bash
+# The MFE fill gives the same output on any number of threads. The three arcs of the tRNA constraint are independent,
+# so fill_by_arcs fills their interiors concurrently; the hotspots add constraints with one arc.
+B=$1
+S=GGGCUCGUAGAUCAGCGGUAGAUCGCUUCCUUCGCAAGGAAGAGGCCCUGGGUUCAAAUCCCAGCGAGUCCACCA
+R='.........((((.......)))).(((((.......))))).....(((((.......)))))...........'
+same(){ [ "$2" == "$3" ] || { echo "$1: $2 != $3"; exit 1; }; }
+
+for option in "-r $R" "-n 5" "-n 5 --fastBacktrack" "-p -r $R"; do
+	one=$($B --mfe-only -t 1 $option $S)
+	for t in 2 4 7; do same "-t $t $option" "$one" "$($B --mfe-only -t $t $option $S)"; done
+done
+exit 0
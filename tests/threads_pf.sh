@@ -0,0 +1,19 @@
+#!/bin/bash
+# The partition function fill gives the same result on any number of threads: fill_by_spans reduces every cell in the
+# same order whatever thread fills it. The ensemble energies, the --bpp and --gradients files and the structures drawn
+# by --sample from the same seed are compared, the last being sensitive to the low bits of the matrices.
+B=$1
+S=GGGCUCGUAGAUCAGCGGUAGAUCGCUUCCUUCGCAAGGAAGAGGCCCUGGGUUCAAAUCCCAGCGAGUCCACCA
+R='.........((((.......)))).(((((.......))))).....(((((.......)))))...........'
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+
+run(){ $B -t $1 $2 --bpp $DIR/bpp --gradients $DIR/gradients --sample 500 --seed 5 $S; cat $DIR/bpp $DIR/gradients; }
+
+for option in "-r $R" "-n 3" "--pf-only -r $R" "-p -r $R" "--extended-pf -r $R" "--float-pf -r $R" "--fused -r $R"; do
+	one=$(run 1 "$option")
+	for t in 2 4 7; do
+		[ "$one" == "$(run $t "$option")" ] || { echo "-t $t $option: not the output of one thread"; exit 1; }
+	done
+done
+exit 0
@@ -0,0 +1,23 @@
+#!/bin/bash
+# The 'x' runs at the ends of the input structure are cut off before folding, see trim_forced_ends. The structure and
+# both energies must be the same as for the whole sequence, which --incremental and --cotranscriptional fold untrimmed.
+B=$1
+result(){ tail -1 | sed 's/^[0-9]* //'; }
+same(){ [ "$2" == "$3" ] || { echo "$1: $2 != $3"; exit 1; }; }
+
+# a pseudoknot on the restricted stem
+S=GCGCAUAGCAAAAUAAACUUGUGUUGCACCUCGUGAAGUCAUGAUCAAAGGUAUAGGUUGCAUCGAUGC
+R='xxxxxxxxxx.......((((((...)))......))).......................xxxxxxxx'
+for o in "" "-d1" "-k"; do
+	same "pk $o" "$($B $o -r "$R" $S | result)" "$($B $o --incremental -r "$R" $S | result)"
+done
+
+# no restricted pair, the stem ends next to the trimmed bases
+S=AAAUAAACUUGUGUUGCACCUCGUGAAGUCAUGAUCAAAGGUAUAGGUUGGCAUCGAUGCAAUAGCGCGAUUAGC
+R='xxxxxxxxxxxx.................................................xxxxxxxxxxxxxx'
+for o in "" "-p" "-d1"; do
+	trimmed=$($B $o -r "$R" $S | result)
+	same "free $o" "$trimmed" "$($B $o --incremental -r "$R" $S | result)"
+	same "free $o --cotranscriptional" "$trimmed" "$($B $o --cotranscriptional -r "$R" $S | result)"
+done
+exit 0